@@ -6,14 +6,18 @@
 //
 // game-style memory allocator
 //
-// this is a placeholder for a game-style memory allocator
 // using malloc and free is frowned upon in grown-up circles.
 //
-// these functions are poor for the following reasons:
+// the system functions are poor for the following reasons:
 //
 // 1) free() has to compute the size of the block to free
 // 2) these functions use heavy weight locks to guard the heap.
 // 3) implementations are quite variable
+//
+// so we keep pools of fixed size blocks, one for each size class.
+// the caller always passes the size to free(), so we never need a header
+// on the block to find out which pool it came from.
+//
 
 // this is a dummy class used to customise the placement new and delete
 struct dynarray_dummy_t {};
@@ -49,10 +53,350 @@ void operator delete(void *ptr, void *place, dynarray_dummy_t x) {}
 
 
 namespace octet { namespace containers {
+  /// Heap profiler totals for one tag and call site. See allocator::set_tracking().
+  struct heap_record {
+    const char *tag;        // from allocator::set_tag(), "" if none
+    const void *site;       // where malloc() was called from, or null
+    intptr_t live_bytes;    // bytes allocated and not yet freed
+    intptr_t live_allocs;   // blocks allocated and not yet freed
+    intptr_t num_allocs;    // blocks ever allocated
+    intptr_t num_bytes;     // bytes ever allocated
+    intptr_t peak_bytes;    // high-water mark of live_bytes
+  };
+
+  /// A copy of the heap profiler records that can be saved, loaded and compared.
+  ///
+  /// Example:
+  ///
+  ///     heap_snapshot before, after, change;
+  ///     allocator::get_heap_snapshot(before);
+  ///     load_level();
+  ///     allocator::get_heap_snapshot(after);
+  ///     change.diff(before, after);
+  ///     change.sort();
+  ///     change.write(log(""));
+  ///
+  /// Call sites are code addresses, so to compare files from different builds,
+  /// call merge_sites() on both first to compare by tag only.
+  ///
+  /// Snapshots use the system malloc so that they do not show up in the profile.
+  class heap_snapshot {
+    heap_record *records;
+    unsigned num_records;
+    unsigned max_records;
+    intptr_t live_bytes;
+    intptr_t peak_bytes;
+
+    // text of tags read from a file.
+    char *text;
+    size_t text_size;
+    size_t max_text;
+
+    static bool same_key(const heap_record &a, const heap_record &b) {
+      return a.site == b.site && (a.tag == b.tag || !strcmp(a.tag, b.tag));
+    }
+
+    static int compare_records(const void *a, const void *b) {
+      const heap_record &ra = *(const heap_record*)a;
+      const heap_record &rb = *(const heap_record*)b;
+      intptr_t sa = ra.live_bytes < 0 ? -ra.live_bytes : ra.live_bytes;
+      intptr_t sb = rb.live_bytes < 0 ? -rb.live_bytes : rb.live_bytes;
+      if (sa != sb) return sa > sb ? -1 : 1;
+      int cmp = strcmp(ra.tag, rb.tag);
+      if (cmp) return cmp;
+      return ra.site < rb.site ? -1 : ra.site > rb.site ? 1 : 0;
+    }
+
+    int find(const heap_record &key) const {
+      for (unsigned i = 0; i != num_records; ++i) {
+        if (same_key(records[i], key)) return (int)i;
+      }
+      return -1;
+    }
+
+    // snapshots own their tag text: do not copy them.
+    heap_snapshot(const heap_snapshot &rhs);
+    heap_snapshot &operator=(const heap_snapshot &rhs);
+  public:
+    /// Make an empty snapshot.
+    heap_snapshot() {
+      records = 0;
+      num_records = max_records = 0;
+      live_bytes = peak_bytes = 0;
+      text = 0;
+      text_size = max_text = 0;
+    }
+
+    ~heap_snapshot() {
+      ::free(records);
+      ::free(text);
+    }
+
+    /// Remove all the records.
+    void reset() {
+      num_records = 0;
+      text_size = 0;
+      live_bytes = peak_bytes = 0;
+    }
+
+    /// Add a record.
+    void add(const heap_record &record) {
+      if (num_records == max_records) {
+        max_records = max_records ? max_records * 2 : 256;
+        records = (heap_record*)::realloc(records, max_records * sizeof(heap_record));
+      }
+      records[num_records++] = record;
+    }
+
+    /// Set the total live bytes and the high-water mark of the heap.
+    void set_totals(intptr_t live_bytes_, intptr_t peak_bytes_) {
+      live_bytes = live_bytes_;
+      peak_bytes = peak_bytes_;
+    }
+
+    /// Number of records.
+    unsigned size() const {
+      return num_records;
+    }
+
+    /// Access a record.
+    const heap_record &operator[](unsigned index) const {
+      assert(index < num_records);
+      return records[index];
+    }
+
+    /// Total live bytes when the snapshot was taken.
+    intptr_t get_live_bytes() const {
+      return live_bytes;
+    }
+
+    /// High-water mark of the live bytes when the snapshot was taken.
+    intptr_t get_peak_bytes() const {
+      return peak_bytes;
+    }
+
+    /// Sort the records, largest (or largest change in) live size first.
+    void sort() {
+      if (num_records) qsort(records, num_records, sizeof(heap_record), compare_records);
+    }
+
+    /// Combine the records for each tag, forgetting the call sites.
+    void merge_sites() {
+      unsigned old_num_records = num_records;
+      num_records = 0;
+      for (unsigned i = 0; i != old_num_records; ++i) {
+        heap_record r = records[i];
+        r.site = 0;
+        int j = find(r);
+        if (j == -1) {
+          records[num_records++] = r;
+        } else {
+          heap_record &dest = records[j];
+          dest.live_bytes += r.live_bytes;
+          dest.live_allocs += r.live_allocs;
+          dest.num_allocs += r.num_allocs;
+          dest.num_bytes += r.num_bytes;
+          dest.peak_bytes += r.peak_bytes;
+        }
+      }
+    }
+
+    /// Make this snapshot the change from "before" to "after".
+    /// Peak bytes are taken from "after".
+    void diff(const heap_snapshot &before, const heap_snapshot &after) {
+      reset();
+      for (unsigned i = 0; i != after.num_records; ++i) {
+        heap_record r = after.records[i];
+        int j = before.find(r);
+        if (j != -1) {
+          const heap_record &b = before.records[j];
+          r.live_bytes -= b.live_bytes;
+          r.live_allocs -= b.live_allocs;
+          r.num_allocs -= b.num_allocs;
+          r.num_bytes -= b.num_bytes;
+        }
+        if (r.live_bytes || r.live_allocs || r.num_allocs) add(r);
+      }
+      for (unsigned i = 0; i != before.num_records; ++i) {
+        if (after.find(before.records[i]) == -1) {
+          heap_record r = before.records[i];
+          r.live_bytes = -r.live_bytes;
+          r.live_allocs = -r.live_allocs;
+          r.num_allocs = -r.num_allocs;
+          r.num_bytes = -r.num_bytes;
+          r.peak_bytes = 0;
+          add(r);
+        }
+      }
+      live_bytes = after.live_bytes - before.live_bytes;
+      peak_bytes = after.peak_bytes;
+    }
+
+    /// Format one record as a line of text, as used by write().
+    static int format_record(char *buf, size_t size, const heap_record &r) {
+      return snprintf(buf, size, "%12lld %10lld %10lld %14lld %12lld %16llx %s\n",
+        (long long)r.live_bytes, (long long)r.live_allocs, (long long)r.num_allocs,
+        (long long)r.num_bytes, (long long)r.peak_bytes, (unsigned long long)(uintptr_t)r.site,
+        r.tag[0] ? r.tag : "-"
+      );
+    }
+
+    /// Format the column titles, as used by write().
+    static int format_title(char *buf, size_t size, intptr_t live_bytes, intptr_t peak_bytes) {
+      return snprintf(buf, size,
+        "# octet heap profile\n"
+        "total %lld %lld\n"
+        "# %10s %10s %10s %14s %12s %16s %s\n",
+        (long long)live_bytes, (long long)peak_bytes,
+        "live_bytes", "live", "allocs", "bytes", "peak_bytes", "site", "tag"
+      );
+    }
+
+    /// Write the snapshot as text that read() understands.
+    void write(FILE *file) const {
+      char buf[512];
+      format_title(buf, sizeof(buf), live_bytes, peak_bytes);
+      fputs(buf, file);
+      for (unsigned i = 0; i != num_records; ++i) {
+        format_record(buf, sizeof(buf), records[i]);
+        fputs(buf, file);
+      }
+    }
+
+    /// Read a snapshot written by write(), for example by another build.
+    bool read(FILE *file) {
+      reset();
+      char line[512];
+      while (fgets(line, sizeof(line), file)) {
+        if (line[0] == '#') continue;
+        long long live, peak;
+        if (sscanf(line, "total %lld %lld", &live, &peak) == 2) {
+          set_totals((intptr_t)live, (intptr_t)peak);
+          continue;
+        }
+        long long lb, la, na, nb, pb;
+        unsigned long long site;
+        int tag_pos = 0;
+        if (sscanf(line, "%lld %lld %lld %lld %lld %llx %n", &lb, &la, &na, &nb, &pb, &site, &tag_pos) < 6 || !tag_pos) {
+          // the records hold offsets, not tags, so do not leave them behind.
+          reset();
+          return false;
+        }
+
+        // keep the tag text. until we have finished, records hold its offset.
+        char *tag = line + tag_pos;
+        size_t len = strcspn(tag, "\r\n");
+        if (len == 1 && tag[0] == '-') len = 0;
+        if (text_size + len + 1 > max_text) {
+          max_text = (text_size + len + 1) * 2;
+          text = (char*)::realloc(text, max_text);
+        }
+        memcpy(text + text_size, tag, len);
+        text[text_size + len] = 0;
+
+        heap_record r = {
+          (const char*)(uintptr_t)text_size, (const void*)(uintptr_t)site,
+          (intptr_t)lb, (intptr_t)la, (intptr_t)na, (intptr_t)nb, (intptr_t)pb
+        };
+        add(r);
+        text_size += len + 1;
+      }
+      for (unsigned i = 0; i != num_records; ++i) {
+        records[i].tag = text + (uintptr_t)records[i].tag;
+      }
+      return true;
+    }
+  };
+
+  /// Memory allocator used by the containers and resources.
+  ///
+  /// Blocks of up to max_pool_size bytes come from pools of fixed size blocks.
+  /// Each thread keeps a short list of free blocks for each size class, so most
+  /// calls to malloc() and free() do not take a lock at all.
+  /// Larger blocks go to the system malloc.
+  ///
+  /// Build with OCTET_POOL_ALLOCATOR=0 to send everything to the system malloc.
+  ///
+  /// There is also a heap profiler which records who allocates what (see set_tracking()).
+  ///
+  /// Example:
+  ///
+  ///     void *ptr = allocator::malloc(24);
+  ///     ...
+  ///     allocator::free(ptr, 24); // you must pass the same size back.
   class allocator {
+  public:
+    enum {
+      /// blocks larger than this come from the system malloc
+      max_pool_size = 1024,
+
+      /// 16 byte steps up to 256 bytes, then 128 byte steps up to max_pool_size
+      num_size_classes = 22,
+
+      /// pools grow by this many bytes at a time
+      slab_size = 0x10000,
+
+      /// number of blocks moved between a thread's cache and the pool in one go
+      cache_batch = 32,
+
+      /// if a thread has more than this many free blocks of one size, give some back
+      cache_limit = cache_batch * 2,
+
+      /// most tags and call sites that the heap profiler can tell apart
+      max_heap_records = 4096,
+
+      /// size of the filter that lets free() skip untracked blocks
+      filter_size = 4096,
+    };
+
+    /// Heap profiler modes, see set_tracking().
+    enum tracking_mode {
+      track_off,
+      track_all,
+      track_sampled,
+    };
+
+    /// Statistics for one size class. The last entry (block_size == 0) counts system mallocs.
+    struct size_class_stats {
+      size_t block_size;
+      size_t num_allocs;
+      size_t num_frees;
+      size_t num_slabs;
+    };
+
+  private:
+    // free blocks are chained through their first word
+    struct free_block {
+      free_block *next;
+    };
+
+    // a pool of blocks of one size, guarded by the state lock
+    struct pool_t {
+      free_block *free_list;
+      uint8_t *slab_ptr;
+      uint8_t *slab_end;
+      size_t num_allocs;
+      size_t num_frees;
+      size_t num_slabs;
+    };
+
+    // per-thread free lists and statistics not yet added to the pools.
+    // this must be plain old data to live in thread local storage.
+    struct thread_cache_t {
+      free_block *head[num_size_classes];
+      unsigned count[num_size_classes];
+      unsigned num_allocs[num_size_classes+1];
+      unsigned num_frees[num_size_classes+1];
+      intptr_t num_bytes;
+      const char *tag;
+      intptr_t sample_countdown;
+    };
+
     // singleton state, a bit like an old-world global variable
     struct state_t {
-      size_t num_bytes;
+      std::atomic_flag lock;
+      intptr_t num_bytes;
+      pool_t pools[num_size_classes+1];
     };
 
     static state_t &state() {
@@ -60,10 +404,33 @@ namespace octet { namespace containers {
       return instance;
     }
 
-  public:
-    // todo: implement this from scratch using a pool allocator
-    static void *malloc(size_t size) {
-      state().num_bytes += size;
+    static thread_cache_t &cache() {
+      static OCTET_THREAD_LOCAL thread_cache_t instance;
+      return instance;
+    }
+
+    static void lock() {
+      unsigned spins = 0;
+      while (state().lock.test_and_set(std::memory_order_acquire)) {
+        spin_backoff(spins);
+      }
+    }
+
+    static void unlock() {
+      state().lock.clear(std::memory_order_release);
+    }
+
+    static unsigned size_class(size_t size) {
+      if (size <= 16) return 0;
+      if (size <= 256) return (unsigned)((size - 1) >> 4);
+      return (unsigned)((size - 257) >> 7) + 16;
+    }
+
+    static size_t block_size(unsigned sc) {
+      return sc < 16 ? (sc + 1) * 16 : (sc - 15) * 128 + 256;
+    }
+
+    static void *system_malloc(size_t size) {
       #if OCTET_MAC
         void *res = 0;
         posix_memalign(&res, 16, size);
@@ -74,13 +441,10 @@ namespace octet { namespace containers {
       #else
         void *res = ::malloc(size);
       #endif
-      //printf("malloc %p[%d] -> %d\n", res, size, state().num_bytes);
       return res;
     }
 
-    static void free(void *ptr, size_t size) {
-      state().num_bytes -= size;
-      //printf("free %p[%d] -> %d\n", ptr, size, state().num_bytes);
+    static void system_free(void *ptr) {
       #if OCTET_MAC
         return ::free(ptr);
       #elif OCTET_SSE
@@ -90,8 +454,7 @@ namespace octet { namespace containers {
       #endif
     }
 
-    static void *realloc(void *ptr, size_t old_size, size_t size) {
-      state().num_bytes += size - old_size;
+    static void *system_realloc(void *ptr, size_t size) {
       #if OCTET_MAC
         void *res = ::realloc(ptr, size);
       #elif OCTET_SSE
@@ -99,10 +462,527 @@ namespace octet { namespace containers {
       #else
         void *res = ::realloc(ptr, size);
       #endif
-      //printf("realloc %p[%d] -> %p[%d] %d\n", ptr, old_size, res, size, state().num_bytes);
       return res;
     }
 
+    // add this thread's counters to the totals. call with the lock held.
+    static void flush_stats(thread_cache_t &tc) {
+      state_t &st = state();
+      for (unsigned sc = 0; sc <= num_size_classes; ++sc) {
+        st.pools[sc].num_allocs += tc.num_allocs[sc];
+        st.pools[sc].num_frees += tc.num_frees[sc];
+        tc.num_allocs[sc] = 0;
+        tc.num_frees[sc] = 0;
+      }
+      st.num_bytes += tc.num_bytes;
+      tc.num_bytes = 0;
+    }
+
+    // move a batch of blocks from the pool to this thread's cache, carving a new slab if we must.
+    static free_block *refill(thread_cache_t &tc, unsigned sc) {
+      pool_t &pool = state().pools[sc];
+      size_t size = block_size(sc);
+      free_block *head = 0;
+      unsigned count = 0;
+
+      lock();
+      flush_stats(tc);
+      while (count != cache_batch && pool.free_list) {
+        free_block *block = pool.free_list;
+        pool.free_list = block->next;
+        block->next = head;
+        head = block;
+        count++;
+      }
+
+      while (count != cache_batch) {
+        if ((size_t)(pool.slab_end - pool.slab_ptr) < size) {
+          // the tail of the old slab is too small for a block, start a new one.
+          if (count) break;
+          uint8_t *slab = (uint8_t*)system_malloc(slab_size);
+          if (!slab) break;
+          pool.slab_ptr = slab;
+          pool.slab_end = slab + slab_size;
+          pool.num_slabs++;
+        }
+        free_block *block = (free_block*)pool.slab_ptr;
+        pool.slab_ptr += size;
+        block->next = head;
+        head = block;
+        count++;
+      }
+      unlock();
+
+      tc.head[sc] = head;
+      tc.count[sc] = count;
+      return head;
+    }
+
+    // give up to "max_blocks" of this thread's free blocks back to the pool.
+    static void drain(thread_cache_t &tc, unsigned sc, unsigned max_blocks) {
+      pool_t &pool = state().pools[sc];
+
+      lock();
+      flush_stats(tc);
+      for (unsigned i = 0; i != max_blocks && tc.head[sc]; ++i) {
+        free_block *block = tc.head[sc];
+        tc.head[sc] = block->next;
+        tc.count[sc]--;
+        block->next = pool.free_list;
+        pool.free_list = block;
+      }
+      unlock();
+    }
+
+    #if OCTET_ALLOC_TRACKING
+      // one tracked block: the bytes and count it stands for (more than one when sampling).
+      struct live_entry_t {
+        void *ptr;
+        size_t bytes;
+        uint32_t count;
+        uint32_t record;
+      };
+
+      // heap profiler state, guarded by its own lock.
+      struct track_state_t {
+        std::atomic_flag lock;
+        std::atomic<int> mode;
+        std::atomic<unsigned> num_live;
+        size_t sample_interval;
+        bool call_sites;
+        heap_record *records;
+        unsigned num_records;
+        live_entry_t *live;
+        unsigned live_capacity;
+        intptr_t live_bytes;
+        intptr_t peak_bytes;
+
+        // count of tracked blocks for each hash of the address, so free() can
+        // skip the lock for blocks that were never tracked.
+        std::atomic<uint32_t> filter[filter_size];
+      };
+
+      static track_state_t &track_state() {
+        static track_state_t instance;
+        return instance;
+      }
+
+      static void track_lock() {
+        unsigned spins = 0;
+        while (track_state().lock.test_and_set(std::memory_order_acquire)) {
+          spin_backoff(spins);
+        }
+      }
+
+      static void track_unlock() {
+        track_state().lock.clear(std::memory_order_release);
+      }
+
+      static uint32_t hash_address(uintptr_t value) {
+        return (uint32_t)(((uint64_t)value * 0x9e3779b97f4a7c15ULL) >> 32);
+      }
+
+      // find or add the record for a tag and call site. call with the track lock held.
+      static unsigned find_record(track_state_t &ts, const char *tag, const void *site) {
+        // keep a quarter of the table free; extra call sites share one record.
+        if (ts.num_records >= max_heap_records * 3 / 4) {
+          tag = "(other)";
+          site = 0;
+        }
+        unsigned mask = max_heap_records - 1;
+        for (unsigned i = hash_address((uintptr_t)tag * 31 + (uintptr_t)site) & mask; ; i = (i + 1) & mask) {
+          heap_record &r = ts.records[i];
+          if (!r.tag) {
+            r.tag = tag;
+            r.site = site;
+            ts.num_records++;
+            return i;
+          }
+          if (r.tag == tag && r.site == site) {
+            return i;
+          }
+        }
+      }
+
+      // find the slot for a block: either the matching one or an empty one.
+      static live_entry_t *find_live(track_state_t &ts, void *ptr) {
+        unsigned mask = ts.live_capacity - 1;
+        for (unsigned i = hash_address((uintptr_t)ptr) & mask; ; i = (i + 1) & mask) {
+          live_entry_t *e = &ts.live[i];
+          if (!e->ptr || e->ptr == ptr) return e;
+        }
+      }
+
+      // double the size of the table of tracked blocks.
+      static void grow_live(track_state_t &ts) {
+        live_entry_t *old_live = ts.live;
+        unsigned old_capacity = ts.live_capacity;
+        ts.live_capacity = old_capacity ? old_capacity * 2 : 1024;
+        ts.live = (live_entry_t*)::calloc(ts.live_capacity, sizeof(live_entry_t));
+        for (unsigned i = 0; i != old_capacity; ++i) {
+          if (old_live[i].ptr) {
+            *find_live(ts, old_live[i].ptr) = old_live[i];
+          }
+        }
+        ::free(old_live);
+      }
+
+      // remove a block from the table, moving later entries back to close the gap.
+      static void erase_live(track_state_t &ts, live_entry_t *e) {
+        unsigned mask = ts.live_capacity - 1;
+        unsigned i = (unsigned)(e - ts.live);
+        for (unsigned j = (i + 1) & mask; ts.live[j].ptr; j = (j + 1) & mask) {
+          unsigned home = hash_address((uintptr_t)ts.live[j].ptr) & mask;
+          // can entry j move to the gap at i?
+          if (((j - home) & mask) >= ((j - i) & mask)) {
+            ts.live[i] = ts.live[j];
+            i = j;
+          }
+        }
+        ts.live[i].ptr = 0;
+      }
+
+      static std::atomic<uint32_t> &filter_entry(track_state_t &ts, void *ptr) {
+        return ts.filter[(hash_address((uintptr_t)ptr) >> 8) & (filter_size - 1)];
+      }
+
+      // record a new block.
+      static OCTET_NOINLINE void track_malloc(void *ptr, size_t size, const void *site) {
+        track_state_t &ts = track_state();
+        thread_cache_t &tc = cache();
+        size_t bytes = size;
+        if (ts.mode.load(std::memory_order_relaxed) == track_sampled) {
+          // sample about one block every sample_interval bytes.
+          // each sample stands for sample_interval bytes of small blocks.
+          tc.sample_countdown -= (intptr_t)size;
+          if (tc.sample_countdown > 0) return;
+          tc.sample_countdown = (intptr_t)ts.sample_interval;
+          if (bytes < ts.sample_interval) bytes = ts.sample_interval;
+        }
+        uint32_t count = size ? (uint32_t)(bytes / size) : 1;
+
+        track_lock();
+        if ((ts.num_live + 1) * 2 > ts.live_capacity) {
+          grow_live(ts);
+        }
+        unsigned rec = find_record(ts, tc.tag ? tc.tag : "", ts.call_sites ? site : 0);
+        heap_record &r = ts.records[rec];
+        r.num_allocs += count;
+        r.num_bytes += bytes;
+        r.live_allocs += count;
+        r.live_bytes += bytes;
+        if (r.live_bytes > r.peak_bytes) r.peak_bytes = r.live_bytes;
+        ts.live_bytes += bytes;
+        if (ts.live_bytes > ts.peak_bytes) ts.peak_bytes = ts.live_bytes;
+
+        live_entry_t *e = find_live(ts, ptr);
+        if (!e->ptr) ts.num_live++;
+        e->ptr = ptr;
+        e->bytes = bytes;
+        e->count = count;
+        e->record = rec;
+        filter_entry(ts, ptr).fetch_add(1, std::memory_order_relaxed);
+        track_unlock();
+      }
+
+      // forget a block if it was tracked.
+      static void track_free(void *ptr) {
+        track_state_t &ts = track_state();
+        if (ts.num_live.load(std::memory_order_relaxed) && filter_entry(ts, ptr).load(std::memory_order_relaxed)) {
+          untrack(ptr);
+        }
+      }
+
+      static OCTET_NOINLINE void untrack(void *ptr) {
+        track_state_t &ts = track_state();
+        std::atomic<uint32_t> &filter = filter_entry(ts, ptr);
+        track_lock();
+        if (ts.live_capacity) {
+          live_entry_t *e = find_live(ts, ptr);
+          if (e->ptr) {
+            heap_record &r = ts.records[e->record];
+            r.live_allocs -= e->count;
+            r.live_bytes -= e->bytes;
+            ts.live_bytes -= e->bytes;
+            erase_live(ts, e);
+            ts.num_live--;
+            filter.fetch_sub(1, std::memory_order_relaxed);
+          }
+        }
+        track_unlock();
+      }
+    #endif
+
+    // allocate from the pools without tracking.
+    static void *raw_malloc(size_t size) {
+      thread_cache_t &tc = cache();
+      #if OCTET_POOL_ALLOCATOR
+        if (size <= max_pool_size) {
+          unsigned sc = size_class(size);
+          free_block *block = tc.head[sc];
+          if (!block) {
+            block = refill(tc, sc);
+            if (!block) return 0;
+          }
+          tc.head[sc] = block->next;
+          tc.count[sc]--;
+          tc.num_allocs[sc]++;
+          tc.num_bytes += size;
+          return block;
+        }
+      #endif
+      tc.num_allocs[num_size_classes]++;
+      tc.num_bytes += size;
+      return system_malloc(size);
+    }
+
+    // free to the pools without tracking.
+    static void raw_free(void *ptr, size_t size) {
+      if (!ptr) return;
+      thread_cache_t &tc = cache();
+      tc.num_bytes -= size;
+      #if OCTET_POOL_ALLOCATOR
+        if (size <= max_pool_size) {
+          unsigned sc = size_class(size);
+          free_block *block = (free_block*)ptr;
+          block->next = tc.head[sc];
+          tc.head[sc] = block;
+          tc.num_frees[sc]++;
+          if (++tc.count[sc] > cache_limit) {
+            drain(tc, sc, cache_batch);
+          }
+          return;
+        }
+      #endif
+      tc.num_frees[num_size_classes]++;
+      system_free(ptr);
+    }
+
+    // change the size of a block without tracking.
+    static void *raw_realloc(void *ptr, size_t old_size, size_t size) {
+      if (!ptr) return raw_malloc(size);
+      #if OCTET_POOL_ALLOCATOR
+        if (old_size <= max_pool_size || size <= max_pool_size) {
+          if (old_size <= max_pool_size && size <= max_pool_size && size_class(old_size) == size_class(size)) {
+            // still fits in the same block
+            cache().num_bytes += size - old_size;
+            return ptr;
+          }
+          void *res = raw_malloc(size);
+          if (res) {
+            memcpy(res, ptr, old_size < size ? old_size : size);
+            raw_free(ptr, old_size);
+          }
+          return res;
+        }
+      #endif
+      cache().num_bytes += size - old_size;
+      return system_realloc(ptr, size);
+    }
+
+
+  public:
+    /// Allocate a block of memory aligned to 16 bytes.
+    static void *malloc(size_t size) {
+      void *res = raw_malloc(size);
+      #if OCTET_ALLOC_TRACKING
+        if (res && track_state().mode.load(std::memory_order_relaxed) != track_off) {
+          track_malloc(res, size, OCTET_RETURN_ADDRESS());
+        }
+      #endif
+      return res;
+    }
+
+    /// Free a block of memory. Size must be the size passed to malloc or realloc.
+    static void free(void *ptr, size_t size) {
+      if (!ptr) return;
+      #if OCTET_ALLOC_TRACKING
+        track_free(ptr);
+      #endif
+      raw_free(ptr, size);
+    }
+
+    /// Change the size of a block, keeping the contents.
+    static void *realloc(void *ptr, size_t old_size, size_t size) {
+      #if OCTET_ALLOC_TRACKING
+        if (ptr) track_free(ptr);
+        void *res = raw_realloc(ptr, old_size, size);
+        if (track_state().mode.load(std::memory_order_relaxed) != track_off) {
+          if (res) {
+            track_malloc(res, size, OCTET_RETURN_ADDRESS());
+          } else if (ptr) {
+            track_malloc(ptr, old_size, OCTET_RETURN_ADDRESS());
+          }
+        }
+        return res;
+      #else
+        return raw_realloc(ptr, old_size, size);
+      #endif
+    }
+
+    /// Return this thread's cached blocks and statistics to the pools.
+    /// Worker threads should call this before they exit.
+    static void flush_thread_cache() {
+      thread_cache_t &tc = cache();
+      for (unsigned sc = 0; sc != num_size_classes; ++sc) {
+        drain(tc, sc, tc.count[sc]);
+      }
+      lock();
+      flush_stats(tc);
+      unlock();
+    }
+
+    /// Number of bytes currently allocated.
+    /// Other threads' allocations are counted the next time they visit the pools.
+    static size_t get_num_bytes() {
+      lock();
+      flush_stats(cache());
+      size_t result = (size_t)state().num_bytes;
+      unlock();
+      return result;
+    }
+
+    /// Number of blocks ever allocated, from the pools and the system.
+    /// Other threads' allocations are counted the next time they visit the pools.
+    static size_t get_num_allocs() {
+      state_t &st = state();
+      lock();
+      flush_stats(cache());
+      size_t result = 0;
+      for (unsigned sc = 0; sc <= num_size_classes; ++sc) {
+        result += st.pools[sc].num_allocs;
+      }
+      unlock();
+      return result;
+    }
+
+    /// Fill in num_size_classes + 1 entries of statistics.
+    static void get_stats(size_class_stats *stats) {
+      state_t &st = state();
+      lock();
+      flush_stats(cache());
+      for (unsigned sc = 0; sc <= num_size_classes; ++sc) {
+        stats[sc].block_size = sc == num_size_classes ? 0 : block_size(sc);
+        stats[sc].num_allocs = st.pools[sc].num_allocs;
+        stats[sc].num_frees = st.pools[sc].num_frees;
+        stats[sc].num_slabs = st.pools[sc].num_slabs;
+      }
+      unlock();
+    }
+
+    /// Write a table of pool statistics to a file (eg. log("") or stdout).
+    static void dump_stats(FILE *file) {
+      size_class_stats stats[num_size_classes+1];
+      get_stats(stats);
+      fprintf(file, "allocator: %d bytes in use\n", (int)get_num_bytes());
+      fprintf(file, "%10s %10s %10s %10s %8s\n", "block", "allocs", "frees", "live", "slabs");
+      for (unsigned sc = 0; sc <= num_size_classes; ++sc) {
+        const size_class_stats &s = stats[sc];
+        if (s.num_allocs == 0) continue;
+        fprintf(file, "%10d %10d %10d %10d %8d\n",
+          (int)s.block_size, (int)s.num_allocs, (int)s.num_frees,
+          (int)(s.num_allocs - s.num_frees), (int)s.num_slabs
+        );
+      }
+    }
+
+    /// Switch the heap profiler on or off.
+    /// This does nothing unless the build defines OCTET_ALLOC_TRACKING=1.
+    ///
+    /// With track_all, every block is recorded against the current tag (see set_tag())
+    /// and, if call_sites is set, the return address of the code that called malloc().
+    /// With track_sampled, about one block in every sample_interval bytes is recorded
+    /// and the totals are estimates. This is cheap enough to leave on in profiling builds.
+    ///
+    /// Blocks allocated while tracking is on are still counted when they are freed later.
+    static void set_tracking(tracking_mode mode, size_t sample_interval = 0x4000, bool call_sites = true) {
+      #if OCTET_ALLOC_TRACKING
+        track_state_t &ts = track_state();
+        track_lock();
+        if (!ts.records) {
+          ts.records = (heap_record*)::calloc(max_heap_records, sizeof(heap_record));
+        }
+        ts.sample_interval = sample_interval ? sample_interval : 1;
+        ts.call_sites = call_sites;
+        ts.mode.store(mode, std::memory_order_relaxed);
+        track_unlock();
+      #endif
+    }
+
+    /// Get the current tracking mode.
+    static tracking_mode get_tracking() {
+      #if OCTET_ALLOC_TRACKING
+        return (tracking_mode)track_state().mode.load(std::memory_order_relaxed);
+      #else
+        return track_off;
+      #endif
+    }
+
+    /// Forget all the heap profiler records.
+    static void reset_tracking() {
+      #if OCTET_ALLOC_TRACKING
+        track_state_t &ts = track_state();
+        track_lock();
+        if (ts.records) memset(ts.records, 0, max_heap_records * sizeof(heap_record));
+        ts.num_records = 0;
+        if (ts.live) memset(ts.live, 0, ts.live_capacity * sizeof(live_entry_t));
+        ts.num_live = 0;
+        for (unsigned i = 0; i != filter_size; ++i) {
+          ts.filter[i].store(0, std::memory_order_relaxed);
+        }
+        ts.live_bytes = 0;
+        ts.peak_bytes = 0;
+        track_unlock();
+      #endif
+    }
+
+    /// Set the tag for this thread's allocations and return the old one.
+    /// The tag must be a string that lives forever, such as a literal.
+    static const char *set_tag(const char *tag) {
+      thread_cache_t &tc = cache();
+      const char *old_tag = tc.tag;
+      tc.tag = tag;
+      return old_tag;
+    }
+
+    /// Tag the allocations made in a block of code.
+    ///
+    ///     {
+    ///       allocator::tag_scope tag("textures");
+    ///       load_textures();
+    ///     }
+    class tag_scope {
+      const char *old_tag;
+    public:
+      tag_scope(const char *tag) { old_tag = set_tag(tag); }
+      ~tag_scope() { set_tag(old_tag); }
+    };
+
+    /// Copy the heap profiler records.
+    static void get_heap_snapshot(heap_snapshot &snapshot) {
+      snapshot.reset();
+      #if OCTET_ALLOC_TRACKING
+        track_state_t &ts = track_state();
+        track_lock();
+        if (ts.records) {
+          for (unsigned i = 0; i != max_heap_records; ++i) {
+            if (ts.records[i].tag) snapshot.add(ts.records[i]);
+          }
+        }
+        snapshot.set_totals(ts.live_bytes, ts.peak_bytes);
+        track_unlock();
+      #endif
+    }
+
+    /// Write the heap profile to a file, largest live size first.
+    /// Use heap_snapshot to compare it with another run.
+    static void dump_heap(FILE *file) {
+      heap_snapshot snapshot;
+      get_heap_snapshot(snapshot);
+      snapshot.sort();
+      snapshot.write(file);
+    }
+
     // crude check of stack integrity
     static void test(const char *label) {
       printf("test %s\n", label);
@@ -111,4 +991,3 @@ namespace octet { namespace containers {
     }
   };
 } }
-
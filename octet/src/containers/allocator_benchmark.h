@@ -0,0 +1,125 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// Benchmarks for the pool allocator
+//
+// example:
+//
+//   allocator_benchmark::run(stdout);
+//
+
+namespace octet { namespace containers {
+  /// Speed of allocator::malloc() and free() against the system malloc.
+  ///
+  /// For each we print the best of five runs of:
+  ///
+  ///   a malloc and free of a small block, over and over;
+  ///   a frame of 500 temporaries of 16 to 256 bytes, freed in a different order;
+  ///   loading 20000 objects of 32 to 512 bytes, then freeing them all, like a scene.
+  ///
+  /// With OCTET_POOL_ALLOCATOR=0 both columns measure the system malloc.
+  class allocator_benchmark {
+    typedef std::chrono::high_resolution_clock clock;
+
+    static double elapsed_ms(clock::time_point start) {
+      return std::chrono::duration<double, std::milli>(clock::now() - start).count();
+    }
+
+    // the same sizes for both allocators.
+    static unsigned next_size(unsigned &seed, unsigned min_size, unsigned max_size) {
+      seed = seed * 1664525 + 1013904223;
+      return min_size + (seed >> 8) % (max_size - min_size + 1);
+    }
+
+    struct pool_malloc {
+      static void *malloc(size_t size) { return allocator::malloc(size); }
+      static void free(void *ptr, size_t size) { allocator::free(ptr, size); }
+    };
+
+    struct system_malloc {
+      static void *malloc(size_t size) { return ::malloc(size); }
+      static void free(void *ptr, size_t size) { ::free(ptr); }
+    };
+
+    template <class alloc_t> static double pairs_ns(unsigned num_pairs) {
+      clock::time_point start = clock::now();
+      unsigned seed = 1;
+      for (unsigned i = 0; i != num_pairs; ++i) {
+        unsigned size = next_size(seed, 16, 128);
+        void *ptr = alloc_t::malloc(size);
+        *(volatile char*)ptr = 0;
+        alloc_t::free(ptr, size);
+      }
+      return elapsed_ms(start) * 1e6 / num_pairs;
+    }
+
+    template <class alloc_t> static double frame_us(void **ptrs, unsigned *sizes, unsigned num_frames) {
+      const unsigned num_temps = 500;
+      clock::time_point start = clock::now();
+      unsigned seed = 2;
+      for (unsigned f = 0; f != num_frames; ++f) {
+        for (unsigned i = 0; i != num_temps; ++i) {
+          sizes[i] = next_size(seed, 16, 256);
+          ptrs[i] = alloc_t::malloc(sizes[i]);
+        }
+        // free every third one first, then the rest, so that the lists get mixed up.
+        for (unsigned j = 0; j != 3; ++j) {
+          for (unsigned i = j; i < num_temps; i += 3) {
+            alloc_t::free(ptrs[i], sizes[i]);
+          }
+        }
+      }
+      return elapsed_ms(start) * 1000 / num_frames;
+    }
+
+    template <class alloc_t> static double load_ms(void **ptrs, unsigned *sizes, unsigned num_objects) {
+      clock::time_point start = clock::now();
+      unsigned seed = 3;
+      for (unsigned i = 0; i != num_objects; ++i) {
+        sizes[i] = next_size(seed, 32, 512);
+        ptrs[i] = alloc_t::malloc(sizes[i]);
+        memset(ptrs[i], 0, sizes[i]);
+      }
+      for (unsigned i = 0; i != num_objects; ++i) {
+        alloc_t::free(ptrs[i], sizes[i]);
+      }
+      return elapsed_ms(start);
+    }
+
+  public:
+    struct result {
+      double pair_ns;
+      double frame_us;
+      double load_ms;
+    };
+
+    /// Measure one allocator: pool_malloc or system_malloc.
+    template <class alloc_t> static result measure() {
+      const unsigned num_objects = 20000;
+      void **ptrs = (void**)::malloc(num_objects * sizeof(void*));
+      unsigned *sizes = (unsigned*)::malloc(num_objects * sizeof(unsigned));
+      result res = { 1e9, 1e9, 1e9 };
+      for (unsigned rep = 0; rep != 5; ++rep) {
+        res.pair_ns = std::min(res.pair_ns, pairs_ns<alloc_t>(1000000));
+        res.frame_us = std::min(res.frame_us, frame_us<alloc_t>(ptrs, sizes, 1000));
+        res.load_ms = std::min(res.load_ms, load_ms<alloc_t>(ptrs, sizes, num_objects));
+      }
+      ::free(sizes);
+      ::free(ptrs);
+      return res;
+    }
+
+    /// Print a table comparing the allocator with the system malloc.
+    static void run(FILE *file) {
+      result pool = measure<pool_malloc>();
+      result sys = measure<system_malloc>();
+      fprintf(file, "allocator_benchmark:       allocator    system malloc\n");
+      fprintf(file, "malloc + free             %7.1f ns  %10.1f ns\n", pool.pair_ns, sys.pair_ns);
+      fprintf(file, "frame of 500 temporaries  %7.1f us  %10.1f us\n", pool.frame_us, sys.frame_us);
+      fprintf(file, "load and free 20000       %7.2f ms  %10.2f ms\n", pool.load_ms, sys.load_ms);
+    }
+  };
+}}
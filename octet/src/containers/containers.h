@@ -26,13 +26,21 @@
 #define OCTET_CONTAINERS_INCLUDED
 
 #include "../containers/allocator.h"
+#include "../containers/allocator_benchmark.h"
+#include "../containers/frame_allocator.h"
+#include "../containers/string_view.h"
 #include "../containers/dictionary.h"
 #include "../containers/hash_map.h"
 #include "../containers/double_list.h"
 #include "../containers/dynarray.h"
 #include "../containers/string.h"
+#include "../containers/string_table.h"
+#include "../containers/release_queue.h"
 #include "../containers/ref.h"
 #include "../containers/bitset.h"
+#include "../containers/dynamic_bitset.h"
+#include "../containers/slot_map.h"
+#include "../containers/hash_map_benchmark.h"
 
 namespace octet {
   using namespace containers;
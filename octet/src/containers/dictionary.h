@@ -15,42 +15,42 @@ namespace octet { namespace containers {
   /// Example:
   ///
   ///     dictionary<int> my_dict;
-  ///     my_dict["fred"] = 27; 
-  ///     my_dict["anne"] = 28; 
+  ///     my_dict["fred"] = 27;
+  ///     my_dict["anne"] = 28;
   ///
   ///     int annes_age = my_dict["anne"];
   ///
+  /// Keys can also be a string_view, so a word in a buffer can be looked up without copying it.
+  /// If you look up the same key in several places, calculate its hash once with calc_hash()
+  /// and use the pre-hashed functions.
+  ///
+  ///     string_view key(text + start, length);
+  ///     uint32_t hash = my_dict.calc_hash(key);
+  ///     int index = my_dict.get_index(key, hash);
+  ///
   template <class value_t, class allocator_t=allocator> class dictionary {
-    struct entry_t { const char *key; unsigned hash; value_t value; };
+    // each entry keeps the length and hash of its key so that
+    // a failed comparison is nearly always decided without touching the text.
+    struct entry_t { const char *key; unsigned length; uint32_t hash; value_t value; };
     entry_t *entries;
     unsigned num_entries;
     unsigned max_entries;
-  
-    // hash is a compromise between fewer collisions and
-    // faster hash calculation.
-    unsigned calc_hash( const char *key ) {
-      unsigned hash = 0;
-      for (int i = 0; key[i]; ++i) {
-        hash = ( hash << 5 ) ^ ( hash << 3 ) ^ (key[i] & 0xff);
-      }
-      return hash;
-    }
-  
+
     // internal method to find an entry for a key
-    entry_t *find( const char *key, unsigned hash ) {
+    entry_t *find( const string_view &key, uint32_t hash ) {
       unsigned mask = max_entries - 1;
       for (unsigned i = 0; i != max_entries; ++i) {
         entry_t *entry = &entries[ ( i + hash ) & mask ];
         if (!entry->key) {
           return entry;
         }
-        if (entry->hash == hash && !strcmp(entry->key, key)) {
+        if (entry->hash == hash && entry->length == key.size() && !memcmp(entry->key, key.data(), key.size())) {
           return entry;
         }
       }
       return 0;
     }
-  
+
     // grow the dictionary when needed
     void expand() {
       entry_t *old_entries = entries;
@@ -61,7 +61,7 @@ namespace octet { namespace containers {
       for (unsigned i = 0; i != old_max_entries; ++i) {
         entry_t *old_entry = &old_entries[i];
         if (old_entry->key) {
-          entry_t *new_entry = find(old_entry->key, old_entry->hash);
+          entry_t *new_entry = find(string_view(old_entry->key, old_entry->length), old_entry->hash);
           *new_entry = *old_entry;
         }
       }
@@ -72,7 +72,7 @@ namespace octet { namespace containers {
       for (unsigned i = 0; i != max_entries; ++i) {
         entry_t *entry = &entries[i];
         if (entry->key ) {
-          allocator_t::free((void*)entry->key, strlen(entry->key)+1);
+          allocator_t::free((void*)entry->key, entry->length+1);
         }
       }
       allocator_t::free(entries, sizeof(entry_t) * max_entries);
@@ -93,11 +93,27 @@ namespace octet { namespace containers {
       init();
     }
 
+    /// The hash used by this dictionary, for the pre-hashed functions.
+    static uint32_t calc_hash(const string_view &key) {
+      return key.get_hash();
+    }
+
     /// Access an element by name.
     /// This will create a new element if one does not exist.
     /// For more detail, use get_index(), get_key() and get_value()
     value_t &operator[]( const char *key ) {
-      unsigned hash = calc_hash( key );
+      string_view view(key);
+      return find_or_add(view, view.get_hash());
+    }
+
+    /// Access an element by name, which need not be zero terminated.
+    value_t &operator[]( const string_view &key ) {
+      return find_or_add(key, key.get_hash());
+    }
+
+    /// Access an element by name and hash from calc_hash().
+    /// This will create a new element if one does not exist.
+    value_t &find_or_add( const string_view &key, uint32_t hash ) {
       entry_t *entry = find( key, hash );
       if (!entry || !entry->key) {
         // reducing this ratio decreases hot search time at the
@@ -107,19 +123,24 @@ namespace octet { namespace containers {
           entry = find(key, hash);
         }
         num_entries++;
-        size_t bytes = strlen(key) + 1;
-        entry->key = (char *)allocator_t::malloc(bytes);
+        char *new_key = (char *)allocator_t::malloc(key.size() + 1);
+        memcpy(new_key, key.data(), key.size());
+        new_key[key.size()] = 0;
+        entry->key = new_key;
+        entry->length = key.size();
         entry->hash = hash;
-        memcpy((void*)entry->key, key, bytes);
       }
       return entry->value;
     }
 
     /// Return true if the dictionary contains key.
     bool contains(const char *key) {
-      unsigned hash = calc_hash( key );
-      entry_t *entry = find( key, hash );
-      return entry && entry->key;
+      return get_index(key) >= 0;
+    }
+
+    /// Return true if the dictionary contains key.
+    bool contains(const string_view &key, uint32_t hash) {
+      return get_index(key, hash) >= 0;
     }
 
     /// Return the number of entries stored in the dictionary.
@@ -138,6 +159,12 @@ namespace octet { namespace containers {
       return entries[index].key;
     }
 
+    /// When iterating, get the length of the key for a certain index.
+    unsigned get_key_length(unsigned index) const {
+      assert(index < max_entries);
+      return entries[index].length;
+    }
+
     /// When iterating, access a specified value.
     value_t &get_value(unsigned index) {
       assert(index < max_entries);
@@ -146,7 +173,12 @@ namespace octet { namespace containers {
 
     /// Get the index for a certain key, or -1 if the key is not found.
     int get_index(const char *key) {
-      unsigned hash = calc_hash( key );
+      string_view view(key);
+      return get_index(view, view.get_hash());
+    }
+
+    /// Get the index for a certain key and hash from calc_hash(), or -1 if the key is not found.
+    int get_index(const string_view &key, uint32_t hash) {
       entry_t *entry = find( key, hash );
       return entry && entry->key ? (int)(entry - entries) : -1;
     }
@@ -156,10 +188,10 @@ namespace octet { namespace containers {
       release();
       init();
     }
-  
+
     /// Bye bye dictionary. Use the allocator to free up memory.
     ~dictionary() {
-      reset();
+      release();
     }
   };
 } }
@@ -0,0 +1,432 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// variable size boolean bitset
+//
+// example:
+//
+//   dynamic_bitset<> live(num_particles);
+//   live.setbit(17);
+//   for (int i = live.find_first(); i != -1; i = live.find_next(i+1)) {
+//     animate(particles[i]);
+//   }
+//
+
+namespace octet { namespace containers {
+  /// Bit set whose size is chosen at run time.
+  ///
+  /// Use this for particle liveness, occupancy and visibility masks where the
+  /// number of objects is not known when we compile.
+  /// Bits are stored in 64 bit words, bits past size() are always zero.
+  ///
+  /// Whole-set operations (&=, |=, ^=, and_not, pop_count) work on many words at a time
+  /// with SSE2 or AVX2 (see OCTET_AVX2 in configure.h).
+  /// Iterating with find_next() or for_each_set() skips empty words, so a sparse mask costs
+  /// little more than its number of words.
+  ///
+  /// rank() and select() use an index of counts that is rebuilt on first use after a change.
+  /// This means that they are not safe to call from several threads
+  /// on a bitset that has been changed since the last call.
+  template <class allocator_t=allocator> class dynamic_bitset {
+    enum {
+      // number of words counted by each entry in the rank index
+      words_per_block = 8,
+    };
+
+    dynarray<uint64_t, allocator_t> words;
+    unsigned num_bits;
+
+    // rank_index[i] = number of bits set before block i.
+    mutable dynarray<uint32_t, allocator_t> rank_index;
+    mutable bool rank_dirty;
+
+    struct and_op {
+      static uint64_t apply(uint64_t a, uint64_t b) { return a & b; }
+      #if OCTET_SSE2
+        static __m128i apply(__m128i a, __m128i b) { return _mm_and_si128(a, b); }
+      #endif
+      #if OCTET_AVX2
+        static __m256i apply(__m256i a, __m256i b) { return _mm256_and_si256(a, b); }
+      #endif
+    };
+
+    struct or_op {
+      static uint64_t apply(uint64_t a, uint64_t b) { return a | b; }
+      #if OCTET_SSE2
+        static __m128i apply(__m128i a, __m128i b) { return _mm_or_si128(a, b); }
+      #endif
+      #if OCTET_AVX2
+        static __m256i apply(__m256i a, __m256i b) { return _mm256_or_si256(a, b); }
+      #endif
+    };
+
+    struct xor_op {
+      static uint64_t apply(uint64_t a, uint64_t b) { return a ^ b; }
+      #if OCTET_SSE2
+        static __m128i apply(__m128i a, __m128i b) { return _mm_xor_si128(a, b); }
+      #endif
+      #if OCTET_AVX2
+        static __m256i apply(__m256i a, __m256i b) { return _mm256_xor_si256(a, b); }
+      #endif
+    };
+
+    struct and_not_op {
+      static uint64_t apply(uint64_t a, uint64_t b) { return a & ~b; }
+      #if OCTET_SSE2
+        static __m128i apply(__m128i a, __m128i b) { return _mm_andnot_si128(b, a); }
+      #endif
+      #if OCTET_AVX2
+        static __m256i apply(__m256i a, __m256i b) { return _mm256_andnot_si256(b, a); }
+      #endif
+    };
+
+    // dest[i] = op(dest[i], src[i]) as many words at a time as the cpu allows.
+    template <class op_t> static void combine(uint64_t *dest, const uint64_t *src, unsigned n) {
+      unsigned i = 0;
+      #if OCTET_AVX2
+        for (; i + 4 <= n; i += 4) {
+          __m256i a = _mm256_loadu_si256((const __m256i*)(dest + i));
+          __m256i b = _mm256_loadu_si256((const __m256i*)(src + i));
+          _mm256_storeu_si256((__m256i*)(dest + i), op_t::apply(a, b));
+        }
+      #endif
+      #if OCTET_SSE2
+        for (; i + 2 <= n; i += 2) {
+          __m128i a = _mm_loadu_si128((const __m128i*)(dest + i));
+          __m128i b = _mm_loadu_si128((const __m128i*)(src + i));
+          _mm_storeu_si128((__m128i*)(dest + i), op_t::apply(a, b));
+        }
+      #endif
+      for (; i != n; ++i) {
+        dest[i] = op_t::apply(dest[i], src[i]);
+      }
+    }
+
+    // total number of bits set in n words.
+    static unsigned count_words(const uint64_t *src, unsigned n) {
+      unsigned i = 0;
+      uint64_t total = 0;
+      #if OCTET_AVX2
+        // count the bits in each nibble with a table lookup (vpshufb)
+        // and add up the bytes with vpsadbw.
+        const __m256i table = _mm256_setr_epi8(
+          0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+          0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4
+        );
+        const __m256i low_nibbles = _mm256_set1_epi8(0x0f);
+        __m256i sum = _mm256_setzero_si256();
+        for (; i + 4 <= n; i += 4) {
+          __m256i v = _mm256_loadu_si256((const __m256i*)(src + i));
+          __m256i lo = _mm256_shuffle_epi8(table, _mm256_and_si256(v, low_nibbles));
+          __m256i hi = _mm256_shuffle_epi8(table, _mm256_and_si256(_mm256_srli_epi16(v, 4), low_nibbles));
+          sum = _mm256_add_epi64(sum, _mm256_sad_epu8(_mm256_add_epi8(lo, hi), _mm256_setzero_si256()));
+        }
+        uint64_t lanes[4];
+        _mm256_storeu_si256((__m256i*)lanes, sum);
+        total = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+      #endif
+      for (; i != n; ++i) {
+        total += pop_count64(src[i]);
+      }
+      return (unsigned)total;
+    }
+
+    // index of the first word at or after "start" that is not zero, or the number of words.
+    unsigned find_word(unsigned start) const {
+      const uint64_t *src = words.data();
+      unsigned n = words.size();
+      unsigned i = start;
+      #if OCTET_AVX2
+        for (; i + 4 <= n; i += 4) {
+          __m256i v = _mm256_loadu_si256((const __m256i*)(src + i));
+          if (!_mm256_testz_si256(v, v)) break;
+        }
+      #elif OCTET_SSE2
+        for (; i + 2 <= n; i += 2) {
+          __m128i v = _mm_loadu_si128((const __m128i*)(src + i));
+          if (_mm_movemask_epi8(_mm_cmpeq_epi32(v, _mm_setzero_si128())) != 0xffff) break;
+        }
+      #endif
+      while (i != n && !src[i]) ++i;
+      return i;
+    }
+
+    // index of the first word at or after "start" that is not all ones, or the number of words.
+    unsigned find_clear_word(unsigned start) const {
+      const uint64_t *src = words.data();
+      unsigned n = words.size();
+      unsigned i = start;
+      while (i != n && src[i] == ~(uint64_t)0) ++i;
+      return i;
+    }
+
+    // mask of the bits in the last word that are inside the set.
+    uint64_t tail_mask() const {
+      return num_bits & 63 ? ((uint64_t)1 << (num_bits & 63)) - 1 : ~(uint64_t)0;
+    }
+
+    // keep the bits past the end zero so that counts and searches do not see them.
+    void clear_tail() {
+      if (!words.empty()) words.back() &= tail_mask();
+    }
+
+    void update_rank_index() const {
+      unsigned num_blocks = (words.size() + words_per_block - 1) / words_per_block;
+      rank_index.resize(num_blocks + 1);
+      uint32_t total = 0;
+      for (unsigned b = 0; b != num_blocks; ++b) {
+        rank_index[b] = total;
+        unsigned first = b * words_per_block;
+        unsigned n = words.size() - first < words_per_block ? words.size() - first : words_per_block;
+        total += count_words(words.data() + first, n);
+      }
+      rank_index[num_blocks] = total;
+      rank_dirty = false;
+    }
+
+    // index of the n'th set bit (from zero) of a word with more than n bits set.
+    static unsigned select_in_word(uint64_t word, unsigned n) {
+      for (; n; --n) {
+        word &= word - 1;
+      }
+      return find_lowest_bit64(word);
+    }
+  public:
+    /// Make an empty set.
+    dynamic_bitset() {
+      num_bits = 0;
+      rank_dirty = true;
+    }
+
+    /// Make a set of "size" bits, all false or all true.
+    dynamic_bitset(unsigned size, bool value = false) {
+      num_bits = 0;
+      rank_dirty = true;
+      resize(size, value);
+    }
+
+    /// Number of bits in the set.
+    unsigned size() const {
+      return num_bits;
+    }
+
+    /// Change the number of bits. New bits are set to "value".
+    void resize(unsigned size, bool value = false) {
+      unsigned old_bits = num_bits;
+      unsigned old_words = words.size();
+      unsigned new_words = (size + 63) / 64;
+      words.resize(new_words);
+      for (unsigned i = old_words; i < new_words; ++i) {
+        words[i] = value ? ~(uint64_t)0 : 0;
+      }
+      num_bits = size;
+      if (value && size > old_bits && (old_bits & 63)) {
+        // fill the rest of the old last word.
+        words[old_bits / 64] |= ~(uint64_t)0 << (old_bits & 63);
+      }
+      clear_tail();
+      rank_dirty = true;
+    }
+
+    /// Free all the memory and make the set empty.
+    void reset() {
+      words.reset();
+      rank_index.reset();
+      num_bits = 0;
+      rank_dirty = true;
+    }
+
+    /// Set every bit to false.
+    void clear() {
+      if (!words.empty()) memset(words.data(), 0, words.size() * sizeof(uint64_t));
+      rank_dirty = true;
+    }
+
+    /// Set every bit to true.
+    void set_all() {
+      if (!words.empty()) memset(words.data(), 0xff, words.size() * sizeof(uint64_t));
+      clear_tail();
+      rank_dirty = true;
+    }
+
+    /// Invert every bit.
+    void flip_all() {
+      for (unsigned i = 0; i != words.size(); ++i) {
+        words[i] = ~words[i];
+      }
+      clear_tail();
+      rank_dirty = true;
+    }
+
+    /// Test one bit.
+    bool operator[](unsigned index) const {
+      assert(index < num_bits);
+      return ((words[index / 64] >> (index & 63)) & 1) != 0;
+    }
+
+    /// Set one bit to true.
+    void setbit(unsigned index) {
+      assert(index < num_bits);
+      words[index / 64] |= (uint64_t)1 << (index & 63);
+      rank_dirty = true;
+    }
+
+    /// Set one bit to false.
+    void clearbit(unsigned index) {
+      assert(index < num_bits);
+      words[index / 64] &= ~((uint64_t)1 << (index & 63));
+      rank_dirty = true;
+    }
+
+    /// Set one bit to "value".
+    void assign(unsigned index, bool value) {
+      if (value) setbit(index); else clearbit(index);
+    }
+
+    /// Keep only the bits that are also in rhs. The sets must be the same size.
+    dynamic_bitset &operator&=(const dynamic_bitset &rhs) {
+      assert(num_bits == rhs.num_bits);
+      combine<and_op>(words.data(), rhs.words.data(), words.size());
+      rank_dirty = true;
+      return *this;
+    }
+
+    /// Add the bits in rhs. The sets must be the same size.
+    dynamic_bitset &operator|=(const dynamic_bitset &rhs) {
+      assert(num_bits == rhs.num_bits);
+      combine<or_op>(words.data(), rhs.words.data(), words.size());
+      rank_dirty = true;
+      return *this;
+    }
+
+    /// Flip the bits that are set in rhs. The sets must be the same size.
+    dynamic_bitset &operator^=(const dynamic_bitset &rhs) {
+      assert(num_bits == rhs.num_bits);
+      combine<xor_op>(words.data(), rhs.words.data(), words.size());
+      rank_dirty = true;
+      return *this;
+    }
+
+    /// Remove the bits that are set in rhs. The sets must be the same size.
+    dynamic_bitset &and_not(const dynamic_bitset &rhs) {
+      assert(num_bits == rhs.num_bits);
+      combine<and_not_op>(words.data(), rhs.words.data(), words.size());
+      rank_dirty = true;
+      return *this;
+    }
+
+    /// Return true if any bit is set in both sets.
+    bool intersects(const dynamic_bitset &rhs) const {
+      assert(num_bits == rhs.num_bits);
+      for (unsigned i = 0; i != words.size(); ++i) {
+        if (words[i] & rhs.words[i]) return true;
+      }
+      return false;
+    }
+
+    /// Return true if any bit is set.
+    bool any() const {
+      return find_word(0) != words.size();
+    }
+
+    /// Number of bits set.
+    unsigned pop_count() const {
+      return count_words(words.data(), words.size());
+    }
+
+    /// Index of the first bit set or -1 if there is none.
+    int find_first() const {
+      return find_next(0);
+    }
+
+    /// Index of the first bit set at or after "start" or -1 if there is none.
+    int find_next(unsigned start) const {
+      if (start >= num_bits) return -1;
+      unsigned w = start / 64;
+      uint64_t bits = words[w] & (~(uint64_t)0 << (start & 63));
+      if (!bits) {
+        w = find_word(w + 1);
+        if (w == words.size()) return -1;
+        bits = words[w];
+      }
+      return (int)(w * 64 + find_lowest_bit64(bits));
+    }
+
+    /// Index of the first bit clear at or after "start" or -1 if there is none.
+    /// Use this to find a free slot in a pool.
+    int find_next_clear(unsigned start = 0) const {
+      if (start >= num_bits) return -1;
+      unsigned w = start / 64;
+      uint64_t bits = ~words[w] & (~(uint64_t)0 << (start & 63));
+      if (!bits) {
+        w = find_clear_word(w + 1);
+        if (w == words.size()) return -1;
+        bits = ~words[w];
+      }
+      unsigned result = w * 64 + find_lowest_bit64(bits);
+      return result < num_bits ? (int)result : -1;
+    }
+
+    /// Call fn(index) for every bit that is set, in order.
+    /// This is the fastest way to visit the members of the set.
+    template <class fn_t> void for_each_set(fn_t fn) const {
+      const uint64_t *src = words.data();
+      unsigned n = words.size();
+      for (unsigned w = find_word(0); w != n; w = find_word(w + 1)) {
+        for (uint64_t bits = src[w]; bits; bits &= bits - 1) {
+          fn(w * 64 + find_lowest_bit64(bits));
+        }
+      }
+    }
+
+    /// Number of bits set before "index".
+    unsigned rank(unsigned index) const {
+      assert(index <= num_bits);
+      if (rank_dirty) update_rank_index();
+      unsigned w = index / 64;
+      unsigned first = w / words_per_block * words_per_block;
+      unsigned result = rank_index[first / words_per_block] + count_words(words.data() + first, w - first);
+      if (index & 63) {
+        result += pop_count64(words[w] & (((uint64_t)1 << (index & 63)) - 1));
+      }
+      return result;
+    }
+
+    /// Index of the n'th bit set (counting from zero) or -1 if fewer bits are set.
+    int select(unsigned n) const {
+      if (rank_dirty) update_rank_index();
+      unsigned num_blocks = rank_index.size() - 1;
+      if (n >= rank_index[num_blocks]) return -1;
+
+      // find the last block with fewer than n bits before it.
+      unsigned lo = 0, hi = num_blocks;
+      while (hi - lo > 1) {
+        unsigned mid = (lo + hi) / 2;
+        if (rank_index[mid] <= n) lo = mid; else hi = mid;
+      }
+
+      n -= rank_index[lo];
+      unsigned w = lo * words_per_block;
+      for (;;) {
+        unsigned count = pop_count64(words[w]);
+        if (n < count) break;
+        n -= count;
+        ++w;
+      }
+      return (int)(w * 64 + select_in_word(words[w], n));
+    }
+
+    /// Number of 64 bit words used to store the bits.
+    unsigned get_num_words() const {
+      return words.size();
+    }
+
+    /// Raw access to the words. Bit i is bit (i & 63) of word (i / 64).
+    const uint64_t *get_words() const {
+      return words.data();
+    }
+  };
+} }
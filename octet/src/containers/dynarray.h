@@ -6,7 +6,24 @@
 //
 
 
+// mark a class as safe to move in memory with memcpy (see is_relocatable).
+// use at global scope with the full class name, eg. OCTET_RELOCATABLE(octet::math::vec4)
+#define OCTET_RELOCATABLE(name) \
+  namespace octet { namespace containers { \
+    template <> struct is_relocatable<name> { enum { value = 1 }; }; \
+  } }
+
 namespace octet { namespace containers {
+  /// Is it safe to move an object to a new address with memcpy, without calling
+  /// a constructor and destructor?
+  ///
+  /// This is true for plain data and for classes that do not point into themselves,
+  /// such as ref<>, string and dynarray. dynarray grows arrays of these with realloc
+  /// instead of copying every element, which avoids add_ref/release storms for dynarray<ref<> >.
+  template <class item_t> struct is_relocatable {
+    enum { value = std::is_pod<item_t>::value };
+  };
+
   /// Dynamic array class similar to std::vector.
   ///
   /// Example
@@ -33,6 +50,24 @@ namespace octet { namespace containers {
     int_size_t capacity_;
     enum { min_capacity = 8 };
 
+    // can we move items with memcpy/realloc?
+    enum { relocatable = !use_new_delete || is_relocatable<item_t>::value };
+
+    // make room for one more item: round up to power of two.
+    void grow() {
+      reserve(capacity_ == 0 ? min_capacity : capacity_ * 2);
+    }
+
+    // move an item into uninitialised memory
+    static void move_construct(item_t *dest, item_t &src) {
+      if (use_new_delete) {
+        dynarray_dummy_t x;
+        new (dest, x) item_t(std::move(src));
+      } else {
+        memcpy((void*)dest, (const void*)&src, sizeof(item_t));
+      }
+    }
+
   public:
     /// Create a new, empty, dynamic array
     dynarray() {
@@ -43,7 +78,7 @@ namespace octet { namespace containers {
 
     /// Create a new dynamic array of a certain size.
     dynarray(int_size_t size) {
-      data_ = (item_t*)allocator::malloc(size * sizeof(item_t));
+      data_ = (item_t*)allocator_t::malloc(size * sizeof(item_t));
       size_ = capacity_ = size;
       if (use_new_delete) {
         dynarray_dummy_t x;
@@ -57,7 +92,7 @@ namespace octet { namespace containers {
     ///
     /// Note: this is very slow and will happen frequently in naive code.
     dynarray(const dynarray &rhs) {
-      data_ = (item_t*)allocator::malloc(rhs.size_ * sizeof(item_t));
+      data_ = (item_t*)allocator_t::malloc(rhs.size_ * sizeof(item_t));
       size_ = capacity_ = rhs.size_;
       if (use_new_delete) {
         dynarray_dummy_t x;
@@ -69,6 +104,50 @@ namespace octet { namespace containers {
       }
     }
 
+    /// Take the contents of another array, leaving it empty. This is very fast.
+    dynarray(dynarray &&rhs) {
+      data_ = rhs.data_;
+      size_ = rhs.size_;
+      capacity_ = rhs.capacity_;
+      rhs.data_ = 0;
+      rhs.size_ = 0;
+      rhs.capacity_ = 0;
+    }
+
+    /// Replace the contents with a copy of another array.
+    dynarray &operator=(const dynarray &rhs) {
+      if (this != &rhs) {
+        resize(0);
+        if (rhs.size_ > capacity_) {
+          reserve(rhs.size_);
+        }
+        if (use_new_delete) {
+          dynarray_dummy_t x;
+          for (int_size_t i = 0; i != rhs.size_; ++i) {
+            new (data_ + i, x)item_t(rhs.data_[i]);
+          }
+        } else if (rhs.size_) {
+          memcpy(data_, rhs.data_, rhs.size_ * sizeof(item_t));
+        }
+        size_ = rhs.size_;
+      }
+      return *this;
+    }
+
+    /// Replace the contents with those of another array, leaving it empty.
+    dynarray &operator=(dynarray &&rhs) {
+      if (this != &rhs) {
+        reset();
+        data_ = rhs.data_;
+        size_ = rhs.size_;
+        capacity_ = rhs.capacity_;
+        rhs.data_ = 0;
+        rhs.size_ = 0;
+        rhs.capacity_ = 0;
+      }
+      return *this;
+    }
+
     /// Destroy the array and its contents.
     ~dynarray() {
       reset();
@@ -108,37 +187,93 @@ namespace octet { namespace containers {
   
     /// iterator insert for STL compatibility
     iterator insert(iterator it, const item_t &new_item) {
-      int_size_t old_length = size_;
-      resize(size_+1);
-      for (int_size_t i = old_length; i != it.elem; --i) {
-        data_[i] = data_[i-1];
+      // new_item may be in this array, so take a copy before we move things.
+      item_t tmp(new_item);
+      int_size_t pos = it.elem;
+      if (size_ == capacity_) grow();
+      if (relocatable) {
+        memmove((void*)(data_ + pos + 1), (const void*)(data_ + pos), (size_ - pos) * sizeof(item_t));
+        move_construct(data_ + pos, tmp);
+      } else if (pos == size_) {
+        move_construct(data_ + pos, tmp);
+      } else {
+        move_construct(data_ + size_, data_[size_-1]);
+        for (int_size_t i = size_ - 1; i != pos; --i) {
+          data_[i] = std::move(data_[i-1]);
+        }
+        data_[pos] = std::move(tmp);
       }
-      data_[it.elem] = new_item;
+      size_++;
       return it;
     }
 
     /// iterator erase for STL compatibility
     iterator erase(iterator it) {
-      for (int_size_t i = it.elem; i < size_-1; ++i) {
-        data_[i] = data_[i+1];
-      }
-      resize(size_-1);
+      erase(it.elem);
       return it;
     }
   
     /// Erase an item; move subsequent items down to fill the gap.
     void erase(unsigned elem) {
-      for (int_size_t i = elem; i < size_-1; ++i) {
-        data_[i] = data_[i+1];
+      if (relocatable) {
+        if (use_new_delete) {
+          data_[elem].~item_t();
+        }
+        memmove((void*)(data_ + elem), (const void*)(data_ + elem + 1), (size_ - elem - 1) * sizeof(item_t));
+        size_--;
+      } else {
+        for (int_size_t i = elem; i < size_-1; ++i) {
+          data_[i] = std::move(data_[i+1]);
+        }
+        resize(size_-1);
       }
-      resize(size_-1);
     }
 
     /// Add an item at the back of the array.
     void push_back(const item_t &new_item) {
-      int_size_t old_length = size_;
-      resize(size_+1);
-      data_[old_length] = new_item;
+      if (size_ == capacity_) {
+        // new_item may be in this array, so copy it before we grow.
+        item_t tmp(new_item);
+        grow();
+        move_construct(data_ + size_, tmp);
+      } else if (use_new_delete) {
+        dynarray_dummy_t x;
+        new (data_ + size_, x) item_t(new_item);
+      } else {
+        memcpy((void*)(data_ + size_), (const void*)&new_item, sizeof(item_t));
+      }
+      size_++;
+    }
+
+    /// Move an item to the back of the array.
+    void push_back(item_t &&new_item) {
+      if (size_ == capacity_) {
+        item_t tmp(std::move(new_item));
+        grow();
+        move_construct(data_ + size_, tmp);
+      } else {
+        move_construct(data_ + size_, new_item);
+      }
+      size_++;
+    }
+
+    /// Construct an item in place at the back of the array.
+    ///
+    /// Example:
+    ///
+    ///     dynarray<mesh::vertex> vertices;
+    ///     vertices.emplace_back(pos, normal, uvw); // no temporary vertex
+    template <class... args_t> item_t &emplace_back(args_t&&... args) {
+      dynarray_dummy_t x;
+      if (size_ == capacity_) {
+        // args may refer to items in this array.
+        item_t tmp(std::forward<args_t>(args)...);
+        grow();
+        move_construct(data_ + size_, tmp);
+      } else {
+        new (data_ + size_, x) item_t(std::forward<args_t>(args)...);
+      }
+      return data_[size_++];
     }
 
     /// Get the last element in the array.
@@ -222,24 +357,26 @@ namespace octet { namespace containers {
     /// Reserve an amount of memory to use with this array.
     /// Use this before you start a loop with push_back calls, for example.
     void reserve(int_size_t new_capacity) {
-      if (new_capacity >= size_) {
-        dynarray_dummy_t x;
-        item_t *new_data = (item_t *)allocator_t::malloc(sizeof(item_t) * new_capacity);
-      
-        if (use_new_delete) {
-          // initialize new data_ elements from old ones
+      if (new_capacity >= size_ && new_capacity != capacity_) {
+        if (relocatable) {
+          // one realloc, no constructors or destructors.
+          data_ = (item_t *)allocator_t::realloc(data_, capacity_ * sizeof(item_t), new_capacity * sizeof(item_t));
+        } else {
+          item_t *new_data = (item_t *)allocator_t::malloc(sizeof(item_t) * new_capacity);
+
+          // move data_ elements to new_data
           for (int_size_t i = 0; i != size_; ++i) {
-            new (new_data + i, x) item_t(data_[i]);
+            move_construct(new_data + i, data_[i]);
             data_[i].~item_t();
           }
-        }
 
-        // free up data_
-        if (data_) {
-          allocator_t::free(data_, capacity_ * sizeof(item_t));
-        }
+          // free up data_
+          if (data_) {
+            allocator_t::free(data_, capacity_ * sizeof(item_t));
+          }
 
-        data_ = new_data;
+          data_ = new_data;
+        }
         capacity_ = new_capacity;
       }
     }
@@ -248,6 +385,9 @@ namespace octet { namespace containers {
     void pop_back() {
       assert(size_ != 0);
       size_--;
+      if (use_new_delete) {
+        data_[size_].~item_t();
+      }
     }
 
     /// Reset the array to zero size, freeing up the data.
@@ -267,6 +407,11 @@ namespace octet { namespace containers {
     }
   };
 
+  /// dynarray only holds a pointer to its data, so it can move with memcpy.
+  template <class item_t, class allocator_t, bool use_new_delete> struct is_relocatable<dynarray<item_t, allocator_t, use_new_delete> > {
+    enum { value = 1 };
+  };
+
   inline void vformat(dynarray <char> &ary, const char *fmt, va_list v) {
     unsigned old_size = ary.size();
     #ifdef WIN32
@@ -0,0 +1,206 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// linear (bump) allocator for temporaries that live for one frame.
+//
+// example:
+//
+//   dynarray<scene_node*, frame_allocator> stack;
+//   stack.push_back(node); // no heap traffic
+//
+
+namespace octet { namespace containers {
+  /// Frame arena allocator for short lived arrays and maps.
+  ///
+  /// Use this as the allocator_t parameter of dynarray or hash_map for
+  /// temporaries that are built and thrown away during a frame.
+  /// malloc() just moves a pointer and free() does nothing unless the block
+  /// was the last one allocated. The whole arena is reset by app_common::end_frame().
+  ///
+  /// If a frame needs more than one chunk, the chunks are merged into one at the
+  /// end of the frame so that the next frame does not touch the heap at all.
+  ///
+  /// The arena belongs to the main thread (see set_main_thread()) and malloc() asserts
+  /// if a worker thread uses it. In debug builds, reset() asserts if any block was
+  /// not freed, ie. memory has escaped the frame.
+  class frame_allocator {
+  public:
+    enum {
+      /// size of the first chunk
+      min_chunk_size = 0x40000,
+
+      /// all blocks are aligned to this.
+      alignment = 16,
+    };
+
+  private:
+    // chunks are chained so that blocks never move when the arena grows.
+    struct chunk_t {
+      chunk_t *next;
+      size_t size;
+    };
+
+    // singleton state, a bit like an old-world global variable
+    struct state_t {
+      chunk_t *chunks;
+      uint8_t *ptr;
+      uint8_t *end;
+
+      // bytes used this frame including chunks that are full
+      size_t used_bytes;
+      size_t high_water;
+      size_t capacity;
+
+      // allocations not yet freed this frame
+      int num_live;
+
+      // the only thread allowed to use the arena
+      std::thread::id main_thread;
+      bool has_main_thread;
+    };
+
+    static state_t &state() {
+      static state_t instance;
+      return instance;
+    }
+
+    static size_t align(size_t size) {
+      return (size + (alignment-1)) & ~(size_t)(alignment-1);
+    }
+
+    static uint8_t *chunk_base(chunk_t *chunk) {
+      return (uint8_t*)chunk + align(sizeof(chunk_t));
+    }
+
+    // start a new chunk big enough for at least "size" bytes.
+    static bool add_chunk(size_t size) {
+      state_t &st = state();
+      size_t chunk_size = st.capacity > min_chunk_size ? st.capacity : min_chunk_size;
+      while (chunk_size < size) chunk_size *= 2;
+      chunk_t *chunk = (chunk_t*)allocator::malloc(align(sizeof(chunk_t)) + chunk_size);
+      if (!chunk) return false;
+      if (st.chunks) {
+        st.used_bytes += st.end - st.ptr;
+      }
+      chunk->next = st.chunks;
+      chunk->size = chunk_size;
+      st.chunks = chunk;
+      st.ptr = chunk_base(chunk);
+      st.end = st.ptr + chunk_size;
+      st.capacity += chunk_size;
+      return true;
+    }
+
+  public:
+    /// Make the calling thread the owner of the arena. app_common does this for the main thread.
+    static void set_main_thread() {
+      state_t &st = state();
+      st.main_thread = std::this_thread::get_id();
+      st.has_main_thread = true;
+    }
+
+    /// Return true if the calling thread may use the arena.
+    static bool is_main_thread() {
+      state_t &st = state();
+      return !st.has_main_thread || st.main_thread == std::this_thread::get_id();
+    }
+
+    /// Allocate from the current frame. The memory is only valid until end_frame().
+    static void *malloc(size_t size) {
+      assert(is_main_thread() && "frame_allocator: use the arena only on the main thread");
+      state_t &st = state();
+      size = align(size);
+      if ((size_t)(st.end - st.ptr) < size && !add_chunk(size)) {
+        return 0;
+      }
+      void *result = st.ptr;
+      st.ptr += size;
+      st.used_bytes += size;
+      st.num_live++;
+      return result;
+    }
+
+    /// Return memory to the arena. Only the most recent block is actually reclaimed.
+    static void free(void *ptr, size_t size) {
+      if (!ptr) return;
+      state_t &st = state();
+      size = align(size);
+      if ((uint8_t*)ptr + size == st.ptr) {
+        st.ptr -= size;
+        st.used_bytes -= size;
+      }
+      #ifndef NDEBUG
+        memset(ptr, 0xdd, size);
+      #endif
+      st.num_live--;
+    }
+
+    /// Resize a block. The most recent block grows in place if there is room.
+    static void *realloc(void *ptr, size_t old_size, size_t size) {
+      if (!ptr) return malloc(size);
+      state_t &st = state();
+      old_size = align(old_size);
+      size_t new_size = align(size);
+      if ((uint8_t*)ptr + old_size == st.ptr && (size_t)(st.end - (uint8_t*)ptr) >= new_size) {
+        st.ptr = (uint8_t*)ptr + new_size;
+        st.used_bytes += new_size - old_size;
+        return ptr;
+      }
+      void *result = malloc(size);
+      if (result) {
+        memcpy(result, ptr, old_size < new_size ? old_size : new_size);
+        free(ptr, old_size);
+      }
+      return result;
+    }
+
+    /// Throw away everything allocated this frame. Called by app_common::end_frame().
+    static void reset() {
+      state_t &st = state();
+      assert(st.num_live == 0 && "frame_allocator: memory escaped the frame");
+
+      if (st.used_bytes > st.high_water) {
+        st.high_water = st.used_bytes;
+      }
+
+      if (st.chunks && st.chunks->next) {
+        // merge the chunks so that next frame fits in one.
+        size_t capacity = st.capacity;
+        for (chunk_t *chunk = st.chunks, *next; chunk; chunk = next) {
+          next = chunk->next;
+          allocator::free(chunk, align(sizeof(chunk_t)) + chunk->size);
+        }
+        st.chunks = 0;
+        st.ptr = st.end = 0;
+        st.capacity = 0;
+        add_chunk(capacity);
+      } else if (st.chunks) {
+        uint8_t *base = chunk_base(st.chunks);
+        #ifndef NDEBUG
+          memset(base, 0xdd, st.ptr - base);
+        #endif
+        st.ptr = base;
+      }
+      st.used_bytes = 0;
+      st.num_live = 0;
+    }
+
+    /// Bytes allocated so far this frame.
+    static size_t get_num_bytes() {
+      return state().used_bytes;
+    }
+
+    /// Largest number of bytes used in any frame.
+    static size_t get_high_water() {
+      return state().high_water;
+    }
+
+    /// Bytes reserved for the arena.
+    static size_t get_capacity() {
+      return state().capacity;
+    }
+  };
+} }
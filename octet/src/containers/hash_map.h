@@ -6,27 +6,41 @@
 //
 // map key_t to value_t.
 //
-// strings and values are owned by the dictionary.
+// open addressing with a byte of control data per slot ("swiss table").
+// the control bytes are tested sixteen at a time with SSE2 so that
+// a lookup rarely touches more than one key.
 //
 namespace octet { namespace containers {
 
   /// A support class for hash_map that is used to implement different kinds of key.
+  ///
+  /// Derive from this to add a key type; provide get_hash() and operator == on the key.
+  /// The map mixes every hash with mix_hash(), so get_hash() does not need to be strong.
   class hash_map_cmp {
   public:
     // mix in some bits from higher positions to lower positions
     static unsigned fuzz_hash(unsigned hash) { return hash ^ (hash >> 3) ^ (hash >> 5); }
 
-    static unsigned get_hash(void *key) { return fuzz_hash((unsigned)(intptr_t)key); }
-    static unsigned get_hash(int key) { return fuzz_hash((unsigned)key); }
-    static unsigned get_hash(unsigned key) { return fuzz_hash((unsigned)key); }
-    static unsigned get_hash(uint64_t key) { return fuzz_hash((unsigned)(key ^ (key >> 32))); }
+    /// 64 bit finaliser from MurmurHash3. Every input bit affects every output bit.
+    static uint64_t mix_hash(uint64_t hash) {
+      hash ^= hash >> 33;
+      hash *= 0xff51afd7ed558ccdULL;
+      hash ^= hash >> 33;
+      hash *= 0xc4ceb9fe1a85ec53ULL;
+      hash ^= hash >> 33;
+      return hash;
+    }
+
+    static uint64_t get_hash(void *key) { return (uint64_t)(uintptr_t)key; }
+    static uint64_t get_hash(int key) { return (uint64_t)(unsigned)key; }
+    static uint64_t get_hash(unsigned key) { return (uint64_t)key; }
+    static uint64_t get_hash(uint64_t key) { return key; }
 
+    // hash_map no longer uses these: zero is a valid key.
     static bool is_empty(void *key) { return !key; }
     static bool is_empty(int key) { return !key; }
     static bool is_empty(unsigned key) { return !key; }
     static bool is_empty(uint64_t key) { return !key; }
-
-    //template <typename T> static bool equals(const T &lhs, const T &rhs) { return lhs == rhs; }
   };
 
   /// A map fom a key type to an object type.
@@ -34,6 +48,7 @@ namespace octet { namespace containers {
   /// Do not use for strings, use %dictionary instead.
   ///
   /// A hash map is like a dictionary in JavaScript or Python, but works with only one type of key and value.
+  /// New values are value-initialised, so numbers and pointers start at zero.
   ///
   /// Example:
   ///
@@ -42,137 +57,376 @@ namespace octet { namespace containers {
   ///     int_to_int[9] = 11;
   ///     printf("[5]=%d [9]=%d\n", int_to_int[5], int_to_int[9]);
   ///
-  ///     for (unsigned i = 0; i != int_to_int.size(); ++i) {
-  ///       printf("key=d value=%d\n", int_to_int.get_key(i), int_to_int.get_value(i));
+  ///     for (hash_map<int, int>::iterator i = int_to_int.begin(); i != int_to_int.end(); ++i) {
+  ///       printf("key=%d value=%d\n", i->key, i->value);
   ///     }
+  ///
+  ///     int_to_int.erase(5);
   template <typename key_t, typename value_t, class cmp_t=hash_map_cmp, class allocator_t=allocator> class hash_map {
-    // internal gubbins to implement the hash map
-    struct entry_t { key_t key; unsigned hash; value_t value; };
+  public:
+    /// a key and its value
+    struct entry_t { key_t key; value_t value; };
+
+  private:
+    enum {
+      // number of control bytes tested at once
+      group_width = 16,
+
+      // smallest table we allocate
+      min_capacity = group_width,
+    };
+
+    // control bytes: full slots hold the low seven bits of the hash (0..127)
+    enum {
+      ctrl_empty = -128,
+      ctrl_deleted = -2,
+    };
+
+    // a group of control bytes, starting at any slot.
+    class group_t {
+      #if OCTET_SSE2
+        __m128i ctrl;
+      public:
+        group_t(const int8_t *pos) { ctrl = _mm_loadu_si128((const __m128i*)pos); }
+
+        // one bit for each byte equal to "value"
+        unsigned match(int8_t value) const {
+          return (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_set1_epi8(value), ctrl));
+        }
+
+        // one bit for each empty or deleted slot: these have the top bit set.
+        unsigned match_free() const {
+          return (unsigned)_mm_movemask_epi8(ctrl);
+        }
+      #else
+        const int8_t *ctrl;
+      public:
+        group_t(const int8_t *pos) { ctrl = pos; }
 
-    entry_t *entries;
+        unsigned match(int8_t value) const {
+          unsigned result = 0;
+          for (unsigned i = 0; i != group_width; ++i) {
+            result |= (ctrl[i] == value) << i;
+          }
+          return result;
+        }
+
+        unsigned match_free() const {
+          unsigned result = 0;
+          for (unsigned i = 0; i != group_width; ++i) {
+            result |= (ctrl[i] < 0) << i;
+          }
+          return result;
+        }
+      #endif
+
+      unsigned match_empty() const { return match(ctrl_empty); }
+    };
+
+    // slots followed by capacity + group_width control bytes in one block.
+    // the last group_width control bytes repeat the first ones so that
+    // a group can be loaded at any slot without wrapping.
+    entry_t *slots;
+    int8_t *ctrl;
+    unsigned capacity_;
     unsigned num_entries;
-    unsigned max_entries;
-
-    // internal method to find an existing key in the map
-    entry_t *find( const key_t &key, unsigned hash ) {
-      unsigned mask = max_entries - 1;
-      for (unsigned i = 0; i != max_entries; ++i) {
-        entry_t *entry = &entries[ ( i + hash ) & mask ];
-        if (cmp_t::is_empty(entry->key)) {
-          return entry;
+
+    // number of empty slots we can fill before we must rehash.
+    unsigned growth_left;
+
+    static size_t alloc_size(unsigned capacity) {
+      return capacity * sizeof(entry_t) + capacity + group_width;
+    }
+
+    // keep at least one slot in eight empty so that probes terminate quickly.
+    static unsigned max_load(unsigned capacity) {
+      return capacity - capacity / 8;
+    }
+
+    static uint64_t hash_of(const key_t &key) {
+      return hash_map_cmp::mix_hash((uint64_t)cmp_t::get_hash(key));
+    }
+
+    static int8_t h2(uint64_t hash) { return (int8_t)(hash & 0x7f); }
+    static unsigned h1(uint64_t hash) { return (unsigned)(hash >> 7); }
+
+    void set_ctrl(unsigned index, int8_t value) {
+      ctrl[index] = value;
+      if (index < group_width) {
+        ctrl[capacity_ + index] = value;
+      }
+    }
+
+    // find the slot that holds this key or -1
+    int find_slot(const key_t &key, uint64_t hash) const {
+      if (!capacity_) return -1;
+      unsigned mask = capacity_ - 1;
+      unsigned pos = h1(hash) & mask;
+      int8_t tag = h2(hash);
+      for (unsigned stride = group_width; ; stride += group_width) {
+        group_t group(ctrl + pos);
+        for (unsigned bits = group.match(tag); bits; bits &= bits - 1) {
+          unsigned index = (pos + find_lowest_bit(bits)) & mask;
+          if (slots[index].key == key) {
+            return (int)index;
+          }
         }
-        if (entry->hash == hash && entry->key == key) {
-          return entry;
+        if (group.match_empty()) {
+          return -1;
+        }
+        pos = (pos + stride) & mask;
+      }
+    }
+
+    // find the first empty or deleted slot on the probe sequence for this hash
+    unsigned find_free_slot(uint64_t hash) const {
+      unsigned mask = capacity_ - 1;
+      unsigned pos = h1(hash) & mask;
+      for (unsigned stride = group_width; ; stride += group_width) {
+        unsigned bits = group_t(ctrl + pos).match_free();
+        if (bits) {
+          return (pos + find_lowest_bit(bits)) & mask;
         }
+        pos = (pos + stride) & mask;
       }
-      assert(0 && "hash_map: all entries are used. expand() did not get called");
-      return 0;
-    }
-  
-    // increase the size of the map if we have run out of space
-    void expand() {
-      entry_t *old_entries = entries;
-      unsigned old_max_entries = max_entries;
-      entries = (entry_t *)allocator_t::malloc(sizeof(entry_t) * max_entries*2);
-      memset(entries, 0, sizeof(entry_t) * max_entries*2);
-      max_entries *= 2;
-      for (unsigned i = 0; i != old_max_entries; ++i) {
-        entry_t *old_entry = &old_entries[i];
-        if (!cmp_t::is_empty(old_entry->key)) {
-          entry_t *new_entry = find(old_entry->key, old_entry->hash);
-          *new_entry = *old_entry;
+    }
+
+    // move everything to a new table, dropping deleted slots.
+    void rehash(unsigned new_capacity) {
+      entry_t *old_slots = slots;
+      int8_t *old_ctrl = ctrl;
+      unsigned old_capacity = capacity_;
+
+      slots = (entry_t*)allocator_t::malloc(alloc_size(new_capacity));
+      memset((void*)slots, 0, new_capacity * sizeof(entry_t));
+      ctrl = (int8_t*)(slots + new_capacity);
+      memset(ctrl, ctrl_empty, new_capacity + group_width);
+      capacity_ = new_capacity;
+      growth_left = max_load(new_capacity) - num_entries;
+
+      dynarray_dummy_t x;
+      for (unsigned i = 0; i != old_capacity; ++i) {
+        if (old_ctrl[i] >= 0) {
+          entry_t &old_entry = old_slots[i];
+          uint64_t hash = hash_of(old_entry.key);
+          unsigned index = find_free_slot(hash);
+          set_ctrl(index, h2(hash));
+          new (&slots[index], x) entry_t(std::move(old_entry));
+          old_entry.~entry_t();
         }
       }
-      allocator_t::free(old_entries, sizeof(entry_t) * old_max_entries);
+
+      if (old_slots) {
+        allocator_t::free(old_slots, alloc_size(old_capacity));
+      }
     }
 
-    void release() {
-      allocator_t::free(entries, sizeof(entry_t) * max_entries);
-      entries = 0;
-      num_entries = 0;
-      max_entries = 0;
+    // make room for one more entry
+    void grow() {
+      if (capacity_ && num_entries <= max_load(capacity_) / 2) {
+        // mostly deleted slots: clean up without growing.
+        rehash(capacity_);
+      } else {
+        rehash(capacity_ ? capacity_ * 2 : (unsigned)min_capacity);
+      }
     }
 
-    void init() {
+    // remove the entry in a full slot.
+    void erase_slot(unsigned index) {
+      slots[index].~entry_t();
+      memset((void*)&slots[index], 0, sizeof(entry_t));
+      num_entries--;
+
+      // if no probe can have passed this slot while its window was full,
+      // the slot can be marked empty and no tombstone is needed.
+      unsigned mask = capacity_ - 1;
+      unsigned empty_after = group_t(ctrl + index).match_empty();
+      unsigned empty_before = group_t(ctrl + ((index - group_width) & mask)).match_empty();
+      bool was_never_full =
+        empty_before && empty_after &&
+        find_lowest_bit(empty_after) + (15 - find_highest_bit(empty_before)) < group_width
+      ;
+      if (was_never_full) {
+        set_ctrl(index, ctrl_empty);
+        growth_left++;
+      } else {
+        set_ctrl(index, ctrl_deleted);
+      }
+    }
+
+    void release() {
+      for (unsigned i = 0; i != capacity_; ++i) {
+        if (ctrl[i] >= 0) {
+          slots[i].~entry_t();
+        }
+      }
+      if (slots) {
+        allocator_t::free(slots, alloc_size(capacity_));
+      }
+      slots = 0;
+      ctrl = 0;
+      capacity_ = 0;
       num_entries = 0;
-      max_entries = 4;
-      entries = (entry_t*)allocator_t::malloc(sizeof(entry_t) * max_entries);
-      memset(entries, 0, sizeof(entry_t) * max_entries);
+      growth_left = 0;
     }
+
+    // maps own their entries: do not copy them.
+    hash_map(const hash_map &rhs);
+    hash_map &operator=(const hash_map &rhs);
   public:
-    // Create an empty map.
+    /// iterator for visiting every entry in the map, in no particular order.
+    class iterator {
+      hash_map *map;
+      unsigned index;
+      friend class hash_map;
+
+      // move to the next full slot
+      void skip() {
+        while (index != map->capacity_ && map->ctrl[index] < 0) {
+          index++;
+        }
+      }
+    public:
+      iterator(hash_map *map_, unsigned index_) : map(map_), index(index_) { skip(); }
+      entry_t *operator ->() const { return &map->slots[index]; }
+      entry_t &operator *() const { return map->slots[index]; }
+      bool operator == (const iterator &rhs) const { return index == rhs.index; }
+      bool operator != (const iterator &rhs) const { return index != rhs.index; }
+      void operator++() { index++; skip(); }
+      void operator++(int) { index++; skip(); }
+    };
+
+    // Create an empty map. This does not allocate any memory.
     hash_map() {
-      init();
+      slots = 0;
+      ctrl = 0;
+      capacity_ = 0;
+      num_entries = 0;
+      growth_left = 0;
+    }
+
+    /// bye bye hash map
+    ~hash_map() {
+      release();
     }
 
     /// Remove all keys and values from the hash map.
     void clear() {
       release();
-      init();
     }
-  
-    /// Access the map by key
+
+    /// Make room for this many entries without rehashing.
+    void reserve(unsigned new_entries) {
+      unsigned new_capacity = min_capacity;
+      while (max_load(new_capacity) < new_entries) new_capacity *= 2;
+      if (new_capacity > capacity_) {
+        rehash(new_capacity);
+      }
+    }
+
+    /// Access the map by key, adding a zero value if the key is new.
     value_t &operator[]( const key_t &key ) {
-      unsigned hash = cmp_t::get_hash(key);
-      entry_t *entry = find( key, hash );
-      if (cmp_t::is_empty(entry->key)) {
-        // reducing this ratio decreases hot search time at the
-        // expense of size (cold search time).
-        if (num_entries >= max_entries * 3 / 4) {
-          expand();
-          entry = find(key, hash);
-        }
-        num_entries++;
-        entry->key = key;
-        entry->hash = hash;
+      uint64_t hash = hash_of(key);
+      int found = find_slot(key, hash);
+      if (found >= 0) {
+        return slots[found].value;
+      }
+
+      // key may be in this map, so copy it before we rehash.
+      key_t new_key(key);
+      if (growth_left == 0) {
+        grow();
+      }
+      unsigned index = find_free_slot(hash);
+      if (ctrl[index] == ctrl_empty) {
+        growth_left--;
       }
+      set_ctrl(index, h2(hash));
+      num_entries++;
+
+      dynarray_dummy_t x;
+      entry_t *entry = &slots[index];
+      new (&entry->key, x) key_t(std::move(new_key));
+      new (&entry->value, x) value_t();
       return entry->value;
     }
 
+    /// Remove a key. Return true if it was there.
+    bool erase(const key_t &key) {
+      int index = find_slot(key, hash_of(key));
+      if (index < 0) return false;
+      erase_slot((unsigned)index);
+      return true;
+    }
+
+    /// Remove the entry at an iterator and return an iterator to the next one.
+    iterator erase(iterator it) {
+      erase_slot(it.index);
+      ++it;
+      return it;
+    }
+
+    /// Find a key; returns end() if it is not there.
+    iterator find(const key_t &key) {
+      int index = find_slot(key, hash_of(key));
+      return iterator(this, index < 0 ? capacity_ : (unsigned)index);
+    }
+
     /// Does the map have this key?
-    bool contains(const key_t &key) {
-      unsigned hash = cmp_t::get_hash(key);
-      entry_t *entry = find( key, hash );
-      return !cmp_t::is_empty(entry->key);
+    bool contains(const key_t &key) const {
+      return find_slot(key, hash_of(key)) >= 0;
+    }
+
+    /// first entry in the map
+    iterator begin() {
+      return iterator(this, 0);
     }
 
-    /// Get an integer that represents the position in the map of this key.
+    /// end of the map
+    iterator end() {
+      return iterator(this, capacity_);
+    }
+
+    /// Number of keys in the map.
+    unsigned get_num_entries() const { return num_entries; }
+
+    /// Number of slots in the table.
+    unsigned capacity() const { return capacity_; }
+
+    /// Return true if there are no keys.
+    bool empty() const { return num_entries == 0; }
+
+    /// Get an integer that represents the position in the map of this key or -1 if it is not there.
     ///
-    /// Note: only valid if the map does not change size.
-    int get_index(const key_t &key) {
-      unsigned hash = cmp_t::get_hash(key);
-      entry_t *entry = find( key, hash );
-      return entry ? (int)(entry - entries) : -1;
+    /// Note: only valid if the map does not change.
+    int get_index(const key_t &key) const {
+      return find_slot(key, hash_of(key));
     }
 
     /// For a specfic index, get the key.
     ///
-    /// Used for iterating through the map or if using find()
+    /// Used with get_index() or for iterating through the map (prefer begin() and end()).
+    /// Unused slots have zero keys.
     const key_t &get_key(int index) const {
-      assert((unsigned)index < max_entries);
-      return entries[index].key;
+      assert((unsigned)index < capacity_);
+      return slots[index].key;
     }
 
     /// For a specific index, get the value
     const value_t &get_value(int index) const {
-      assert((unsigned)index < max_entries);
-      return entries[index].value;
+      assert((unsigned)index < capacity_);
+      return slots[index].value;
     }
 
-    /// bye bye hash map
-    ~hash_map() {
-      allocator_t::free(entries, sizeof(entry_t) * max_entries);
-      entries = 0;
-      num_entries = 0;
-      max_entries = 0;
+    /// Return true if this index holds a key.
+    bool is_used(int index) const {
+      assert((unsigned)index < capacity_);
+      return ctrl[index] >= 0;
     }
 
-    /// Get the maximum number of keys and values in the map.
+    /// Get the number of slots in the map (not the number of keys, see get_num_entries()).
     ///
-    /// Used for iteration.
-    unsigned size() { return max_entries; }
-    
-    //key_t key(unsigned i) { return entries[i].key; }
-    //value_t value(unsigned i) { return entries[i].value; }
+    /// Used for iteration with get_key() and get_value().
+    unsigned size() const { return capacity_; }
   };
 } }
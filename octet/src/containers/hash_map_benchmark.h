@@ -0,0 +1,129 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// Benchmarks for hash_map
+//
+// example:
+//
+//   hash_map_benchmark::run(stdout);            // 1M keys
+//   hash_map_benchmark::run(stdout, 100000);    // 100k keys
+//
+
+namespace octet { namespace containers {
+  /// Cost per operation of hash_map with different kinds of key.
+  ///
+  /// For each kind of key we print the best of five runs of inserting num_keys keys,
+  /// finding them all, looking for num_keys keys that are not there, erasing half
+  /// of the keys and iterating over the rest.
+  ///
+  /// The keys are:
+  ///
+  ///   sequential: 0, 1, 2 ...
+  ///   random:     a random 32 bit number
+  ///   strided:    multiples of 4096, like pointers or packed vertex hashes.
+  ///
+  /// Strided keys have no low bits and made the old linearly probed map collapse,
+  /// so all three rows should be similar.
+  class hash_map_benchmark {
+    typedef std::chrono::high_resolution_clock clock;
+
+    static double elapsed_ms(clock::time_point start) {
+      return std::chrono::duration<double, std::milli>(clock::now() - start).count();
+    }
+
+  public:
+    enum key_kind {
+      keys_sequential,
+      keys_random,
+      keys_strided,
+    };
+
+    struct result {
+      double insert_ns;
+      double find_ns;
+      double miss_ns;
+      double erase_ns;
+      double iterate_ns;
+    };
+
+    /// Make "num_keys" distinct keys of a kind.
+    static void make_keys(uint64_t *keys, unsigned num_keys, key_kind kind) {
+      uint64_t seed = 1;
+      for (unsigned i = 0; i != num_keys; ++i) {
+        switch (kind) {
+          case keys_sequential: keys[i] = i; break;
+          case keys_strided: keys[i] = (uint64_t)i << 12; break;
+          default: {
+            // the high half is the index, so the keys are all different.
+            seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+            keys[i] = (seed >> 32) | ((uint64_t)i << 32);
+          } break;
+        }
+      }
+    }
+
+    /// Measure one kind of key. "keys" holds 2 * num_keys keys: the second half are misses.
+    static result measure(const uint64_t *keys, unsigned num_keys) {
+      result res = { 1e9, 1e9, 1e9, 1e9, 1e9 };
+      for (unsigned rep = 0; rep != 5; ++rep) {
+        hash_map<uint64_t, unsigned> map;
+
+        clock::time_point start = clock::now();
+        for (unsigned i = 0; i != num_keys; ++i) {
+          map[keys[i]] = i;
+        }
+        res.insert_ns = std::min(res.insert_ns, elapsed_ms(start) * 1e6 / num_keys);
+
+        start = clock::now();
+        unsigned found = 0;
+        for (unsigned i = 0; i != num_keys; ++i) {
+          found += map.contains(keys[i]);
+        }
+        res.find_ns = std::min(res.find_ns, elapsed_ms(start) * 1e6 / num_keys);
+
+        start = clock::now();
+        for (unsigned i = num_keys; i != num_keys * 2; ++i) {
+          found += map.contains(keys[i]);
+        }
+        res.miss_ns = std::min(res.miss_ns, elapsed_ms(start) * 1e6 / num_keys);
+        assert(found == num_keys);
+
+        start = clock::now();
+        for (unsigned i = 0; i < num_keys; i += 2) {
+          map.erase(keys[i]);
+        }
+        res.erase_ns = std::min(res.erase_ns, elapsed_ms(start) * 1e6 / ((num_keys + 1) / 2));
+
+        start = clock::now();
+        unsigned sum = 0;
+        for (hash_map<uint64_t, unsigned>::iterator it = map.begin(); it != map.end(); ++it) {
+          sum += it->value;
+        }
+        res.iterate_ns = std::min(res.iterate_ns, elapsed_ms(start) * 1e6 / (map.get_num_entries() + 1));
+
+        // stop the compiler from throwing the loop away.
+        *(volatile unsigned*)&sum = sum;
+      }
+      return res;
+    }
+
+    /// Print a table for each kind of key.
+    static void run(FILE *file, unsigned num_keys = 1000000) {
+      static const char *names[] = { "sequential", "random", "strided" };
+      dynarray<uint64_t> keys(num_keys * 2);
+      fprintf(file, "hash_map_benchmark: %u keys, ns per key\n", num_keys);
+      fprintf(file, "keys        insert    find    miss   erase  iterate\n");
+      for (unsigned kind = 0; kind != 3; ++kind) {
+        // the misses are the keys after the first num_keys.
+        make_keys(keys.data(), num_keys * 2, (key_kind)kind);
+        result res = measure(keys.data(), num_keys);
+        fprintf(file, "%-10s %7.1f %7.1f %7.1f %7.1f %8.2f\n",
+          names[kind], res.insert_ns, res.find_ns, res.miss_ns, res.erase_ns, res.iterate_ns
+        );
+      }
+    }
+  };
+}}
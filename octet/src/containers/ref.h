@@ -46,6 +46,12 @@ namespace octet { namespace containers {
       if (item) item->add_ref();
     }
 
+    /// move constructor - takes the pointer without touching the reference count.
+    ref(ref &&rhs) {
+      item = rhs.item;
+      rhs.item = 0;
+    }
+
     /// initialize with new item - pointer then "owns" object
     ref(item_t *new_item) {
       if (new_item) new_item->add_ref();
@@ -61,6 +67,17 @@ namespace octet { namespace containers {
       return rhs;
     }
 
+    /// take the item from another ref - frees any old object
+    const ref &operator=(ref &&rhs) {
+      if (this != &rhs) {
+        item_t *old_item = item;
+        item = rhs.item;
+        rhs.item = 0;
+        if (old_item) old_item->release();
+      }
+      return *this;
+    }
+
     /// replace item with new one - frees any old object
     item_t *operator=(item_t *new_item) {
       if (new_item) new_item->add_ref();
@@ -90,4 +107,9 @@ namespace octet { namespace containers {
       item = 0;
     }
   };
+
+  /// a ref is just a pointer, so dynarray can move it with memcpy.
+  template <class item_t, class allocator_t> struct is_relocatable<ref<item_t, allocator_t> > {
+    enum { value = 1 };
+  };
 } }
@@ -0,0 +1,108 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// objects that must be destroyed on the main thread
+//
+// OpenGL objects can only be deleted on the thread that owns the context.
+// If the last reference to a texture or buffer is dropped on a worker thread,
+// the object is queued here and destroyed at the end of the frame.
+//
+
+namespace octet { namespace containers {
+  /// Queue of objects waiting to be destroyed on the main thread.
+  ///
+  /// app_common marks the thread that creates the app as the main thread
+  /// and calls flush() from end_frame(). Until a main thread is set,
+  /// every thread counts as the main thread.
+  ///
+  /// Example:
+  ///
+  ///     if (release_queue::is_main_thread()) {
+  ///       delete obj;
+  ///     } else {
+  ///       release_queue::push(obj, destroy_obj);
+  ///     }
+  class release_queue {
+    struct item_t {
+      void *object;
+      void (*destroy)(void *object);
+    };
+
+    // singleton state, a bit like an old-world global variable
+    struct state_t {
+      std::atomic_flag lock;
+      dynarray<item_t> items;
+      std::thread::id main_thread;
+      bool has_main_thread;
+    };
+
+    static state_t &state() {
+      static state_t instance;
+      return instance;
+    }
+
+    static void lock() {
+      unsigned spins = 0;
+      while (state().lock.test_and_set(std::memory_order_acquire)) {
+        spin_backoff(spins);
+      }
+    }
+
+    static void unlock() {
+      state().lock.clear(std::memory_order_release);
+    }
+
+  public:
+    /// Make the calling thread the main thread.
+    static void set_main_thread() {
+      state_t &st = state();
+      st.main_thread = std::this_thread::get_id();
+      st.has_main_thread = true;
+    }
+
+    /// Return true if we are on the main (GL) thread.
+    static bool is_main_thread() {
+      state_t &st = state();
+      return !st.has_main_thread || st.main_thread == std::this_thread::get_id();
+    }
+
+    /// Queue an object to be destroyed by the main thread. Safe to call from any thread.
+    static void push(void *object, void (*destroy)(void *object)) {
+      item_t item = { object, destroy };
+      lock();
+      state().items.push_back(item);
+      unlock();
+    }
+
+    /// Destroy everything in the queue. Call this on the main thread.
+    /// Returns the number of objects destroyed.
+    static unsigned flush() {
+      state_t &st = state();
+      unsigned num_destroyed = 0;
+      dynarray<item_t> items;
+      for (;;) {
+        // take the whole queue so that we do not hold the lock during destructors.
+        lock();
+        items = std::move(st.items);
+        unlock();
+        if (items.empty()) break;
+        for (unsigned i = 0; i != items.size(); ++i) {
+          items[i].destroy(items[i].object);
+        }
+        num_destroyed += items.size();
+      }
+      return num_destroyed;
+    }
+
+    /// Number of objects waiting to be destroyed.
+    static unsigned get_num_pending() {
+      lock();
+      unsigned result = state().items.size();
+      unlock();
+      return result;
+    }
+  };
+} }
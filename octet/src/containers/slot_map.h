@@ -0,0 +1,236 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// dense array of objects with stable handles
+//
+// example:
+//
+//   slot_map<ref<mesh_instance> > bullets;
+//   slot_handle h = bullets.insert(new mesh_instance(...));
+//   ...
+//   bullets.erase(h);                 // O(1), the last bullet fills the gap
+//   if (!bullets.get(h)) ...          // the handle is now stale
+//
+
+namespace octet { namespace containers {
+  /// A handle to an object in a slot_map. Zero is never a valid handle.
+  typedef uint32_t slot_handle;
+
+  /// Array of objects that keeps them packed together but gives out stable handles.
+  ///
+  /// Objects are stored contiguously, so iterating with size() and operator[] is as fast
+  /// as a dynarray. insert() and erase() are O(1): erase moves the last object into the gap,
+  /// so the order of the objects changes.
+  ///
+  /// A handle is a slot index and a generation number. The generation changes when
+  /// an object is erased, so a handle to an erased object is detected by get() and erase()
+  /// instead of finding whatever object took its place.
+  template <class item_t, class allocator_t=allocator> class slot_map {
+    enum {
+      index_bits = 20,
+      max_slots = 1 << index_bits,
+      index_mask = max_slots - 1,
+      generation_mask = (1 << (32 - index_bits)) - 1,
+      no_slot = 0xffffffff,
+    };
+
+    struct slot_t {
+      uint32_t index;       // position in items[] when used, next free slot when not
+      uint32_t generation;  // part of the handle, changes on every erase
+    };
+
+    dynarray<item_t, allocator_t> items;
+    dynarray<uint32_t, allocator_t> item_slots;
+    dynarray<slot_t, allocator_t> slots;
+
+    // free slots are reused oldest first so that generations last longer.
+    uint32_t free_head;
+    uint32_t free_tail;
+
+    static uint32_t next_generation(uint32_t generation) {
+      generation = (generation + 1) & generation_mask;
+      return generation ? generation : 1;
+    }
+
+    static slot_handle make_handle(uint32_t slot, uint32_t generation) {
+      return (generation << index_bits) | slot;
+    }
+
+    // return the slot for a handle or 0 if it is stale.
+    const slot_t *find_slot(slot_handle handle) const {
+      uint32_t slot = handle & index_mask;
+      if (slot >= slots.size()) return 0;
+      const slot_t &s = slots[slot];
+      return s.generation == (handle >> index_bits) && s.index < items.size() && item_slots[s.index] == slot ? &s : 0;
+    }
+
+    void push_free(uint32_t slot) {
+      slots[slot].index = no_slot;
+      if (free_tail == no_slot) {
+        free_head = slot;
+      } else {
+        slots[free_tail].index = slot;
+      }
+      free_tail = slot;
+    }
+
+    // find a slot for a new object at the end of items[].
+    slot_handle alloc_slot() {
+      uint32_t slot = free_head;
+      if (slot != no_slot) {
+        free_head = slots[slot].index;
+        if (free_head == no_slot) free_tail = no_slot;
+      } else {
+        slot = slots.size();
+        assert(slot < max_slots && "slot_map: too many objects");
+        slot_t new_slot = { 0, 1 };
+        slots.push_back(new_slot);
+      }
+      slots[slot].index = items.size();
+      item_slots.push_back(slot);
+      return make_handle(slot, slots[slot].generation);
+    }
+  public:
+    /// Make an empty slot map.
+    slot_map() {
+      free_head = free_tail = no_slot;
+    }
+
+    /// Add an object and return its handle.
+    slot_handle insert(const item_t &item) {
+      slot_handle handle = alloc_slot();
+      items.push_back(item);
+      return handle;
+    }
+
+    /// Add an object and return its handle.
+    slot_handle insert(item_t &&item) {
+      slot_handle handle = alloc_slot();
+      items.push_back(std::move(item));
+      return handle;
+    }
+
+    /// Remove an object. Returns false if the handle is stale.
+    /// The last object moves into the gap.
+    bool erase(slot_handle handle) {
+      const slot_t *s = find_slot(handle);
+      if (!s) return false;
+      uint32_t slot = handle & index_mask;
+      uint32_t index = s->index;
+      uint32_t last = items.size() - 1;
+      if (index != last) {
+        items[index] = std::move(items[last]);
+        item_slots[index] = item_slots[last];
+        slots[item_slots[index]].index = index;
+      }
+      items.pop_back();
+      item_slots.pop_back();
+      slots[slot].generation = next_generation(slots[slot].generation);
+      push_free(slot);
+      return true;
+    }
+
+    /// Remove the object at a position in the array. The last object moves into the gap.
+    void erase_index(unsigned index) {
+      assert(index < items.size());
+      uint32_t slot = item_slots[index];
+      erase(make_handle(slot, slots[slot].generation));
+    }
+
+    /// Get an object from its handle or null if the handle is stale.
+    item_t *get(slot_handle handle) {
+      const slot_t *s = find_slot(handle);
+      return s ? &items[s->index] : 0;
+    }
+
+    /// Get an object from its handle or null if the handle is stale.
+    const item_t *get(slot_handle handle) const {
+      const slot_t *s = find_slot(handle);
+      return s ? &items[s->index] : 0;
+    }
+
+    /// Return true if the handle refers to an object.
+    bool contains(slot_handle handle) const {
+      return find_slot(handle) != 0;
+    }
+
+    /// Position of an object in the array or -1 if the handle is stale.
+    int get_index(slot_handle handle) const {
+      const slot_t *s = find_slot(handle);
+      return s ? (int)s->index : -1;
+    }
+
+    /// Handle of the object at a position in the array.
+    slot_handle get_handle(unsigned index) const {
+      assert(index < items.size());
+      uint32_t slot = item_slots[index];
+      return make_handle(slot, slots[slot].generation);
+    }
+
+    /// Number of objects.
+    unsigned size() const {
+      return items.size();
+    }
+
+    /// Return true if there are no objects.
+    bool empty() const {
+      return items.empty();
+    }
+
+    /// Access an object by its position in the array, for iteration.
+    item_t &operator[](unsigned index) {
+      return items[index];
+    }
+
+    /// Access an object by its position in the array, for iteration.
+    const item_t &operator[](unsigned index) const {
+      return items[index];
+    }
+
+    /// Make space for "size" objects.
+    void reserve(unsigned size) {
+      items.reserve(size);
+      item_slots.reserve(size);
+      slots.reserve(size);
+    }
+
+    /// Remove all the objects and free the memory. Old handles may become valid again.
+    void reset() {
+      items.reset();
+      item_slots.reset();
+      slots.reset();
+      free_head = free_tail = no_slot;
+    }
+
+    /// Access the array of objects directly, for example to serialize it.
+    /// If you change the number of objects, call rebuild() afterwards.
+    dynarray<item_t, allocator_t> &access_items() {
+      return items;
+    }
+
+    /// Give every object a new handle after the array has been changed by access_items().
+    /// All the old handles become stale.
+    void rebuild() {
+      for (unsigned i = 0; i != slots.size(); ++i) {
+        slots[i].generation = next_generation(slots[i].generation);
+      }
+      while (slots.size() < items.size()) {
+        slot_t new_slot = { 0, 1 };
+        slots.push_back(new_slot);
+      }
+      item_slots.resize(items.size());
+      free_head = free_tail = no_slot;
+      for (unsigned i = 0; i != slots.size(); ++i) {
+        if (i < items.size()) {
+          slots[i].index = i;
+          item_slots[i] = i;
+        } else {
+          push_free(i);
+        }
+      }
+    }
+  };
+} }
@@ -13,6 +13,26 @@
 //
 
 namespace octet { namespace containers {
+  /// Split text at each delimiter into views of the text. No text is copied.
+  ///
+  /// Example:
+  ///
+  ///     dynarray<string_view> fields;
+  ///     for (each line of a csv file) {
+  ///       split(fields, string_view(line, line_length), ",");
+  ///       ...
+  ///     }
+  template <class allocator_t> void split(dynarray<string_view, allocator_t> &result, const string_view &text, const string_view &delimiter) {
+    result.resize(0);
+    unsigned cur = 0;
+    if (delimiter.size()) {
+      for (int next; (next = text.find(delimiter, cur)) != -1; cur = next + delimiter.size()) {
+        result.push_back(text.substr(cur, next - cur));
+      }
+    }
+    result.push_back(text.substr(cur));
+  }
+
   /// The string class is used to hold persistant text strings.
   ///
   /// Only use this class as a data member in another class. Do not pass strings as parameters
@@ -21,16 +41,80 @@ namespace octet { namespace containers {
   /// This string class has the ability to perform a few common operations such as formatting
   /// and url encode/decode.
   ///
+  /// Strings of up to 15 bytes are stored in the string itself, so they never touch the heap.
+  /// Longer strings grow geometrically, so a string can be used as a builder:
+  ///
+  ///     string json;
+  ///     for (unsigned i = 0; i != n; ++i) {
+  ///       json.printf("%s{\"id\": %d}", i ? "," : "", ids[i]);
+  ///     }
+  ///
   class string {
-    char *data_;
+    enum { inline_capacity = 15 };
+
+    // short text lives in buf_, long text on the heap.
+    // there are no pointers into the object, so a string can move with memcpy.
+    union {
+      char *heap_;
+      char buf_[inline_capacity + 1];
+    };
+
+    // length in bytes, not counting the terminator.
+    unsigned size_;
+
+    // bytes available, not counting the terminator. inline_capacity while the text is in buf_.
+    unsigned capacity_;
 
-    static char *null_string() { static char c; return &c; }
+    bool is_inline() const { return capacity_ == inline_capacity; }
+
+    void init() {
+      buf_[0] = 0;
+      size_ = 0;
+      capacity_ = inline_capacity;
+    }
 
     void release() {
-      if (data_ != null_string()) {
-        allocator::free((void*)data_, size() + 1);
-        data_ = null_string();
+      if (!is_inline()) {
+        allocator::free((void*)heap_, capacity_ + 1);
+      }
+      init();
+    }
+
+    // copy the text to a new heap buffer with room for at least min_capacity bytes.
+    // the string keeps its old buffer until adopt(), as heap_ shares its bytes with buf_,
+    // so anything that points into the old text stays valid until then.
+    char *grow(unsigned min_capacity, unsigned &new_capacity) {
+      new_capacity = capacity_ * 2 > min_capacity ? capacity_ * 2 : min_capacity;
+      char *new_data = (char*)allocator::malloc(new_capacity + 1);
+      memcpy(new_data, data(), size_ + 1);
+      return new_data;
+    }
+
+    // switch to a buffer made by grow() and free the old one.
+    void adopt(char *new_data, unsigned new_capacity) {
+      if (!is_inline()) {
+        allocator::free((void*)heap_, capacity_ + 1);
+      }
+      heap_ = new_data;
+      capacity_ = new_capacity;
+    }
+
+    // replace the text. value may point into this string.
+    string &assign(const char *value, unsigned size) {
+      if (size > capacity_) {
+        char *new_data = (char*)allocator::malloc(size + 1);
+        memcpy(new_data, value, size);
+        if (!is_inline()) {
+          allocator::free((void*)heap_, capacity_ + 1);
+        }
+        heap_ = new_data;
+        capacity_ = size;
+      } else {
+        memmove(data(), value, size);
       }
+      size_ = size;
+      data()[size] = 0;
+      return *this;
     }
 
     // When dealing with windows or java, we will come across the less popular
@@ -145,19 +229,28 @@ namespace octet { namespace containers {
     }
   public:
     /// Default constructor: empty string.
-    string() { data_ = null_string(); }
+    string() { init(); }
 
     /// Copy a UTF8 C string
-    string(const char *value) { data_ = null_string(); *this = value; }
-    
+    string(const char *value) { init(); *this = value; }
+
     /// Copy of a UFT16 C string
-    string(const wchar_t *value) { data_ = null_string(); *this = value; }
-    
+    string(const wchar_t *value) { init(); *this = value; }
+
     /// Copy of another string
-    string(const string& rhs) { data_ = null_string(); *this = rhs.c_str(); }
-    
+    string(const string& rhs) { init(); assign(rhs.data(), rhs.size_); }
+
+    /// Take the text from another string, leaving it empty.
+    string(string &&rhs) {
+      memcpy((void*)this, (const void*)&rhs, sizeof(*this));
+      rhs.init();
+    }
+
     /// Copy of a substring
-    string(const char *value, unsigned size) { data_ = null_string(); set(value, size); }
+    string(const char *value, unsigned size) { init(); set(value, size); }
+
+    /// Copy of a string_view
+    string(const string_view &value) { init(); set(value.data(), value.size()); }
 
     /// Free up memory used by the string.
     ~string() { release(); }
@@ -168,8 +261,10 @@ namespace octet { namespace containers {
     ///
     ///     string my_path;
     ///     my_path.format("%s/%s.dat", path, filename);
+    ///
+    /// Note: the arguments must not point into this string.
     string &format(const char *fmt, ...) {
-      release();
+      truncate(0);
       va_list v;
       va_start(v, fmt);
       vformat(fmt, v);
@@ -177,6 +272,7 @@ namespace octet { namespace containers {
       return *this;
     }
 
+    /// Append formatted text to a string. The arguments may point into this string.
     string &printf(const char *fmt, ...) {
       va_list v;
       va_start(v, fmt);
@@ -185,152 +281,163 @@ namespace octet { namespace containers {
       return *this;
     }
 
+    /// Append formatted text, printing straight into the string's buffer.
     void vformat(const char *fmt, va_list v) {
+      va_list v2;
+      va_copy(v2, v);
       #ifdef WIN32
-        size_t cur_len = strlen(data_);
         int len = _vscprintf(fmt, v);
-        if (len) {
-          if (cur_len) {
-            data_ = (char*)allocator::realloc(data_, cur_len+1, cur_len + len + 1);
-            vsprintf_s(data_ + cur_len, len+1, fmt, v);
-          } else {
-            data_ = (char*)allocator::malloc(len+1);
-            vsprintf_s(data_, len+1, fmt, v);
-          }
-        }
       #else
-        char tmp[1024];
-        vsnprintf(tmp, sizeof(tmp)-1, fmt, v);
-        *this += tmp;
+        int len = vsnprintf(0, 0, fmt, v);
       #endif
+      if (len > 0) {
+        // the arguments may point into this string, so print before adopting a new buffer.
+        unsigned new_capacity = capacity_;
+        char *dest = size_ + len > capacity_ ? grow(size_ + len, new_capacity) : data();
+        #ifdef WIN32
+          vsprintf_s(dest + size_, len + 1, fmt, v2);
+        #else
+          vsnprintf(dest + size_, len + 1, fmt, v2);
+        #endif
+        size_ += len;
+        if (dest != data()) adopt(dest, new_capacity);
+      }
+      va_end(v2);
     }
 
     /// Decode url strings - to turn them into filenames, for example.
     string &urldecode(const char *value) {
-      release();
+      truncate(0);
       if (value) {
         unsigned size = urldecode_impl(0, value);
-        if (size) {
-          data_ = (char*)allocator::malloc(size+1);
-          urldecode_impl(data_, value);
-        }
+        reserve(size);
+        urldecode_impl(data(), value);
+        size_ = size;
       }
       return *this;
     }
 
     /// encode url strings - to turn them into URLs, for example
     string &urlencode(const char *value) {
-      release();
+      truncate(0);
       if (value) {
         unsigned size = urlencode_impl(0, value);
-        if (size) {
-          data_ = (char*)allocator::malloc(size+1);
-          urlencode_impl(data_, value);
-        }
+        reserve(size);
+        urlencode_impl(data(), value);
+        size_ = size;
       }
       return *this;
     }
 
     // copy a utf8 string - unix, mac and the web.
     string &operator=(const char *value) {
-      release();
-      if (value) {
-        size_t size = strlen(value);
-        if (size) {
-          data_ = (char*)allocator::malloc(size+1);
-          memcpy((char*)data_, value, size+1);
-        }
-      }
-      return *this;
+      return assign(value ? value : "", value ? (unsigned)strlen(value) : 0);
     }
 
     // copy utf16 unicode strings - microsoft & java
     string &operator=(const wchar_t *value) {
-      release();
+      truncate(0);
       if (value) {
         unsigned size = utf16_to_utf8(0, value);
-        if (size) {
-          data_ = (char*)allocator::malloc(size+1);
-          utf16_to_utf8(data_, value);
-        }
+        reserve(size);
+        utf16_to_utf8(data(), value);
+        size_ = size;
       }
       return *this;
     }
 
     /// copy another string
-    string &operator=(const string& rhs) { data_ = null_string(); *this = rhs.c_str(); return *this; }
+    string &operator=(const string& rhs) { if (this != &rhs) assign(rhs.data(), rhs.size_); return *this; }
 
-    /// copy a substring
-    string &set(const char *value, unsigned size) {
-      release();
-      if (value) {
-        if (size) {
-          data_ = (char*)allocator::malloc(size+1);
-          memcpy((char*)data_, value, size);
-          data_[size] = 0;
-        }
+    // take the text from another string, leaving it empty.
+    string &operator=(string &&rhs) {
+      if (this != &rhs) {
+        release();
+        memcpy((void*)this, (const void*)&rhs, sizeof(*this));
+        rhs.init();
       }
       return *this;
     }
 
-    /// shorten a string to a new length
+    /// copy a string_view
+    string &operator=(const string_view &rhs) { return assign(rhs.data(), rhs.size()); }
+
+    /// copy a substring
+    string &set(const char *value, unsigned size) {
+      return value ? assign(value, size) : truncate(0);
+    }
+
+    /// shorten a string to a new length. This keeps the memory for reuse.
     string &truncate(int new_len) {
-      int size = (int)strlen(data_);
-      if (new_len < size) {
-        if (data_ == null_string()) {
-          data_ = (char*)allocator::malloc(new_len+1);
-        } else {
-          data_ = (char*)allocator::realloc((void*)data_, size+1, new_len+1);
-        }
-        data_[new_len] = 0;
+      if ((unsigned)new_len < size_) {
+        size_ = (unsigned)new_len;
+        data()[new_len] = 0;
       }
       return *this;
     }
 
+    /// Make room for a string of this many bytes.
+    void reserve(unsigned new_capacity) {
+      if (new_capacity > capacity_) {
+        unsigned capacity = 0;
+        char *new_data = grow(new_capacity, capacity);
+        adopt(new_data, capacity);
+      }
+    }
+
     /// compare two strings
-    bool operator==(const char *rhs) const { return strcmp(data_, rhs) == 0; }
+    bool operator==(const char *rhs) const { return strcmp(data(), rhs) == 0; }
     /// compare two strings
-    bool operator!=(const char *rhs) const { return strcmp(data_, rhs) != 0; }
+    bool operator!=(const char *rhs) const { return strcmp(data(), rhs) != 0; }
     /// compare two strings
-    bool operator<(const char *rhs) const { return strcmp(data_, rhs) < 0; }
+    bool operator<(const char *rhs) const { return strcmp(data(), rhs) < 0; }
     /// compare two strings
-    bool operator>(const char *rhs) const { return strcmp(data_, rhs) > 0; }
+    bool operator>(const char *rhs) const { return strcmp(data(), rhs) > 0; }
+
+    /// Append some bytes to a string. text may point into this string.
+    string &append(const char *text, unsigned size) {
+      if (size) {
+        // text may point into the old buffer, so copy it before adopting a new one.
+        unsigned new_capacity = capacity_;
+        char *dest = size_ + size > capacity_ ? grow(size_ + size, new_capacity) : data();
+        memmove(dest + size_, text, size);
+        size_ += size;
+        dest[size_] = 0;
+        if (dest != data()) adopt(dest, new_capacity);
+      }
+      return *this;
+    }
 
     /// Append to a string. Note: it is generally better to use format.
     string &operator+=(const char *rhs) {
-      if (rhs) {
-        size_t data_size = strlen(data_);
-        size_t rhs_size = strlen(rhs);
-        if (data_ == null_string()) {
-          data_ = (char*)allocator::malloc(data_size+rhs_size+1);
-        } else {
-          data_ = (char*)allocator::realloc(data_, data_size + 1, data_size+rhs_size+1);
-        }
-        memcpy(data_ + data_size, rhs, rhs_size+1);
-      }
-      return *this;
+      return rhs ? append(rhs, (unsigned)strlen(rhs)) : *this;
+    }
+
+    /// Append a string_view.
+    string &operator+=(const string_view &rhs) {
+      return append(rhs.data(), rhs.size());
     }
 
     /// Insert a substring.
     string &insert(unsigned pos, const char *rhs) {
       if (rhs) {
-        size_t data_size = strlen(data_);
-        size_t rhs_size = strlen(rhs);
-        char *new_data = (char*)allocator::malloc(data_size+rhs_size+1);
-        memcpy(new_data, data_, pos);
-        memcpy(new_data + pos, rhs, rhs_size);
-        memcpy(new_data + pos + rhs_size, data_, data_size - pos + 1);
-        release();
-        data_ = new_data;
+        // rhs may point into this string.
+        string tmp(rhs);
+        unsigned rhs_size = tmp.size_;
+        reserve(size_ + rhs_size);
+        char *dest = data();
+        memmove(dest + pos + rhs_size, dest + pos, size_ - pos + 1);
+        memcpy(dest + pos, tmp.data(), rhs_size);
+        size_ += rhs_size;
       }
       return *this;
     }
 
     /// Find a substring.
     int find(const char *rhs) const {
-      char *d = strstr(data_, rhs);
+      const char *d = strstr(data(), rhs);
       if (d) {
-        return (int)(d - data_);
+        return (int)(d - data());
       }
       return -1;
     }
@@ -338,12 +445,12 @@ namespace octet { namespace containers {
     /// Find the position of the extension in a file path.
     int extension_pos() const {
       int res = -1;
-      for (const char *p = data_; *p; ++p) {
+      for (const char *p = data(); *p; ++p) {
         char chr = *p;
         if (chr == '/' || chr == '\\') {
           res = -1;  // note  /usr/fred.jim/harry   has no extension
         } else if (chr == '.') {
-          res = (int)(p - data_);
+          res = (int)(p - data());
         }
       }
       return res;
@@ -352,33 +459,39 @@ namespace octet { namespace containers {
     /// Find the position of a filename in a file path
     int filename_pos() const  {
       int res = 0;
-      for (const char *p = data_; *p; ++p) {
+      for (const char *p = data(); *p; ++p) {
         char chr = *p;
         if (chr == '/' || chr == '\\') {
-          res = (int)(p - data_ + 1);
+          res = (int)(p - data() + 1);
         }
       }
       return res;
     }
 
     /// Number of bytes in a string. Note: this is not the number of characters.
-    int size() { return (int)strlen(data_); }
+    int size() const { return (int)size_; }
+
+    /// Number of bytes the string can hold without allocating.
+    unsigned capacity() const { return capacity_; }
 
     /// Get a C string from this string.
-    const char *c_str() const { return data_; }
+    const char *c_str() const { return data(); }
     /// Get a C string from this string.
-    operator const char *() { return data_; }
+    operator const char *() const { return data(); }
 
-    /// raw data access
+    /// Get a view of this string.
+    string_view view() const { return string_view(data(), size_); }
+
+    /// raw data access. If you write a zero into the string, size() will not know.
     char *data() const {
-      return data_;
+      return is_inline() ? (char*)buf_ : heap_;
     }
 
     /// Get/set a byte from the string.
-    char &operator[](int index) { return data_[index]; }
-    
+    char &operator[](int index) { return data()[index]; }
+
     /// Get a byte from the string.
-    char operator[](int index) const { return data_[index]; }
+    char operator[](int index) const { return data()[index]; }
 
     /// python-style string split.
     ///
@@ -388,24 +501,64 @@ namespace octet { namespace containers {
     ///     string my_csv = "100,fred,bert,harry";
     ///     my_csv.split(parts, ",")
     ///     // parts now contains four strings: "100", "fred", "bert", "harry"
-    void split(dynarray<string> &result, const char *delimiter) {
+    template <class allocator_t> void split(dynarray<string, allocator_t> &result, const char *delimiter) const {
+      string_view text = view();
+      string_view delim(delimiter);
       result.resize(0);
-      char *cur = data_;
-      unsigned delim_len = (unsigned)strlen(delimiter);
-      for(;;) {
-        char *next = strstr(cur, delimiter);
-        if (!next) break;
-        result.push_back(string());
-        result.back().set(cur, (int)(next - cur));
-        cur = next + delim_len;
+      unsigned cur = 0;
+      if (delim.size()) {
+        for (int next; (next = text.find(delim, cur)) != -1; cur = next + delim.size()) {
+          result.push_back(string(text.substr(cur, next - cur)));
+        }
       }
-      result.push_back(string());
-      result.back() = cur;
+      result.push_back(string(text.substr(cur)));
+    }
+
+    /// python-style string split that does not copy the text.
+    ///
+    /// The views point into this string, so do not change the string while you use them.
+    /// Reuse the result array and this will not allocate at all.
+    template <class allocator_t> void split(dynarray<string_view, allocator_t> &result, const char *delimiter) const {
+      containers::split(result, view(), delimiter);
     }
 
     /// return true if the string is empty.
-    bool empty() {
-      return size() == 0;
+    bool empty() const {
+      return size_ == 0;
     }
   };
+
+  /// string_view is just a pointer and a length.
+  template <> struct is_relocatable<string_view> {
+    enum { value = 1 };
+  };
+
+  /// a string has no pointers to itself, so dynarray can move it with memcpy.
+  template <> struct is_relocatable<string> {
+    enum { value = 1 };
+  };
+
+  #if OCTET_UNIT_TEST
+    class string_unit_test {
+    public:
+      string_unit_test() {
+        // appending a string to itself while it grows out of the inline buffer...
+        string short_str("abcdefghij");
+        short_str.append(short_str.c_str(), short_str.size());
+        assert(short_str == "abcdefghijabcdefghij");
+
+        // ...and while it grows a heap buffer.
+        string long_str("0123456789abcdefghijklmnopqrstuvwxyz");
+        long_str.append(long_str.c_str(), long_str.size());
+        assert(long_str == "0123456789abcdefghijklmnopqrstuvwxyz0123456789abcdefghijklmnopqrstuvwxyz");
+        long_str += long_str.c_str() + 36;
+        assert(long_str.size() == 108);
+
+        string fmt_str("abc");
+        fmt_str.printf("%s%s%s%s%s%s", fmt_str.c_str(), fmt_str.c_str(), fmt_str.c_str(), fmt_str.c_str(), fmt_str.c_str(), fmt_str.c_str());
+        assert(fmt_str == "abcabcabcabcabcabcabc");
+      }
+    };
+    static string_unit_test string_unit_test;
+  #endif
 } }
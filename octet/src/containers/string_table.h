@@ -0,0 +1,223 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// table of unique strings (string interning)
+//
+// example:
+//
+//   string_table names;
+//   unsigned fred = names.intern("fred");      // 0
+//   unsigned anne = names.intern("anne");      // 1
+//   unsigned fred2 = names.intern("fred");     // 0 again
+//   printf("%s\n", names.get_text(anne));      // "anne"
+//
+
+namespace octet { namespace containers {
+  /// Table of unique strings, each with a small integer id.
+  ///
+  /// Each string is stored once, along with its length and hash, and ids are given
+  /// out in order of first use. Comparing ids is much cheaper than comparing text.
+  /// The atoms (see app_utils::get_atom()) are ids in a string_table.
+  ///
+  /// Text pointers stay valid until the table is reset.
+  class string_table {
+  public:
+    /// A stored string. The text follows the header and is zero terminated.
+    struct entry_t {
+      uint32_t hash;
+      uint32_t length;
+
+      const char *get_text() const { return (const char*)(this + 1); }
+    };
+
+  private:
+    enum {
+      // text is stored in chunks of this size, long strings get their own chunk.
+      chunk_size = 0x1000,
+    };
+
+    // chunks are chained so that entries never move.
+    struct chunk_t {
+      chunk_t *next;
+      size_t size;
+    };
+
+    // index slot: the hash saves us visiting entries that do not match.
+    struct slot_t {
+      uint32_t hash;
+      uint32_t id_plus_one;
+    };
+
+    dynarray<entry_t*> entries;
+    slot_t *slots;
+    unsigned num_slots;
+
+    chunk_t *chunks;
+    uint8_t *ptr;
+    uint8_t *end;
+
+    static size_t align(size_t size) {
+      return (size + 7) & ~(size_t)7;
+    }
+
+    // copy the text into a chunk
+    entry_t *add_entry(const string_view &key, uint32_t hash) {
+      size_t bytes = align(sizeof(entry_t) + key.size() + 1);
+      if ((size_t)(end - ptr) < bytes) {
+        size_t size = bytes > chunk_size / 4 ? bytes : chunk_size;
+        chunk_t *chunk = (chunk_t*)allocator::malloc(align(sizeof(chunk_t)) + size);
+        chunk->next = chunks;
+        chunk->size = size;
+        chunks = chunk;
+        uint8_t *base = (uint8_t*)chunk + align(sizeof(chunk_t));
+        if (size == chunk_size) {
+          ptr = base;
+          end = base + size;
+        } else {
+          // big strings do not disturb the current chunk.
+          entry_t *entry = (entry_t*)base;
+          fill_entry(entry, key, hash);
+          return entry;
+        }
+      }
+      entry_t *entry = (entry_t*)ptr;
+      ptr += bytes;
+      fill_entry(entry, key, hash);
+      return entry;
+    }
+
+    static void fill_entry(entry_t *entry, const string_view &key, uint32_t hash) {
+      entry->hash = hash;
+      entry->length = key.size();
+      char *text = (char*)(entry + 1);
+      memcpy(text, key.data(), key.size());
+      text[key.size()] = 0;
+    }
+
+    // find the slot for this key: either the matching one or an empty one.
+    slot_t *find_slot(const string_view &key, uint32_t hash) const {
+      unsigned mask = num_slots - 1;
+      for (unsigned i = hash & mask; ; i = (i + 1) & mask) {
+        slot_t *slot = &slots[i];
+        if (!slot->id_plus_one) return slot;
+        if (slot->hash == hash) {
+          const entry_t *entry = entries[slot->id_plus_one - 1];
+          if (entry->length == key.size() && !memcmp(entry->get_text(), key.data(), key.size())) {
+            return slot;
+          }
+        }
+      }
+    }
+
+    // double the size of the index, keeping the load under a half.
+    void grow() {
+      slot_t *old_slots = slots;
+      unsigned old_num_slots = num_slots;
+      num_slots = num_slots ? num_slots * 2 : 64;
+      slots = (slot_t*)allocator::malloc(num_slots * sizeof(slot_t));
+      memset(slots, 0, num_slots * sizeof(slot_t));
+      unsigned mask = num_slots - 1;
+      for (unsigned i = 0; i != old_num_slots; ++i) {
+        if (old_slots[i].id_plus_one) {
+          unsigned j = old_slots[i].hash & mask;
+          while (slots[j].id_plus_one) j = (j + 1) & mask;
+          slots[j] = old_slots[i];
+        }
+      }
+      allocator::free(old_slots, old_num_slots * sizeof(slot_t));
+    }
+
+    // tables own their text: do not copy them.
+    string_table(const string_table &rhs);
+    string_table &operator=(const string_table &rhs);
+  public:
+    /// Make an empty table.
+    string_table() {
+      slots = 0;
+      num_slots = 0;
+      chunks = 0;
+      ptr = end = 0;
+    }
+
+    /// Free the text.
+    ~string_table() {
+      reset();
+    }
+
+    /// Remove all strings. Ids start again from zero.
+    void reset() {
+      for (chunk_t *chunk = chunks, *next; chunk; chunk = next) {
+        next = chunk->next;
+        allocator::free(chunk, align(sizeof(chunk_t)) + chunk->size);
+      }
+      allocator::free(slots, num_slots * sizeof(slot_t));
+      entries.reset();
+      slots = 0;
+      num_slots = 0;
+      chunks = 0;
+      ptr = end = 0;
+    }
+
+    /// Get the id of a string, adding it if it is new.
+    unsigned intern(const string_view &key) {
+      return intern(key, key.get_hash());
+    }
+
+    /// Get the id of a string with a hash from string_view::get_hash(), adding it if it is new.
+    unsigned intern(const string_view &key, uint32_t hash) {
+      if ((entries.size() + 1) * 2 > num_slots) {
+        grow();
+      }
+      slot_t *slot = find_slot(key, hash);
+      if (!slot->id_plus_one) {
+        entries.push_back(add_entry(key, hash));
+        slot->hash = hash;
+        slot->id_plus_one = entries.size();
+      }
+      return slot->id_plus_one - 1;
+    }
+
+    /// Get the id of a string or -1 if it is not in the table.
+    int find(const string_view &key) const {
+      return find(key, key.get_hash());
+    }
+
+    /// Get the id of a string with a hash from string_view::get_hash() or -1 if it is not in the table.
+    int find(const string_view &key, uint32_t hash) const {
+      if (!num_slots) return -1;
+      return (int)find_slot(key, hash)->id_plus_one - 1;
+    }
+
+    /// Number of strings in the table. Ids go from 0 to get_num_strings() - 1.
+    unsigned get_num_strings() const {
+      return entries.size();
+    }
+
+    /// Zero terminated text of a string.
+    const char *get_text(unsigned id) const {
+      assert(id < entries.size());
+      return entries[id]->get_text();
+    }
+
+    /// Length of a string in bytes.
+    unsigned get_length(unsigned id) const {
+      assert(id < entries.size());
+      return entries[id]->length;
+    }
+
+    /// Precomputed hash of a string.
+    uint32_t get_hash(unsigned id) const {
+      assert(id < entries.size());
+      return entries[id]->hash;
+    }
+
+    /// The string as a view.
+    string_view get_view(unsigned id) const {
+      assert(id < entries.size());
+      return string_view(entries[id]->get_text(), entries[id]->length);
+    }
+  };
+} }
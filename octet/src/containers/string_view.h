@@ -0,0 +1,121 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// a pointer and a length: text that we do not own.
+//
+// example:
+//
+//   const char *target = "node/translate.X";
+//   string_view node_name(target, 4); // "node", no copy and no terminator
+//
+
+namespace octet { namespace containers {
+  /// A piece of text that belongs to someone else, such as a substring of a file.
+  ///
+  /// The text does not need to end in a zero, so we can look up words in a buffer
+  /// without copying them to a temporary string first.
+  ///
+  /// Like a raw pointer, a string_view must not outlive the text it points to.
+  class string_view {
+    const char *data_;
+    unsigned size_;
+  public:
+    /// Empty text.
+    string_view() {
+      data_ = "";
+      size_ = 0;
+    }
+
+    /// View a C string. Null pointers become empty text.
+    string_view(const char *value) {
+      data_ = value ? value : "";
+      size_ = value ? (unsigned)strlen(value) : 0;
+    }
+
+    /// View "size" bytes of text.
+    string_view(const char *value, unsigned size) {
+      data_ = value;
+      size_ = size;
+    }
+
+    /// Pointer to the first character. Not necessarily zero terminated!
+    const char *data() const { return data_; }
+
+    /// Number of bytes of text.
+    unsigned size() const { return size_; }
+
+    /// Return true if there is no text.
+    bool empty() const { return size_ == 0; }
+
+    /// Access a character.
+    char operator[](unsigned index) const { return data_[index]; }
+
+    /// Compare two pieces of text.
+    bool operator==(const string_view &rhs) const {
+      return size_ == rhs.size_ && !memcmp(data_, rhs.data_, size_);
+    }
+
+    bool operator!=(const string_view &rhs) const {
+      return !(*this == rhs);
+    }
+
+    /// Part of the text, starting at "pos".
+    string_view substr(unsigned pos, unsigned size = ~0u) const {
+      if (pos > size_) pos = size_;
+      if (size > size_ - pos) size = size_ - pos;
+      return string_view(data_ + pos, size);
+    }
+
+    /// Return the position of a character or -1.
+    int find(char chr) const {
+      const char *pos = (const char*)memchr(data_, chr, size_);
+      return pos ? (int)(pos - data_) : -1;
+    }
+
+    /// Return the position of some text at or after "start" or -1.
+    int find(const string_view &rhs, unsigned start = 0) const {
+      if (rhs.size_ == 0) return start <= size_ ? (int)start : -1;
+      const char *end = data_ + size_;
+      for (const char *p = data_ + start; p < end && (unsigned)(end - p) >= rhs.size_; ++p) {
+        p = (const char*)memchr(p, rhs.data_[0], (end - p) - rhs.size_ + 1);
+        if (!p) break;
+        if (!memcmp(p, rhs.data_, rhs.size_)) return (int)(p - data_);
+      }
+      return -1;
+    }
+
+    /// A strong 32 bit hash of the text.
+    ///
+    /// Dictionaries and string tables use this, so it can be calculated once
+    /// and passed to their pre-hashed lookups.
+    uint32_t get_hash() const {
+      const uint64_t k = 0xff51afd7ed558ccdULL;
+      uint64_t hash = size_ * 0x9e3779b97f4a7c15ULL;
+      const char *src = data_;
+      unsigned bytes = size_;
+
+      // eight bytes at a time
+      for (; bytes >= 8; bytes -= 8, src += 8) {
+        uint64_t word;
+        memcpy(&word, src, 8);
+        hash = (hash ^ word) * k;
+        hash ^= hash >> 29;
+      }
+
+      if (bytes) {
+        uint64_t word = 0;
+        memcpy(&word, src, bytes);
+        hash = (hash ^ word) * k;
+      }
+
+      // MurmurHash3 finaliser
+      hash ^= hash >> 33;
+      hash *= 0xc4ceb9fe1a85ec53ULL;
+      hash ^= hash >> 33;
+      return (uint32_t)hash;
+    }
+  };
+} }
@@ -26,39 +26,108 @@ namespace octet { namespace helpers {
     // temporary buffer used for send/recieve
     dynarray<char> buf;
 
+    // heap profile saved by /heap?operation=mark
+    heap_snapshot heap_mark;
+
     void set_non_blocking(int socket) {
       unsigned long mode = 1;
       ioctlsocket(socket, FIONBIO, &mode);
     }
 
-    void parse_http_request(session &s, char *p) {
-      string header(p);
+    // /heap                   heap profile (build with OCTET_ALLOC_TRACKING=1, see allocator::set_tracking)
+    // /heap?operation=sample  start the sampling profiler
+    // /heap?operation=all     record every allocation
+    // /heap?operation=stop    stop recording
+    // /heap?operation=mark    remember the profile
+    // /heap?operation=diff    show the change since the mark
+    void send_heap_profile(session &s, const string_view &query) {
+      dynarray<string_view, frame_allocator> ops;
+      split(ops, query, "&");
+      string_view operation;
+      dynarray<string_view, frame_allocator> lhsrhs;
+      for (unsigned i = 0; i != ops.size(); ++i) {
+        split(lhsrhs, ops[i], "=");
+        if (lhsrhs.size() >= 2 && lhsrhs[0] == "operation") {
+          operation = lhsrhs[1];
+        }
+      }
 
-      dynarray<string> lines;
+      if (operation == "sample") {
+        allocator::set_tracking(allocator::track_sampled);
+      } else if (operation == "all") {
+        allocator::set_tracking(allocator::track_all);
+      } else if (operation == "stop") {
+        allocator::set_tracking(allocator::track_off);
+      }
+
+      heap_snapshot current;
+      allocator::get_heap_snapshot(current);
+      heap_snapshot change;
+      heap_snapshot *result = &current;
+      if (operation == "mark") {
+        allocator::get_heap_snapshot(heap_mark);
+      } else if (operation == "diff") {
+        change.diff(heap_mark, current);
+        result = &change;
+      }
+      result->sort();
+
+      static const char *mode_names[] = { "off", "all", "sampled" };
+      string body;
+      body.format("# tracking: %s\n", mode_names[allocator::get_tracking()]);
+      char line[512];
+      heap_snapshot::format_title(line, sizeof(line), result->get_live_bytes(), result->get_peak_bytes());
+      body += line;
+      for (unsigned i = 0; i != result->size(); ++i) {
+        heap_snapshot::format_record(line, sizeof(line), (*result)[i]);
+        body += line;
+      }
+
+      string response_header;
+      response_header.format(
+        "HTTP/1.1 200 OK\n"
+        "Content-Type: text/plain; charset=UTF-8\n"
+        "Content-Length: %d\n"
+        "\n",
+        body.size()
+      );
+      send(s.client_socket, response_header.c_str(), response_header.size(), 0);
+      send(s.client_socket, body.c_str(), body.size(), 0);
+    }
+
+    void parse_http_request(session &s, char *p) {
+      // these arrays only live for this call, so keep them off the general heap.
+      // the views point into the request buffer, so no text is copied.
+      dynarray<string_view, frame_allocator> lines;
       lines.reserve(32);
-      header.split(lines, "\n");
+      split(lines, p, "\n");
       if (lines.size() == 0) return;
 
-      dynarray<string> line0;
-      lines[0].split(line0, " ");
+      dynarray<string_view, frame_allocator> line0;
+      split(line0, lines[0], " ");
       if (line0.size() < 3) return;
       if (line0[0] != "GET") return;
 
-      log("http get from: %s\n", line0[1].c_str());
+      log("http get from: %.*s\n", line0[1].size(), line0[1].data());
 
       // /graph?operation=get_children&id=1
-      dynarray<string> url;
-      line0[1].split(url, "?");
+      dynarray<string_view, frame_allocator> url;
+      split(url, line0[1], "?");
+      if (url.size() >= 1 && url[0] == "/heap") {
+        send_heap_profile(s, url.size() >= 2 ? url[1] : string_view());
+        return;
+      }
       if (url.size() < 2) return;
 
-      dynarray<string> ops;
-      url[1].split(ops, "&");
+      dynarray<string_view, frame_allocator> ops;
+      split(ops, url[1], "&");
       string id;
       string callback;
       bool get_children = false;
+      dynarray<string_view, frame_allocator> lhsrhs;
       for (unsigned i = 0; i != ops.size(); ++i) {
-        dynarray<string> lhsrhs;
-        ops[i].split(lhsrhs, "=");
+        split(lhsrhs, ops[i], "=");
+        if (lhsrhs.size() < 2) continue;
         if (lhsrhs[0] == "operation") {
           get_children = lhsrhs[1] == "get_children";
         } else if (lhsrhs[0] == "id") {
@@ -66,7 +135,7 @@ namespace octet { namespace helpers {
         } else if (lhsrhs[0] == "callback") {
           callback = lhsrhs[1];
         }
-        //log("%s = %s\n", lhsrhs[0].c_str(), lhsrhs[1].c_str());
+        //log("%.*s = %.*s\n", lhsrhs[0].size(), lhsrhs[0].data(), lhsrhs[1].size(), lhsrhs[1].data());
       }
 
       if (!get_children) return;
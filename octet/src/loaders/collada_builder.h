@@ -47,7 +47,8 @@ namespace octet { namespace loaders {
     TiXmlElement *find_id(const char *source) {
       if (source) {
         if (source[0] == '#') source++;
-        return ids[source];
+        int index = ids.get_index(source);
+        return index < 0 ? 0 : ids.get_value(index);
       }
       return 0;
     }
@@ -758,18 +759,19 @@ namespace octet { namespace loaders {
         if (debug > 0) log("animation %s\n", id);
         for (TiXmlElement *channel_elem = child(anim_elem, "channel"); channel_elem != NULL; channel_elem = sibling(channel_elem, "channel")) {
           const char *target = attr(channel_elem, "target");
-          string node_name = target;
-          string sub_target_name;
-          string component_name;
+          // split "node/sub_target.component" without copying
+          string_view node_name(target);
+          string_view sub_target_name;
+          string_view component_name;
 
-          int slash = node_name.find("/");
+          int slash = node_name.find('/');
           if (slash != -1) {
-            node_name.truncate(slash);
-            sub_target_name = target + slash + 1;
-            int dot = sub_target_name.find(".");
+            sub_target_name = node_name.substr(slash + 1);
+            node_name = node_name.substr(0, slash);
+            int dot = sub_target_name.find('.');
             if (dot != -1) {
-              sub_target_name.truncate(dot);
-              component_name = target + slash + 1 + dot + 1;
+              component_name = sub_target_name.substr(dot + 1);
+              sub_target_name = sub_target_name.substr(0, dot);
             }
           }
           
@@ -777,7 +779,7 @@ namespace octet { namespace loaders {
           atom_t sub_target_sid = app_utils::get_atom(sub_target_name);
           atom_t component_sid = app_utils::get_atom(component_name);
           
-          if (debug > 0) log("  channel target %s %s %s\n", node_name.c_str(), sub_target_name.c_str(), component_name.c_str());
+          if (debug > 0) log("  channel target %.*s %.*s %.*s\n", (int)node_name.size(), node_name.data(), (int)sub_target_name.size(), sub_target_name.data(), (int)component_name.size(), component_name.data());
           TiXmlElement *sampler_elem = find_id(attr(channel_elem, "source"));
           if (sampler_elem) {
             dynarray<float> times;
@@ -1093,6 +1095,7 @@ namespace octet { namespace loaders {
       mesh->assign(vsize, isize, (unsigned char*)&state.vertices[0], (unsigned char*)&state.indices[0]);
       mesh->set_params(state.attr_stride * 4, num_indices, num_vertices, GL_TRIANGLES, GL_UNSIGNED_INT);
       mesh->calc_aabb();
+      dict.mesh_loaded(mesh_url, mesh);
       if (debug > 1) mesh->dump(log("mesh\n"));
     }
 
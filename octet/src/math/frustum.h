@@ -0,0 +1,171 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// view frustum: the six planes of a camera's view volume
+//
+
+namespace octet { namespace math {
+  /// The volume that a camera can see, as six half spaces.
+  ///
+  /// Build one from a world to projection matrix and use it to skip objects
+  /// that are off screen:
+  ///
+  ///     frustum view(cam->get_worldToProjection());
+  ///     if (view.intersects(world_aabb)) draw();
+  class frustum {
+  public:
+    enum { num_planes = 6 };
+
+    /// results of classify()
+    enum { outside = 0, intersecting = 1, inside = 2 };
+
+  private:
+    // xyz = normal, w = offset. dot(normal, p) + offset >= 0 if p is inside.
+    // left, right, bottom, top, near, far
+    vec4 planes[num_planes];
+
+    // bit n is set if plane n has normal.x() >= 0, bit n+8 for y, bit n+16 for z.
+    unsigned signs;
+
+  public:
+    /// A frustum that contains everything.
+    frustum() {
+      for (int i = 0; i != num_planes; ++i) {
+        planes[i] = vec4(0, 0, 0, 1);
+      }
+      signs = 0;
+    }
+
+    /// The frustum of a world (or model) to projection matrix.
+    frustum(const mat4t &worldToProjection) {
+      init(worldToProjection);
+    }
+
+    /// Extract the planes from a world (or model) to projection matrix.
+    /// The matrix multiplies row vectors, so the planes come from its columns.
+    void init(const mat4t &worldToProjection) {
+      vec4 x = worldToProjection.colx();
+      vec4 y = worldToProjection.coly();
+      vec4 z = worldToProjection.colz();
+      vec4 w = worldToProjection.colw();
+
+      // -w <= x, y, z <= w in projection space
+      planes[0] = w + x;
+      planes[1] = w - x;
+      planes[2] = w + y;
+      planes[3] = w - y;
+      planes[4] = w + z;
+      planes[5] = w - z;
+
+      signs = 0;
+      for (int i = 0; i != num_planes; ++i) {
+        float len = planes[i].xyz().length();
+        if (len != 0) planes[i] = planes[i] * (1.0f / len);
+        signs |= (planes[i].x() >= 0 ? 1 << i : 0) | (planes[i].y() >= 0 ? 0x100 << i : 0) | (planes[i].z() >= 0 ? 0x10000 << i : 0);
+      }
+    }
+
+    /// Get a plane: xyz is the inward facing normal, w the offset.
+    const vec4 &get_plane(int i) const {
+      return planes[i];
+    }
+
+    /// Get a plane as a half space.
+    half_space get_half_space(int i) const {
+      return half_space(planes[i].xyz(), planes[i].w());
+    }
+
+    /// Is the point inside the frustum?
+    bool intersects(const vec3 &rhs) const {
+      for (int i = 0; i != num_planes; ++i) {
+        if (dot(planes[i].xyz(), rhs) + planes[i].w() < 0) return false;
+      }
+      return true;
+    }
+
+    /// Is the sphere partly inside the frustum?
+    bool intersects(const sphere &rhs) const {
+      for (int i = 0; i != num_planes; ++i) {
+        if (dot(planes[i].xyz(), rhs.get_center()) + planes[i].w() < -rhs.get_radius()) return false;
+      }
+      return true;
+    }
+
+    /// Is the box partly inside the frustum?
+    /// This is conservative: a few boxes near the corners pass when they are outside.
+    bool intersects(const aabb &rhs) const {
+      return classify(rhs) != outside;
+    }
+
+    /// Is the box outside, intersecting or entirely inside the frustum?
+    int classify(const aabb &rhs) const {
+      vec3 center = rhs.get_center();
+      vec3 half = rhs.get_half_extent();
+      int result = inside;
+      for (int i = 0; i != num_planes; ++i) {
+        vec3 normal = planes[i].xyz();
+        float fatness = sum(abs(normal * half));
+        float distance = dot(normal, center) + planes[i].w();
+        if (distance < -fatness) return outside;
+        if (distance < fatness) result = intersecting;
+      }
+      return result;
+    }
+
+    /// Test four boxes at once. The boxes are stored as separate arrays of four
+    /// minimum and maximum values for x, y and z.
+    /// Returns a mask with bit i set if box i is partly inside the frustum.
+    /// Bits in "inside_mask" are set for boxes entirely inside.
+    unsigned intersects4(
+      const float *min_x, const float *min_y, const float *min_z,
+      const float *max_x, const float *max_y, const float *max_z,
+      unsigned &inside_mask
+    ) const {
+      #if OCTET_SSE2
+        __m128 mnx = _mm_loadu_ps(min_x), mny = _mm_loadu_ps(min_y), mnz = _mm_loadu_ps(min_z);
+        __m128 mxx = _mm_loadu_ps(max_x), mxy = _mm_loadu_ps(max_y), mxz = _mm_loadu_ps(max_z);
+        __m128 zero = _mm_setzero_ps();
+        __m128 out = zero;
+        __m128 partial = zero;
+        for (int i = 0; i != num_planes; ++i) {
+          const vec4 &p = planes[i];
+          // the corners furthest along and against the normal.
+          __m128 far_x = signs & (1 << i) ? mxx : mnx, near_x = signs & (1 << i) ? mnx : mxx;
+          __m128 far_y = signs & (0x100 << i) ? mxy : mny, near_y = signs & (0x100 << i) ? mny : mxy;
+          __m128 far_z = signs & (0x10000 << i) ? mxz : mnz, near_z = signs & (0x10000 << i) ? mnz : mxz;
+          __m128 nx = _mm_set1_ps(p[0]), ny = _mm_set1_ps(p[1]), nz = _mm_set1_ps(p[2]), d = _mm_set1_ps(p[3]);
+          __m128 far_dist = _mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, far_x), _mm_mul_ps(ny, far_y)), _mm_add_ps(_mm_mul_ps(nz, far_z), d));
+          __m128 near_dist = _mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, near_x), _mm_mul_ps(ny, near_y)), _mm_add_ps(_mm_mul_ps(nz, near_z), d));
+          out = _mm_or_ps(out, _mm_cmplt_ps(far_dist, zero));
+          partial = _mm_or_ps(partial, _mm_cmplt_ps(near_dist, zero));
+        }
+        unsigned out_mask = (unsigned)_mm_movemask_ps(out);
+        inside_mask = ~(out_mask | (unsigned)_mm_movemask_ps(partial)) & 0x0f;
+        return ~out_mask & 0x0f;
+      #else
+        unsigned mask = 0;
+        inside_mask = 0;
+        for (int j = 0; j != 4; ++j) {
+          bool is_out = false, is_partial = false;
+          for (int i = 0; i != num_planes; ++i) {
+            const vec4 &p = planes[i];
+            float far_dist =
+              p[0] * (signs & (1 << i) ? max_x[j] : min_x[j]) + p[1] * (signs & (0x100 << i) ? max_y[j] : min_y[j]) +
+              (p[2] * (signs & (0x10000 << i) ? max_z[j] : min_z[j]) + p[3]);
+            float near_dist =
+              p[0] * (signs & (1 << i) ? min_x[j] : max_x[j]) + p[1] * (signs & (0x100 << i) ? min_y[j] : max_y[j]) +
+              (p[2] * (signs & (0x10000 << i) ? min_z[j] : max_z[j]) + p[3]);
+            is_out |= far_dist < 0;
+            is_partial |= near_dist < 0;
+          }
+          mask |= is_out ? 0 : 1 << j;
+          inside_mask |= is_out || is_partial ? 0 : 1 << j;
+        }
+        return mask;
+      #endif
+    }
+  };
+} }
@@ -82,9 +82,20 @@ namespace octet {
 #include "sphere.h"
 #include "plane.h"
 #include "half_space.h"
+#include "frustum.h"
 #include "ray.h"
 #include "polygon.h"
 #include "zcylinder.h"
 #include "voxel_grid.h"
 
+// these have constructors but are plain data, so dynarray can move them with memcpy.
+OCTET_RELOCATABLE(octet::math::vec2)
+OCTET_RELOCATABLE(octet::math::vec3)
+OCTET_RELOCATABLE(octet::math::vec4)
+OCTET_RELOCATABLE(octet::math::ivec3)
+OCTET_RELOCATABLE(octet::math::ivec4)
+OCTET_RELOCATABLE(octet::math::quat)
+OCTET_RELOCATABLE(octet::math::mat4t)
+OCTET_RELOCATABLE(octet::math::aabb)
+
 #endif
@@ -22,6 +22,8 @@ namespace octet {
     attribute_blendindices = 7,
     attribute_texcoord = 8,
     attribute_uv = 8,
+    attribute_instance_matrix = 9,  // 9-12: model to camera matrix of an instance
+    attribute_instance = 13,        // instance number in a copied mesh
     attribute_tangent = 14,
     attribute_bitangent = 15,
     attribute_binormal = 15,
@@ -79,6 +81,12 @@ namespace octet {
     int viewport_y;
     int frame_number;
     bool is_gles3;
+
+    // general heap use and allocation count at the end of the last two frames
+    size_t heap_bytes;
+    size_t prev_heap_bytes;
+    size_t heap_allocs;
+    size_t prev_heap_allocs;
     video_capture video_capture_;
 
     // queue of files to load
@@ -93,6 +101,12 @@ namespace octet {
       mouse_abs_x = mouse_abs_y = 0;
       is_gles3 = false;
       frame_number = 0;
+      heap_bytes = prev_heap_bytes = 0;
+      heap_allocs = prev_heap_allocs = 0;
+
+      // GL objects dropped by other threads are destroyed on this one.
+      release_queue::set_main_thread();
+      frame_allocator::set_main_thread();
     }
 
     virtual ~app_common() {
@@ -106,6 +120,21 @@ namespace octet {
 
     void end_frame() {
       prev_keys = keys;
+
+      // destroy objects whose last reference went away on a worker thread.
+      release_queue::flush();
+
+      // temporaries allocated this frame are now gone.
+      frame_allocator::reset();
+
+      #if OCTET_GL_SHIM
+        gl_shim::end_frame();
+      #endif
+
+      prev_heap_bytes = heap_bytes;
+      heap_bytes = allocator::get_num_bytes();
+      prev_heap_allocs = heap_allocs;
+      heap_allocs = allocator::get_num_allocs();
     }
 
     virtual void draw_world(int x, int y, int w, int h) = 0;
@@ -164,6 +193,19 @@ namespace octet {
       return frame_number;
     }
 
+    /// change in general heap use over the last frame.
+    /// in a steady state render/update loop this should be zero.
+    intptr_t get_heap_bytes_delta() const {
+      return (intptr_t)(heap_bytes - prev_heap_bytes);
+    }
+
+    /// number of general heap allocations made during the last frame.
+    /// a block allocated and freed in the same frame shows up here but not in
+    /// get_heap_bytes_delta(), so use this to check that a frame makes no heap traffic.
+    size_t get_heap_allocs_delta() const {
+      return heap_allocs - prev_heap_allocs;
+    }
+
     void inc_frame_number() {
       frame_number++;
     }
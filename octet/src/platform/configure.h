@@ -26,6 +26,28 @@
   #define OCTET_OPENCL 0
 #endif
 
+// set this to 0 to send all allocator requests straight to the system malloc
+#ifndef OCTET_POOL_ALLOCATOR
+  #define OCTET_POOL_ALLOCATOR 1
+#endif
+
+// set this to 1 in profiling builds to compile in the heap profiler (see allocator::set_tracking).
+// when it is compiled in but switched off, it still costs a test in each malloc and free.
+#ifndef OCTET_ALLOC_TRACKING
+  #define OCTET_ALLOC_TRACKING 0
+#endif
+
+// set this to 1 to make every resource's reference count atomic.
+// otherwise only classes that call resource::set_thread_safe() pay for it.
+#ifndef OCTET_ATOMIC_REFCOUNT
+  #define OCTET_ATOMIC_REFCOUNT 0
+#endif
+
+// set this to 1 to count GL calls (see platform/gl_shim.h).
+#ifndef OCTET_GL_SHIM
+  #define OCTET_GL_SHIM 0
+#endif
+
 #if defined(WIN32)
   #define OCTET_SSE 1
   #pragma warning(disable : 4996)
@@ -54,11 +76,68 @@
 #include <numeric>
 #include <iostream>
 #include <fstream>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <type_traits>
+
+// thread local storage for plain old data (no constructors or destructors)
+#if defined(_MSC_VER)
+  #define OCTET_THREAD_LOCAL __declspec(thread)
+#else
+  #define OCTET_THREAD_LOCAL __thread
+#endif
 
 #if defined(WIN32)
   #include <direct.h>
 #endif
 
+// keep rarely used code out of hot functions
+#if defined(_MSC_VER)
+  #define OCTET_NOINLINE __declspec(noinline)
+#else
+  #define OCTET_NOINLINE __attribute__((noinline))
+#endif
+
+// address that the current function will return to, used to identify call sites.
+#if defined(_MSC_VER)
+  #define OCTET_RETURN_ADDRESS() _ReturnAddress()
+#else
+  #define OCTET_RETURN_ADDRESS() __builtin_return_address(0)
+#endif
+
+// SSE2 is always there on x64 and can be enabled on x86
+#ifndef OCTET_SSE2
+  #if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+    #define OCTET_SSE2 1
+  #else
+    #define OCTET_SSE2 0
+  #endif
+#endif
+
+#if OCTET_SSE2
+  #include <emmintrin.h>
+#endif
+
+// AVX2 must be enabled in the compiler (-mavx2 or /arch:AVX2) as not every x64 cpu has it.
+#ifndef OCTET_AVX2
+  #if defined(__AVX2__)
+    #define OCTET_AVX2 1
+  #else
+    #define OCTET_AVX2 0
+  #endif
+#endif
+
+#if OCTET_AVX2
+  #include <immintrin.h>
+#endif
+
+#if defined(_MSC_VER)
+  #include <intrin.h>
+#endif
+
 namespace octet {
   /// write some text to log.txt
   inline static FILE * log(const char *fmt, ...) {
@@ -71,5 +150,67 @@ namespace octet {
     //fflush(file);
     return file;
   }
+
+  /// index of the lowest set bit of a non-zero value (count trailing zeros)
+  inline unsigned find_lowest_bit(uint32_t value) {
+    #if defined(_MSC_VER)
+      unsigned long index;
+      _BitScanForward(&index, value);
+      return (unsigned)index;
+    #else
+      return (unsigned)__builtin_ctz(value);
+    #endif
+  }
+
+  /// index of the highest set bit of a non-zero value
+  inline unsigned find_highest_bit(uint32_t value) {
+    #if defined(_MSC_VER)
+      unsigned long index;
+      _BitScanReverse(&index, value);
+      return (unsigned)index;
+    #else
+      return 31 - (unsigned)__builtin_clz(value);
+    #endif
+  }
+
+  /// index of the lowest set bit of a non-zero 64 bit value
+  inline unsigned find_lowest_bit64(uint64_t value) {
+    #if defined(_MSC_VER) && defined(_M_X64)
+      unsigned long index;
+      _BitScanForward64(&index, value);
+      return (unsigned)index;
+    #elif defined(_MSC_VER)
+      return (uint32_t)value ? find_lowest_bit((uint32_t)value) : 32 + find_lowest_bit((uint32_t)(value >> 32));
+    #else
+      return (unsigned)__builtin_ctzll(value);
+    #endif
+  }
+
+  /// number of set bits in a 64 bit value
+  inline unsigned pop_count64(uint64_t value) {
+    #if defined(_MSC_VER) && defined(_M_X64) && OCTET_AVX2
+      // every AVX2 cpu has the popcnt instruction.
+      return (unsigned)__popcnt64(value);
+    #elif defined(_MSC_VER)
+      value = value - ((value >> 1) & 0x5555555555555555ULL);
+      value = (value & 0x3333333333333333ULL) + ((value >> 2) & 0x3333333333333333ULL);
+      value = (value + (value >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+      return (unsigned)((value * 0x0101010101010101ULL) >> 56);
+    #else
+      return (unsigned)__builtin_popcountll(value);
+    #endif
+  }
+
+  /// call this each time round a spin lock loop: it pauses the core for the first few
+  /// spins and then gives the time slice away, so a descheduled lock holder can run.
+  inline void spin_backoff(unsigned &spins) {
+    if (++spins < 16) {
+      #if OCTET_SSE2
+        _mm_pause();
+      #endif
+    } else {
+      std::this_thread::yield();
+    }
+  }
 }
 
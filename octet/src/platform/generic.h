@@ -24,6 +24,9 @@ typedef float float_t;
 #include "gl_skeleton.h"
 #include "al_defs.h"
 
+// count GL calls if OCTET_GL_SHIM is set
+#include "gl_shim.h"
+
 // include cross platform app helpers, such as texture loaders
 #include "video_capture.h"
 #include "app_common.h"
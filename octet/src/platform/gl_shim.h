@@ -0,0 +1,265 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// GL call counter and recorder
+//
+// Build with OCTET_GL_SHIM=1 to count the GL calls made by the engine.
+//
+// example:
+//
+//   gl_shim::set_recording(true);     // do not call GL at all: runs without a context
+//   app->draw_world(0, 0, 256, 256);
+//   gl_shim::end_frame();             // app_common::end_frame() does this for you
+//   gl_shim::dump(stdout);            // calls made in the last frame
+//
+
+#if OCTET_GL_SHIM
+
+// every GL function that the engine calls. Calls to other functions are not counted.
+#define OCTET_GL_SHIM_FUNCTIONS(X) \
+  X(glActiveTexture) X(glAttachShader) X(glBindAttribLocation) X(glBindBuffer) \
+  X(glBindBufferBase) X(glBindTexture) X(glBlendFunc) X(glBufferData) \
+  X(glBufferSubData) X(glClear) X(glClearColor) X(glCompileShader) \
+  X(glCreateProgram) X(glCreateShader) X(glCullFace) X(glDeleteBuffers) \
+  X(glDeleteTextures) X(glDisable) X(glDisableVertexAttribArray) X(glDrawArrays) \
+  X(glDrawArraysInstanced) X(glDrawElements) X(glDrawElementsInstanced) X(glEnable) \
+  X(glEnableVertexAttribArray) X(glFrontFace) X(glGenBuffers) X(glGenTextures) \
+  X(glGenerateMipmap) X(glGetActiveUniformBlockiv) X(glGetActiveUniformsiv) X(glGetError) \
+  X(glGetIntegerv) X(glGetProgramInfoLog) X(glGetShaderInfoLog) X(glGetString) \
+  X(glGetUniformBlockIndex) X(glGetUniformIndices) X(glGetUniformLocation) X(glLinkProgram) \
+  X(glMapBuffer) X(glMapBufferRange) X(glShaderSource) X(glTexImage2D) \
+  X(glTexParameteri) X(glTexSubImage2D) X(glUniform1f) X(glUniform1fv) \
+  X(glUniform1i) X(glUniform1iv) X(glUniform2fv) X(glUniform2iv) \
+  X(glUniform3fv) X(glUniform3iv) X(glUniform4fv) X(glUniform4iv) \
+  X(glUniformBlockBinding) X(glUniformMatrix2fv) X(glUniformMatrix3fv) X(glUniformMatrix4fv) \
+  X(glUnmapBuffer) X(glUseProgram) X(glVertexAttribDivisor) X(glVertexAttribPointer) \
+  X(glViewport)
+
+namespace octet { namespace platform {
+  /// Counts the GL calls made by the engine and optionally stops them reaching GL.
+  ///
+  /// Each GL function in OCTET_GL_SHIM_FUNCTIONS is replaced by a macro that
+  /// counts the call. In recording mode the call is not made and functions that return
+  /// something return a harmless value (new names for glGen* and glCreate*, empty logs),
+  /// so a scene can be rendered without a window to measure how many state changes it makes.
+  class gl_shim {
+  public:
+    #define OCTET_GL_SHIM_ENUM(name) fn_##name,
+    enum function {
+      OCTET_GL_SHIM_FUNCTIONS(OCTET_GL_SHIM_ENUM)
+      num_functions
+    };
+    #undef OCTET_GL_SHIM_ENUM
+
+  private:
+    struct state_t {
+      unsigned counts[num_functions];
+      unsigned frame_counts[num_functions];
+      unsigned num_frames;
+      GLuint next_name;
+      bool recording;
+      dynarray<uint8_t> map_bytes;
+
+      state_t() {
+        memset(counts, 0, sizeof(counts));
+        memset(frame_counts, 0, sizeof(frame_counts));
+        num_frames = 0;
+        next_name = 1;
+        recording = false;
+      }
+    };
+
+    static state_t &state() {
+      static state_t s;
+      return s;
+    }
+
+  public:
+    /// Count one call. Called by the GL macros.
+    static void count(function fn) {
+      state().counts[fn]++;
+    }
+
+    /// Stop GL calls reaching GL. Use this to run without a GL context.
+    static void set_recording(bool value) {
+      state().recording = value;
+    }
+
+    /// Return true if GL calls are being counted but not made.
+    static bool is_recording() {
+      return state().recording;
+    }
+
+    /// Number of calls to a function since the last end_frame().
+    static unsigned get_count(function fn) {
+      return state().counts[fn];
+    }
+
+    /// Number of calls to a function in the last complete frame.
+    static unsigned get_frame_count(function fn) {
+      return state().frame_counts[fn];
+    }
+
+    /// Number of calls to all functions in the last complete frame.
+    static unsigned get_frame_total() {
+      unsigned total = 0;
+      for (unsigned i = 0; i != num_functions; ++i) {
+        total += state().frame_counts[i];
+      }
+      return total;
+    }
+
+    /// Number of frames ended since the last reset().
+    static unsigned get_num_frames() {
+      return state().num_frames;
+    }
+
+    /// Finish a frame: the counts so far become the last frame's counts.
+    static void end_frame() {
+      state_t &s = state();
+      memcpy(s.frame_counts, s.counts, sizeof(s.counts));
+      memset(s.counts, 0, sizeof(s.counts));
+      s.num_frames++;
+    }
+
+    /// Clear all the counts.
+    static void reset() {
+      state_t &s = state();
+      memset(s.counts, 0, sizeof(s.counts));
+      memset(s.frame_counts, 0, sizeof(s.frame_counts));
+      s.num_frames = 0;
+    }
+
+    /// Name of a function, eg. "glDrawElements".
+    static const char *get_name(function fn) {
+      #define OCTET_GL_SHIM_NAME(name) #name,
+      static const char *names[] = {
+        OCTET_GL_SHIM_FUNCTIONS(OCTET_GL_SHIM_NAME)
+      };
+      #undef OCTET_GL_SHIM_NAME
+      return names[fn];
+    }
+
+    /// Print the calls made in the last frame.
+    static void dump(FILE *file) {
+      for (unsigned i = 0; i != num_functions; ++i) {
+        unsigned count = get_frame_count((function)i);
+        if (count) fprintf(file, "%8d %s\n", count, get_name((function)i));
+      }
+      fprintf(file, "%8d total\n", get_frame_total());
+    }
+
+    // harmless results for the functions that return something in recording mode.
+
+    /// A new name for a recorded glCreate* call.
+    static GLuint new_name() {
+      return state().next_name++;
+    }
+
+    /// New names for a recorded glGen* call.
+    static void gen_names(GLsizei n, GLuint *names) {
+      for (GLsizei i = 0; i < n; ++i) {
+        names[i] = new_name();
+      }
+    }
+
+    /// An empty log for a recorded glGet*InfoLog call.
+    static void get_info_log(GLuint object, GLsizei buf_size, GLsizei *length, GLchar *log) {
+      if (length) *length = 0;
+      if (log && buf_size) log[0] = 0;
+    }
+
+    /// Zero for a recorded glGetIntegerv call.
+    static void get_integer(GLenum pname, GLint *data) {
+      if (data) *data = 0;
+    }
+
+    /// Scratch memory for a recorded glMapBufferRange call.
+    static void *map_buffer_range(GLenum target, GLintptr offset, GLsizeiptr length, GLbitfield access) {
+      state_t &s = state();
+      if (s.map_bytes.size() < (unsigned)length) s.map_bytes.resize((unsigned)length);
+      return s.map_bytes.data();
+    }
+  };
+} }
+
+// count the call, then make it unless we are recording.
+// The name in the expansion refers to the real function as a macro does not expand inside itself.
+#define OCTET_GL_SHIM_VOID(name, recorded, args) \
+  (octet::platform::gl_shim::count(octet::platform::gl_shim::fn_##name), \
+  octet::platform::gl_shim::is_recording() ? (void)(recorded) : (void)name args)
+
+#define OCTET_GL_SHIM_VALUE(name, recorded, args) \
+  (octet::platform::gl_shim::count(octet::platform::gl_shim::fn_##name), \
+  octet::platform::gl_shim::is_recording() ? (recorded) : name args)
+
+#define glActiveTexture(...) OCTET_GL_SHIM_VOID(glActiveTexture, 0, (__VA_ARGS__))
+#define glAttachShader(...) OCTET_GL_SHIM_VOID(glAttachShader, 0, (__VA_ARGS__))
+#define glBindAttribLocation(...) OCTET_GL_SHIM_VOID(glBindAttribLocation, 0, (__VA_ARGS__))
+#define glBindBuffer(...) OCTET_GL_SHIM_VOID(glBindBuffer, 0, (__VA_ARGS__))
+#define glBindBufferBase(...) OCTET_GL_SHIM_VOID(glBindBufferBase, 0, (__VA_ARGS__))
+#define glBindTexture(...) OCTET_GL_SHIM_VOID(glBindTexture, 0, (__VA_ARGS__))
+#define glBlendFunc(...) OCTET_GL_SHIM_VOID(glBlendFunc, 0, (__VA_ARGS__))
+#define glBufferData(...) OCTET_GL_SHIM_VOID(glBufferData, 0, (__VA_ARGS__))
+#define glBufferSubData(...) OCTET_GL_SHIM_VOID(glBufferSubData, 0, (__VA_ARGS__))
+#define glClear(...) OCTET_GL_SHIM_VOID(glClear, 0, (__VA_ARGS__))
+#define glClearColor(...) OCTET_GL_SHIM_VOID(glClearColor, 0, (__VA_ARGS__))
+#define glCompileShader(...) OCTET_GL_SHIM_VOID(glCompileShader, 0, (__VA_ARGS__))
+#define glCreateProgram(...) OCTET_GL_SHIM_VALUE(glCreateProgram, octet::platform::gl_shim::new_name(), (__VA_ARGS__))
+#define glCreateShader(...) OCTET_GL_SHIM_VALUE(glCreateShader, octet::platform::gl_shim::new_name(), (__VA_ARGS__))
+#define glCullFace(...) OCTET_GL_SHIM_VOID(glCullFace, 0, (__VA_ARGS__))
+#define glDeleteBuffers(...) OCTET_GL_SHIM_VOID(glDeleteBuffers, 0, (__VA_ARGS__))
+#define glDeleteTextures(...) OCTET_GL_SHIM_VOID(glDeleteTextures, 0, (__VA_ARGS__))
+#define glDisable(...) OCTET_GL_SHIM_VOID(glDisable, 0, (__VA_ARGS__))
+#define glDisableVertexAttribArray(...) OCTET_GL_SHIM_VOID(glDisableVertexAttribArray, 0, (__VA_ARGS__))
+#define glDrawArrays(...) OCTET_GL_SHIM_VOID(glDrawArrays, 0, (__VA_ARGS__))
+#define glDrawArraysInstanced(...) OCTET_GL_SHIM_VOID(glDrawArraysInstanced, 0, (__VA_ARGS__))
+#define glDrawElements(...) OCTET_GL_SHIM_VOID(glDrawElements, 0, (__VA_ARGS__))
+#define glDrawElementsInstanced(...) OCTET_GL_SHIM_VOID(glDrawElementsInstanced, 0, (__VA_ARGS__))
+#define glEnable(...) OCTET_GL_SHIM_VOID(glEnable, 0, (__VA_ARGS__))
+#define glEnableVertexAttribArray(...) OCTET_GL_SHIM_VOID(glEnableVertexAttribArray, 0, (__VA_ARGS__))
+#define glFrontFace(...) OCTET_GL_SHIM_VOID(glFrontFace, 0, (__VA_ARGS__))
+#define glGenBuffers(...) OCTET_GL_SHIM_VOID(glGenBuffers, octet::platform::gl_shim::gen_names(__VA_ARGS__), (__VA_ARGS__))
+#define glGenTextures(...) OCTET_GL_SHIM_VOID(glGenTextures, octet::platform::gl_shim::gen_names(__VA_ARGS__), (__VA_ARGS__))
+#define glGenerateMipmap(...) OCTET_GL_SHIM_VOID(glGenerateMipmap, 0, (__VA_ARGS__))
+#define glGetActiveUniformBlockiv(...) OCTET_GL_SHIM_VOID(glGetActiveUniformBlockiv, 0, (__VA_ARGS__))
+#define glGetActiveUniformsiv(...) OCTET_GL_SHIM_VOID(glGetActiveUniformsiv, 0, (__VA_ARGS__))
+#define glGetError(...) OCTET_GL_SHIM_VALUE(glGetError, (GLenum)0, (__VA_ARGS__))
+#define glGetIntegerv(...) OCTET_GL_SHIM_VOID(glGetIntegerv, octet::platform::gl_shim::get_integer(__VA_ARGS__), (__VA_ARGS__))
+#define glGetProgramInfoLog(...) OCTET_GL_SHIM_VOID(glGetProgramInfoLog, octet::platform::gl_shim::get_info_log(__VA_ARGS__), (__VA_ARGS__))
+#define glGetShaderInfoLog(...) OCTET_GL_SHIM_VOID(glGetShaderInfoLog, octet::platform::gl_shim::get_info_log(__VA_ARGS__), (__VA_ARGS__))
+#define glGetString(...) OCTET_GL_SHIM_VALUE(glGetString, (const GLubyte*)"", (__VA_ARGS__))
+#define glGetUniformBlockIndex(...) OCTET_GL_SHIM_VALUE(glGetUniformBlockIndex, (GLuint)GL_INVALID_INDEX, (__VA_ARGS__))
+#define glGetUniformIndices(...) OCTET_GL_SHIM_VOID(glGetUniformIndices, 0, (__VA_ARGS__))
+#define glGetUniformLocation(...) OCTET_GL_SHIM_VALUE(glGetUniformLocation, (GLint)octet::platform::gl_shim::new_name(), (__VA_ARGS__))
+#define glLinkProgram(...) OCTET_GL_SHIM_VOID(glLinkProgram, 0, (__VA_ARGS__))
+#define glMapBuffer(...) OCTET_GL_SHIM_VALUE(glMapBuffer, (void*)0, (__VA_ARGS__))
+#define glMapBufferRange(...) OCTET_GL_SHIM_VALUE(glMapBufferRange, octet::platform::gl_shim::map_buffer_range(__VA_ARGS__), (__VA_ARGS__))
+#define glShaderSource(...) OCTET_GL_SHIM_VOID(glShaderSource, 0, (__VA_ARGS__))
+#define glTexImage2D(...) OCTET_GL_SHIM_VOID(glTexImage2D, 0, (__VA_ARGS__))
+#define glTexParameteri(...) OCTET_GL_SHIM_VOID(glTexParameteri, 0, (__VA_ARGS__))
+#define glTexSubImage2D(...) OCTET_GL_SHIM_VOID(glTexSubImage2D, 0, (__VA_ARGS__))
+#define glUniform1f(...) OCTET_GL_SHIM_VOID(glUniform1f, 0, (__VA_ARGS__))
+#define glUniform1fv(...) OCTET_GL_SHIM_VOID(glUniform1fv, 0, (__VA_ARGS__))
+#define glUniform1i(...) OCTET_GL_SHIM_VOID(glUniform1i, 0, (__VA_ARGS__))
+#define glUniform1iv(...) OCTET_GL_SHIM_VOID(glUniform1iv, 0, (__VA_ARGS__))
+#define glUniform2fv(...) OCTET_GL_SHIM_VOID(glUniform2fv, 0, (__VA_ARGS__))
+#define glUniform2iv(...) OCTET_GL_SHIM_VOID(glUniform2iv, 0, (__VA_ARGS__))
+#define glUniform3fv(...) OCTET_GL_SHIM_VOID(glUniform3fv, 0, (__VA_ARGS__))
+#define glUniform3iv(...) OCTET_GL_SHIM_VOID(glUniform3iv, 0, (__VA_ARGS__))
+#define glUniform4fv(...) OCTET_GL_SHIM_VOID(glUniform4fv, 0, (__VA_ARGS__))
+#define glUniform4iv(...) OCTET_GL_SHIM_VOID(glUniform4iv, 0, (__VA_ARGS__))
+#define glUniformBlockBinding(...) OCTET_GL_SHIM_VOID(glUniformBlockBinding, 0, (__VA_ARGS__))
+#define glUniformMatrix2fv(...) OCTET_GL_SHIM_VOID(glUniformMatrix2fv, 0, (__VA_ARGS__))
+#define glUniformMatrix3fv(...) OCTET_GL_SHIM_VOID(glUniformMatrix3fv, 0, (__VA_ARGS__))
+#define glUniformMatrix4fv(...) OCTET_GL_SHIM_VOID(glUniformMatrix4fv, 0, (__VA_ARGS__))
+#define glUnmapBuffer(...) OCTET_GL_SHIM_VALUE(glUnmapBuffer, (GLboolean)1, (__VA_ARGS__))
+#define glUseProgram(...) OCTET_GL_SHIM_VOID(glUseProgram, 0, (__VA_ARGS__))
+#define glVertexAttribDivisor(...) OCTET_GL_SHIM_VOID(glVertexAttribDivisor, 0, (__VA_ARGS__))
+#define glVertexAttribPointer(...) OCTET_GL_SHIM_VOID(glVertexAttribPointer, 0, (__VA_ARGS__))
+#define glViewport(...) OCTET_GL_SHIM_VOID(glViewport, 0, (__VA_ARGS__))
+
+#endif
@@ -47,6 +47,9 @@
   #include <AL/al.h>
 #endif
 
+// count GL calls if OCTET_GL_SHIM is set
+#include "gl_shim.h"
+
 // include cross platform app helpers, such as texture loaders
 #include "app_common.h"
 
@@ -153,7 +156,7 @@ namespace octet {
       glutTimerFunc(16, timer, 1);
       map_t &m = map();
       for (int i = 0; i != m.size(); ++i) {
-        if (m.get_key(i)) {
+        if (m.is_used(i)) {
           glutSetWindow(m.get_key(i));
           glutPostRedisplay();
         }
@@ -178,7 +181,7 @@ namespace octet {
     static void run_all_apps() {
       map_t &m = map();
       for (int i = 0; i != m.size(); ++i) {
-        if (m.get_key(i)) {
+        if (m.is_used(i)) {
           glutSetWindow(m.get_key(i));
           glutDisplayFunc(display);
           glutReshapeFunc(reshape);
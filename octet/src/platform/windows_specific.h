@@ -69,6 +69,9 @@
 #include "gl_defs.h"
 #include "al_defs.h"
 
+// count GL calls if OCTET_GL_SHIM is set
+#include "gl_shim.h"
+
 // include cross platform app helpers, such as texture loaders
 #include "app_common.h"
 
@@ -84,7 +87,7 @@
 namespace octet {
   class HWND_cmp : public hash_map_cmp {
   public:
-    static unsigned get_hash(HWND key) { return fuzz_hash((unsigned)(intptr_t)key); }
+    static uint64_t get_hash(HWND key) { return (uint64_t)(uintptr_t)key; }
 
     static bool is_empty(HWND key) { return !key; }
   };
@@ -343,7 +346,7 @@ namespace octet {
 
         for (int i = 0; i != m.size(); ++i) {
           // note: because Win8 generates an invisible window, we need to check m.value(i)
-          if (m.get_key(i) && m.get_value(i)) {
+          if (m.is_used(i) && m.get_value(i)) {
             m.get_value(i)->render();
           }
         }
@@ -209,11 +209,19 @@ namespace octet { namespace resources {
       return id;
     }
 
-    /// Get the system atom dictionary. Atoms are unique names with an integer representation.
-    static dictionary<atom_t> *get_atom_dict() {
-      static dictionary<atom_t> *dict;
-      if (!dict) dict = new dictionary<atom_t>();
-      return dict;
+    /// Get the system atom table. Atoms are unique names with an integer representation.
+    /// The id of each name in the table is its atom.
+    static string_table *get_atom_table() {
+      static string_table *table;
+      if (!table) {
+        table = new string_table();
+
+        // atom_ is the empty string, followed by the predefined atoms in order.
+        for (unsigned i = 0; predefined_atom(i); ++i) {
+          table->intern(predefined_atom(i));
+        }
+      }
+      return table;
     }
 
     /// Get a unique int for a string (atom). Atoms are unique names with an integer representation.
@@ -223,22 +231,20 @@ namespace octet { namespace resources {
       if (name == 0 || name[0] == 0) {
         return atom_;
       }
+      return get_atom(string_view(name));
+    }
 
-      dictionary<atom_t> *dict = get_atom_dict();
+    /// Get an atom for some text which need not be zero terminated, eg. part of an attribute.
+    static atom_t get_atom(const string_view &name) {
+      return get_atom(name, name.get_hash());
+    }
 
-      static int num_atoms = 0;
-      if (num_atoms == 0) {
-        for (++num_atoms; predefined_atom(num_atoms); num_atoms++) {
-          (*dict)[predefined_atom(num_atoms)] = (atom_t)num_atoms;
-        }
-      }
-      if (dict->contains(name)) {
-        //log("old atom %s %d\n", name, (*dict)[name]);
-        return (*dict)[name];
-      } else {
-        //log("new atom %s %d\n", name, num_atoms);
-        return (*dict)[name] = (atom_t)num_atoms++;
+    /// Get an atom for some text with a hash from string_view::get_hash().
+    static atom_t get_atom(const string_view &name, uint32_t hash) {
+      if (name.empty()) {
+        return atom_;
       }
+      return (atom_t)get_atom_table()->intern(name, hash);
     }
 
     /// Get the text of a predefined atom (atom_*)
@@ -274,13 +280,9 @@ namespace octet { namespace resources {
       const char *name = predefined_atom((unsigned)atom);
       if (name) return name;
 
-      // slow!
-      dictionary<atom_t> *dict = get_atom_dict();
-      unsigned num_indices = dict->get_num_indices();
-      for (unsigned i = 0; i != num_indices; ++i) {
-        if (dict->get_value(i) == atom) {
-          return dict->get_key(i);
-        }
+      string_table *table = get_atom_table();
+      if ((unsigned)atom < table->get_num_strings()) {
+        return table->get_text((unsigned)atom);
       }
       return "???";
     }
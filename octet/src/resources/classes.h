@@ -36,4 +36,9 @@ OCTET_CLASS(scene, mesh_voxel_grid)
 #endif
 OCTET_CLASS(scene, mesh_points)
 OCTET_CLASS(scene, mesh_cylinder)
+OCTET_CLASS(scene, transform_hierarchy)
+OCTET_CLASS(scene, cpu_skin)
+OCTET_CLASS(scene, animation_clip)
+OCTET_CLASS(scene, mesh_bvh)
+OCTET_CLASS(scene, mesh_adjacency)
 //OCTET_CLASS(scene, value)
@@ -23,6 +23,14 @@ namespace octet { namespace resources {
     // GL_ARRAY_BUFFER etc.
     GLuint target;
 
+    // changes whenever the contents may have changed.
+    mutable unsigned version;
+
+    static unsigned new_version() {
+      static std::atomic<unsigned> next_version(1);
+      return next_version++;
+    }
+
   public:
     /// Helper class to make a write-only lock
     class wolock {
@@ -69,7 +77,10 @@ namespace octet { namespace resources {
 
     /// Make a new OpenGL Resource
     gl_resource(unsigned target=0, unsigned size=0) {
+      // buffers are loaded on other threads, but must be deleted on the GL thread.
+      set_destroy_on_main_thread();
       buffer = 0;
+      version = new_version();
       this->target = target;
       if (size) {
         allocate(target, size);
@@ -82,6 +93,7 @@ namespace octet { namespace resources {
         v.visit(bytes, atom_bytes);
       #endif
       v.visit(target, atom_target);
+      version = new_version();
     }
 
     /// Allocate a new OpenGL object.
@@ -96,6 +108,7 @@ namespace octet { namespace resources {
         this->size = size;
       #endif
       this->target = target;
+      version = new_version();
       glBindBuffer(target, 0);
     }
 
@@ -129,6 +142,12 @@ namespace octet { namespace resources {
       #endif
     }
 
+    /// A number that changes whenever the contents may have changed, eg. after a write lock.
+    /// Use this to find out if data made from the buffer is out of date.
+    unsigned get_version() const {
+      return version;
+    }
+
     /// get the GL buffer object we are wrapping.
     GLuint get_buffer() const {
       return buffer;
@@ -179,6 +198,7 @@ namespace octet { namespace resources {
     /// release a read-write lock
     /// deprecated
     void unlock() const {
+      version = new_version();
       #ifdef OCTET_GLES2
         glBindBuffer(target, buffer);
         glBufferSubData(target, 0, bytes.size(), &bytes[0]);
@@ -206,6 +226,7 @@ namespace octet { namespace resources {
     /// release a read-write lock
     /// deprecated
     void unlock_write_only() const {
+      version = new_version();
       #ifdef OCTET_GLES2
         glBindBuffer(target, buffer);
         glBufferSubData(target, 0, bytes.size(), &bytes[0]);
@@ -227,6 +248,24 @@ namespace octet { namespace resources {
       unlock_write_only();
     }
 
+    /// Replace the contents with new data that will be used once, eg. per-frame instance data.
+    /// The old buffer storage is dropped so that GL does not wait for draws that use it.
+    void stream(GLuint target, const void *ptr, size_t size) {
+      if (buffer == 0) {
+        glGenBuffers(1, &buffer);
+      }
+      glBindBuffer(target, buffer);
+      glBufferData(target, size, ptr, GL_STREAM_DRAW);
+      #ifdef OCTET_GLES2
+        bytes.resize(size);
+        memcpy(bytes.data(), ptr, size);
+      #else
+        this->size = size;
+      #endif
+      this->target = target;
+      version = new_version();
+    }
+
     /// copy data from another gl resource.
     void copy(const gl_resource *rhs) {
       allocate(rhs->get_target(), rhs->get_size());
@@ -4,52 +4,607 @@
 //
 // Modular Framework for OpenGLES2 rendering on multiple platforms.
 //
-// work in progress
+// work stealing job system
+//
+// example:
+//
+//   job_system &jobs = job_system::get();
+//
+//   // a loop split over all the threads
+//   jobs.parallel_for(0, num_items, 0, [&](unsigned begin, unsigned end) {
+//     for (unsigned i = begin; i != end; ++i) process(items[i]);
+//   });
+//
+//   // jobs with dependencies
+//   job_counter loaded, built, uploaded;
+//   jobs.run([=]() { load(file); }, &loaded);
+//   jobs.run([=]() { build_meshes(); }, &built, &loaded);           // after the load
+//   jobs.run([=]() { upload(); }, &uploaded, &built, "upload", job::main_thread_only);
+//   jobs.wait(&uploaded);
+//
 
 namespace octet { namespace resources {
-  class job : public resource {
-    ref<job> next;
+  class job_system;
+
+  /// Counts jobs that have not finished yet. Jobs can wait for a counter to reach zero.
+  /// Use job_system::wait() before a counter goes out of scope.
+  class job_counter {
+    std::atomic<int> count;
+    std::atomic_flag lock_flag;
+    dynarray<class job *> waiting;
+
+    void lock() {
+      unsigned spins = 0;
+      while (lock_flag.test_and_set(std::memory_order_acquire)) {
+        spin_backoff(spins);
+      }
+    }
+
+    void unlock() {
+      lock_flag.clear(std::memory_order_release);
+    }
+
+    friend class job_system;
+  public:
+    /// A counter with no jobs.
+    job_counter() : count(0) {
+      lock_flag.clear();
+    }
+
+    /// Number of jobs still to finish.
+    int get_count() const {
+      return count.load(std::memory_order_acquire);
+    }
+  };
+
+  /// A piece of work. Derive from this and implement kernel(), or use job_system::run() with a function.
+  /// The job system deletes a job after it has run.
+  class job {
+  public:
+    /// Which threads can run a job.
+    enum affinity_t {
+      any_thread,
+      main_thread_only,  // eg. OpenGL calls; see job_system::run_main_thread_jobs()
+    };
+
+  private:
+    job_counter *signal;
+    const char *name;
+    affinity_t affinity;
+    friend class job_system;
+
+  public:
+    /// "name" is for the profiler and must outlive the job (eg. a string literal).
+    job(const char *name = "job", affinity_t affinity = any_thread) {
+      this->signal = 0;
+      this->name = name;
+      this->affinity = affinity;
+    }
+
+    virtual ~job() {
+    }
+
+    /// Do the work.
+    virtual void kernel() = 0;
+
+    const char *get_name() const {
+      return name;
+    }
+
+    affinity_t get_affinity() const {
+      return affinity;
+    }
+  };
+
+  /// Runs jobs on a pool of worker threads.
+  ///
+  /// Each thread has a Chase-Lev deque: it pushes and pops new jobs at the bottom
+  /// (most recent first, which keeps the data in cache) and idle threads steal the oldest
+  /// jobs from the top of other threads' deques. Threads that are not part of the pool
+  /// add jobs to a shared queue.
+  ///
+  /// The thread that makes the job system is its main thread and can wait for jobs
+  /// with the workers. Jobs with main_thread_only affinity only run on the main thread,
+  /// when it waits or calls run_main_thread_jobs().
+  class job_system {
+  public:
+    /// Function called for a piece [begin, end) of a range.
+    typedef void (*range_fn_t)(void *context, unsigned begin, unsigned end);
 
-    enum state_t {
-      state_waiting,
-      state_running,
+    /// Called after each job when profiling: the job's name, thread (0 = main) and
+    /// start and end times in seconds from when the job system was made.
+    typedef void (*profile_fn_t)(void *user, const char *name, unsigned thread, double start, double end);
+
+  private:
+    enum {
+      deque_size = 4096,  // jobs pushed beyond this are run at once
+      spin_count = 64,    // times an idle worker looks for work before sleeping
+    };
+
+    // a lock free work stealing deque of a fixed size.
+    // only the owner calls push() and pop(); anyone can steal().
+    class job_deque {
+      std::atomic<int64_t> top;
+      char pad0[64];
+      std::atomic<int64_t> bottom;
+      char pad1[64];
+      std::atomic<job *> items[deque_size];
+
+    public:
+      job_deque() : top(0), bottom(0) {
+        for (unsigned i = 0; i != deque_size; ++i) {
+          items[i].store(0, std::memory_order_relaxed);
+        }
+      }
+
+      bool push(job *j) {
+        int64_t b = bottom.load(std::memory_order_relaxed);
+        int64_t t = top.load(std::memory_order_acquire);
+        if (b - t >= deque_size) return false;
+        items[b & (deque_size-1)].store(j, std::memory_order_relaxed);
+        bottom.store(b + 1, std::memory_order_release);
+        return true;
+      }
+
+      job *pop() {
+        int64_t b = bottom.load(std::memory_order_relaxed) - 1;
+        bottom.store(b, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t t = top.load(std::memory_order_relaxed);
+        if (t > b) {
+          // empty
+          bottom.store(b + 1, std::memory_order_relaxed);
+          return 0;
+        }
+        job *j = items[b & (deque_size-1)].load(std::memory_order_relaxed);
+        if (t == b) {
+          // the last job: race the thieves for it.
+          if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+            j = 0;
+          }
+          bottom.store(b + 1, std::memory_order_relaxed);
+        }
+        return j;
+      }
+
+      job *steal() {
+        int64_t t = top.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t b = bottom.load(std::memory_order_acquire);
+        if (t >= b) return 0;
+        job *j = items[t & (deque_size-1)].load(std::memory_order_relaxed);
+        if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+          return 0;
+        }
+        return j;
+      }
+
+      bool empty() const {
+        return bottom.load(std::memory_order_relaxed) <= top.load(std::memory_order_relaxed);
+      }
+    };
+
+    // a queue guarded by a spin lock, for jobs from other threads and main thread jobs.
+    class locked_queue {
+      std::atomic_flag lock_flag;
+      std::atomic<unsigned> size;
+      dynarray<job *> items;
+      unsigned next;
+
+    public:
+      locked_queue() : size(0) {
+        lock_flag.clear();
+        next = 0;
+      }
+
+      void push(job *j) {
+        unsigned spins = 0;
+        while (lock_flag.test_and_set(std::memory_order_acquire)) {
+          spin_backoff(spins);
+        }
+        items.push_back(j);
+        size.fetch_add(1, std::memory_order_release);
+        lock_flag.clear(std::memory_order_release);
+      }
+
+      job *pop() {
+        if (size.load(std::memory_order_acquire) == 0) return 0;
+        job *j = 0;
+        unsigned spins = 0;
+        while (lock_flag.test_and_set(std::memory_order_acquire)) {
+          spin_backoff(spins);
+        }
+        if (next != items.size()) {
+          j = items[next++];
+          size.fetch_sub(1, std::memory_order_relaxed);
+          if (next == items.size()) {
+            items.resize(0);
+            next = 0;
+          }
+        }
+        lock_flag.clear(std::memory_order_release);
+        return j;
+      }
     };
 
-    state_t state;
+    // runs a range a grain at a time, giving away the top half of what is left
+    // whenever this thread's deque is empty, ie. when the thieves have taken
+    // everything (lazy binary splitting). With no idle threads a range hardly splits.
+    class range_job : public job {
+      job_system *system;
+      range_fn_t fn;
+      void *context;
+      unsigned begin;
+      unsigned end;
+      unsigned grain;
+
+    public:
+      range_job(job_system *system, range_fn_t fn, void *context, unsigned begin, unsigned end, unsigned grain) :
+        job("parallel_for")
+      {
+        this->system = system;
+        this->fn = fn;
+        this->context = context;
+        this->begin = begin;
+        this->end = end;
+        this->grain = grain;
+      }
+
+      void kernel() {
+        while (begin != end) {
+          if (end - begin > grain && system->is_deque_empty()) {
+            unsigned mid = begin + (end - begin) / 2;
+            system->add(new range_job(system, fn, context, mid, end, grain), signal);
+            end = mid;
+          }
+          unsigned piece_end = end - begin > grain ? begin + grain : end;
+          fn(context, begin, piece_end);
+          begin = piece_end;
+        }
+      }
 
-    class scheduler {
-      job *waiting;
-      job *running;
+      void set_signal(job_counter *c) {
+        signal = c;
+      }
+    };
+
+    template <class fn_t> class function_job : public job {
+      fn_t fn;
     public:
-      scheduler() {
-        waiting = 0;
-        running = 0;
+      function_job(const fn_t &fn, const char *name, affinity_t affinity) : job(name, affinity), fn(fn) {
       }
 
-      void add_to_waiting(job *jb) {
-        jb->next = waiting;
-        waiting = this;
+      void kernel() {
+        fn();
       }
     };
 
-    scheduler *get_scheduler() {
-      static scheduler sch;
-      return &sch;
+    // per thread state of the workers. plain old data for thread local storage.
+    // a worker belongs to one job system, but a main thread may have several.
+    struct thread_state {
+      job_system *system;
+      unsigned index;
+      unsigned random;
+    };
+
+    static thread_state &this_thread() {
+      static OCTET_THREAD_LOCAL thread_state instance;
+      return instance;
     }
+
+    // the deques of the main thread (0) and the workers (1..n)
+    dynarray<job_deque *> deques;
+    dynarray<std::thread *> workers;
+    locked_queue shared_jobs;
+    locked_queue main_jobs;
+
+    // sleeping workers wait for the epoch to change.
+    std::mutex sleep_mutex;
+    std::condition_variable wake;
+    std::atomic<unsigned> epoch;
+    std::atomic<unsigned> num_sleeping;
+    std::atomic<bool> quit;
+
+    profile_fn_t profile_fn;
+    void *profile_user;
+    std::chrono::high_resolution_clock::time_point start_time;
+
+    // the thread that made the job system, index 0.
+    std::thread::id main_thread;
+
+    // our index if this thread belongs to this job system, or -1
+    int get_thread_index() const {
+      const thread_state &ts = this_thread();
+      if (ts.system == this) return (int)ts.index;
+      return std::this_thread::get_id() == main_thread ? 0 : -1;
+    }
+
+    // true if this thread has no jobs of its own waiting, or is not one of ours.
+    bool is_deque_empty() const {
+      int index = get_thread_index();
+      return index < 0 || deques[index]->empty();
+    }
+
+    void wake_worker() {
+      epoch.fetch_add(1);
+      if (num_sleeping.load() != 0) {
+        std::lock_guard<std::mutex> lock(sleep_mutex);
+        wake.notify_one();
+      }
+    }
+
+    // queue a job that is ready to run.
+    void push_ready(job *j) {
+      if (j->affinity == job::main_thread_only) {
+        main_jobs.push(j);
+        return;
+      }
+      int index = get_thread_index();
+      if (index < 0 || !deques[index]->push(j)) {
+        if (index >= 0) {
+          // our deque is full: do it now.
+          execute(j, (unsigned)index);
+          return;
+        }
+        shared_jobs.push(j);
+      }
+      wake_worker();
+    }
+
+    // find a job for a thread: our own newest job first, then the shared queue, then steal.
+    job *find_job(int index) {
+      job *j = 0;
+      if (index == 0) {
+        j = main_jobs.pop();
+        if (j) return j;
+      }
+      if (index >= 0) {
+        j = deques[index]->pop();
+        if (j) return j;
+      }
+      j = shared_jobs.pop();
+      if (j) return j;
+
+      // steal from a random thread to spread the contention.
+      unsigned num_deques = deques.size();
+      thread_state &ts = this_thread();
+      unsigned r = ts.random = ts.random * 1664525 + 1013904223;
+      unsigned first = (r >> 8) % num_deques;
+      for (unsigned i = 0; i != num_deques; ++i) {
+        unsigned victim = first + i < num_deques ? first + i : first + i - num_deques;
+        if ((int)victim == index) continue;
+        j = deques[victim]->steal();
+        if (j) return j;
+      }
+      return 0;
+    }
+
+    // run a job, then count down its counter and release the jobs waiting for it.
+    void execute(job *j, unsigned thread) {
+      if (profile_fn) {
+        double start = get_time();
+        j->kernel();
+        profile_fn(profile_user, j->name, thread, start, get_time());
+      } else {
+        j->kernel();
+      }
+      job_counter *signal = j->signal;
+      delete j;
+      if (signal) finish(signal);
+    }
+
+    void finish(job_counter *c) {
+      c->lock();
+      if (c->count.fetch_sub(1, std::memory_order_acq_rel) != 1) {
+        c->unlock();
+        return;
+      }
+
+      // the last job has finished: the waiting jobs can run.
+      // keep the lock so that wait() can not return and destroy the counter under us.
+      unsigned num_waiting = c->waiting.size();
+      job *local[16];
+      dynarray<job *> released;
+      job **ready = local;
+      if (num_waiting > 16) {
+        released.resize(num_waiting);
+        ready = released.data();
+      }
+      for (unsigned i = 0; i != num_waiting; ++i) {
+        ready[i] = c->waiting[i];
+      }
+      c->waiting.resize(0);
+      c->unlock();
+
+      for (unsigned i = 0; i != num_waiting; ++i) {
+        push_ready(ready[i]);
+      }
+    }
+
+    void worker_loop(unsigned index) {
+      thread_state &ts = this_thread();
+      ts.system = this;
+      ts.index = index;
+      ts.random = index * 0x9e3779b9u;
+
+      unsigned spins = 0;
+      for (;;) {
+        unsigned seen = epoch.load();
+        job *j = find_job((int)index);
+        if (j) {
+          execute(j, index);
+          spins = 0;
+        } else if (quit.load()) {
+          return;
+        } else if (++spins < spin_count) {
+          std::this_thread::yield();
+        } else {
+          // sleep until someone adds a job.
+          std::unique_lock<std::mutex> lock(sleep_mutex);
+          num_sleeping.fetch_add(1);
+          while (epoch.load() == seen && !quit.load()) {
+            wake.wait(lock);
+          }
+          num_sleeping.fetch_sub(1);
+          spins = 0;
+        }
+      }
+    }
+
+    template <class fn_t> static void call_range(void *context, unsigned begin, unsigned end) {
+      (*(fn_t*)context)(begin, end);
+    }
+
   public:
-    job() {
-      scheduler *sch = get_scheduler();
-      sch->add_to_waiting(this);
+    /// Make a pool with a number of worker threads. The calling thread becomes the main thread.
+    /// The threads that wait for jobs also do work, so zero workers is allowed.
+    job_system(unsigned num_workers) : epoch(0), num_sleeping(0), quit(false) {
+      profile_fn = 0;
+      profile_user = 0;
+      start_time = std::chrono::high_resolution_clock::now();
+      main_thread = std::this_thread::get_id();
+
+      for (unsigned i = 0; i != num_workers + 1; ++i) {
+        deques.push_back(new job_deque());
+      }
+      for (unsigned i = 0; i != num_workers; ++i) {
+        workers.push_back(new std::thread(&job_system::worker_loop, this, i + 1));
+      }
     }
 
-    virtual ~job() {
+    /// Finish the jobs that are left and stop the workers.
+    ~job_system() {
+      quit.store(true);
+      {
+        std::lock_guard<std::mutex> lock(sleep_mutex);
+        wake.notify_all();
+      }
+      for (unsigned i = 0; i != workers.size(); ++i) {
+        workers[i]->join();
+        delete workers[i];
+      }
+      // jobs for the main thread or added by other threads at the end.
+      while (job *j = find_job(0)) {
+        execute(j, 0);
+      }
+      for (unsigned i = 0; i != deques.size(); ++i) {
+        delete deques[i];
+      }
     }
 
-    virtual void kernel() = 0;
-    virtual bool is_ready() = 0;
+    /// The shared pool, with one worker for each core except the one we are on.
+    static job_system &get() {
+      static job_system instance(std::thread::hardware_concurrency() > 1 ? std::thread::hardware_concurrency() - 1 : 0);
+      return instance;
+    }
+
+    /// Number of threads that run jobs, including the main thread.
+    unsigned get_num_threads() const {
+      return workers.size() + 1;
+    }
+
+    /// Return true on the thread that made the job system.
+    bool is_main_thread() const {
+      return get_thread_index() == 0;
+    }
+
+    /// Call fn(user, name, thread, start, end) after every job, or stop profiling if fn is NULL.
+    /// Set this while no jobs are running.
+    void set_profiler(profile_fn_t fn, void *user) {
+      profile_user = user;
+      profile_fn = fn;
+    }
+
+    /// Seconds since the job system was made, for profiling.
+    double get_time() const {
+      return std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start_time).count();
+    }
+
+    /// Add a job (made with new), which the job system will delete after it has run.
+    /// "signal" is counted up now and down when the job has finished.
+    /// If "wait_for" is not NULL, the job does not start until that counter is zero.
+    /// "signal" and "wait_for" must be different counters, or the job would wait for itself.
+    void add(job *j, job_counter *signal = 0, job_counter *wait_for = 0) {
+      assert(!signal || signal != wait_for);
+      if (signal) signal->count.fetch_add(1, std::memory_order_relaxed);
+      j->signal = signal;
+
+      if (wait_for) {
+        wait_for->lock();
+        if (wait_for->count.load(std::memory_order_acquire) != 0) {
+          wait_for->waiting.push_back(j);
+          wait_for->unlock();
+          return;
+        }
+        wait_for->unlock();
+      }
+      push_ready(j);
+    }
+
+    /// Run fn() as a job. See add().
+    template <class fn_t> void run(const fn_t &fn, job_counter *signal = 0, job_counter *wait_for = 0, const char *name = "job", job::affinity_t affinity = job::any_thread) {
+      add(new function_job<fn_t>(fn, name, affinity), signal, wait_for);
+    }
+
+    /// Run jobs until a counter reaches zero. The main thread also runs main_thread_only jobs.
+    void wait(job_counter *c) {
+      int index = get_thread_index();
+      for (;;) {
+        if (c->count.load(std::memory_order_acquire) == 0) {
+          // make sure finish() has let go of the counter.
+          c->lock();
+          c->unlock();
+          return;
+        }
+        job *j = find_job(index);
+        if (j) {
+          execute(j, index < 0 ? ~0u : (unsigned)index);
+        } else {
+          std::this_thread::yield();
+        }
+      }
+    }
+
+    /// Run the main_thread_only jobs that are ready. Call this on the main thread, eg. once a frame.
+    /// Returns the number of jobs run.
+    unsigned run_main_thread_jobs() {
+      assert(get_thread_index() == 0 || workers.empty());
+      unsigned num_run = 0;
+      while (job *j = main_jobs.pop()) {
+        execute(j, 0);
+        num_run++;
+      }
+      return num_run;
+    }
+
+    /// Call fn(context, begin, end) for pieces of [begin, end) on any thread and return when they are done.
+    /// Pieces have at most "grain" items and are only split off when other threads are
+    /// free to take them, so the grain is the smallest useful piece, not the number of jobs.
+    /// A grain of zero picks a size from the number of threads.
+    void parallel_for(unsigned begin, unsigned end, unsigned grain, range_fn_t fn, void *context) {
+      if (begin >= end) return;
+      unsigned num_items = end - begin;
+      if (grain == 0) {
+        // small enough to balance the load, big enough to hide the cost of a call.
+        grain = num_items / (get_num_threads() * 16);
+        if (grain == 0) grain = 1;
+      }
+      if (num_items <= grain || workers.empty()) {
+        fn(context, begin, end);
+        return;
+      }
+
+      // run the first piece on this thread while the others steal the rest.
+      job_counter done;
+      range_job first(this, fn, context, begin, end, grain);
+      first.set_signal(&done);
+      first.kernel();
+      wait(&done);
+    }
 
-    state_t get_state() {
-      return state;
+    /// Call fn(begin, end) for pieces of [begin, end) on any thread and return when they are done.
+    template <class fn_t> void parallel_for(unsigned begin, unsigned end, unsigned grain, fn_t fn) {
+      parallel_for(begin, end, grain, &call_range<fn_t>, (void*)&fn);
     }
   };
 } }
@@ -0,0 +1,92 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// Benchmarks for the job system
+//
+// example:
+//
+//   job_benchmark::run(stdout);        // 1 to 64 threads
+//   job_benchmark::run(stdout, 8);     // 1 to 8 threads
+//
+
+namespace octet { namespace resources {
+  /// Scheduling overhead and speedup of job_system on 1, 2, 4 ... max_threads threads.
+  ///
+  /// For each thread count we print the best of five runs of:
+  ///
+  ///   the cost of an empty job, run() to finish, over 100000 jobs;
+  ///   a parallel_for of sqrt over 4M floats, and the speedup over one thread;
+  ///   a parallel_for over 1024 items, like the small loops of a scene update.
+  ///
+  /// Thread counts above the number of cores measure oversubscription, not speedup.
+  class job_benchmark {
+    typedef std::chrono::high_resolution_clock clock;
+
+    static double elapsed_ms(clock::time_point start) {
+      return std::chrono::duration<double, std::milli>(clock::now() - start).count();
+    }
+
+  public:
+    struct result {
+      unsigned num_threads;
+      double empty_job_ns;
+      double large_loop_ms;
+      double small_loop_us;
+    };
+
+    /// Measure one job system.
+    static result measure(job_system &jobs, float *data, unsigned num_items) {
+      const unsigned num_jobs = 100000;
+      const unsigned num_small_loops = 1000;
+      result res = { jobs.get_num_threads(), 1e9, 1e9, 1e9 };
+      for (unsigned rep = 0; rep != 5; ++rep) {
+        clock::time_point start = clock::now();
+        job_counter counter;
+        for (unsigned i = 0; i != num_jobs; ++i) {
+          jobs.run([]() {}, &counter);
+        }
+        jobs.wait(&counter);
+        res.empty_job_ns = std::min(res.empty_job_ns, elapsed_ms(start) * 1e6 / num_jobs);
+
+        start = clock::now();
+        jobs.parallel_for(0, num_items, 0, [=](unsigned begin, unsigned end) {
+          for (unsigned i = begin; i != end; ++i) data[i] = sqrtf(data[i] * data[i] + 1.0f);
+        });
+        res.large_loop_ms = std::min(res.large_loop_ms, elapsed_ms(start));
+
+        start = clock::now();
+        for (unsigned k = 0; k != num_small_loops; ++k) {
+          jobs.parallel_for(0, 1024, 0, [=](unsigned begin, unsigned end) {
+            for (unsigned i = begin; i != end; ++i) data[i] += 1.0f;
+          });
+        }
+        res.small_loop_us = std::min(res.small_loop_us, elapsed_ms(start) * 1000 / num_small_loops);
+      }
+      return res;
+    }
+
+    /// Make a job system for each thread count and print a table to a file.
+    static void run(FILE *file, unsigned max_threads = 64) {
+      const unsigned num_items = 1 << 22;
+      dynarray<float> data(num_items);
+      for (unsigned i = 0; i != num_items; ++i) {
+        data[i] = (float)i;
+      }
+
+      fprintf(file, "job_benchmark: %u cores\n", std::thread::hardware_concurrency());
+      fprintf(file, "threads  empty job   4M loop (speedup)   1024 item loop\n");
+      double base_ms = 0;
+      for (unsigned num_threads = 1; num_threads <= max_threads; num_threads *= 2) {
+        job_system jobs(num_threads - 1);
+        result res = measure(jobs, data.data(), num_items);
+        if (num_threads == 1) base_ms = res.large_loop_ms;
+        fprintf(file, "%7u  %6.0f ns  %7.2f ms (x%.2f)  %9.1f us\n",
+          res.num_threads, res.empty_job_ns, res.large_loop_ms, base_ms / res.large_loop_ms, res.small_loop_us
+        );
+      }
+    }
+  };
+}}
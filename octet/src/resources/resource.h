@@ -17,15 +17,46 @@
 
 namespace octet { namespace resources {
   /// Base class for resources; provides aligned allocation and reference counting.
+  ///
+  /// By default, the reference count is a plain counter and refs to a resource
+  /// must only be copied and dropped on one thread. A class that is shared between
+  /// threads calls set_thread_safe() in its constructor to use an atomic counter
+  /// (or build with OCTET_ATOMIC_REFCOUNT=1 to do this for every resource).
+  ///
+  /// Classes that own GL objects call set_destroy_on_main_thread(). If their last
+  /// reference is dropped on a worker, they are destroyed at the end of the frame.
   class resource {
     // how many lives do we have?
-    int ref_count;
+    std::atomic<int> ref_count;
+
+    // reference counting policy
+    enum {
+      ref_atomic = 1,
+      ref_main_thread = 2,
+    };
+    uint8_t ref_flags;
+
+    static void destroy(void *ptr) {
+      delete (resource*)ptr;
+    }
 
   public:
     /// Make a new resource with no lives.
     /// Adding it to a ref<> will give it a life.
     resource() {
-      ref_count = 0;
+      ref_count.store(0, std::memory_order_relaxed);
+      ref_flags = OCTET_ATOMIC_REFCOUNT ? ref_atomic : 0;
+    }
+
+    /// A copy of a resource is a new object with no lives.
+    resource(const resource &rhs) {
+      ref_count.store(0, std::memory_order_relaxed);
+      ref_flags = rhs.ref_flags;
+    }
+
+    /// Assignment keeps our own lives.
+    resource &operator=(const resource &rhs) {
+      return *this;
     }
 
     /// factory for making new resources of various kinds
@@ -55,16 +86,54 @@ namespace octet { namespace resources {
 
     /// Give this resource an extra life; see the %ref class.
     void add_ref() {
-      ref_count++;
+      if (ref_flags & ref_atomic) {
+        // nothing else depends on the new value, so no ordering is needed.
+        ref_count.fetch_add(1, std::memory_order_relaxed);
+      } else {
+        ref_count.store(ref_count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+      }
     }
 
     /// Remove a life from this resource and delete it if it is dead; see the %ref class.
     void release() {
-      if (--ref_count == 0) {
-        delete this;
+      int old_count;
+      if (ref_flags & ref_atomic) {
+        // acquire and release so that every thread's writes are seen by the destructor.
+        old_count = ref_count.fetch_sub(1, std::memory_order_acq_rel);
+      } else {
+        old_count = ref_count.load(std::memory_order_relaxed);
+        ref_count.store(old_count - 1, std::memory_order_relaxed);
+      }
+
+      if (old_count == 1) {
+        if ((ref_flags & ref_main_thread) && !release_queue::is_main_thread()) {
+          release_queue::push((void*)this, destroy);
+        } else {
+          delete this;
+        }
       }
     }
 
+    /// Use an atomic reference count, so that refs to this object can be copied and dropped on any thread.
+    void set_thread_safe(bool value = true) {
+      ref_flags = value ? (ref_flags | ref_atomic) : (ref_flags & ~ref_atomic);
+    }
+
+    /// Always destroy this object on the main thread. This also makes the reference count thread safe.
+    void set_destroy_on_main_thread(bool value = true) {
+      ref_flags = value ? (ref_flags | ref_main_thread | ref_atomic) : (ref_flags & ~ref_main_thread);
+    }
+
+    /// Return true if the reference count is atomic.
+    bool is_thread_safe() const {
+      return (ref_flags & ref_atomic) != 0;
+    }
+
+    /// Number of lives (for debugging only: other threads may change this at any time).
+    int get_ref_count() const {
+      return ref_count.load(std::memory_order_relaxed);
+    }
+
     /// use the allocator to allocate this resource and its child classes
     void *operator new (size_t size) {
       return allocator::malloc(size);
@@ -16,6 +16,10 @@ namespace octet { namespace resources {
     dictionary<ref<resource> > dict;
     ref<scene::visual_scene> active_scene;
 
+    // meshes to optimise as they are loaded, by name, and the default for the others.
+    dictionary<bool> mesh_optimisation;
+    bool optimise_meshes;
+
     #ifdef WIN32
       // vc2010/../
       static const char *prefix() { return "../"; }
@@ -65,6 +69,7 @@ namespace octet { namespace resources {
   public:
     /// Construct a new resource dictionary
     resource_dict() {
+      optimise_meshes = false;
     }
 
     /// Visitor for loading and saving
@@ -87,16 +92,18 @@ namespace octet { namespace resources {
     /// Note: you can get a specific type using get_<typename>
     /// For example, scene_node *node = dict.get_scene_node("name");
     resource *get_resource(const char *name) {
-      if (name == 0 || name[0] == 0) {
-        return NULL;
-      }
-      if (name[0] == '#') name++;
+      return get_resource(string_view(name));
+    }
 
-      if (!dict.contains(name)) {
+    /// Get a generic resource by name, which need not be zero terminated.
+    resource *get_resource(string_view name) {
+      if (!name.empty() && name[0] == '#') name = name.substr(1);
+      if (name.empty()) {
         return NULL;
-      } else {
-        return dict[name];
       }
+
+      int index = dict.get_index(name, dict.calc_hash(name));
+      return index < 0 ? NULL : (resource*)dict.get_value(index);
     }
 
     /// As this dict represents a game world, what is the active scene?
@@ -115,6 +122,27 @@ namespace octet { namespace resources {
       }
     }
 
+    /// Optimise the meshes that loaders add from now on: share their vertices and reorder
+    /// them for the vertex cache, overdraw and vertex fetch (see mesh_optimiser). Off by default.
+    void set_mesh_optimisation(bool value) {
+      optimise_meshes = value;
+    }
+
+    /// Turn mesh optimisation on or off for one mesh resource, whatever the default.
+    void set_mesh_optimisation(const char *name, bool value) {
+      mesh_optimisation[name] = value;
+    }
+
+    /// Will the mesh with this name be optimised when it is loaded?
+    bool get_mesh_optimisation(const char *name) {
+      int index = name ? mesh_optimisation.get_index(name) : -1;
+      return index >= 0 ? mesh_optimisation.get_value(index) : optimise_meshes;
+    }
+
+    /// Loaders call this when the vertices and indices of a mesh are complete.
+    /// If the mesh is to be optimised, this does it and logs the ACMR and ATVR before and after.
+    void mesh_loaded(const char *name, scene::mesh *msh);
+
     /// factory for textures: Deprecated will use Image object in future
     static GLuint get_texture_handle(unsigned gl_kind, const char *name) {
       GLuint &result = textures()[name];
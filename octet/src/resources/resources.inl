@@ -7,6 +7,22 @@
 // a container for named resources
 //
 
+void octet::resources::resource_dict::mesh_loaded(const char *name, scene::mesh *msh) {
+  if (!msh || !get_mesh_optimisation(name)) return;
+
+  // loaders make a vertex for each corner of each triangle, so share them first.
+  unsigned num_loaded = msh->get_num_vertices();
+  msh->reindex();
+
+  scene::mesh_optimiser::cache_stats before, after;
+  if (scene::mesh_optimiser::optimise(msh, &before, &after)) {
+    log(
+      "optimised mesh %s: %d triangles, %d -> %d vertices, ACMR %.3f -> %.3f, ATVR %.3f -> %.3f\n",
+      name, after.num_triangles, num_loaded, after.num_vertices, before.acmr, after.acmr, before.atvr, after.atvr
+    );
+  }
+}
+
 // todo: kill this
 GLuint octet::resources::resource_dict::get_texture_handle_internal(unsigned gl_kind, const char *url) {
   if (url[0] == '!') {
@@ -72,15 +72,14 @@ namespace octet { namespace resources {
               d.usize = u4(p + 24);
               unsigned file_name_len = u2(p + 28);
               unsigned extra_len = u2(p + 30);
-              string file;
-              file.set((const char*)(p + 46), file_name_len);
+              char *file = (char*)(p + 46);
               i += 46 + file_name_len + extra_len;
               d.offset = u4(p + 42);// + (46 + file_name_len + extra_len);
-              for (unsigned i = 0; file[i]; ++i) {
+              for (unsigned i = 0; i != file_name_len; ++i) {
                 if (file[i] == '\\') file[i] = '/';
               }
-              //printf("%s\n", file.c_str());
-              directory[file] = d;
+              // look up the name in place in the directory buffer.
+              directory[string_view(file, file_name_len)] = d;
             }
             break;
           }
@@ -0,0 +1,378 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// Bounding volume hierarchy of axis aligned boxes
+//
+// example:
+//
+//   aabb_tree tree;
+//   tree.resize(num_objects);
+//   for (unsigned i = 0; i != num_objects; ++i) tree.set_item(i, world_box[i]);
+//   tree.update();
+//   tree.query(frustum(worldToProjection), [&](unsigned item) { draw(item); });
+//   tree.query_ray(start, end - start, 1.0f, [&](unsigned item, float &max_t) { max_t = hit(item, max_t); });
+//
+
+namespace octet { namespace scene {
+  /// A bounding volume hierarchy over a set of boxes (items) that move.
+  ///
+  /// Each node has up to four children and stores their boxes side by side,
+  /// so one node can be tested against a frustum plane with four-wide SIMD.
+  ///
+  /// The tree is built top down by splitting the items at the median of their centers.
+  /// When items move, set_item() marks their nodes and update() refits the boxes
+  /// bottom up, which is much cheaper than a build. If the boxes have grown
+  /// a lot since the last build, update() builds the tree again.
+  class aabb_tree {
+  public:
+    /// Counters for the last query, for tuning.
+    struct query_stats {
+      unsigned num_nodes_visited;
+      unsigned num_boxes_tested;
+      unsigned num_items_found;
+    };
+
+  private:
+    enum {
+      max_stack = 256,
+    };
+
+    struct node_t {
+      // boxes of the four children
+      float min_x[4], min_y[4], min_z[4];
+      float max_x[4], max_y[4], max_z[4];
+
+      // child nodes are >= 0, items are stored as ~item.
+      int children[4];
+      int parent;
+      unsigned num_children;
+      unsigned dirty;
+      unsigned pad;
+    };
+
+    dynarray<node_t> nodes;
+    dynarray<aabb> item_boxes;
+
+    // where each item lives in the tree
+    dynarray<int> item_nodes;
+    dynarray<uint8_t> item_slots;
+
+    // sum of the surface areas of all the boxes in the tree, now and after the last build.
+    float total_area;
+    float built_area;
+
+    // the tree must be built again before it is used.
+    bool needs_build;
+    unsigned num_dirty;
+
+    static float get_area(float dx, float dy, float dz) {
+      return 2 * (dx * dy + dy * dz + dz * dx);
+    }
+
+    float get_slot_area(const node_t &n, unsigned slot) const {
+      return get_area(n.max_x[slot] - n.min_x[slot], n.max_y[slot] - n.min_y[slot], n.max_z[slot] - n.min_z[slot]);
+    }
+
+    void set_slot(node_t &n, unsigned slot, vec3_in min, vec3_in max) {
+      n.min_x[slot] = min.x(); n.min_y[slot] = min.y(); n.min_z[slot] = min.z();
+      n.max_x[slot] = max.x(); n.max_y[slot] = max.y(); n.max_z[slot] = max.z();
+    }
+
+    // the box around all the children of a node.
+    void get_node_bounds(const node_t &n, vec3 &min, vec3 &max) const {
+      min = vec3(n.min_x[0], n.min_y[0], n.min_z[0]);
+      max = vec3(n.max_x[0], n.max_y[0], n.max_z[0]);
+      for (unsigned j = 1; j < n.num_children; ++j) {
+        min = math::min(min, vec3(n.min_x[j], n.min_y[j], n.min_z[j]));
+        max = math::max(max, vec3(n.max_x[j], n.max_y[j], n.max_z[j]));
+      }
+    }
+
+    // split items [begin, end) at the median of the centers on the longest axis.
+    unsigned *split(unsigned *begin, unsigned *end) {
+      vec3 min = item_boxes[*begin].get_center(), max = min;
+      for (unsigned *p = begin + 1; p != end; ++p) {
+        vec3 center = item_boxes[*p].get_center();
+        min = math::min(min, center);
+        max = math::max(max, center);
+      }
+      vec3 size = max - min;
+      int axis = size.x() >= size.y() && size.x() >= size.z() ? 0 : size.y() >= size.z() ? 1 : 2;
+      unsigned *mid = begin + (end - begin) / 2;
+      const aabb *boxes = item_boxes.data();
+      std::nth_element(begin, mid, end, [boxes, axis](unsigned a, unsigned b) {
+        return boxes[a].get_center()[axis] < boxes[b].get_center()[axis];
+      });
+      return mid;
+    }
+
+    // build a node for items [begin, end) and return its index and bounds.
+    int build_node(unsigned *begin, unsigned *end, int parent, vec3 &min, vec3 &max) {
+      int index = nodes.size();
+      nodes.resize(index + 1);
+      nodes[index].parent = parent;
+      nodes[index].dirty = 0;
+      nodes[index].pad = 0;
+
+      // up to four groups of items
+      unsigned *groups[5];
+      unsigned count = (unsigned)(end - begin);
+      unsigned num_groups;
+      if (count <= 4) {
+        num_groups = count;
+        for (unsigned j = 0; j <= count; ++j) groups[j] = begin + j;
+      } else {
+        unsigned *mid = split(begin, end);
+        groups[0] = begin;
+        groups[1] = split(begin, mid);
+        groups[2] = mid;
+        groups[3] = split(mid, end);
+        groups[4] = end;
+        num_groups = 4;
+      }
+
+      nodes[index].num_children = num_groups;
+      for (unsigned j = 0; j != num_groups; ++j) {
+        vec3 child_min, child_max;
+        int child;
+        if (groups[j+1] - groups[j] == 1) {
+          unsigned item = *groups[j];
+          child_min = item_boxes[item].get_min();
+          child_max = item_boxes[item].get_max();
+          item_nodes[item] = index;
+          item_slots[item] = (uint8_t)j;
+          child = ~(int)item;
+        } else {
+          child = build_node(groups[j], groups[j+1], index, child_min, child_max);
+        }
+        node_t &n = nodes[index];
+        n.children[j] = child;
+        set_slot(n, j, child_min, child_max);
+        total_area += get_slot_area(n, j);
+      }
+
+      // unused slots get empty boxes.
+      node_t &n = nodes[index];
+      for (unsigned j = num_groups; j != 4; ++j) {
+        n.children[j] = 0;
+        set_slot(n, j, vec3(1e37f), vec3(-1e37f));
+      }
+      get_node_bounds(n, min, max);
+      return index;
+    }
+
+  public:
+    /// Make an empty tree.
+    aabb_tree() {
+      total_area = built_area = 0;
+      needs_build = false;
+      num_dirty = 0;
+    }
+
+    /// Set the number of items. New items have empty boxes at the origin.
+    /// The tree will be built again at the next update().
+    void resize(unsigned num_items) {
+      item_boxes.resize(num_items);
+      item_nodes.resize(num_items);
+      item_slots.resize(num_items);
+      needs_build = true;
+    }
+
+    /// Number of items.
+    unsigned get_num_items() const {
+      return item_boxes.size();
+    }
+
+    /// Number of nodes, for statistics.
+    unsigned get_num_nodes() const {
+      return nodes.size();
+    }
+
+    /// Set the world box of an item. Call update() before the next query.
+    void set_item(unsigned item, const aabb &box) {
+      item_boxes[item] = box;
+      if (!needs_build) {
+        for (int n = item_nodes[item]; n >= 0 && !nodes[n].dirty; n = nodes[n].parent) {
+          nodes[n].dirty = 1;
+          num_dirty++;
+        }
+      }
+    }
+
+    /// Get the box of an item.
+    const aabb &get_item(unsigned item) const {
+      return item_boxes[item];
+    }
+
+    /// Build the tree from scratch.
+    void build() {
+      nodes.resize(0);
+      total_area = 0;
+      unsigned num_items = item_boxes.size();
+      if (num_items) {
+        dynarray<unsigned> items(num_items);
+        for (unsigned i = 0; i != num_items; ++i) items[i] = i;
+        vec3 min, max;
+        nodes.reserve(num_items / 2 + 1);
+        build_node(items.data(), items.data() + num_items, -1, min, max);
+      }
+      built_area = total_area;
+      needs_build = false;
+      num_dirty = 0;
+    }
+
+    /// Recalculate the boxes of the nodes whose items have moved.
+    void refit() {
+      if (needs_build) {
+        build();
+        return;
+      }
+      if (num_dirty == 0) return;
+
+      // children always come after their parents, so go backwards.
+      for (unsigned i = nodes.size(); i-- != 0; ) {
+        node_t &n = nodes[i];
+        if (!n.dirty) continue;
+        for (unsigned j = 0; j != n.num_children; ++j) {
+          int child = n.children[j];
+          vec3 min, max;
+          if (child < 0) {
+            const aabb &box = item_boxes[~child];
+            min = box.get_min();
+            max = box.get_max();
+          } else {
+            get_node_bounds(nodes[child], min, max);
+          }
+          total_area -= get_slot_area(n, j);
+          set_slot(n, j, min, max);
+          total_area += get_slot_area(n, j);
+        }
+        n.dirty = 0;
+      }
+      num_dirty = 0;
+    }
+
+    /// Return true if refitting has made the boxes so loose that queries would be slow.
+    bool needs_rebuild() const {
+      return needs_build || total_area > built_area * 2;
+    }
+
+    /// Refit the tree, or build it again if the boxes have grown too much.
+    /// Returns true if the tree was built.
+    bool update() {
+      refit();
+      if (needs_rebuild()) {
+        build();
+        return true;
+      }
+      return false;
+    }
+
+    /// Call fn(item) for every item whose box is at least partly inside the frustum.
+    /// Items are found in tree order, not item order.
+    template <class fn_t> void query(const frustum &view, fn_t fn, query_stats *stats = 0) const {
+      query_stats qs = { 0, 0, 0 };
+      if (!nodes.empty()) {
+        // each entry is (node * 2 + 1) if the node is known to be inside the frustum.
+        unsigned stack[max_stack];
+        unsigned sp = 0;
+        stack[sp++] = 0;
+        while (sp) {
+          unsigned entry = stack[--sp];
+          const node_t &n = nodes[entry >> 1];
+          unsigned all = (1 << n.num_children) - 1;
+          unsigned mask = all, inside = all;
+          qs.num_nodes_visited++;
+          if (!(entry & 1)) {
+            mask = view.intersects4(n.min_x, n.min_y, n.min_z, n.max_x, n.max_y, n.max_z, inside) & all;
+            qs.num_boxes_tested += n.num_children;
+          }
+          for (; mask; mask &= mask - 1) {
+            unsigned j = find_lowest_bit(mask);
+            int child = n.children[j];
+            if (child < 0) {
+              qs.num_items_found++;
+              fn((unsigned)~child);
+            } else {
+              assert(sp != max_stack);
+              stack[sp++] = (unsigned)child * 2 + ((inside >> j) & 1);
+            }
+          }
+        }
+      }
+      if (stats) *stats = qs;
+    }
+
+    /// Call fn(item, max_t) for every item whose box is crossed by the ray start + distance * t for 0 <= t <= max_t,
+    /// nearest box first. fn can make max_t smaller, eg. to the nearest hit so far, to skip the boxes behind it.
+    template <class fn_t> void query_ray(vec3_in start, vec3_in distance, float max_t, fn_t fn, query_stats *stats = 0) const {
+      query_stats qs = { 0, 0, 0 };
+      if (!nodes.empty()) {
+        float inv[3], org[3];
+        for (unsigned i = 0; i != 3; ++i) {
+          inv[i] = distance[i] != 0 ? 1.0f / distance[i] : 1e30f;
+          org[i] = start[i];
+        }
+
+        // each entry is a node or ~item and the distance to its box.
+        struct entry_t { int child; float t; };
+        entry_t stack[max_stack];
+        unsigned sp = 0;
+        entry_t root = { 0, 0 };
+        stack[sp++] = root;
+        while (sp) {
+          entry_t entry = stack[--sp];
+          if (entry.t > max_t) continue;
+          if (entry.child < 0) {
+            qs.num_items_found++;
+            fn((unsigned)~entry.child, max_t);
+            continue;
+          }
+
+          const node_t &n = nodes[entry.child];
+          qs.num_nodes_visited++;
+          qs.num_boxes_tested += n.num_children;
+
+          // slab test of the ray against the four children.
+          float t0[4], t1[4];
+          #if OCTET_SSE2
+            __m128 ox = _mm_set1_ps(org[0]), oy = _mm_set1_ps(org[1]), oz = _mm_set1_ps(org[2]);
+            __m128 ix = _mm_set1_ps(inv[0]), iy = _mm_set1_ps(inv[1]), iz = _mm_set1_ps(inv[2]);
+            __m128 ax = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(n.min_x), ox), ix), bx = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(n.max_x), ox), ix);
+            __m128 ay = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(n.min_y), oy), iy), by = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(n.max_y), oy), iy);
+            __m128 az = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(n.min_z), oz), iz), bz = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(n.max_z), oz), iz);
+            __m128 near_t = _mm_max_ps(_mm_max_ps(_mm_min_ps(ax, bx), _mm_min_ps(ay, by)), _mm_max_ps(_mm_min_ps(az, bz), _mm_setzero_ps()));
+            __m128 far_t = _mm_min_ps(_mm_min_ps(_mm_max_ps(ax, bx), _mm_max_ps(ay, by)), _mm_min_ps(_mm_max_ps(az, bz), _mm_set1_ps(max_t)));
+            _mm_storeu_ps(t0, near_t);
+            _mm_storeu_ps(t1, far_t);
+          #else
+            for (unsigned j = 0; j != 4; ++j) {
+              float ax = (n.min_x[j] - org[0]) * inv[0], bx = (n.max_x[j] - org[0]) * inv[0];
+              float ay = (n.min_y[j] - org[1]) * inv[1], by = (n.max_y[j] - org[1]) * inv[1];
+              float az = (n.min_z[j] - org[2]) * inv[2], bz = (n.max_z[j] - org[2]) * inv[2];
+              t0[j] = std::max(std::max(std::min(ax, bx), std::min(ay, by)), std::max(std::min(az, bz), 0.0f));
+              t1[j] = std::min(std::min(std::max(ax, bx), std::max(ay, by)), std::min(std::max(az, bz), max_t));
+            }
+          #endif
+
+          // push the children that are hit, furthest first, so that the nearest is visited first.
+          unsigned first = sp;
+          for (unsigned j = 0; j != n.num_children; ++j) {
+            if (t0[j] > t1[j]) continue;
+            assert(sp != max_stack);
+            unsigned k = sp++;
+            for (; k != first && stack[k-1].t < t0[j]; --k) {
+              stack[k] = stack[k-1];
+            }
+            stack[k].child = n.children[j];
+            stack[k].t = t0[j];
+          }
+        }
+      }
+      if (stats) *stats = qs;
+    }
+  };
+} }
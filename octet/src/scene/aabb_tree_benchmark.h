@@ -0,0 +1,126 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// Benchmarks for aabb_tree culling
+//
+// example:
+//
+//   aabb_tree_benchmark::run(stdout);            // 50000 boxes
+//   aabb_tree_benchmark::run(stdout, 200000);    // 200000 boxes
+//
+
+namespace octet { namespace scene {
+  /// Cost of frustum culling with an aabb_tree against testing every box.
+  ///
+  /// The boxes are scattered over a 1000 x 1000 area with a camera in the middle
+  /// with a 30 degree field of view, so about one box in fifteen is visible.
+  /// For each number of boxes we print the best of five runs, in ms, of:
+  ///
+  ///   building the tree;
+  ///   testing every box against the frustum;
+  ///   querying the tree;
+  ///   moving one box in ten and calling update() to refit the tree.
+  ///
+  /// Both ways of culling must find the same boxes.
+  class aabb_tree_benchmark {
+    typedef std::chrono::high_resolution_clock clock;
+
+    static double elapsed_ms(clock::time_point start) {
+      return std::chrono::duration<double, std::milli>(clock::now() - start).count();
+    }
+
+  public:
+    struct result {
+      double build_ms;
+      double brute_force_ms;
+      double query_ms;
+      double refit_ms;
+      unsigned num_visible;
+      unsigned num_mismatches;
+      aabb_tree::query_stats stats;
+    };
+
+    /// Measure "num_boxes" boxes.
+    static result measure(unsigned num_boxes) {
+      dynarray<aabb> boxes(num_boxes);
+      unsigned seed = 1;
+      for (unsigned i = 0; i != num_boxes; ++i) {
+        float pos[3];
+        for (unsigned j = 0; j != 3; ++j) {
+          seed = seed * 1664525 + 1013904223;
+          pos[j] = (seed >> 8) * (1.0f / 0x1000000) - 0.5f;
+        }
+        boxes[i] = aabb(vec3(pos[0] * 1000, pos[1] * 40, pos[2] * 1000), vec3(1, 1, 1));
+      }
+
+      // a 30 degree field of view looking down -z.
+      float near_plane = 0.1f, far_plane = 500.0f;
+      float size = near_plane * tanf(15 * (3.14159265f / 180));
+      mat4t cameraToProjection;
+      cameraToProjection.loadIdentity();
+      cameraToProjection.frustum(-size, size, -size, size, near_plane, far_plane);
+      frustum view(cameraToProjection);
+
+      result res = { 1e9, 1e9, 1e9, 1e9, 0, 0, { 0, 0, 0 } };
+      dynamic_bitset<> visible;
+      visible.resize(num_boxes);
+      aabb_tree tree;
+
+      for (unsigned rep = 0; rep != 5; ++rep) {
+        clock::time_point start = clock::now();
+        tree.resize(num_boxes);
+        for (unsigned i = 0; i != num_boxes; ++i) {
+          tree.set_item(i, boxes[i]);
+        }
+        tree.build();
+        res.build_ms = std::min(res.build_ms, elapsed_ms(start));
+
+        start = clock::now();
+        unsigned num_visible = 0;
+        for (unsigned i = 0; i != num_boxes; ++i) {
+          num_visible += view.intersects(boxes[i]);
+        }
+        res.brute_force_ms = std::min(res.brute_force_ms, elapsed_ms(start));
+        res.num_visible = num_visible;
+
+        start = clock::now();
+        visible.clear();
+        tree.query(view, [&](unsigned item) { visible.setbit(item); }, &res.stats);
+        res.query_ms = std::min(res.query_ms, elapsed_ms(start));
+
+        // move every tenth box a little and back again on the next run.
+        vec3 offset(rep & 1 ? -0.5f : 0.5f, 0, 0);
+        start = clock::now();
+        for (unsigned i = 0; i < num_boxes; i += 10) {
+          boxes[i] = aabb(boxes[i].get_center() + offset, vec3(1, 1, 1));
+          tree.set_item(i, boxes[i]);
+        }
+        tree.update();
+        res.refit_ms = std::min(res.refit_ms, elapsed_ms(start));
+      }
+
+      visible.clear();
+      tree.query(view, [&](unsigned item) { visible.setbit(item); });
+      for (unsigned i = 0; i != num_boxes; ++i) {
+        res.num_mismatches += visible[i] != view.intersects(boxes[i]);
+      }
+      return res;
+    }
+
+    /// Print a table for "num_boxes" boxes.
+    static void run(FILE *file, unsigned num_boxes = 50000) {
+      result res = measure(num_boxes);
+      fprintf(file, "aabb_tree_benchmark: %u boxes, %u visible\n", num_boxes, res.num_visible);
+      fprintf(file, "build                 %8.3f ms\n", res.build_ms);
+      fprintf(file, "test every box        %8.3f ms\n", res.brute_force_ms);
+      fprintf(file, "tree query            %8.3f ms  (%u nodes, %u boxes tested)\n",
+        res.query_ms, res.stats.num_nodes_visited, res.stats.num_boxes_tested
+      );
+      fprintf(file, "refit, 10%% moved      %8.3f ms\n", res.refit_ms);
+      fprintf(file, "mismatches            %8u\n", res.num_mismatches);
+    }
+  };
+}}
@@ -7,7 +7,7 @@
 
 namespace octet { namespace scene {
   /// Animation resource: Contains times and values.
-  /// Still a work in progress. Requires splines, compression, blending etc.
+  /// Use get_clip() for fast playback of all the channels together.
   class animation : public resource {
     // todo: this could be a GL/CL buffer
     dynarray<unsigned char> data;
@@ -31,8 +31,15 @@ namespace octet { namespace scene {
     dynarray<ref<resource> > targets;
 
     float end_time;
+
+    // compiled form of the channels, see get_clip().
+    ref<animation_clip> clip;
   public:
     RESOURCE_META(animation)
+
+    enum {
+      max_floats = 16,  // largest channel value (a matrix)
+    };
   
     /// Default constructor. Use add_channel to add channels to the animation,
     animation() {
@@ -105,10 +112,65 @@ namespace octet { namespace scene {
       memcpy(&data[offset], &values[0], component_size * num_times);
       channels.push_back(ch);
       targets.push_back(target);
+
+      // the clip keeps the times as floats, so it is not limited to 65 seconds.
+      // channels added after the clip is built make get_clip() compile it again from the stored keys.
+      if (channels.size() == 1) clip = new animation_clip();
+      if (clip && !clip->get_num_times() && clip->get_num_channels() == channels.size() - 1) {
+        clip->add_channel(target, sid, sub_target, component, &times[0], num_times, &values[0], component_size / sizeof(float));
+      } else {
+        clip = 0;
+      }
+    }
+
+    /// Get the compiled clip of this animation, building it the first time.
+    /// This is not thread safe: get the clip before sampling it on other threads.
+    animation_clip *get_clip() {
+      if (!clip || clip->get_num_channels() != channels.size()) {
+        // eg. loaded from a file: compile the stored keys.
+        clip = new animation_clip();
+        dynarray<float> times;
+        dynarray<float> values;
+        for (unsigned ch = 0; ch != channels.size(); ++ch) {
+          const channel &c = channels[ch];
+          const unsigned short *p = (const unsigned short *)&data[c.offset];
+          times.resize(c.num_times);
+          for (unsigned i = 0; i != c.num_times; ++i) {
+            times[i] = p[i] * 0.001f;
+          }
+          // the values are only two byte aligned.
+          values.resize(c.num_times * c.component_size / sizeof(float));
+          memcpy(values.data(), &data[c.offset + c.num_times * sizeof(unsigned short)], c.num_times * c.component_size);
+          clip->add_channel(targets[ch], c.sid, c.sub_target, c.component, times.data(), c.num_times, values.data(), c.component_size / sizeof(float));
+        }
+      }
+      clip->build();
+      return clip;
+    }
+
+    /// Number of floats in the value of a channel.
+    unsigned get_num_floats(int chan) const {
+      return channels[chan].component_size / sizeof(float);
     }
 
     /// Evaluate one channel. Time is in ms. This is very inefficient, it is much better to evalaute all channels together.
     void eval_chan(int chan, float time, resource *target) const {
+      float value[max_floats];
+      if (sample_chan(chan, time, value)) {
+        apply_chan(chan, value, target);
+      }
+    }
+
+    /// Set the value of a channel on a target.
+    void apply_chan(int chan, float *value, resource *target) const {
+      const channel &ch = channels[chan];
+      target->set_value(ch.sid, ch.sub_target, ch.component, value);
+    }
+
+    /// Calculate the value of a channel without changing the target, so that channels can be
+    /// sampled on any thread. "value" must have room for get_num_floats(chan) floats.
+    /// Returns false if the channel has more than max_floats floats.
+    bool sample_chan(int chan, float time, float *value) const {
       int time_ms = int(time * 1000);
       const channel &ch = channels[chan];
       unsigned short *p = (unsigned short *)&data[ch.offset];
@@ -138,17 +200,16 @@ namespace octet { namespace scene {
       unsigned data_offset = ch.offset + ch.num_times * sizeof(unsigned short);
 
       float t = float(time_ms - p[a]) / (p[b] - p[a]);
-      float tmp1[16];
-      float tmp2[16];
-      if (component_size <= sizeof(tmp1)) {
-        memcpy(tmp1, &data[data_offset + a * component_size], component_size);
-        memcpy(tmp2, &data[data_offset + b * component_size], component_size);
-        for (int i = 0; i != component_size/4; ++i) {
-          tmp1[i] = tmp1[i] * (1-t) + tmp2[i] * t;
-        }
-        //log("  t=%f %f %f %f\n", t, tmp1[0], tmp1[1], tmp1[2]);
-        target->set_value(ch.sid, ch.sub_target, ch.component, tmp1);
+      float tmp2[max_floats];
+      if (component_size > sizeof(tmp2)) return false;
+
+      memcpy(value, &data[data_offset + a * component_size], component_size);
+      memcpy(tmp2, &data[data_offset + b * component_size], component_size);
+      for (unsigned i = 0; i != component_size/4; ++i) {
+        value[i] = value[i] * (1-t) + tmp2[i] * t;
       }
+      //log("  t=%f %f %f %f\n", t, value[0], value[1], value[2]);
+      return true;
     }
   };
 }}
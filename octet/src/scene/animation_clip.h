@@ -0,0 +1,493 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// Compact animation clips
+//
+// example:
+//
+//   animation_clip *clip = anim->get_clip();      // compiled once, on one thread
+//   dynarray<vec4> pose(clip->get_num_parts());
+//   unsigned cursor = 0;
+//   clip->sample(time, cursor, pose.data());      // on any thread
+//   clip->apply(pose.data(), NULL);               // sets the targets
+//
+
+namespace octet { namespace scene {
+  /// A compiled form of an animation that plays back quickly.
+  ///
+  /// All channels share one time grid (every key time of every channel), so one search finds the keys of
+  /// every channel, and a cursor makes the search free when the time only goes forward. Times are floats,
+  /// so clips may be as long as you like.
+  ///
+  /// Each channel is split into parts of four floats. Matrix (transform) channels become a translation,
+  /// a rotation quaternion and a scale. Parts that change are stored as four 16 bit numbers per key:
+  /// fixed point between the smallest and largest value for translations, scales and other values,
+  /// and the three smallest components of the quaternion with the index of the largest for rotations.
+  /// Parts that never change are stored once.
+  ///
+  /// A pose is an array of get_num_parts() vec4s. Poses of the same clip can be blended.
+  class animation_clip : public resource {
+  public:
+    enum part_kind {
+      part_translation,
+      part_rotation,
+      part_scale,
+      part_values,
+    };
+
+  private:
+    enum {
+      constant_part = ~0u,
+    };
+
+    // four floats of a channel's value.
+    struct part {
+      vec4 offset;       // value of a zero key or of a constant part
+      vec4 scale;        // value of one step of a key
+      uint32_t kind;     // part_kind
+      uint32_t column;   // which four keys of a key frame, or constant_part
+      uint32_t channel;
+      uint32_t index;    // which part of the channel
+    };
+
+    struct channel {
+      atom_t sid;
+      atom_t sub_target;
+      atom_t component;
+      uint32_t first_part;
+      uint32_t num_parts;
+      uint32_t num_floats;
+      bool is_transform;
+    };
+
+    // channels from add_channel(), waiting for build().
+    struct source_channel {
+      uint32_t first_time;
+      uint32_t num_times;
+      uint32_t first_value;
+    };
+
+    dynarray<source_channel> sources;
+    dynarray<float> source_times;
+    dynarray<float> source_values;
+
+    dynarray<channel> channels;
+    dynarray<ref<resource> > targets;
+    dynarray<part> parts;
+    dynarray<float> times;
+    dynarray<uint16_t> keys;   // four keys per column per time
+    unsigned num_columns;
+    float end_time;
+    bool is_built;
+
+    // the value of a source channel at a time, with the same linear interpolation as animation.
+    void sample_source(unsigned ch, float time, float *value) const {
+      const source_channel &src = sources[ch];
+      const float *t = source_times.data() + src.first_time;
+      const float *v = source_values.data() + src.first_value;
+      unsigned num_floats = channels[ch].num_floats;
+      unsigned b = std::upper_bound(t, t + src.num_times, time) - t;
+      if (b == 0 || b == src.num_times) {
+        unsigned a = b ? b - 1 : 0;
+        memcpy(value, v + a * num_floats, num_floats * sizeof(float));
+      } else {
+        unsigned a = b - 1;
+        float f = (time - t[a]) / (t[b] - t[a]);
+        for (unsigned i = 0; i != num_floats; ++i) {
+          value[i] = v[a * num_floats + i] * (1 - f) + v[b * num_floats + i] * f;
+        }
+      }
+    }
+
+    // split a matrix into translation, rotation and scale. Returns false if it has shear or projection.
+    static bool decompose(const mat4t &m, vec4 *trs) {
+      vec3 r0 = m[0].xyz(), r1 = m[1].xyz(), r2 = m[2].xyz();
+      float sx = r0.length(), sy = r1.length(), sz = r2.length();
+      if (sx == 0 || sy == 0 || sz == 0) return false;
+      if (dot(cross(r0, r1), r2) < 0) sx = -sx;
+
+      mat4t rot;
+      rot[0] = vec4(r0 / sx, 0);
+      rot[1] = vec4(r1 / sy, 0);
+      rot[2] = vec4(r2 / sz, 0);
+      rot[3] = vec4(0, 0, 0, 1);
+      trs[0] = vec4(m[3].xyz(), 0);
+      trs[1] = vec4(rot.toQuaternion()).normalize();
+      trs[2] = vec4(sx, sy, sz, 0);
+
+      mat4t check = compose(trs);
+      float error = 0, size = 1;
+      for (unsigned i = 0; i != 4; ++i) {
+        for (unsigned j = 0; j != 4; ++j) {
+          error = std::max(error, fabsf(check[i][j] - m[i][j]));
+          size = std::max(size, fabsf(m[i][j]));
+        }
+      }
+      return error <= size * 1e-4f;
+    }
+
+    // build a matrix from translation, rotation and scale.
+    static mat4t compose(const vec4 *trs) {
+      mat4t m(quat(trs[1][0], trs[1][1], trs[1][2], trs[1][3]));
+      m[0] = m[0] * trs[2].x();
+      m[1] = m[1] * trs[2].y();
+      m[2] = m[2] * trs[2].z();
+      m[3] = vec4(trs[0].xyz(), 1);
+      return m;
+    }
+
+    // the largest component goes in the fourth key, so the others are all within +/- sqrt(0.5).
+    static void encode_rotation(vec4 q, uint16_t *key) {
+      unsigned largest = 0;
+      for (unsigned i = 1; i != 4; ++i) {
+        if (fabsf(q[i]) > fabsf(q[largest])) largest = i;
+      }
+      if (q[largest] < 0) q = -q;
+      for (unsigned i = 0, k = 0; i != 4; ++i) {
+        if (i != largest) {
+          float f = (q[i] + 0.70710678f) * (65535.0f / 1.41421356f);
+          key[k++] = (uint16_t)std::max(0.0f, std::min(65535.0f, f + 0.5f));
+        }
+      }
+      key[3] = (uint16_t)largest;
+    }
+
+    static vec4 decode(const uint16_t *key, const part &p) {
+      #if OCTET_SSE2
+        __m128i k = _mm_unpacklo_epi16(_mm_loadl_epi64((const __m128i*)key), _mm_setzero_si128());
+        __m128 f = _mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(k), _mm_loadu_ps(p.scale.get())), _mm_loadu_ps(p.offset.get()));
+        vec4 result;
+        _mm_storeu_ps(result.get(), f);
+        return result;
+      #else
+        return vec4(key[0], key[1], key[2], key[3]) * p.scale + p.offset;
+      #endif
+    }
+
+    static vec4 decode_rotation(const uint16_t *key, const part &p) {
+      vec4 abc = decode(key, p);
+      float a = abc[0], b = abc[1], c = abc[2];
+      float largest = sqrtf(std::max(0.0f, 1 - a*a - b*b - c*c));
+      switch (key[3]) {
+        case 0: return vec4(largest, a, b, c);
+        case 1: return vec4(a, largest, b, c);
+        case 2: return vec4(a, b, largest, c);
+        default: return vec4(a, b, c, largest);
+      }
+    }
+
+    // normalised lerp along the short arc.
+    static vec4 nlerp(const vec4 &a, vec4 b, float t) {
+      if (dot(a, b) < 0) b = -b;
+      vec4 r = a + (b - a) * t;
+      return r * (1.0f / sqrtf(dot(r, r)));
+    }
+
+    // find the key at or before "time", starting from the cursor.
+    unsigned find_key(float time, unsigned &cursor) const {
+      unsigned last = times.size() - 1;
+      unsigned k = cursor < last ? cursor : 0;
+      if (times[k] <= time) {
+        // the usual case: the same key or one of the next few.
+        unsigned limit = std::min(k + 4, last);
+        while (k < limit && times[k+1] <= time) ++k;
+        if (k == limit && k != last && times[k+1] <= time) {
+          k = (unsigned)(std::upper_bound(times.data() + k, times.data() + last, time) - times.data()) - 1;
+        }
+      } else {
+        const float *p = std::upper_bound(times.data(), times.data() + last, time);
+        k = p == times.data() ? 0 : (unsigned)(p - times.data()) - 1;
+      }
+      cursor = k;
+      return k;
+    }
+
+    void add_part(unsigned ch, unsigned index, part_kind kind, const vec4 *values, unsigned stride) {
+      unsigned num_times = times.size();
+      part p;
+      p.kind = kind;
+      p.channel = ch;
+      p.index = index;
+      p.column = constant_part;
+      p.offset = values[0];
+      p.scale = vec4(0, 0, 0, 0);
+
+      // rotations that differ only in sign are the same, so compare them with the
+      // sign that matches the first key.
+      vec4 vmin = values[0], vmax = values[0];
+      for (unsigned i = 1; i != num_times; ++i) {
+        vec4 value = values[i * stride];
+        if (kind == part_rotation && dot(value, values[0]) < 0) value = -value;
+        vmin = min(vmin, value);
+        vmax = max(vmax, value);
+      }
+      vec4 range = vmax - vmin;
+      float largest = std::max(std::max(range[0], range[1]), std::max(range[2], range[3]));
+
+      if (largest > 1e-6f) {
+        p.column = num_columns++;
+        if (kind == part_rotation) {
+          p.offset = vec4(-0.70710678f, -0.70710678f, -0.70710678f, 0);
+          p.scale = vec4(1.41421356f / 65535, 1.41421356f / 65535, 1.41421356f / 65535, 0);
+        } else {
+          p.offset = vmin;
+          p.scale = range * (1.0f / 65535);
+        }
+      }
+      parts.push_back(p);
+    }
+
+  public:
+    RESOURCE_META(animation_clip)
+
+    /// Make an empty clip. Use add_channel() then build().
+    animation_clip() {
+      num_columns = 0;
+      end_time = 0;
+      is_built = false;
+    }
+
+    /// Add a channel, as in animation::add_channel(). Times are in seconds.
+    void add_channel(resource *target, atom_t sid, atom_t sub_target, atom_t component, const float *key_times, unsigned num_times, const float *values, unsigned num_floats) {
+      assert(!is_built && num_times && num_floats);
+      source_channel src;
+      src.first_time = source_times.size();
+      src.num_times = num_times;
+      src.first_value = source_values.size();
+      sources.push_back(src);
+      source_times.resize(src.first_time + num_times);
+      memcpy(source_times.data() + src.first_time, key_times, num_times * sizeof(float));
+      source_values.resize(src.first_value + num_times * num_floats);
+      memcpy(source_values.data() + src.first_value, values, num_times * num_floats * sizeof(float));
+
+      channel ch;
+      ch.sid = sid;
+      ch.sub_target = sub_target;
+      ch.component = component;
+      ch.first_part = 0;
+      ch.num_parts = 0;
+      ch.num_floats = num_floats;
+      ch.is_transform = false;
+      channels.push_back(ch);
+      targets.push_back(target);
+      end_time = std::max(end_time, key_times[num_times-1]);
+    }
+
+    /// Compile the channels. Does nothing if the clip has been built already.
+    void build() {
+      if (is_built) return;
+      is_built = true;
+
+      // the time grid is every key of every channel.
+      times = source_times;
+      std::sort(times.data(), times.data() + times.size());
+      unsigned num_times = 0;
+      for (unsigned i = 0; i != times.size(); ++i) {
+        if (num_times == 0 || times[i] - times[num_times-1] > 1e-6f) {
+          times[num_times++] = times[i];
+        }
+      }
+      if (num_times == 0) {
+        times.resize(1);
+        times[0] = 0;
+        num_times = 1;
+      }
+      times.resize(num_times);
+
+      // first find the parts and their values at each time, then quantise the parts that change.
+      dynarray<float> value;
+      dynarray<vec4> frames;
+      dynarray<vec4> trs;
+      dynarray<vec4> series;   // num_times values for each part
+      for (unsigned ch = 0; ch != channels.size(); ++ch) {
+        channel &c = channels[ch];
+        c.first_part = parts.size();
+
+        // resample the channel at the grid times: exact, as the curves are straight between keys.
+        unsigned parts_per_time = (c.num_floats + 3) / 4;
+        frames.resize(num_times * parts_per_time);
+        value.resize(parts_per_time * 4);
+        for (unsigned i = 0; i != num_times; ++i) {
+          memset(value.data(), 0, value.size() * sizeof(float));
+          sample_source(ch, times[i], value.data());
+          for (unsigned j = 0; j != parts_per_time; ++j) {
+            frames[i * parts_per_time + j] = vec4(value[j*4+0], value[j*4+1], value[j*4+2], value[j*4+3]);
+          }
+        }
+
+        // collada transforms are transposed matrices.
+        c.is_transform = c.sub_target == atom_transform && c.num_floats == 16;
+        if (c.is_transform) {
+          trs.resize(num_times * 3);
+          for (unsigned i = 0; i != num_times && c.is_transform; ++i) {
+            mat4t m;
+            m.init_transpose((float*)&frames[i * 4]);
+            c.is_transform = decompose(m, &trs[i * 3]);
+          }
+        }
+
+        const vec4 *src = c.is_transform ? trs.data() : frames.data();
+        unsigned stride = c.is_transform ? 3 : parts_per_time;
+        c.num_parts = stride;
+        for (unsigned j = 0; j != stride; ++j) {
+          part_kind kind = c.is_transform ? (part_kind)(part_translation + j) : part_values;
+          add_part(ch, j, kind, src + j, stride);
+          unsigned first = series.size();
+          series.resize(first + num_times);
+          for (unsigned i = 0; i != num_times; ++i) {
+            series[first + i] = src[i * stride + j];
+          }
+        }
+      }
+
+      keys.resize(num_times * num_columns * 4);
+      for (unsigned pi = 0; pi != parts.size(); ++pi) {
+        const part &p = parts[pi];
+        if (p.column == constant_part) continue;
+        for (unsigned i = 0; i != num_times; ++i) {
+          vec4 v = series[pi * num_times + i];
+          uint16_t *key = &keys[(i * num_columns + p.column) * 4];
+          if (p.kind == part_rotation) {
+            encode_rotation(v, key);
+          } else {
+            for (unsigned k = 0; k != 4; ++k) {
+              float f = p.scale[k] != 0 ? (v[k] - p.offset[k]) / p.scale[k] : 0;
+              key[k] = (uint16_t)std::max(0.0f, std::min(65535.0f, f + 0.5f));
+            }
+          }
+        }
+      }
+
+      sources.reset();
+      source_times.reset();
+      source_values.reset();
+    }
+
+    /// Number of vec4s in a pose.
+    unsigned get_num_parts() const {
+      return parts.size();
+    }
+
+    /// What a part of a pose holds.
+    part_kind get_part_kind(unsigned index) const {
+      return (part_kind)parts[index].kind;
+    }
+
+    /// Number of channels.
+    unsigned get_num_channels() const {
+      return channels.size();
+    }
+
+    /// Number of key frames in the shared time grid.
+    unsigned get_num_times() const {
+      return times.size();
+    }
+
+    /// Length of the clip in seconds.
+    float get_end_time() const {
+      return end_time;
+    }
+
+    /// Bytes used by the keys and parts.
+    size_t get_size() const {
+      return keys.size() * sizeof(uint16_t) + times.size() * sizeof(float) + parts.size() * sizeof(part) + channels.size() * sizeof(channel);
+    }
+
+    /// Interpolate every part at a time (in seconds) into a pose of get_num_parts() vec4s.
+    /// The cursor is the last key used; start it at zero. This does not change the clip or the targets,
+    /// so poses can be sampled on any thread.
+    void sample(float time, unsigned &cursor, vec4 *pose) const {
+      assert(is_built);
+      unsigned num_times = times.size();
+      unsigned a = find_key(time, cursor);
+      unsigned b = a + 1 < num_times ? a + 1 : a;
+      float t = b != a ? (time - times[a]) / (times[b] - times[a]) : 0;
+      t = std::max(0.0f, std::min(1.0f, t));
+
+      const uint16_t *keys_a = keys.data() + a * num_columns * 4;
+      const uint16_t *keys_b = keys.data() + b * num_columns * 4;
+      const part *p = parts.data();
+      for (unsigned i = 0, n = parts.size(); i != n; ++i, ++p) {
+        if (p->column == constant_part) {
+          pose[i] = p->offset;
+        } else if (p->kind == part_rotation) {
+          pose[i] = nlerp(decode_rotation(keys_a + p->column * 4, *p), decode_rotation(keys_b + p->column * 4, *p), t);
+        } else {
+          vec4 va = decode(keys_a + p->column * 4, *p);
+          vec4 vb = decode(keys_b + p->column * 4, *p);
+          pose[i] = va + (vb - va) * t;
+        }
+      }
+    }
+
+    /// Blend two poses part by part: result = from * (1 - weight) + to * weight.
+    /// "to_parts" maps parts of "to" to parts of "from" (see match_parts) or is NULL if they are the same clip.
+    void blend(const vec4 *from, const int *to_parts, const vec4 *to, float weight, vec4 *result) const {
+      for (unsigned i = 0, n = parts.size(); i != n; ++i) {
+        int j = to_parts ? to_parts[i] : (int)i;
+        if (j < 0) {
+          result[i] = to[i];
+        } else if (parts[i].kind == part_rotation) {
+          result[i] = nlerp(from[j], to[i], weight);
+        } else {
+          result[i] = from[j] + (to[i] - from[j]) * weight;
+        }
+      }
+    }
+
+    /// For each part of this clip, find the same part (same target, sid, sub target and component) of another
+    /// clip, or -1 if it has none. "result" has get_num_parts() entries.
+    void match_parts(const animation_clip *other, resource *target, resource *other_target, int *result) const {
+      for (unsigned i = 0, n = parts.size(); i != n; ++i) {
+        const part &p = parts[i];
+        const channel &c = channels[p.channel];
+        resource *t = target ? target : (resource*)targets[p.channel];
+        result[i] = -1;
+        for (unsigned j = 0, m = other->parts.size(); j != m; ++j) {
+          const part &op = other->parts[j];
+          const channel &oc = other->channels[op.channel];
+          resource *ot = other_target ? other_target : (resource*)other->targets[op.channel];
+          if (
+            op.kind == p.kind && op.index == p.index && oc.sid == c.sid &&
+            oc.sub_target == c.sub_target && oc.component == c.component && ot == t
+          ) {
+            result[i] = (int)j;
+            break;
+          }
+        }
+      }
+    }
+
+    /// Set a pose on the targets (or on one target, if "target" is not null).
+    /// Call this on one thread, as clips may share targets.
+    void apply(const vec4 *pose, resource *target) const {
+      for (unsigned ch = 0; ch != channels.size(); ++ch) {
+        const channel &c = channels[ch];
+        resource *t = target ? target : (resource*)targets[ch];
+        if (!t) continue;
+        const vec4 *p = pose + c.first_part;
+        if (c.is_transform) {
+          mat4t m = compose(p);
+          scene_node *node = t->get_scene_node();
+          if (node) {
+            node->access_nodeToParent() = m;
+          } else {
+            float value[16];
+            for (unsigned i = 0; i != 4; ++i) {
+              for (unsigned j = 0; j != 4; ++j) {
+                value[j*4+i] = m[i][j];
+              }
+            }
+            t->set_value(c.sid, c.sub_target, c.component, value);
+          }
+        } else {
+          // the floats of the parts are in a row.
+          t->set_value(c.sid, c.sub_target, c.component, (float*)p);
+        }
+      }
+    }
+  };
+}}
@@ -15,6 +15,48 @@ namespace octet { namespace scene {
     float time;
     bool is_looping;
     bool is_paused;
+
+    // the compiled animation and the pose from evaluate(), waiting for apply().
+    ref<animation_clip> clip;
+    dynarray<vec4> pose;
+    unsigned cursor;
+
+    // cross fade from another instance.
+    ref<animation_instance> fade_from;
+    dynarray<int> fade_parts;
+    float fade_time;
+    float fade_duration;
+
+    // where this instance is in its visual_scene, so that it can be deleted in O(1).
+    slot_handle scene_handle;
+
+    // get the compiled clip of the animation, which several instances may share.
+    // The constructor calls this so that evaluate() never compiles on a worker thread;
+    // instances loaded from a file get their clip on the first apply().
+    bool load_clip() {
+      if (!clip && anim) {
+        clip = anim->get_clip();
+        pose.resize(clip->get_num_parts());
+        cursor = 0;
+        clip->sample(time, cursor, pose.data());
+      }
+      return clip != 0;
+    }
+
+    void advance(float delta_time) {
+      //log("update %f\n", delta_time);
+      if (!is_paused) {
+        time += delta_time;
+        //log("..update %f\n", time);
+        if (time >= anim->get_end_time()) {
+          if (is_looping) {
+            time -= anim->get_end_time();
+          } else {
+            is_paused = true;
+          }
+        }
+      }
+    }
   public:
     RESOURCE_META(animation_instance)
 
@@ -25,6 +67,11 @@ namespace octet { namespace scene {
       this->time = 0;
       this->is_looping = is_looping;
       this->is_paused = false;
+      this->cursor = 0;
+      this->fade_time = 0;
+      this->fade_duration = 0;
+      this->scene_handle = 0;
+      load_clip();
     }
 
     /// serialize the animation
@@ -36,6 +83,16 @@ namespace octet { namespace scene {
       v.visit(is_paused, atom_is_paused);
     }
 
+    /// Handle of this instance in the visual_scene it was last added to, or 0.
+    slot_handle get_scene_handle() const {
+      return scene_handle;
+    }
+
+    /// Called by visual_scene to remember where it put this instance.
+    void set_scene_handle(slot_handle value) {
+      scene_handle = value;
+    }
+
     /// get the animation
     const animation *get_anim() const {
       return anim;
@@ -46,31 +103,58 @@ namespace octet { namespace scene {
       return time;
     }
 
+    /// get the pose from the last evaluate(): one vec4 for each part of the animation's clip.
+    const vec4 *get_pose() const {
+      return pose.data();
+    }
+
+    /// Blend from another instance to this one over "duration" seconds, eg. from walking to running.
+    /// Parts of the pose that the other animation does not have come from this one alone.
+    /// The other instance keeps playing during the fade, but should not be in the scene.
+    void cross_fade(animation_instance *from, float duration) {
+      fade_from = from;
+      fade_time = 0;
+      fade_duration = duration;
+      if (from && load_clip() && from->load_clip()) {
+        fade_parts.resize(clip->get_num_parts());
+        clip->match_parts(from->clip, target, from->target, fade_parts.data());
+      }
+    }
+
     /// update the animation and the resources it connects to.
     void update(float delta_time) {
-      if (target) {
-        for (int ch = 0; ch != anim->get_num_channels(); ++ch) {
-          anim->eval_chan(ch, time, target);
-        }
-      } else {
-        for (int ch = 0; ch != anim->get_num_channels(); ++ch) {
-          resource *anim_target = anim->get_target(ch);
-          anim->eval_chan(ch, time, anim_target);
-        }
+      evaluate();
+      apply(delta_time);
+    }
+
+    /// Sample every channel at the current time without changing the targets.
+    /// Different animation instances can be evaluated on different threads.
+    void evaluate() {
+      if (!clip) return;
+      clip->sample(time, cursor, pose.data());
+      if (fade_from && fade_from->clip && fade_duration > 0) {
+        fade_from->evaluate();
+        float weight = std::min(1.0f, fade_time / fade_duration);
+        clip->blend(fade_from->pose.data(), fade_parts.data(), pose.data(), weight, pose.data());
       }
+    }
 
-      //log("update %f\n", delta_time);
-      if (!is_paused) {
-        time += delta_time;
-        //log("..update %f\n", time);
-        if (time >= anim->get_end_time()) {
-          if (is_looping) {
-            time -= anim->get_end_time();
-          } else {
-            is_paused = true;
-          }
+    /// Set the pose from the last evaluate() on the targets and advance the time.
+    /// Call this on one thread, as animations may share targets.
+    void apply(float delta_time) {
+      if (!load_clip()) return;
+      clip->apply(pose.data(), target);
+
+      if (fade_from) {
+        fade_from->advance(delta_time);
+        fade_time += delta_time;
+        if (fade_time >= fade_duration) {
+          fade_from = 0;
+          fade_parts.reset();
         }
       }
+
+      advance(delta_time);
     }
   };
 }}
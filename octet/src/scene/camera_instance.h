@@ -36,6 +36,9 @@ namespace octet { namespace scene {
     float xscale;
     float yscale;
 
+    // where this instance is in its visual_scene, so that it can be deleted in O(1).
+    slot_handle scene_handle;
+
   public:
     RESOURCE_META(camera_instance)
 
@@ -55,6 +58,8 @@ namespace octet { namespace scene {
       // ortho camera
       xmag = 1;
       ymag = 1;
+
+      scene_handle = 0;
     }
 
     /// Serialize
@@ -77,6 +82,16 @@ namespace octet { namespace scene {
       v.visit(ymag, atom_ymag);
     }
 
+    /// Handle of this instance in the visual_scene it was last added to, or 0.
+    slot_handle get_scene_handle() const {
+      return scene_handle;
+    }
+
+    /// Called by visual_scene to remember where it put this instance.
+    void set_scene_handle(slot_handle value) {
+      scene_handle = value;
+    }
+
     /// set the parameters as in the collada perspective element
     void set_perspective(float xfov, float yfov, float aspect_ratio, float n, float f)
     {
@@ -144,6 +159,11 @@ namespace octet { namespace scene {
       return cameraToProjection;
     }
 
+    /// Get the view frustum in world space, as set by the last set_cameraToWorld().
+    frustum get_frustum() const {
+      return frustum(worldToCamera * cameraToProjection);
+    }
+
     /// return a ray from screen (x, y) to the far plane; used for picking.
     ray get_ray(float x, float y) {
       vec4 ray_start, ray_end;
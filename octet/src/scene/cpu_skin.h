@@ -0,0 +1,246 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// Skinning on the CPU
+//
+// example:
+//
+//   ref<cpu_skin> cs = new cpu_skin(skinned_mesh);  // on the GL thread: reads the vertices
+//   cs->skin(skin_matrices, num_matrices);          // on any thread
+//   mesh *msh = cs->upload();                       // on the GL thread
+//   mat->render(modelToProjection, modelToCamera, light_uniforms, num_light_uniforms, num_lights);
+//   msh->enable_attributes();
+//   msh->draw();
+//   msh->disable_attributes();
+//
+
+namespace octet { namespace scene {
+  /// Skins a mesh on the CPU, for skeletons with more bones than the skinned shader can take.
+  ///
+  /// The result is an unskinned mesh of positions, normals and uvs that shares the index buffer
+  /// of the original. It is drawn with the mesh instance's own model to camera matrix.
+  class cpu_skin : public resource {
+    // the parts of a vertex that skinning reads, laid out for SIMD loads.
+    struct source_vertex {
+      float pos[4];
+      float normal[4];
+      float weight[4];   // the first weight is 1 minus the others, as in the shader
+      uint32_t index[4];
+    };
+
+    ref<mesh> source;
+    ref<mesh> result_mesh;
+    dynarray<source_vertex> sources;
+    dynarray<mesh::vertex> skinned;
+    unsigned num_joints;
+    bool needs_upload;
+
+    friend class cpu_skin_unit_test;
+
+    // skin one vertex with plain C++. This is the reference for the SSE2 version.
+    static void skin_vertex_scalar(mesh::vertex &dv, const source_vertex &sv, const mat4t *matrices) {
+      mat4t blend =
+        matrices[sv.index[0]] * sv.weight[0] + matrices[sv.index[1]] * sv.weight[1] +
+        matrices[sv.index[2]] * sv.weight[2] + matrices[sv.index[3]] * sv.weight[3];
+      vec4 pos = vec4(sv.pos[0], sv.pos[1], sv.pos[2], 1) * blend;
+      vec4 normal = vec4(sv.normal[0], sv.normal[1], sv.normal[2], 0) * blend;
+      float len2 = dot(normal, normal);
+      if (len2 > 0) normal = normal * (1.0f / sqrtf(len2));
+      dv.pos = pos.xyz();
+      dv.normal = normal.xyz();
+    }
+
+    // skin one vertex: blend four matrices by the weights and transform the position and normal.
+    static void skin_vertex(mesh::vertex &dv, const source_vertex &sv, const mat4t *matrices) {
+      #if OCTET_SSE2
+        const float *m0 = (const float*)&matrices[sv.index[0]];
+        const float *m1 = (const float*)&matrices[sv.index[1]];
+        const float *m2 = (const float*)&matrices[sv.index[2]];
+        const float *m3 = (const float*)&matrices[sv.index[3]];
+        __m128 w = _mm_loadu_ps(sv.weight);
+        __m128 w0 = _mm_shuffle_ps(w, w, 0x00), w1 = _mm_shuffle_ps(w, w, 0x55);
+        __m128 w2 = _mm_shuffle_ps(w, w, 0xaa), w3 = _mm_shuffle_ps(w, w, 0xff);
+
+        // blend the rows of the four matrices.
+        __m128 rows[4];
+        for (unsigned r = 0; r != 4; ++r) {
+          rows[r] = _mm_add_ps(
+            _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(m0 + r*4), w0), _mm_mul_ps(_mm_loadu_ps(m1 + r*4), w1)),
+            _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(m2 + r*4), w2), _mm_mul_ps(_mm_loadu_ps(m3 + r*4), w3))
+          );
+        }
+
+        // row vector times matrix
+        __m128 p = _mm_loadu_ps(sv.pos), n = _mm_loadu_ps(sv.normal);
+        __m128 pos = _mm_add_ps(
+          _mm_add_ps(_mm_mul_ps(_mm_shuffle_ps(p, p, 0x00), rows[0]), _mm_mul_ps(_mm_shuffle_ps(p, p, 0x55), rows[1])),
+          _mm_add_ps(_mm_mul_ps(_mm_shuffle_ps(p, p, 0xaa), rows[2]), rows[3])
+        );
+        __m128 normal = _mm_add_ps(
+          _mm_add_ps(_mm_mul_ps(_mm_shuffle_ps(n, n, 0x00), rows[0]), _mm_mul_ps(_mm_shuffle_ps(n, n, 0x55), rows[1])),
+          _mm_mul_ps(_mm_shuffle_ps(n, n, 0xaa), rows[2])
+        );
+
+        // normalize: w is zero, so a dot product of all four lanes is the length squared.
+        __m128 sq = _mm_mul_ps(normal, normal);
+        sq = _mm_add_ps(sq, _mm_shuffle_ps(sq, sq, 0x4e));
+        sq = _mm_add_ss(sq, _mm_shuffle_ps(sq, sq, 0x11));
+        float len2 = _mm_cvtss_f32(sq);
+        if (len2 > 0) normal = _mm_mul_ps(normal, _mm_set1_ps(1.0f / sqrtf(len2)));
+
+        // vertices are 12 byte aligned: store x, y then z.
+        float *dp = (float*)&dv.pos, *dn = (float*)&dv.normal;
+        _mm_storel_pi((__m64*)dp, pos);
+        _mm_store_ss(dp + 2, _mm_movehl_ps(pos, pos));
+        _mm_storel_pi((__m64*)dn, normal);
+        _mm_store_ss(dn + 2, _mm_movehl_ps(normal, normal));
+      #else
+        skin_vertex_scalar(dv, sv, matrices);
+      #endif
+    }
+
+  public:
+    RESOURCE_META(cpu_skin)
+
+    /// Make an empty skinner.
+    cpu_skin() {
+      num_joints = 0;
+      needs_upload = false;
+    }
+
+    /// Read the vertices of a skinned mesh (with blendweight and blendindices). Call this on the GL thread.
+    cpu_skin(mesh *src) {
+      source = src;
+      num_joints = src->get_skin() ? src->get_skin()->get_num_joints() : 0;
+      needs_upload = false;
+
+      unsigned num_vertices = src->get_num_vertices();
+      sources.resize(num_vertices);
+      skinned.resize(num_vertices);
+
+      unsigned pos_slot = src->get_slot(attribute_pos);
+      unsigned normal_slot = src->get_slot(attribute_normal);
+      unsigned uv_slot = src->get_slot(attribute_uv);
+      unsigned weight_slot = src->get_slot(attribute_blendweight);
+      unsigned index_slot = src->get_slot(attribute_blendindices);
+      unsigned max_index = num_joints ? num_joints - 1 : 0;
+
+      gl_resource::rolock vtx_lock(src->get_vertices());
+      const uint8_t *bytes = vtx_lock.u8();
+      for (unsigned i = 0; i != num_vertices; ++i) {
+        source_vertex &sv = sources[i];
+        vec4 pos = pos_slot != ~0u ? src->get_value(bytes, pos_slot, i) : vec4(0, 0, 0, 1);
+        vec4 normal = normal_slot != ~0u ? src->get_value(bytes, normal_slot, i) : vec4(0, 0, 0, 0);
+        vec4 weight = weight_slot != ~0u ? src->get_value(bytes, weight_slot, i) : vec4(0, 0, 0, 0);
+        vec4 index = index_slot != ~0u ? src->get_value(bytes, index_slot, i) : vec4(0, 0, 0, 0);
+        for (unsigned j = 0; j != 3; ++j) {
+          sv.pos[j] = pos[j];
+          sv.normal[j] = normal[j];
+          sv.weight[j+1] = weight[j];
+        }
+        sv.pos[3] = 1;
+        sv.normal[3] = 0;
+        sv.weight[0] = 1.0f - weight[0] - weight[1] - weight[2];
+        for (unsigned j = 0; j != 4; ++j) {
+          unsigned idx = (unsigned)std::max(index[j], 0.0f);
+          sv.index[j] = std::min(idx, max_index);
+        }
+        vec4 uv = uv_slot != ~0u ? src->get_value(bytes, uv_slot, i) : vec4(0, 0, 0, 0);
+        skinned[i].uv = uv.xy();
+
+        // with no joints, skin() does nothing: draw the vertices as they are.
+        skinned[i].pos = pos.xyz();
+        skinned[i].normal = normal.xyz();
+      }
+      needs_upload = num_vertices != 0;
+
+      result_mesh = new mesh();
+      result_mesh->set_default_attributes();
+      result_mesh->set_params(sizeof(mesh::vertex), src->get_num_indices(), num_vertices, src->get_mode(), src->get_index_type());
+      result_mesh->set_first_index(src->get_first_index());
+      result_mesh->set_indices(src->get_indices());
+      result_mesh->set_aabb(src->get_aabb());
+    }
+
+    /// The mesh this was made from.
+    mesh *get_source() const {
+      return source;
+    }
+
+    /// Number of matrices skin() needs.
+    unsigned get_num_joints() const {
+      return num_joints;
+    }
+
+    /// Skin the vertices with the skin matrices of the mesh's joints (skin model space to mesh instance space).
+    /// This does not call OpenGL, so different meshes can be skinned on different threads.
+    /// If the mesh has no skin, the vertices stay as they were in the source mesh.
+    void skin(const mat4t *matrices, unsigned num_matrices) {
+      assert(num_matrices >= num_joints);
+      unsigned num_vertices = sources.size();
+      if (!num_joints) return;
+      for (unsigned i = 0; i != num_vertices; ++i) {
+        const source_vertex &sv = sources[i];
+        mesh::vertex &dv = skinned[i];
+        skin_vertex(dv, sv, matrices);
+      }
+      needs_upload = true;
+    }
+
+    /// Send the skinned vertices to the GL (if they have changed) and return the mesh to draw.
+    mesh *upload() {
+      if (needs_upload) {
+        gl_resource *vertices = result_mesh->get_vertices();
+        vertices->stream(GL_ARRAY_BUFFER, skinned.data(), skinned.size() * sizeof(mesh::vertex));
+        needs_upload = false;
+      }
+      return result_mesh;
+    }
+
+    /// Get a skinned vertex, after skin().
+    const mesh::vertex &get_vertex(unsigned index) const {
+      return skinned[index];
+    }
+  };
+
+  #if OCTET_UNIT_TEST
+    class cpu_skin_unit_test {
+    public:
+      cpu_skin_unit_test() {
+        // the SIMD skinning must match the plain C++ version.
+        random rand(0x1234);
+        mat4t matrices[4];
+        for (unsigned m = 0; m != 4; ++m) {
+          matrices[m].loadIdentity();
+          matrices[m].rotate(rand.get(-180.0f, 180.0f), rand.get(-1.0f, 1.0f), rand.get(-1.0f, 1.0f), 1.0f);
+          matrices[m].translate(rand.get(-10.0f, 10.0f), rand.get(-10.0f, 10.0f), rand.get(-10.0f, 10.0f));
+        }
+
+        float max_error = 0;
+        for (unsigned i = 0; i != 1000; ++i) {
+          cpu_skin::source_vertex sv;
+          float sum = 0;
+          for (unsigned j = 0; j != 4; ++j) {
+            sv.pos[j] = j == 3 ? 1.0f : rand.get(-5.0f, 5.0f);
+            sv.normal[j] = j == 3 ? 0.0f : rand.get(-1.0f, 1.0f);
+            sv.index[j] = (i + j) & 3;
+            sv.weight[j] = j == 0 ? 0.0f : rand.get(0.0f, 0.3f);
+            sum += sv.weight[j];
+          }
+          sv.weight[0] = 1.0f - sum;
+
+          mesh::vertex simd, scalar;
+          cpu_skin::skin_vertex(simd, sv, matrices);
+          cpu_skin::skin_vertex_scalar(scalar, sv, matrices);
+          max_error = std::max(max_error, length(vec3(simd.pos) - vec3(scalar.pos)));
+          max_error = std::max(max_error, length(vec3(simd.normal) - vec3(scalar.normal)));
+        }
+        assert(max_error < 1e-4f);
+      }
+    };
+    static cpu_skin_unit_test cpu_skin_unit_test;
+  #endif
+}}
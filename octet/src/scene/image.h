@@ -37,7 +37,13 @@ namespace octet { namespace scene {
 
     GLuint gl_target;
 
+    // true if we made gl_texture and must delete it
+    bool owns_texture;
+
     void init(const char *name) {
+      // textures must be deleted on the GL thread.
+      set_destroy_on_main_thread();
+      owns_texture = false;
       bool is_cubemap = strstr(name, "%s") != 0;
       this->url = name;
       width = height = 0;
@@ -264,6 +270,8 @@ namespace octet { namespace scene {
 
     /// generate an image from an opengl texture
     image(GLuint _target, GLuint _texture, unsigned _width, unsigned _height, unsigned _depth=1) {
+      set_destroy_on_main_thread();
+      owns_texture = false;
       gl_target = _target;
       gl_texture = _texture;
       width = _width;
@@ -273,6 +281,9 @@ namespace octet { namespace scene {
 
     /// release resources.
     ~image() {
+      if (owns_texture && gl_texture) {
+        glDeleteTextures(1, &gl_texture);
+      }
     }
 
     /// width in pixels
@@ -373,6 +384,7 @@ namespace octet { namespace scene {
 
         // make a new texture handle
         glGenTextures(1, &gl_texture);
+        owns_texture = true;
         glActiveTexture(GL_TEXTURE0);
 
         // todo: handle compressed textures
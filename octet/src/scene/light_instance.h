@@ -12,16 +12,21 @@ namespace octet { namespace scene {
   class light_instance : public resource {
     ref<scene_node> node;
     ref<light> light_;
+
+    // where this instance is in its visual_scene, so that it can be deleted in O(1).
+    slot_handle scene_handle;
   public:
     RESOURCE_META(light_instance)
 
     /// Construct a default light instance
     light_instance() {
+      scene_handle = 0;
     }
 
     light_instance(scene_node *_node, light *_light) {
       node = _node;
       light_ = _light;
+      scene_handle = 0;
     }
 
     /// Serialize.
@@ -30,6 +35,16 @@ namespace octet { namespace scene {
       v.visit(light_, atom_light);
     }
 
+    /// Handle of this instance in the visual_scene it was last added to, or 0.
+    slot_handle get_scene_handle() const {
+      return scene_handle;
+    }
+
+    /// Called by visual_scene to remember where it put this instance.
+    void set_scene_handle(slot_handle value) {
+      scene_handle = value;
+    }
+
     /// Set the transform node
     void set_node(scene_node *node) {
       this->node = node;
@@ -24,6 +24,208 @@ namespace octet { namespace scene {
     //dynarray<uint8_t> static_buffer;
     dynarray<uint8_t> buffer;
 
+    // bit n is set if the params are bound to version n of the shader's program (see shader::get_program_version()).
+    unsigned instanced_modes;
+
+    // one glUniform* call for a uniform that only changes when the material changes.
+    struct uniform_upload {
+      GLint location;
+      uint16_t type;
+      uint16_t repeat;
+      uint16_t offset;
+    };
+
+    // a uniform copied from the buffer to the material's std140 uniform block.
+    struct block_copy {
+      uint16_t src_offset;
+      uint16_t dest_offset;
+      uint16_t size;
+    };
+
+    // the uniforms of one version of the shader's program, found once so that
+    // rendering does not search the params or switch on their types.
+    struct uniform_program {
+      GLuint program;           // the program these locations are in; zero to find them again.
+      GLint modelToProjection;
+      GLint modelToCamera;
+      GLint packed_pos_scale;               // decoding of mesh::pack_vertices() positions
+      GLint packed_pos_offset;
+      uniform_upload lighting;
+      uniform_upload num_lights;
+      dynarray<uniform_upload> constants;   // colours, sampler slots and custom uniforms
+      dynarray<param_sampler *> samplers;   // textures to bind for each use of the material
+      GLuint block_index;                   // "material_uniforms" block, or GL_INVALID_INDEX
+      dynarray<block_copy> block_copies;
+    };
+
+    enum {
+      // uniform block binding point for material_uniforms.
+      material_block_binding = 0,
+    };
+
+    uniform_program programs[shader::num_program_versions];
+
+    // the version of the program used by the last begin_render().
+    unsigned current_version;
+
+    // changes when the constant uniforms change; see param_shader::set_uniforms_version.
+    unsigned version;
+
+    // the material_uniforms block, if the shader has one, and the version in it.
+    ref<gl_resource> uniform_block;
+    unsigned block_version;
+
+    // a new version number, unique among all materials.
+    static unsigned next_version() {
+      static unsigned counter;
+      return ++counter;
+    }
+
+    static uniform_upload make_upload(param_uniform *pu, unsigned mode) {
+      uniform_upload result = { pu ? pu->get_uniform(mode) : -1, pu ? pu->get_gl_type() : (uint16_t)0, pu ? (uint16_t)pu->get_repeat() : (uint16_t)0, pu ? (uint16_t)pu->get_offset() : (uint16_t)0 };
+      return result;
+    }
+
+    // find the locations of the params in a version of the shader's program.
+    void compile_uniforms(uniform_program &up, unsigned mode, GLuint program) {
+      up.program = program;
+      up.packed_pos_scale = glGetUniformLocation(program, "packed_pos_scale");
+      up.packed_pos_offset = glGetUniformLocation(program, "packed_pos_offset");
+      param_uniform *mtp = get_param_uniform(atom_modelToProjection);
+      param_uniform *mtc = get_param_uniform(atom_modelToCamera);
+      param_uniform *lighting = get_param_uniform(atom_lighting);
+      param_uniform *num_lights = get_param_uniform(atom_num_lights);
+      up.modelToProjection = mtp ? mtp->get_uniform(mode) : -1;
+      up.modelToCamera = mtc ? mtc->get_uniform(mode) : -1;
+      up.lighting = make_upload(lighting, mode);
+      up.num_lights = make_upload(num_lights, mode);
+
+      up.constants.resize(0);
+      up.samplers.resize(0);
+      for (unsigned i = 0; i != params.size(); ++i) {
+        param_uniform *pu = params[i]->get_param_uniform();
+        if (!pu) continue;
+        if (param_sampler *ps = params[i]->get_param_sampler()) {
+          up.samplers.push_back(ps);
+        }
+        if (pu != mtp && pu != mtc && pu != lighting && pu != num_lights && pu->get_uniform(mode) != -1) {
+          up.constants.push_back(make_upload(pu, mode));
+        }
+      }
+
+      // on OpenGL ES3, a shader can put its material uniforms in a block:
+      //   layout(std140) uniform material_uniforms { vec4 diffuse; ... };
+      // which is set from a buffer once instead of a glUniform call per uniform.
+      #ifndef OCTET_GLES2
+        up.block_index = GL_INVALID_INDEX;
+        up.block_copies.resize(0);
+        GLuint block_index = glGetUniformBlockIndex(program, "material_uniforms");
+        if (block_index == GL_INVALID_INDEX) return;
+
+        GLint block_size = 0;
+        glGetActiveUniformBlockiv(program, block_index, GL_UNIFORM_BLOCK_DATA_SIZE, &block_size);
+        for (unsigned i = 0; i != params.size(); ++i) {
+          param_uniform *pu = params[i]->get_param_uniform();
+          if (!pu || pu->get_uniform(mode) != -1) continue;
+          const char *name = pu->get_atom_name();
+          GLuint index = GL_INVALID_INDEX;
+          glGetUniformIndices(program, 1, &name, &index);
+          if (index == GL_INVALID_INDEX) continue;
+          GLint offset = 0;
+          glGetActiveUniformsiv(program, 1, &index, GL_UNIFORM_OFFSET, &offset);
+          // arrays and matrices have a 16 byte stride in std140, as in our buffer.
+          unsigned size = pu->get_size();
+          if (pu->get_repeat() == 1) {
+            switch (pu->get_gl_type()) {
+              case GL_FLOAT_VEC2: case GL_INT_VEC2: case GL_BOOL_VEC2: size = 8; break;
+              case GL_FLOAT_VEC3: case GL_INT_VEC3: case GL_BOOL_VEC3: size = 12; break;
+              case GL_FLOAT_VEC4: case GL_INT_VEC4: case GL_BOOL_VEC4: size = 16; break;
+              case GL_FLOAT_MAT2: case GL_FLOAT_MAT3: case GL_FLOAT_MAT4: break;
+              default: size = 4; break;
+            }
+          }
+          if (offset < 0 || offset + size > (unsigned)block_size) continue;
+          block_copy copy = { (uint16_t)pu->get_offset(), (uint16_t)offset, (uint16_t)size };
+          up.block_copies.push_back(copy);
+        }
+
+        up.block_index = block_index;
+        glUniformBlockBinding(program, block_index, material_block_binding);
+        if (!uniform_block || uniform_block->get_size() != (unsigned)block_size) {
+          uniform_block = new gl_resource(GL_UNIFORM_BUFFER, block_size);
+        }
+        block_version = 0;
+      #endif
+    }
+
+    // the uniform locations for a mode and vertex format, found again if the program has changed.
+    uniform_program &get_uniform_program(shader::instancing_mode mode, shader::vertex_format format) {
+      unsigned pv = shader::get_program_version(mode, format);
+      if (pv != 0 && !(instanced_modes & (1 << pv))) {
+        custom_shader->init_instanced(params, mode, format);
+        instanced_modes |= 1 << pv;
+      }
+      uniform_program &up = programs[pv];
+      GLuint program = custom_shader->get_instanced_program(mode, format);
+      if (up.program != program) {
+        compile_uniforms(up, pv, program);
+      }
+      current_version = pv;
+      return up;
+    }
+
+    // set the uniforms and textures that do not change from mesh to mesh.
+    void render_constants(shader::instancing_mode mode, shader::vertex_format format, vec4 *light_uniforms, int num_light_uniforms, int num_lights) {
+      uniform_program &up = get_uniform_program(mode, format);
+
+      // lighting goes in the dynamic uniform buffer
+      if (up.lighting.location != -1) {
+        memcpy(buffer.data() + up.lighting.offset, light_uniforms, sizeof(vec4) * num_light_uniforms);
+        glUniform4fv(up.lighting.location, up.lighting.repeat, (float*)(buffer.data() + up.lighting.offset));
+      }
+      if (up.num_lights.location != -1) {
+        glUniform1i(up.num_lights.location, num_lights);
+      }
+
+      // colours and other constants stay in the program until another material with the same shader sets them.
+      if (custom_shader->get_uniforms_version(mode, format) != version) {
+        for (unsigned i = 0; i != up.constants.size(); ++i) {
+          const uniform_upload &u = up.constants[i];
+          param_uniform::upload(u.location, u.type, u.repeat, buffer.data() + u.offset);
+        }
+        custom_shader->set_uniforms_version(mode, version, format);
+      }
+
+      for (unsigned i = 0; i != up.samplers.size(); ++i) {
+        up.samplers[i]->bind_texture();
+      }
+
+      #ifndef OCTET_GLES2
+        if (up.block_index != GL_INVALID_INDEX) {
+          if (block_version != version) {
+            gl_resource::wolock lock(uniform_block);
+            for (unsigned i = 0; i != up.block_copies.size(); ++i) {
+              const block_copy &c = up.block_copies[i];
+              memcpy(lock.u8() + c.dest_offset, buffer.data() + c.src_offset, c.size);
+            }
+            block_version = version;
+          }
+          glBindBufferBase(GL_UNIFORM_BUFFER, material_block_binding, uniform_block->get_buffer());
+        }
+      #endif
+    }
+
+    // forget the uniform locations; used when params are added.
+    void init_uniforms() {
+      instanced_modes = 0;
+      for (unsigned i = 0; i != shader::num_program_versions; ++i) {
+        programs[i].program = 0;
+      }
+      current_version = shader::instancing_none;
+      version = next_version();
+      block_version = 0;
+    }
+
     // create the parameters that change frequently such as the matrices and lighting
     void create_dynamic_params() {
       buffer.reserve(0x200);
@@ -53,10 +255,12 @@ namespace octet { namespace scene {
 
     /// Default constructor makes a blank material.
     material() {
+      init_uniforms();
     }
 
     /// Alternative constructor.
     material(const vec4 &color, param_shader *shader = NULL) {
+      init_uniforms();
       // materials are constructed from parameters which build the final shader.
       // this allows us to use OpenGLES2 (uniforms) and 3 (buffers) as well as new shader features.
       params.reserve(16);
@@ -76,6 +280,7 @@ namespace octet { namespace scene {
 
     /// create a material from an existing image
     material(image *img, sampler *smpl = NULL, param_shader *shader = NULL) {
+      init_uniforms();
       if (!smpl) smpl = new sampler();
 
       params.reserve(16);
@@ -94,6 +299,7 @@ namespace octet { namespace scene {
     }
 
     material(param *diffuse, param *ambient, param *emission, param *specular, param *bump, param *shininess) {
+      init_uniforms();
     }
 
     /// Serialize.
@@ -102,38 +308,67 @@ namespace octet { namespace scene {
 
     /// Set the uniforms for this material.
     void render(const mat4t &modelToProjection, const mat4t &modelToCamera, vec4 *light_uniforms, int num_light_uniforms, int num_lights) {
-      /*char tmp[256];
-      log("lu[0] = %s\n", light_uniforms[0].toString(tmp, sizeof(tmp)));
-      log("lu[1] = %s\n", light_uniforms[1].toString(tmp, sizeof(tmp)));
-      log("lu[2] = %s\n", light_uniforms[2].toString(tmp, sizeof(tmp)));
-      log("lu[3] = %s\n", light_uniforms[3].toString(tmp, sizeof(tmp)));*/
-      {
-        // matrices and lighting go in the dynamic uniform buffer
-        param_uniform *modelToProjection_param = get_param_uniform(atom_modelToProjection);
-        if (modelToProjection_param) modelToProjection_param->set_value(buffer.data(), modelToProjection.get(), sizeof(modelToProjection));
+      begin_render(light_uniforms, num_light_uniforms, num_lights);
+      render_matrices(modelToProjection, modelToCamera);
+    }
 
-        param_uniform *modelToCamera_param = get_param_uniform(atom_modelToCamera);
-        if (modelToCamera_param) modelToCamera_param->set_value(buffer.data(), modelToCamera.get(), sizeof(modelToCamera));
+    /// Use the shader and set the uniforms that are the same for every mesh drawn
+    /// with this material: lighting, colours and textures.
+    /// Then call render_matrices() for each mesh.
+    /// If the last material used the same shader, set use_program to false to skip glUseProgram.
+    /// Meshes with packed vertices (see mesh::get_vertex_format()) need the vertex_packed version.
+    void begin_render(vec4 *light_uniforms, int num_light_uniforms, int num_lights, bool use_program = true, shader::vertex_format format = shader::vertex_float) {
+      if (format == shader::vertex_float) {
+        if (use_program) {
+          custom_shader->render();
+        }
+      } else {
+        // make the packed program before we use it.
+        get_uniform_program(shader::instancing_none, format);
+        if (use_program) {
+          glUseProgram(custom_shader->get_instanced_program(shader::instancing_none, format));
+        }
+      }
 
-        param_uniform *lighting_param = get_param_uniform(atom_lighting);
-        if (lighting_param) lighting_param->set_value(buffer.data(), light_uniforms, sizeof(vec4) * num_light_uniforms);
+      render_constants(shader::instancing_none, format, light_uniforms, num_light_uniforms, num_lights);
+    }
 
-        param_uniform *num_lights_param = get_param_uniform(atom_num_lights);
-        if (num_lights_param) num_lights_param->set_value(buffer.data(), &num_lights, sizeof(int32_t));
-      }
+    /// Use the instanced version of the shader and set the uniforms for a group of
+    /// instances of a mesh. modelToCamera comes from the instances (see param_shader::init_instanced).
+    void begin_render_instanced(shader::instancing_mode mode, const mat4t &cameraToProjection, vec4 *light_uniforms, int num_light_uniforms, int num_lights, bool use_program = true, shader::vertex_format format = shader::vertex_float) {
+      // make the instanced program before we use it.
+      get_uniform_program(mode, format);
+      custom_shader->render_instanced(mode, cameraToProjection, use_program, format);
+      render_constants(mode, format, light_uniforms, num_light_uniforms, num_lights);
+    }
 
-      custom_shader->render();
+    /// Set the matrices for one mesh after begin_render().
+    void render_matrices(const mat4t &modelToProjection, const mat4t &modelToCamera) {
+      // the locations were found by begin_render()
+      const uniform_program &up = programs[current_version];
+      if (up.modelToProjection != -1) {
+        glUniformMatrix4fv(up.modelToProjection, 1, GL_FALSE, modelToProjection.get());
+      }
+      if (up.modelToCamera != -1) {
+        glUniformMatrix4fv(up.modelToCamera, 1, GL_FALSE, modelToCamera.get());
+      }
+    }
 
-      {
-        // colours and textures go in the static uniform buffer
-        for (unsigned i = 0; i != params.size(); ++i) {
-          param_uniform *pu = params[i]->get_param_uniform();
-          if (pu) {
-            //printf("%s: %d off=%x\n", app_utils::get_atom_name(pu->get_name()), pu->get_uniform_buffer_index(), pu->get_offset());
-            pu->render(buffer.data());
-          }
-        }
+    /// Set the range of the positions of a mesh with packed vertices after begin_render()
+    /// or begin_render_instanced(). See mesh::get_pos_scale() and mesh::get_pos_offset().
+    void render_vertex_decode(const vec4 &pos_scale, const vec4 &pos_offset) {
+      const uniform_program &up = programs[current_version];
+      if (up.packed_pos_scale != -1) {
+        glUniform4fv(up.packed_pos_scale, 1, pos_scale.get());
       }
+      if (up.packed_pos_offset != -1) {
+        glUniform4fv(up.packed_pos_offset, 1, pos_offset.get());
+      }
+    }
+
+    /// The shader used by this material.
+    param_shader *get_shader() const {
+      return custom_shader;
     }
 
     /// Set the uniforms for this material on skinned meshes.
@@ -162,11 +397,15 @@ namespace octet { namespace scene {
     void set_diffuse(const vec4 &color) {
       if (param *p = get_param_uniform(atom_diffuse)) {
         p->get_param_uniform()->set_value(buffer.data(), &color, sizeof(color));
+        version = next_version();
       }
     }
 
     void set_uniform(param_uniform *param, const void *data, size_t size) {
-      memcpy(buffer.data() + param->get_offset(), data, size);
+      if (memcmp(buffer.data() + param->get_offset(), data, size)) {
+        memcpy(buffer.data() + param->get_offset(), data, size);
+        version = next_version();
+      }
     }
 
     dynarray<ref<param> > &get_params() {
@@ -177,6 +416,7 @@ namespace octet { namespace scene {
       param_buffer_info pbi(buffer);
       param_uniform *result = new param_uniform(pbi, data, name, _type, _repeat, _stage);
       params.push_back(result);
+      init_uniforms();
 
       param_bind_info pbind;
       pbind.program = custom_shader->get_program();
@@ -189,6 +429,7 @@ namespace octet { namespace scene {
       pbi.texture_slot = texture_slot;
       param_sampler *result = new param_sampler(pbi, name, _image, _sampler, _stage);
       params.push_back(result);
+      init_uniforms();
 
       param_bind_info pbind;
       pbind.program = custom_shader->get_program();
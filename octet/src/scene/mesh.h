@@ -38,7 +38,8 @@ namespace octet { namespace scene {
     ref<gl_resource> indices;
 
     // attribute formats
-    enum { max_slots = 16 };
+    // offset << 9 | attr << 5 | (size-1) << 3 | kind, with the encoding in bits 15-16.
+    enum { max_slots = 16, kind_half_float = 7 };
     uint32_t format[max_slots];
 
     uint32_t num_indices;
@@ -51,98 +52,30 @@ namespace octet { namespace scene {
 
     uint8_t num_slots;
 
+    // range of encoding_pos_range slots: pos = lanes * pos_scale + pos_offset.
+    vec4 pos_scale;
+    vec4 pos_offset;
+
     // optional skin
     ref<skin> mesh_skin;
     
     // bounding box
     aabb mesh_aabb;
 
-    struct general_vertex {
-      const uint8_t *bytes;
-      unsigned size;
-
-      bool is_empty() const { return bytes == 0; }
-
-      bool operator ==(const general_vertex &rhs) const {
-        //printf("%p %p %d\n", this, &rhs, size == rhs.size && memcmp(bytes, rhs.bytes, size) == 0);
-        return size == rhs.size && memcmp(bytes, rhs.bytes, size) == 0;
-      }
-
-      unsigned get_hash() const {
-        unsigned hash = 0;
-        for (unsigned i = 0; i != size; ++i) {
-          hash = ( hash * 7 ) + ( hash >> 13 ) + bytes[i];
-          //printf("%02x ", bytes[i]);
-        }
-        //printf("%d hash=%08x\n", size, hash_map_cmp::fuzz_hash(hash));
-        return hash;
-      }
-    };
+    // triangles for ray_cast() and what they were made from.
+    ref<mesh_bvh> bvh;
+    uint32_t bvh_source[7];
 
-    class vertex_cmp : public hash_map_cmp {
-    public:
-      static unsigned get_hash(const general_vertex &key) { return fuzz_hash(key.get_hash()); }
-      static bool is_empty(const general_vertex &key) { return key.is_empty(); }
-    };
+    // edges and triangle planes for silhouettes, and what they were made from.
+    ref<mesh_adjacency> adjacency;
+    uint32_t adjacency_source[4];
+    uint32_t planes_source[4];
 
-    // add a new edge to a hash map. (index, index) -> (triangle+1, triangle+1)
-    static void add_edge(dynarray<edge> &edges, unsigned tri_idx, unsigned i0, unsigned i1) {
-      edge e = { std::min(i0, i1), std::max(i0, i1), tri_idx, ~0 };
-      edges.push_back(e);
-    }
-
-    // return true if the triangle tri is visible from the viewpoint (in model space)
-    // the exact definition of "is visible" depends on winding order.
-    static bool tri_is_visible(
-      unsigned tri, unsigned pos_offset, unsigned stride,
-      const uint32_t *ip, const uint8_t *vp, const vec3 &viewpoint,
-      bool is_directional
-    ) {
-      const vec3p &pa = *(const vec3p*)(vp + ip[tri+0] * stride + pos_offset);
-      const vec3p &pb = *(const vec3p*)(vp + ip[tri+1] * stride + pos_offset);
-      const vec3p &pc = *(const vec3p*)(vp + ip[tri+2] * stride + pos_offset);
-      vec3 normal = cross(((vec3)pb - pa), ((vec3)pc - pa));
-      vec3 dir = is_directional ? viewpoint - pa : viewpoint;
-      return dot(normal, dir) <= 0;
-    }
-
-    /// Get a vec4 value of an attribute.
-    vec4 get_value(const uint8_t *bytes, unsigned slot, unsigned index) const {
-      unsigned size = get_size(slot);
-      vec4 result = vec4(0, 0, 0, 0);
-      bytes += stride * index + get_offset(slot);
-    
-      switch (get_kind(slot)) {
-        case GL_FLOAT: {
-          const float *src = (const float*)(bytes);
-          result = vec4(src[0], size > 1 ? src[1] : 0, size > 2 ? src[2] : 0, size > 3 ? src[3] : 1);
-     	  } break;
-        case GL_BYTE: {
-          const int8_t *src = (const int8_t*)(bytes);
-          result = vec4((float)src[0], size > 1 ? (float)src[1] : 0, size > 2 ? (float)src[2] : 0, size > 3 ? (float)src[3] : 255) * (1.0f/255);
-     	  } break;
-        case GL_UNSIGNED_BYTE: {
-          const uint8_t *src = (const uint8_t*)(bytes);
-          result = vec4((float)src[0], size > 1 ? (float)src[1] : 0, size > 2 ? (float)src[2] : 0, size > 3 ? (float)src[3] : 255) * (1.0f/255);
-     	  } break;
-        case GL_SHORT: {
-          const int16_t *src = (const int16_t*)(bytes);
-          result = vec4((float)src[0], size > 1 ? (float)src[1] : 0, size > 2 ? (float)src[2] : 0, size > 3 ? (float)src[3] : 0xffff) * (1.0f/0xffff);
-     	  } break;
-        case GL_UNSIGNED_SHORT: {
-          const uint16_t *src = (const uint16_t*)(bytes);
-          result = vec4((float)src[0], size > 1 ? (float)src[1] : 0, size > 2 ? (float)src[2] : 0, size > 3 ? (float)src[3] : 0xffff) * (1.0f/0xffff);
-     	  } break;
-        case GL_INT: {
-          const int32_t *src = (const int32_t*)(bytes);
-          result = vec4((float)src[0], size > 1 ? (float)src[1] : 0, size > 2 ? (float)src[2] : 0, size > 3 ? (float)src[3] : 0xffff) * (1.0f/0xffff);
-     	  } break;
-        case GL_UNSIGNED_INT: {
-          const uint32_t *src = (const uint32_t*)(bytes);
-          result = vec4((float)src[0], size > 1 ? (float)src[1] : 0, size > 2 ? (float)src[2] : 0, size > 3 ? (float)src[3] : 0xffff) * (1.0f/0xffff);
-     	  } break;
+    // copy the lanes of an attribute to floats.
+    template <class lane_t> static void read_lanes(float *lanes, const lane_t *src, unsigned size) {
+      for (unsigned i = 0; i != size; ++i) {
+        lanes[i] = (float)src[i];
       }
-      return result;
     }
 
   public:
@@ -176,6 +109,9 @@ namespace octet { namespace scene {
       index_type = rhs.index_type;
       mode = rhs.mode;
 
+      pos_scale = rhs.pos_scale;
+      pos_offset = rhs.pos_offset;
+
       mesh_skin = rhs.mesh_skin;
     }
 
@@ -198,6 +134,9 @@ namespace octet { namespace scene {
       index_type = GL_UNSIGNED_SHORT;
       mode = GL_TRIANGLES;
 
+      pos_scale = vec4(1, 1, 1, 1);
+      pos_offset = vec4(0, 0, 0, 0);
+
       mesh_skin = _skin;
 
       if (max_vertices || max_indices) {
@@ -221,6 +160,8 @@ namespace octet { namespace scene {
       v.visit(num_slots, atom_num_slots);
       v.visit(mesh_skin, atom_mesh_skin);
       v.visit(mesh_aabb, atom_aabb);
+      v.visit(pos_scale, atom_pos_scale);
+      v.visit(pos_offset, atom_pos_offset);
     }
 
     // Destructor
@@ -240,10 +181,18 @@ namespace octet { namespace scene {
       num_slots = 0;
     }
 
+    /// How the lanes of an attribute are decoded after they are read. See pack_vertices().
+    enum slot_encoding {
+      encoding_none,
+      encoding_pos_range,     // scaled by get_pos_scale() and offset by get_pos_offset()
+      encoding_octahedral,    // a unit vector in two octahedral lanes
+    };
+
     /// Add an extra attribute to the mesh. eg. add_attribute(attribute_pos, 3, GL_FLOAT, 0)
-    unsigned add_attribute(unsigned attr, unsigned size, unsigned kind, unsigned offset, unsigned norm=0) {
+    unsigned add_attribute(unsigned attr, unsigned size, unsigned kind, unsigned offset, unsigned norm=0, unsigned encoding=encoding_none) {
       assert(num_slots < max_slots);
-      format[num_slots] = (offset << 9) + (attr << 5) + ((size-1) << 3) + (kind - GL_BYTE);
+      unsigned kind_bits = kind == GL_HALF_FLOAT ? kind_half_float : kind - GL_BYTE;
+      format[num_slots] = (encoding << 15) + (offset << 9) + (attr << 5) + ((size-1) << 3) + kind_bits;
       if (norm) normalized |= 1 << num_slots;
       return num_slots++;
     }
@@ -251,6 +200,7 @@ namespace octet { namespace scene {
     /// helper function: how many bytes does this GL_? type use?
     static unsigned kind_size(unsigned kind) {
       static const uint8_t bytes[] = { 1, 1, 2, 2, 4, 4, 4, 4 };
+      if (kind == GL_HALF_FLOAT) return 2;
       return kind < GL_BYTE || kind > GL_FLOAT ? 0 : bytes[kind - GL_BYTE];
     }
 
@@ -271,7 +221,18 @@ namespace octet { namespace scene {
 
     /// For a particular slot, get the GL kind of the attribute (eg. GL_FLOAT)
     unsigned get_kind(unsigned slot) const {
-      return ( ( format[slot] >> 0 ) & 0x07 ) + GL_BYTE;
+      unsigned kind_bits = ( format[slot] >> 0 ) & 0x07;
+      return kind_bits == kind_half_float ? GL_HALF_FLOAT : kind_bits + GL_BYTE;
+    }
+
+    /// For a particular slot, is the attribute normalised when it is read?
+    bool get_normalized(unsigned slot) const {
+      return ( normalized >> slot ) & 1;
+    }
+
+    /// For a particular slot, get the slot_encoding of the attribute.
+    unsigned get_encoding(unsigned slot) const {
+      return ( format[slot] >> 15 ) & 0x03;
     }
 
     /// Get the stride of attributes in this mesh.
@@ -362,6 +323,27 @@ namespace octet { namespace scene {
       return mesh_aabb;
     }
 
+    /// get the scale of packed positions: pos = lanes * get_pos_scale() + get_pos_offset(). See pack_vertices().
+    const vec4 &get_pos_scale() const {
+      return pos_scale;
+    }
+
+    /// get the offset of packed positions, the smallest position in the mesh. See pack_vertices().
+    const vec4 &get_pos_offset() const {
+      return pos_offset;
+    }
+
+    /// Which version of a shader draws this mesh: vertex_packed if pack_vertices() has encoded
+    /// the positions. Use with material::begin_render() and material::render_vertex_decode().
+    shader::vertex_format get_vertex_format() const {
+      for (unsigned i = 0; i != num_slots; ++i) {
+        if (get_encoding(i) != encoding_none) {
+          return shader::vertex_packed;
+        }
+      }
+      return shader::vertex_float;
+    }
+
     /// return true if this mesh has a particular attribute. eg. attribute_pos
     bool has_attribute(unsigned attr) {
       for (unsigned i = 0; i != num_slots; ++i) {
@@ -379,21 +361,34 @@ namespace octet { namespace scene {
       }
 
       /// Get a bullet shape object for this mesh for static use only!
+      /// The positions are decoded with get_value(), so this works after pack_vertices().
       virtual btCollisionShape *get_static_bullet_shape() {
         // note that it is your responsibility to deallocate resources!
+        unsigned num_indices = get_num_indices();
+        unsigned num_vertices = get_num_vertices();
         btIndexedMesh mesh;
-        mesh.m_numTriangles = get_num_indices() / 3;
-        mesh.m_triangleIndexBase = (const unsigned char *)malloc(get_indices()->get_size());
-        mesh.m_triangleIndexStride = sizeof(uint32_t) * 3;
-        mesh.m_numVertices = get_num_vertices();
-        mesh.m_vertexBase = (const unsigned char *)malloc(get_vertices()->get_size());
-        mesh.m_vertexStride = get_stride();
-
-        {
+        mesh.m_numTriangles = num_indices / 3;
+        mesh.m_triangleIndexBase = (const unsigned char *)malloc(num_indices * sizeof(uint32_t));
+        mesh.m_triangleIndexStride = sizeof(uint32_t) * 3;
+        mesh.m_numVertices = num_vertices;
+        mesh.m_vertexBase = (const unsigned char *)malloc(num_vertices * sizeof(float) * 3);
+        mesh.m_vertexStride = sizeof(float) * 3;
+
+        {
           gl_resource::rolock idx_lock(get_indices());
           gl_resource::rolock vtx_lock(get_vertices());
-          memcpy((void*)mesh.m_triangleIndexBase, idx_lock.u8() + get_index_size() * first_index, get_indices()->get_size());
-          memcpy((void*)mesh.m_vertexBase, vtx_lock.u8(), get_vertices()->get_size());
+          uint32_t *indices = (uint32_t *)mesh.m_triangleIndexBase;
+          for (unsigned i = 0; i != num_indices; ++i) {
+            indices[i] = get_index(idx_lock.u8(), i);
+          }
+          float *positions = (float *)mesh.m_vertexBase;
+          unsigned pos_slot = get_slot(attribute_pos);
+          for (unsigned i = 0; i != num_vertices; ++i) {
+            vec4 pos = get_value(vtx_lock.u8(), pos_slot, i);
+            positions[i*3+0] = pos[0];
+            positions[i*3+1] = pos[1];
+            positions[i*3+2] = pos[2];
+          }
         }
 
         btTriangleIndexVertexArray *trimesh = new btTriangleIndexVertexArray();
@@ -427,6 +422,48 @@ namespace octet { namespace scene {
       return result;
     }
 
+    /// Get a vec4 value of an attribute, as the vertex shader would see it.
+    /// Normalised lanes are divided by their largest value, missing lanes are (0, 0, 0, 1)
+    /// and packed positions and directions are decoded (see pack_vertices()).
+    vec4 get_value(const uint8_t *bytes, unsigned slot, unsigned index) const {
+      unsigned size = get_size(slot);
+      bytes += stride * index + get_offset(slot);
+
+      float lanes[4] = { 0, 0, 0, 1 };
+      float max_lane = 0;   // divide normalised lanes by this
+      bool is_signed = false;
+      switch (get_kind(slot)) {
+        case GL_FLOAT: read_lanes(lanes, (const float*)bytes, size); break;
+        case GL_HALF_FLOAT: {
+          const uint16_t *src = (const uint16_t*)bytes;
+          for (unsigned i = 0; i != size; ++i) lanes[i] = vertex_packing::half_to_float(src[i]);
+        } break;
+        case GL_BYTE: read_lanes(lanes, (const int8_t*)bytes, size); max_lane = 0x7f; is_signed = true; break;
+        case GL_UNSIGNED_BYTE: read_lanes(lanes, (const uint8_t*)bytes, size); max_lane = 0xff; break;
+        case GL_SHORT: read_lanes(lanes, (const int16_t*)bytes, size); max_lane = 0x7fff; is_signed = true; break;
+        case GL_UNSIGNED_SHORT: read_lanes(lanes, (const uint16_t*)bytes, size); max_lane = 0xffff; break;
+        case GL_INT: read_lanes(lanes, (const int32_t*)bytes, size); max_lane = 0x7fffffff; is_signed = true; break;
+        case GL_UNSIGNED_INT: read_lanes(lanes, (const uint32_t*)bytes, size); max_lane = 0xffffffffu; break;
+      }
+
+      if (max_lane != 0 && get_normalized(slot)) {
+        for (unsigned i = 0; i != size; ++i) {
+          lanes[i] = is_signed ? std::max(lanes[i] / max_lane, -1.0f) : lanes[i] / max_lane;
+        }
+      }
+
+      switch (get_encoding(slot)) {
+        case encoding_pos_range: {
+          vec3 pos = vertex_packing::decode_position(vec3(lanes[0], lanes[1], lanes[2]), pos_scale.xyz(), pos_offset.xyz());
+          return vec4(pos, 1);
+        }
+        case encoding_octahedral: {
+          return vec4(vertex_packing::decode_octahedral(lanes[0], lanes[1]), 0);
+        }
+      }
+      return vec4(lanes[0], lanes[1], lanes[2], lanes[3]);
+    }
+
     /// Allocate VBO and IBO objects together.
     void allocate(size_t vsize, size_t isize) {
       vertices->allocate(GL_ARRAY_BUFFER, vsize);
@@ -483,6 +520,10 @@ namespace octet { namespace scene {
         unsigned kind = get_kind(slot);
         unsigned attr = get_attr(slot);
         unsigned offset = get_offset(slot);
+        #ifdef OCTET_GLES2
+          // half float attributes need OES_vertex_half_float on OpenGL ES2.
+          if (kind == GL_HALF_FLOAT) kind = 0x8D61; // GL_HALF_FLOAT_OES
+        #endif
         glVertexAttribPointer(attr, size, kind, n & 1, get_stride(), (void*)(offset));
         glEnableVertexAttribArray(attr);
         n >>= 1;
@@ -490,14 +531,88 @@ namespace octet { namespace scene {
     }
 
     /// When rendering a mesh, call this next to draw the primitives.
-    void draw() {
+    /// If you draw the same mesh again, the indices are still bound and bind_indices can be false.
+    /// count limits the number of indices (or vertices) drawn.
+    void draw(bool bind_indices = true, unsigned count = ~0u) {
       //printf("de %04x %d %d\n", get_mode(), get_num_vertices(), get_index_type());
       if (get_index_type()) {
-        indices->bind();
-        glDrawElements(get_mode(), get_num_indices(), get_index_type(), (GLvoid*)(get_index_size() * first_index));
+        if (bind_indices) indices->bind();
+        glDrawElements(get_mode(), std::min(count, get_num_indices()), get_index_type(), (GLvoid*)(get_index_size() * first_index));
       } else {
-        glDrawArrays(get_mode(), 0, get_num_vertices());
+        glDrawArrays(get_mode(), 0, std::min(count, get_num_vertices()));
+      }
+    }
+
+    #ifndef OCTET_GLES2
+      /// Draw many instances of the mesh in one call.
+      /// The per-instance attributes must be set up with a divisor of one.
+      void draw_instanced(unsigned num_instances, bool bind_indices = true) {
+        if (get_index_type()) {
+          if (bind_indices) indices->bind();
+          glDrawElementsInstanced(get_mode(), get_num_indices(), get_index_type(), (GLvoid*)(get_index_size() * first_index), num_instances);
+        } else {
+          glDrawArraysInstanced(get_mode(), 0, get_num_vertices(), num_instances);
+        }
+      }
+    #endif
+
+    /// Make a mesh with num_copies copies of the vertices and indices of this mesh
+    /// and a float attribute_instance that numbers the copies.
+    /// This is used to draw many instances with a uniform array on OpenGL ES2, which has no instanced draws.
+    /// Draw the first n copies with draw(true, n * count), where count is the number of indices
+    /// in this mesh (or vertices if it has no indices).
+    /// Returns NULL if there is no room for the extra attribute, the indices would overflow
+    /// or the primitives can not be joined (strips and fans).
+    mesh *make_copies(unsigned num_copies) {
+      if (get_num_slots() >= max_slots || stride + 4 > 64 || has_attribute(attribute_instance)) return NULL;
+      if ((mode != GL_TRIANGLES && mode != GL_LINES && mode != GL_POINTS) || first_index != 0) return NULL;
+      if (index_type == GL_UNSIGNED_SHORT && num_vertices * num_copies > 0x10000) return NULL;
+
+      unsigned new_stride = stride + 4;
+      unsigned copy_indices = index_type ? num_indices : 0;
+      mesh *result = new mesh();
+      result->num_slots = num_slots;
+      memcpy(result->format, format, sizeof(format));
+      result->normalized = normalized;
+      result->pos_scale = pos_scale;
+      result->pos_offset = pos_offset;
+      result->add_attribute(attribute_instance, 1, GL_FLOAT, stride);
+      result->set_params(new_stride, copy_indices * num_copies, num_vertices * num_copies, mode, index_type);
+      result->allocate(new_stride * num_vertices * num_copies, get_index_size() * copy_indices * num_copies);
+      result->set_aabb(mesh_aabb);
+
+      {
+        gl_resource::rolock src(get_vertices());
+        gl_resource::wolock dest(result->get_vertices());
+        uint8_t *dp = dest.u8();
+        for (unsigned copy = 0; copy != num_copies; ++copy) {
+          const uint8_t *sp = src.u8();
+          float instance = (float)copy;
+          for (unsigned i = 0; i != num_vertices; ++i) {
+            memcpy(dp, sp, stride);
+            memcpy(dp + stride, &instance, sizeof(instance));
+            sp += stride;
+            dp += new_stride;
+          }
+        }
       }
+
+      if (copy_indices) {
+        gl_resource::rolock src(get_indices());
+        gl_resource::wolock dest(result->get_indices());
+        for (unsigned copy = 0; copy != num_copies; ++copy) {
+          unsigned base = copy * num_vertices;
+          for (unsigned i = 0; i != copy_indices; ++i) {
+            unsigned index = base + get_index(src.u8(), i);
+            if (index_type == GL_UNSIGNED_SHORT) {
+              dest.u16()[copy * copy_indices + i] = (uint16_t)index;
+            } else {
+              dest.u32()[copy * copy_indices + i] = index;
+            }
+          }
+        }
+      }
+      return result;
     }
 
     /// When rendering a mesh, call this last to disable attributes.
@@ -531,94 +646,99 @@ namespace octet { namespace scene {
       for (unsigned i = 1; i < num_vertices; ++i) {
         vec3 pos = get_value(vtx_lock.u8(), slot, i).xyz();
         vmin = min(pos, vmin);
-        vmax = max(pos, vmin);
+        vmax = max(pos, vmax);
       }
       mesh_aabb = aabb((vmax + vmin) * 0.5f, (vmax - vmin) * 0.5f);
     }
 
-    /// *very* slow ray cast.
-    /// returns "barycentric" coordinates.
-    /// eg. hit pos = bary[0] * pos0 + bary[1] * pos1 + bary[2] * pos2 (or ray.start + ray.distance * bary[3])
-    /// eg. hit uv = bary[0] * uv0 + bary[1] * uv1 + bary[2] * uv2
-    bool ray_cast(const ray &the_ray, int indices[], vec4 &bary_numer, float &bary_denom) {
+    /// Get the tree of triangles used by ray_cast(), building it if the mesh has changed since.
+    /// Building is not thread safe: call this on one thread before casting rays on others.
+    /// Returns NULL if the mesh is not made of triangles.
+    mesh_bvh *get_bvh() {
       unsigned pos_slot = get_slot(attribute_pos);
-      if (get_index_type() != GL_UNSIGNED_INT) return false;
-      if (get_size(pos_slot) < 3) return false;
-      if (get_kind(pos_slot) != GL_FLOAT) return false;
-
-      vec3 org = the_ray.get_start();
-      vec3 dir = the_ray.get_distance();
-      //log("ray_cast: org=%s dir=%s\n", org.toString(), dir.toString());
+      if (mode != GL_TRIANGLES || pos_slot == ~0u) return NULL;
+      if (index_type != GL_UNSIGNED_SHORT && index_type != GL_UNSIGNED_INT) return NULL;
+
+      uint32_t source[7] = {
+        vertices->get_version(), indices->get_version(), num_indices, first_index,
+        index_type, stride, format[pos_slot]
+      };
+      if (bvh && !memcmp(source, bvh_source, sizeof(source))) return bvh;
+      memcpy(bvh_source, source, sizeof(source));
+
+      unsigned num_triangles = num_indices / 3;
+      dynarray<vec3p> corners(num_triangles * 3);
+      {
+        gl_resource::rolock idx_lock(get_indices());
+        gl_resource::rolock vtx_lock(get_vertices());
+        for (unsigned i = 0; i != num_triangles * 3; ++i) {
+          unsigned index = get_index(idx_lock.u8(), i);
+          corners[i] = index < num_vertices ? get_value(vtx_lock.u8(), pos_slot, index).xyz() : vec3(0, 0, 0);
+        }
+      }
+      if (!bvh) bvh = new mesh_bvh();
+      bvh->build(corners.data(), num_triangles);
+      return bvh;
+    }
 
-      unsigned pos_offset = get_offset(pos_slot);
+    /// Get the three vertex indices of a triangle, eg. from a ray cast.
+    void get_triangle_indices(unsigned triangle, int indices[]) {
       gl_resource::rolock idx_lock(get_indices());
-      gl_resource::rolock vtx_lock(get_vertices());
-      const uint32_t *idx = idx_lock.u32() + first_index;
-      const uint8_t *vtx = vtx_lock.u8();
-
-      float best_denom = 0;
-      vec4 best_numer(0, 0, 0, 0);
-      for (unsigned i = 0; i != get_num_indices(); i += 3) {
-        vec3 a = (vec3)*(const vec3p*)(vtx + pos_offset + stride * idx[i+0]) - org;
-        vec3 b = (vec3)*(const vec3p*)(vtx + pos_offset + stride * idx[i+1]) - org;
-        vec3 c = (vec3)*(const vec3p*)(vtx + pos_offset + stride * idx[i+2]) - org;
-        vec3 d = dir;
-
-        // solve [ba, bb, bc, bd] * [[ax, ay, az, 1], [bx, by, bz, 1], [cx, cy, cz, 1], [-dx, -dy, -dz, 0]] = [0, 0, 0, 1]
-        //
-        // ie. ba + bb + bc = 1  and  ba * a + bb * b + bc * c = bd * d
-        //
-        // [ba, bb, bc] are barycentric coordinates, bd is the distance along the vector
-
-        // The last line of the inverse matrix is the solution (vector triple products)
-
-        // numerator
-        vec4 numer(
-          dot(cross(b, c), d),
-          dot(cross(c, a), d),
-          dot(cross(a, b), d),
-          dot(cross(a, b), c)
-        );
-
-        // denominator
-        float denom = numer[0] + numer[1] + numer[2];
-
-        //log("a=%s b=%s c=%s d=%s denom=%f\n", a.toString(), b.toString(), c.toString(), d.toString(), denom);
-        //log("numer=%s\n", numer.toString());
-        //log("res=%s\n", (numer / denom).toString());
-
-        // using a multiply lets us check the sign without using a divide.
-        vec4 bary2 = numer * denom;
-
-        if (all(bary2 >= vec4(0, 0, 0, 0))) {
-          rational best_distance(best_numer[3], best_denom);
-          rational new_distance(numer[3], denom);
-          /*printf(
-            "t%d %9.3f %d %d %d  %s %s %s\n",
-            i, numer[3]/denom, idx[i+0], idx[i+1], idx[i+2],
-            (numer/denom).toString(), best_distance.toString(), new_distance.toString()
-          );*/
-
-          unsigned further = new_distance > best_distance;
-          if (!further) {
-            indices[0] = idx[i+0];
-            indices[1] = idx[i+1];
-            indices[2] = idx[i+2];
-            best_numer = numer;
-            best_denom = denom;
+      for (unsigned i = 0; i != 3; ++i) {
+        indices[i] = (int)get_index(idx_lock.u8(), triangle * 3 + i);
+      }
+    }
+
+    /// Find the nearest triangle hit by the ray start + distance * t for 0 <= t < max_t.
+    /// Use max_t = 1 to stop at the end of the ray.
+    bool ray_cast(const ray &the_ray, mesh_bvh::hit &result, float max_t = 1e37f) {
+      mesh_bvh *tree = get_bvh();
+      if (!tree) {
+        result.t = max_t;
+        result.u = result.v = 0;
+        result.triangle = ~0u;
+        return false;
+      }
+      return tree->ray_cast(the_ray.get_start(), the_ray.get_distance(), max_t, result);
+    }
+
+    /// Cast many rays, four at a time. Neighbouring rays in the array should be close together.
+    void ray_cast(const ray *rays, unsigned num_rays, mesh_bvh::hit *results, float max_t = 1e37f) {
+      mesh_bvh *tree = get_bvh();
+      for (unsigned i = 0; i < num_rays; i += 4) {
+        unsigned n = std::min(num_rays - i, 4u);
+        if (!tree) {
+          for (unsigned j = 0; j != n; ++j) ray_cast(rays[i+j], results[i+j], max_t);
+        } else if (n == 4) {
+          vec3 start[4], distance[4];
+          for (unsigned j = 0; j != 4; ++j) {
+            start[j] = rays[i+j].get_start();
+            distance[j] = rays[i+j].get_distance();
+          }
+          tree->ray_cast4(start, distance, max_t, results + i);
+        } else {
+          for (unsigned j = 0; j != n; ++j) {
+            tree->ray_cast(rays[i+j].get_start(), rays[i+j].get_distance(), max_t, results[i+j]);
           }
         }
       }
+    }
 
-      if (fabsf(best_denom) < 1e-6f) {
+    /// Ray cast, returning "barycentric" coordinates.
+    /// eg. hit pos = bary[0] * pos0 + bary[1] * pos1 + bary[2] * pos2 (or ray.start + ray.distance * bary[3])
+    /// eg. hit uv = bary[0] * uv0 + bary[1] * uv1 + bary[2] * uv2
+    /// where bary = bary_numer / bary_denom.
+    bool ray_cast(const ray &the_ray, int indices[], vec4 &bary_numer, float &bary_denom) {
+      mesh_bvh::hit h;
+      if (!ray_cast(the_ray, h)) {
         bary_numer = vec4(0, 0, 0, 0);
         bary_denom = 0;
         return false;
-      } else {
-        bary_numer = best_numer;
-        bary_denom = best_denom;
-        return true;
       }
+      get_triangle_indices(h.triangle, indices);
+      bary_numer = vec4(1 - h.u - h.v, h.u, h.v, h.t);
+      bary_denom = 1;
+      return true;
     }
 
     /// access the vertex buffer (VBO) or memory buffer
@@ -664,83 +784,114 @@ namespace octet { namespace scene {
       set_first_index(0);
     }
 
-    /// Get all the edges in a hash map to avoid duplicates.
-    /// record the triangle indices that they came from.
-    void get_edges(dynarray<edge> &edges) {
-      if (get_index_type() != GL_UNSIGNED_INT) return;
-
-      gl_resource::rolock idx_lock(get_indices());
-      const uint32_t *ip = idx_lock.u32();
+    /// Get the edges and triangle planes used to find silhouettes, building them the first time
+    /// and when the indices change. Only the planes are found again when just the vertices change.
+    /// Building is not thread safe: call this on one thread.
+    /// Returns NULL if the mesh is not made of indexed triangles.
+    mesh_adjacency *get_adjacency() {
+      unsigned pos_slot = get_slot(attribute_pos);
+      if (mode != GL_TRIANGLES || pos_slot == ~0u) return NULL;
+      if (index_type != GL_UNSIGNED_SHORT && index_type != GL_UNSIGNED_INT) return NULL;
+
+      uint32_t edge_source[4] = { indices->get_version(), num_indices, first_index, index_type };
+      uint32_t plane_source[4] = { vertices->get_version(), num_vertices, stride, format[pos_slot] };
+      bool new_edges = !adjacency || memcmp(edge_source, adjacency_source, sizeof(edge_source));
+      if (new_edges) {
+        memcpy(adjacency_source, edge_source, sizeof(edge_source));
+        if (!adjacency) adjacency = new mesh_adjacency();
+
+        unsigned num_triangles = num_indices / 3;
+        dynarray<uint32_t> triangles(num_triangles * 3);
+        gl_resource::rolock idx_lock(get_indices());
+        for (unsigned i = 0; i != num_triangles * 3; ++i) {
+          triangles[i] = get_index(idx_lock.u8(), i);
+        }
+        adjacency->build_edges(triangles.data(), num_triangles);
+      }
 
-      edges.resize(0);
-      for (unsigned i = 0; i < get_num_indices(); i += 3) {
-        add_edge(edges, i, ip[i+0], ip[i+1]);
-        add_edge(edges, i, ip[i+1], ip[i+2]);
-        add_edge(edges, i, ip[i+2], ip[i+0]);
-      }
-
-      std::sort(edges.data(), edges.data() + edges.size());
-
-      size_t dest = 0, src = 0;
-      for (; src < edges.size()-1; ) {
-        edge &e0 = edges[src];
-        edge &e1 = edges[src+1];
-        if (dest != src && e0.idx0 == e1.idx0 && e0.idx1 == e1.idx1) {
-          // combine two similar edges.
-          edge &ed = edges[dest++];
-          ed = e0;
-          ed.tri1 = e1.tri0;
-          src += 2;
-        } else {
-          edges[dest++] = e0;
-          src++;
+      if (new_edges || memcmp(plane_source, planes_source, sizeof(plane_source))) {
+        memcpy(planes_source, plane_source, sizeof(plane_source));
+        dynarray<vec3p> positions(num_vertices);
+        gl_resource::rolock vtx_lock(get_vertices());
+        for (unsigned i = 0; i != num_vertices; ++i) {
+          positions[i] = get_value(vtx_lock.u8(), pos_slot, i).xyz();
         }
+        adjacency->build_planes(positions.data(), num_vertices);
       }
+      return adjacency;
+    }
 
-      if (src < edges.size()-1) {
-        edges[dest++] = edges[src++];
+    /// Get all the edges of the triangles with the two triangles (as their first index) that use them.
+    /// tri1 is ~0 for an edge with only one triangle.
+    /// use dynarray<edge, frame_allocator> for edges that are only needed this frame.
+    template <class allocator_t> void get_edges(dynarray<edge, allocator_t> &edges) {
+      edges.resize(0);
+      mesh_adjacency *adj = get_adjacency();
+      if (!adj) return;
+
+      edges.resize(adj->get_num_edges());
+      for (unsigned i = 0; i != adj->get_num_edges(); ++i) {
+        const uint32_t *ev = adj->get_edge_vertices(i);
+        const uint32_t *ef = adj->get_edge_faces(i);
+        edge e = { (int32_t)std::min(ev[0], ev[1]), (int32_t)std::max(ev[0], ev[1]), (int32_t)(ef[0] * 3), ef[1] == ~0u ? ~0 : (int32_t)(ef[1] * 3) };
+        edges[i] = e;
       }
-      edges.resize(dest);
     }
 
     /// Generate silhouette edges.
     /// Silhouette edges are used for shadows, highlighting and volumetric effects such as shadows.
-    /// the resulting indices could be used for a GL_LINES render, for example.
+    /// The viewpoint is a point or, if is_directional, a direction towards a light in model space.
     ///
     /// An edge is a silhouette edge if:
     ///
     ///   There is only one triangle that uses the edge.
     ///   One triangle can be seen from the viewpoint, the other can't.
-    void get_silhouette_edges(const vec3 &viewpoint, bool is_directional, dynarray<edge> &edges) {
-      unsigned pos_slot = get_slot(attribute_pos);
-      if (get_index_type() != GL_UNSIGNED_INT) return;
-      if (get_size(pos_slot) < 3) return;
-      if (get_kind(pos_slot) != GL_FLOAT) return;
+    ///
+    /// The edges come from get_adjacency(), so only the triangles are tested on each call.
+    /// For GL_LINES or many viewpoints at once, use get_silhouette_indices().
+    template <class allocator_t> void get_silhouette_edges(const vec3 &viewpoint, bool is_directional, dynarray<edge, allocator_t> &edges) {
+      edges.resize(0);
+      mesh_adjacency *adj = get_adjacency();
+      if (!adj) return;
+
+      vec4 point(viewpoint, is_directional ? 0.0f : 1.0f);
+      const uint32_t *facing = adj->classify(&point, 1);
+      for (unsigned i = 0; i != adj->get_num_edges(); ++i) {
+        const uint32_t *ef = adj->get_edge_faces(i);
+        if (ef[1] == ~0u || facing[ef[0]] != facing[ef[1]]) {
+          const uint32_t *ev = adj->get_edge_vertices(i);
+          edge e = { (int32_t)std::min(ev[0], ev[1]), (int32_t)std::max(ev[0], ev[1]), (int32_t)(ef[0] * 3), ef[1] == ~0u ? ~0 : (int32_t)(ef[1] * 3) };
+          edges.push_back(e);
+        }
+      }
+    }
 
-      unsigned pos_offset = get_offset(pos_slot);
+    /// Write the silhouette edges of up to mesh_adjacency::max_viewpoints viewpoints to an index buffer
+    /// as GL_LINES, growing it if it is too small. Viewpoints are points (x, y, z, 1) or directions
+    /// towards lights (x, y, z, 0) in model space. The count[n] indices of viewpoint n start at
+    /// index first[n] and each edge is in the winding of the triangle that faces the viewpoint.
+    /// Returns the number of indices written.
+    unsigned get_silhouette_indices(const vec4 *viewpoints, unsigned num_viewpoints, gl_resource *index_buffer, unsigned *first, unsigned *count, job_system *jobs = &job_system::get()) {
+      mesh_adjacency *adj = get_adjacency();
+      if (!adj) {
+        for (unsigned n = 0; n != num_viewpoints; ++n) first[n] = count[n] = 0;
+        return 0;
+      }
 
-      get_edges(edges);
+      unsigned total = adj->count_silhouettes(viewpoints, num_viewpoints, count, jobs);
+      for (unsigned n = 0; n != num_viewpoints; ++n) {
+        first[n] = n ? first[n-1] + count[n-1] : 0;
+      }
 
-      gl_resource::rolock idx_lock(get_indices());
-      gl_resource::rolock vtx_lock(get_vertices());
-      const uint32_t *ip = idx_lock.u32() + first_index;
-      const uint8_t *vp = vtx_lock.u8();
-      unsigned stride = get_stride();
-      
-      size_t dest = 0;
-      for (size_t i = 0; i != edges.size(); ++i) {
-        const edge &edge = edges[i];
-        if (
-          tri_is_visible(
-            edge.tri0, pos_offset, stride, ip, vp, viewpoint, is_directional
-          ) != tri_is_visible(
-            edge.tri1, pos_offset, stride, ip, vp, viewpoint, is_directional
-          )
-        ) {
-          edges[dest++] = edge;
+      if (total) {
+        // leave room for the silhouettes to grow as the lights move.
+        if (index_buffer->get_size() < total * sizeof(uint32_t)) {
+          index_buffer->allocate(GL_ELEMENT_ARRAY_BUFFER, (total + total / 2) * sizeof(uint32_t), GL_DYNAMIC_DRAW);
         }
+        gl_resource::wolock lock(index_buffer);
+        adj->write_silhouettes(lock.u32(), jobs);
       }
-      edges.resize(dest);
+      return total;
     }
 
     /// Debugging: show the effect of the vertex shader on the vertices
@@ -788,60 +939,145 @@ namespace octet { namespace scene {
       set_mode(GL_LINES);
     }
 
-    /// re-index the mesh
-    void reindex() {
+    /// Re-index the mesh, merging vertices with the same bytes. Vertices are renumbered in the order
+    /// the indices first use them. With an epsilon, vertices whose float positions are in the same
+    /// grid cell of that size and whose other attributes match are merged too.
+    void reindex(float epsilon = 0, job_system *jobs = &job_system::get()) {
       if (get_index_type() != GL_UNSIGNED_INT) return;
 
-      hash_map<general_vertex, unsigned, vertex_cmp> vertex_to_index;
-
-      dynarray<uint8_t> dest_vertices;
-      dynarray<uint32_t> dest_indices;
-      dest_indices.reserve(get_num_indices());
+      unsigned pos_offset = ~0u;
+      unsigned pos_slot = get_slot(attribute_pos);
+      if (pos_slot != ~0u && get_kind(pos_slot) == GL_FLOAT && get_size(pos_slot) >= 3) {
+        pos_offset = get_offset(pos_slot);
+      }
 
-      //The code below is inside a new scope { ... } with the purpose of be sure that outside the scope idx_lock will be deleted
-      //  why do we want to delete idx_lock? When the object is created it locks indices to read only, and we want to unlock it after using it
-      //  the unlocking of indices at the end of this scope will help us while trying to write to indices again
+      vertex_welder welder;
+      unsigned num_welded = 0;
       {
-        // This is the begining of a scope, every instance declared inside will be deleted at the end of the scope
+        // the locks must be released before we write to the indices.
         gl_resource::rolock idx_lock(get_indices());
         gl_resource::rolock vtx_lock(get_vertices());
-        const uint32_t *ip = idx_lock.u32();
-        const uint8_t *vp = vtx_lock.u8();
-
-        unsigned stride = get_stride();
-        unsigned num_vertices = 0;
-        for (unsigned i = 0; i != get_num_indices(); ++i) {
-          uint32_t idx = ip[i];
-          general_vertex v = { vp + idx * stride, stride };
-          unsigned &e = vertex_to_index[v];
-          if (e == 0) { // hash_map inits to zero
-            // vertex is unique.
-            e = ++num_vertices;
-            unsigned old_size = dest_vertices.size();
-            dest_vertices.resize(old_size + stride);
-            memcpy(&dest_vertices[old_size], vp + idx * stride, stride);
-          }
-          dest_indices.push_back(e - 1);
-        }
+        const uint32_t *ip = idx_lock.u32() + get_first_index();
+        num_welded = welder.weld(vtx_lock.u8(), get_stride(), get_num_vertices(), ip, get_num_indices(), epsilon, pos_offset, jobs);
       }
 
-      // This is the end of the scope, not the end of the reindex() function, hence idx_lock, vtx_lock... will be deleted at this point
-      //    and in the case of idx_lock (check gl_resources.h), it will unlock indices, letting us to write in it
-
       // if we have fewer vertices now, update the index and vertices.
-      if (num_vertices != get_num_vertices()) {
-        unsigned isize = dest_indices.size() * sizeof(uint32_t);
-        unsigned vsize = dest_vertices.size() * sizeof(uint8_t);
-        gl_resource *indices = get_indices();
-        gl_resource *vertices = new gl_resource(GL_ARRAY_BUFFER, vsize);
-        indices->assign(&dest_indices[0], 0, isize);
-        vertices->assign(&dest_vertices[0], 0, vsize);
+      if (num_welded != get_num_vertices()) {
+        gl_resource *vertices = new gl_resource(GL_ARRAY_BUFFER, welder.get_vertices_size());
+        get_indices()->assign(welder.get_indices(), get_first_index() * sizeof(uint32_t), welder.get_indices_size());
+        vertices->assign(welder.get_vertices(), 0, welder.get_vertices_size());
 
         set_vertices(vertices);
-        set_num_vertices(num_vertices);
+        set_num_vertices(num_welded);
       }
     }
 
+    /// Re-encode the vertices in a compact layout for drawing static meshes (see vertex_packing).
+    ///
+    /// Positions become three 16 bit lanes relative to the range of the positions.
+    /// Normals, tangents and bitangents become two octahedral lanes of normal_bits (16 or 8) bits;
+    /// the sign of a vec4 tangent is lost. With half_uvs, uvs become half floats.
+    /// Other attributes are copied. The default 32 byte vertex becomes 16 bytes, or 12 with 8 bit normals.
+    ///
+    /// Draw the mesh with the vertex_packed version of a material's shader (see get_vertex_format()).
+    /// Code that reads the vertex buffer directly, rather than with get_value(), must handle the packed layout.
+    /// Do this after any welding and optimisation: reindex() and add_polygon() need float positions.
+    /// Returns false and leaves the mesh alone if it is skinned, empty, has no float positions
+    /// or is packed already.
+    bool pack_vertices(unsigned normal_bits = 16, bool half_uvs = true, job_system *jobs = &job_system::get()) {
+      assert(normal_bits == 16 || normal_bits == 8);
+      unsigned pos_slot = get_slot(attribute_pos);
+      if (mesh_skin || !stride || pos_slot == ~0u || get_kind(pos_slot) != GL_FLOAT || get_size(pos_slot) < 3) return false;
+      if (get_vertex_format() != shader::vertex_float) return false;
+
+      // pack every vertex in the buffer; indices may use more than num_vertices.
+      unsigned buffer_vertices = vertices->get_size() / stride;
+      if (!buffer_vertices) return false;
+
+      // choose the layout of the new vertices, starting each attribute on a four byte boundary.
+      uint32_t new_format[max_slots];
+      uint16_t new_normalized = 0;
+      unsigned new_offset = 0;
+      for (unsigned slot = 0; slot != num_slots; ++slot) {
+        unsigned attr = get_attr(slot);
+        unsigned size = get_size(slot), kind = get_kind(slot), norm = get_normalized(slot), encoding = encoding_none;
+        bool is_direction = attr == attribute_normal || attr == attribute_tangent || attr == attribute_bitangent;
+        if (slot == pos_slot) {
+          size = 3; kind = GL_UNSIGNED_SHORT; norm = 1; encoding = encoding_pos_range;
+        } else if (is_direction && kind == GL_FLOAT && size >= 3) {
+          size = 2; kind = normal_bits == 16 ? GL_SHORT : GL_BYTE; norm = 1; encoding = encoding_octahedral;
+        } else if (attr == attribute_uv && kind == GL_FLOAT && half_uvs) {
+          kind = GL_HALF_FLOAT;
+        }
+        unsigned bytes = size * kind_size(kind);
+        new_offset = (new_offset + 3) & ~3;
+        unsigned kind_bits = kind == GL_HALF_FLOAT ? kind_half_float : kind - GL_BYTE;
+        new_format[slot] = (encoding << 15) + (new_offset << 9) + (attr << 5) + ((size-1) << 3) + kind_bits;
+        if (norm) new_normalized |= 1 << slot;
+        new_offset += bytes;
+      }
+      unsigned new_stride = (new_offset + 3) & ~3;
+
+      gl_resource *new_vertices = new gl_resource(GL_ARRAY_BUFFER, new_stride * buffer_vertices);
+      {
+        gl_resource::rolock src(get_vertices());
+        const uint8_t *sp = src.u8();
+
+        // the range of the positions, from which the lanes are measured.
+        vec3 vmin = get_value(sp, pos_slot, 0).xyz();
+        vec3 vmax = vmin;
+        for (unsigned i = 1; i != buffer_vertices; ++i) {
+          vec3 pos = get_value(sp, pos_slot, i).xyz();
+          vmin = min(pos, vmin);
+          vmax = max(pos, vmax);
+        }
+        pos_offset = vec4(vmin, 0);
+        pos_scale = vec4(vmax - vmin, 0);
+
+        gl_resource::wolock dest(new_vertices);
+        uint8_t *dp = dest.u8();
+        memset(dp, 0, new_stride * buffer_vertices);
+        auto pack = [&](unsigned begin, unsigned end) {
+          for (unsigned i = begin; i != end; ++i) {
+            uint8_t *vp = dp + i * new_stride;
+            for (unsigned slot = 0; slot != num_slots; ++slot) {
+              uint8_t *lp = vp + ((new_format[slot] >> 9) & 0x3f);
+              unsigned encoding = (new_format[slot] >> 15) & 0x03;
+              if (encoding == encoding_pos_range) {
+                vec3 pos = get_value(sp, slot, i).xyz();
+                vertex_packing::encode_position((uint16_t*)lp, pos, pos_scale.xyz(), pos_offset.xyz());
+              } else if (encoding == encoding_octahedral) {
+                vec3 dir = get_value(sp, slot, i).xyz();
+                if (normal_bits == 16) {
+                  vertex_packing::encode_octahedral((int16_t*)lp, dir);
+                } else {
+                  vertex_packing::encode_octahedral((int8_t*)lp, dir);
+                }
+              } else if ((new_format[slot] & 0x07) == kind_half_float && get_kind(slot) == GL_FLOAT) {
+                const float *fp = (const float*)(sp + i * stride + get_offset(slot));
+                for (unsigned j = 0; j != get_size(slot); ++j) {
+                  ((uint16_t*)lp)[j] = vertex_packing::float_to_half(fp[j]);
+                }
+              } else {
+                memcpy(lp, sp + i * stride + get_offset(slot), get_size(slot) * kind_size(get_kind(slot)));
+              }
+            }
+          }
+        };
+        if (jobs) {
+          jobs->parallel_for(0, buffer_vertices, 4096, pack);
+        } else {
+          pack(0, buffer_vertices);
+        }
+      }
+
+      memcpy(format, new_format, sizeof(uint32_t) * num_slots);
+      normalized = new_normalized;
+      stride = (uint16_t)new_stride;
+      set_vertices(new_vertices);
+      return true;
+    }
+
     /// Add a polygon to the mesh, appending vertices until the buffer size is exceeded.
     /// returns false if no space is available.
     /// If we are in GL_TRIANGLES mode, fill the triangles.
@@ -0,0 +1,325 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// Edge adjacency and silhouettes of mesh triangles
+//
+// example:
+//
+//   vec4 lights[2] = { vec4(light_pos, 1), vec4(light_dir, 0) };
+//   unsigned first[2], count[2];
+//   msh->get_silhouette_indices(lights, 2, silhouette_buffer, first, count);
+//   // draw count[i] indices from first[i] as GL_LINES for light i
+//
+
+namespace octet { namespace scene {
+  /// The edges of a triangle mesh with the two triangles that share each one,
+  /// and the plane of each triangle, for finding silhouettes.
+  ///
+  /// Edges are found once by sorting the sides of the triangles by their two vertices,
+  /// not on every call.
+  /// The planes are kept four triangles at a time, so that SSE2 can test four triangles
+  /// against a viewpoint at once. Each triangle gets a bit for each of up to 32 viewpoints
+  /// and an edge is on the silhouette of viewpoint n if bit n differs for its two triangles,
+  /// so one pass over the edges finds the silhouettes of all the viewpoints.
+  ///
+  /// A viewpoint is a point (x, y, z, 1) or a direction towards a light (x, y, z, 0).
+  class mesh_adjacency : public resource {
+  public:
+    enum {
+      max_viewpoints = 32,
+    };
+
+  private:
+    enum {
+      chunk_size = 16384,   // edges per piece of work when finding silhouettes
+    };
+
+    unsigned num_faces;
+    unsigned num_interior;            // edges with two triangles come first, then edges with one.
+    dynarray<uint32_t> faces;         // three vertices per triangle
+    dynarray<uint32_t> edge_vertices; // two per edge, in the winding of its first triangle
+    dynarray<uint32_t> edge_faces;    // two per edge, ~0 for the second triangle of a boundary edge
+    dynarray<float> planes;           // nx[4], ny[4], nz[4], d[4] for each four triangles
+
+    // state of the last count_silhouettes()
+    unsigned num_viewpoints;
+    dynarray<uint32_t> face_masks;    // bit n is set if the triangle faces viewpoint n
+    dynarray<uint32_t> edge_masks;    // bit n is set if the edge is on the silhouette of viewpoint n
+    dynarray<unsigned> chunk_offsets; // silhouette indices of each viewpoint in each chunk, then where they go
+
+    template <class fn_t> static void parallel_for(job_system *jobs, unsigned num_items, unsigned grain, fn_t fn) {
+      if (jobs) {
+        jobs->parallel_for(0, num_items, grain, fn);
+      } else if (num_items) {
+        fn(0, num_items);
+      }
+    }
+
+    // stable counting sort of the sides of the triangles by key(side), which is less than num_keys.
+    template <class key_t> static void sort_sides(dynarray<unsigned> &sorted, const dynarray<unsigned> &sides, unsigned num_keys, key_t key) {
+      dynarray<unsigned> start(num_keys + 1);
+      memset(start.data(), 0, start.size() * sizeof(unsigned));
+      for (unsigned i = 0; i != sides.size(); ++i) {
+        start[key(sides[i]) + 1]++;
+      }
+      for (unsigned k = 0; k != num_keys; ++k) {
+        start[k + 1] += start[k];
+      }
+      sorted.resize(sides.size());
+      for (unsigned i = 0; i != sides.size(); ++i) {
+        sorted[start[key(sides[i])]++] = sides[i];
+      }
+    }
+
+    unsigned get_num_chunks() const {
+      return (get_num_edges() + chunk_size - 1) / chunk_size;
+    }
+
+    // set a bit in the face masks for each viewpoint in front of each triangle.
+    void classify_faces(const vec4 *viewpoints, unsigned first_group, unsigned end_group) {
+      #if OCTET_SSE2
+        __m128 vx[max_viewpoints], vy[max_viewpoints], vz[max_viewpoints], vw[max_viewpoints];
+        __m128i bits[max_viewpoints];
+        for (unsigned n = 0; n != num_viewpoints; ++n) {
+          vx[n] = _mm_set1_ps(viewpoints[n].x());
+          vy[n] = _mm_set1_ps(viewpoints[n].y());
+          vz[n] = _mm_set1_ps(viewpoints[n].z());
+          vw[n] = _mm_set1_ps(viewpoints[n].w());
+          bits[n] = _mm_set1_epi32((int)(1u << n));
+        }
+
+        const __m128 zero = _mm_setzero_ps();
+        for (unsigned g = first_group; g != end_group; ++g) {
+          const float *p = planes.data() + g * 16;
+          __m128 nx = _mm_loadu_ps(p), ny = _mm_loadu_ps(p + 4), nz = _mm_loadu_ps(p + 8), d = _mm_loadu_ps(p + 12);
+          __m128i mask = _mm_setzero_si128();
+          for (unsigned n = 0; n != num_viewpoints; ++n) {
+            __m128 side = _mm_add_ps(
+              _mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, vx[n]), _mm_mul_ps(ny, vy[n])), _mm_mul_ps(nz, vz[n])),
+              _mm_mul_ps(d, vw[n])
+            );
+            mask = _mm_or_si128(mask, _mm_and_si128(_mm_castps_si128(_mm_cmpgt_ps(side, zero)), bits[n]));
+          }
+          _mm_storeu_si128((__m128i*)(face_masks.data() + g * 4), mask);
+        }
+      #else
+        for (unsigned g = first_group; g != end_group; ++g) {
+          const float *p = planes.data() + g * 16;
+          for (unsigned i = 0; i != 4; ++i) {
+            uint32_t mask = 0;
+            for (unsigned n = 0; n != num_viewpoints; ++n) {
+              const vec4 &v = viewpoints[n];
+              float side = ((p[i] * v.x() + p[i+4] * v.y()) + p[i+8] * v.z()) + p[i+12] * v.w();
+              mask |= (side > 0 ? 1u : 0u) << n;
+            }
+            face_masks[g * 4 + i] = mask;
+          }
+        }
+      #endif
+    }
+
+  public:
+    RESOURCE_META(mesh_adjacency)
+
+    /// Make an empty adjacency.
+    mesh_adjacency() {
+      num_faces = 0;
+      num_interior = 0;
+      num_viewpoints = 0;
+    }
+
+    /// Find the edges of triangles given as three indices each.
+    /// Edges used by more than two triangles are paired in order; any left over are boundary edges.
+    void build_edges(const uint32_t *indices, unsigned num_triangles) {
+      num_faces = num_triangles;
+      faces.resize(num_triangles * 3);
+      if (num_triangles) memcpy(faces.data(), indices, num_triangles * 3 * sizeof(uint32_t));
+      planes.resize(0);
+
+      unsigned num_vertices = 0;
+      for (unsigned i = 0; i != num_triangles * 3; ++i) {
+        num_vertices = std::max(num_vertices, indices[i] + 1);
+      }
+
+      // side h of the triangles goes from indices[h] to indices[next(h)].
+      auto next = [](unsigned h) { return h - h % 3 + (h + 1) % 3; };
+      auto lower = [indices, next](unsigned h) { return std::min(indices[h], indices[next(h)]); };
+      auto upper = [indices, next](unsigned h) { return std::max(indices[h], indices[next(h)]); };
+
+      // sort the sides by their lower then their higher vertex with two counting sorts,
+      // keeping sides with the same vertices in triangle order.
+      dynarray<unsigned> sides;
+      sides.reserve(num_triangles * 3);
+      for (unsigned h = 0; h != num_triangles * 3; ++h) {
+        if (indices[h] != indices[next(h)]) sides.push_back(h);
+      }
+      dynarray<unsigned> by_upper;
+      sort_sides(by_upper, sides, num_vertices, upper);
+      sort_sides(sides, by_upper, num_vertices, lower);
+
+      // pair neighbouring sides with the same vertices.
+      edge_vertices.resize(0);
+      edge_faces.resize(0);
+      dynarray<unsigned> boundary;
+      for (unsigned i = 0; i != sides.size(); ) {
+        unsigned h = sides[i];
+        if (i + 1 == sides.size() || lower(sides[i + 1]) != lower(h) || upper(sides[i + 1]) != upper(h)) {
+          boundary.push_back(h);
+          i++;
+          continue;
+        }
+        edge_vertices.push_back(indices[h]);
+        edge_vertices.push_back(indices[next(h)]);
+        edge_faces.push_back(h / 3);
+        edge_faces.push_back(sides[i + 1] / 3);
+        i += 2;
+      }
+
+      num_interior = edge_faces.size() / 2;
+      for (unsigned i = 0; i != boundary.size(); ++i) {
+        unsigned h = boundary[i];
+        edge_vertices.push_back(indices[h]);
+        edge_vertices.push_back(indices[next(h)]);
+        edge_faces.push_back(h / 3);
+        edge_faces.push_back(~0u);
+      }
+    }
+
+    /// Find the plane of each triangle from the positions of the vertices.
+    /// Call this after build_edges() and again when the vertices move.
+    void build_planes(const vec3p *positions, unsigned num_positions) {
+      unsigned num_groups = (num_faces + 3) / 4;
+      planes.resize(num_groups * 16);
+      memset(planes.data(), 0, planes.size() * sizeof(float));
+      for (unsigned f = 0; f != num_faces; ++f) {
+        const uint32_t *fi = faces.data() + f * 3;
+        if (fi[0] >= num_positions || fi[1] >= num_positions || fi[2] >= num_positions) continue;
+        vec3 a = positions[fi[0]], b = positions[fi[1]], c = positions[fi[2]];
+        vec3 normal = cross(b - a, c - a);
+        float *p = planes.data() + (f / 4) * 16 + f % 4;
+        p[0] = normal.x();
+        p[4] = normal.y();
+        p[8] = normal.z();
+        p[12] = -dot(normal, a);
+      }
+    }
+
+    /// Number of edges, including boundary edges.
+    unsigned get_num_edges() const {
+      return edge_faces.size() / 2;
+    }
+
+    /// Number of edges that are used by only one triangle. These are the last edges.
+    unsigned get_num_boundary_edges() const {
+      return get_num_edges() - num_interior;
+    }
+
+    /// Number of triangles.
+    unsigned get_num_faces() const {
+      return num_faces;
+    }
+
+    /// The two vertices of an edge, in the winding of its first triangle.
+    const uint32_t *get_edge_vertices(unsigned edge) const {
+      return edge_vertices.data() + edge * 2;
+    }
+
+    /// The two triangles of an edge. The second is ~0 for a boundary edge.
+    const uint32_t *get_edge_faces(unsigned edge) const {
+      return edge_faces.data() + edge * 2;
+    }
+
+    /// Test every triangle against up to max_viewpoints viewpoints.
+    /// Bit n of the result for a triangle is set if its front faces viewpoint n.
+    const uint32_t *classify(const vec4 *viewpoints, unsigned num, job_system *jobs = &job_system::get()) {
+      assert(num <= max_viewpoints);
+      assert(planes.size() == (num_faces + 3) / 4 * 16);
+      num_viewpoints = num;
+      unsigned num_groups = (num_faces + 3) / 4;
+      face_masks.resize(num_groups * 4);
+      parallel_for(jobs, num_groups, 1024, [&](unsigned begin, unsigned end) {
+        classify_faces(viewpoints, begin, end);
+      });
+      return face_masks.data();
+    }
+
+    /// Find the silhouette edges of up to max_viewpoints viewpoints in one pass and return
+    /// the number of GL_LINES indices for each in count[] and in total.
+    /// An edge is on the silhouette if one of its triangles faces the viewpoint and the other
+    /// does not, or if it has only one triangle.
+    /// Then call write_silhouettes() to get the indices.
+    unsigned count_silhouettes(const vec4 *viewpoints, unsigned num, unsigned *count, job_system *jobs = &job_system::get()) {
+      classify(viewpoints, num, jobs);
+
+      unsigned num_edges = get_num_edges();
+      unsigned num_chunks = get_num_chunks();
+      uint32_t all = num == 32 ? ~0u : (1u << num) - 1;
+      edge_masks.resize(num_edges);
+      chunk_offsets.resize(num_chunks * num);
+      memset(chunk_offsets.data(), 0, chunk_offsets.size() * sizeof(unsigned));
+
+      parallel_for(jobs, num_chunks, 1, [&](unsigned begin, unsigned end) {
+        for (unsigned c = begin; c != end; ++c) {
+          unsigned *chunk_count = chunk_offsets.data() + c * num;
+          unsigned edge_end = std::min((c + 1) * chunk_size, num_edges);
+          for (unsigned e = c * chunk_size; e != edge_end; ++e) {
+            const uint32_t *ef = edge_faces.data() + e * 2;
+            uint32_t mask = e < num_interior ? face_masks[ef[0]] ^ face_masks[ef[1]] : all;
+            edge_masks[e] = mask;
+            while (mask) {
+              chunk_count[find_lowest_bit(mask)] += 2;
+              mask &= mask - 1;
+            }
+          }
+        }
+      });
+
+      // each viewpoint's indices follow the last one's, in chunk order.
+      unsigned total = 0;
+      for (unsigned n = 0; n != num; ++n) {
+        unsigned first = total;
+        for (unsigned c = 0; c != num_chunks; ++c) {
+          unsigned chunk_count = chunk_offsets[c * num + n];
+          chunk_offsets[c * num + n] = total;
+          total += chunk_count;
+        }
+        if (count) count[n] = total - first;
+      }
+      return total;
+    }
+
+    /// Write the GL_LINES indices of the silhouettes found by count_silhouettes().
+    /// The indices of viewpoint n start at dest + first[n], where first[0] = 0 and
+    /// first[n+1] = first[n] + count[n], and each edge is in the winding of the triangle
+    /// that faces the viewpoint, ready to extrude for a shadow volume.
+    void write_silhouettes(uint32_t *dest, job_system *jobs = &job_system::get()) {
+      unsigned num = num_viewpoints;
+      unsigned num_edges = get_num_edges();
+      parallel_for(jobs, get_num_chunks(), 1, [&](unsigned begin, unsigned end) {
+        unsigned offsets[max_viewpoints];
+        for (unsigned c = begin; c != end; ++c) {
+          memcpy(offsets, chunk_offsets.data() + c * num, num * sizeof(unsigned));
+          unsigned edge_end = std::min((c + 1) * chunk_size, num_edges);
+          for (unsigned e = c * chunk_size; e != edge_end; ++e) {
+            uint32_t mask = edge_masks[e];
+            if (!mask) continue;
+            uint32_t v0 = edge_vertices[e * 2], v1 = edge_vertices[e * 2 + 1];
+            uint32_t front = face_masks[edge_faces[e * 2]];
+            while (mask) {
+              unsigned n = find_lowest_bit(mask);
+              mask &= mask - 1;
+              bool is_front = ((front >> n) & 1) != 0;
+              uint32_t *dp = dest + offsets[n];
+              dp[0] = is_front ? v0 : v1;
+              dp[1] = is_front ? v1 : v0;
+              offsets[n] += 2;
+            }
+          }
+        }
+      });
+    }
+  };
+}}
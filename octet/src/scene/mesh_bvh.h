@@ -0,0 +1,457 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// Bounding volume hierarchy of mesh triangles
+//
+// example:
+//
+//   mesh_bvh *bvh = msh->get_bvh();           // built the first time, and when the mesh changes
+//   mesh_bvh::hit h;
+//   if (bvh->ray_cast(start, end - start, 1.0f, h)) {
+//     vec3 pos = start + (end - start) * h.t;
+//   }
+//
+
+namespace octet { namespace scene {
+  /// A bounding volume hierarchy over the triangles of a mesh, for fast ray casts.
+  ///
+  /// The tree is built top down. At each node, the triangle centers are put into bins on each axis
+  /// and the split with the least surface area heuristic (SAH) cost is taken: the area of each side
+  /// times the number of triangles on it, which is roughly the cost of a random ray.
+  ///
+  /// Rays can be cast one at a time or four at a time. The four rays of a packet go down the tree
+  /// together with SSE2, which is much faster when they are close together, as for picking or shadows.
+  class mesh_bvh : public resource {
+  public:
+    /// Where a ray hit a triangle. The hit point is start + distance * t,
+    /// or pos0 * (1 - u - v) + pos1 * u + pos2 * v for the corners of the triangle.
+    struct hit {
+      float t;
+      float u;
+      float v;
+      unsigned triangle;   // the triangle number in the mesh (first index / 3), or ~0 for no hit
+    };
+
+  private:
+    enum {
+      num_bins = 16,
+      max_leaf_size = 16,
+      max_stack = 64,
+    };
+
+    struct node_t {
+      float min[3];
+      uint32_t first;   // first triangle of a leaf or the first of the two children
+      float max[3];
+      uint16_t count;   // number of triangles in a leaf, zero for an inner node
+      uint16_t axis;    // split axis of an inner node
+    };
+
+    // a triangle as a corner and two edges, ready for the ray test.
+    struct triangle_t {
+      float v0[3];
+      float e1[3];
+      float e2[3];
+      uint32_t index;
+    };
+
+    // used while building the tree.
+    struct build_item {
+      vec3 min;
+      vec3 max;
+      vec3 center;
+    };
+
+    dynarray<node_t> nodes;
+    dynarray<triangle_t> triangles;
+    unsigned depth;
+
+    static float get_area(vec3_in size) {
+      return 2 * (size.x() * size.y() + size.y() * size.z() + size.z() * size.x());
+    }
+
+    static vec3 safe_inverse(vec3_in dir) {
+      vec3 inv;
+      for (unsigned i = 0; i != 3; ++i) {
+        inv[i] = dir[i] != 0 ? 1.0f / dir[i] : 1e30f;
+      }
+      return inv;
+    }
+
+    void set_bounds(node_t &n, const build_item *items, const unsigned *begin, const unsigned *end) {
+      vec3 vmin = items[*begin].min, vmax = items[*begin].max;
+      for (const unsigned *p = begin + 1; p != end; ++p) {
+        vmin = min(vmin, items[*p].min);
+        vmax = max(vmax, items[*p].max);
+      }
+      for (unsigned i = 0; i != 3; ++i) {
+        n.min[i] = vmin[i];
+        n.max[i] = vmax[i];
+      }
+    }
+
+    // find the split of [begin, end) with the least SAH cost. Returns false if a leaf is cheaper.
+    bool find_split(const build_item *items, unsigned *begin, unsigned *end, const node_t &n, unsigned &axis, unsigned *&mid) {
+      unsigned count = (unsigned)(end - begin);
+      vec3 cmin = items[*begin].center, cmax = cmin;
+      for (const unsigned *p = begin + 1; p != end; ++p) {
+        cmin = min(cmin, items[*p].center);
+        cmax = max(cmax, items[*p].center);
+      }
+
+      float best_cost = 1e37f;
+      unsigned best_axis = 0, best_bin = 0;
+      for (unsigned a = 0; a != 3; ++a) {
+        float extent = cmax[a] - cmin[a];
+        if (extent <= 0) continue;
+        float scale = num_bins / extent;
+
+        unsigned bin_count[num_bins] = { 0 };
+        vec3 bin_min[num_bins], bin_max[num_bins];
+        for (unsigned b = 0; b != num_bins; ++b) {
+          bin_min[b] = vec3(1e37f);
+          bin_max[b] = vec3(-1e37f);
+        }
+        for (const unsigned *p = begin; p != end; ++p) {
+          const build_item &item = items[*p];
+          unsigned b = std::min((unsigned)((item.center[a] - cmin[a]) * scale), (unsigned)num_bins - 1);
+          bin_count[b]++;
+          bin_min[b] = min(bin_min[b], item.min);
+          bin_max[b] = max(bin_max[b], item.max);
+        }
+
+        // areas of everything to the right of each split, then sweep from the left.
+        float right_area[num_bins];
+        unsigned right_count[num_bins];
+        vec3 rmin(1e37f), rmax(-1e37f);
+        unsigned rc = 0;
+        for (unsigned b = num_bins; b-- > 1; ) {
+          rmin = min(rmin, bin_min[b]);
+          rmax = max(rmax, bin_max[b]);
+          rc += bin_count[b];
+          right_area[b] = rc ? get_area(rmax - rmin) : 0;
+          right_count[b] = rc;
+        }
+        vec3 lmin(1e37f), lmax(-1e37f);
+        unsigned lc = 0;
+        for (unsigned b = 1; b != num_bins; ++b) {
+          lmin = min(lmin, bin_min[b-1]);
+          lmax = max(lmax, bin_max[b-1]);
+          lc += bin_count[b-1];
+          if (lc == 0 || right_count[b] == 0) continue;
+          float cost = get_area(lmax - lmin) * lc + right_area[b] * right_count[b];
+          if (cost < best_cost) {
+            best_cost = cost;
+            best_axis = a;
+            best_bin = b;
+          }
+        }
+      }
+
+      // a leaf costs one triangle test per triangle, a split about one test and the triangles on each side.
+      float area = get_area(vec3(n.max[0] - n.min[0], n.max[1] - n.min[1], n.max[2] - n.min[2]));
+      if (best_cost == 1e37f || (count <= max_leaf_size && best_cost >= (count - 1.0f) * area)) {
+        if (count <= max_leaf_size) return false;
+
+        // all the centers are in the same place: split in the middle.
+        axis = 0;
+        mid = begin + count / 2;
+        return true;
+      }
+
+      axis = best_axis;
+      float scale = num_bins / (cmax[axis] - cmin[axis]);
+      float split = cmin[axis];
+      mid = std::partition(begin, end, [items, axis, scale, split, best_bin](unsigned i) {
+        return std::min((unsigned)((items[i].center[axis] - split) * scale), (unsigned)num_bins - 1) < best_bin;
+      });
+      return true;
+    }
+
+    // build the node for triangles [begin, end).
+    void build_node(unsigned index, const build_item *items, unsigned *first, unsigned *begin, unsigned *end, unsigned level) {
+      depth = std::max(depth, level);
+      set_bounds(nodes[index], items, begin, end);
+      unsigned axis = 0;
+      unsigned *mid = 0;
+      if (level + 1 >= max_stack || !find_split(items, begin, end, nodes[index], axis, mid)) {
+        nodes[index].first = (uint32_t)(begin - first);
+        nodes[index].count = (uint16_t)(end - begin);
+        nodes[index].axis = 0;
+        return;
+      }
+
+      unsigned children = nodes.size();
+      nodes.resize(children + 2);
+      nodes[index].first = children;
+      nodes[index].count = 0;
+      nodes[index].axis = (uint16_t)axis;
+      build_node(children, items, first, begin, mid, level + 1);
+      build_node(children + 1, items, first, mid, end, level + 1);
+    }
+
+    // slab test: returns the distance to the box, or a negative number for a miss.
+    static float intersect_box(const node_t &n, vec3_in org, vec3_in inv_dir, float max_t) {
+      float t0 = 0, t1 = max_t;
+      for (unsigned i = 0; i != 3; ++i) {
+        float ta = (n.min[i] - org[i]) * inv_dir[i];
+        float tb = (n.max[i] - org[i]) * inv_dir[i];
+        t0 = std::max(t0, std::min(ta, tb));
+        t1 = std::min(t1, std::max(ta, tb));
+      }
+      return t0 <= t1 ? t0 : -1;
+    }
+
+    // Moller-Trumbore ray triangle test. Both sides of the triangle are hit.
+    static bool intersect_triangle(const triangle_t &tri, vec3_in org, vec3_in dir, hit &result) {
+      vec3 e1(tri.e1[0], tri.e1[1], tri.e1[2]);
+      vec3 e2(tri.e2[0], tri.e2[1], tri.e2[2]);
+      vec3 p = cross(dir, e2);
+      float det = dot(e1, p);
+      if (det == 0) return false;
+      float inv_det = 1.0f / det;
+      vec3 s = org - vec3(tri.v0[0], tri.v0[1], tri.v0[2]);
+      float u = dot(s, p) * inv_det;
+      if (u < 0 || u > 1) return false;
+      vec3 q = cross(s, e1);
+      float v = dot(dir, q) * inv_det;
+      if (v < 0 || u + v > 1) return false;
+      float t = dot(e2, q) * inv_det;
+      if (t < 0 || t >= result.t) return false;
+      result.t = t;
+      result.u = u;
+      result.v = v;
+      result.triangle = tri.index;
+      return true;
+    }
+
+  public:
+    RESOURCE_META(mesh_bvh)
+
+    /// Make an empty tree.
+    mesh_bvh() {
+      depth = 0;
+    }
+
+    /// Build the tree for triangles given as three corners each.
+    void build(const vec3p *corners, unsigned num_triangles) {
+      nodes.reset();
+      triangles.reset();
+      depth = 0;
+      if (num_triangles == 0) return;
+
+      dynarray<build_item> items(num_triangles);
+      dynarray<unsigned> order(num_triangles);
+      for (unsigned i = 0; i != num_triangles; ++i) {
+        vec3 a = corners[i*3+0], b = corners[i*3+1], c = corners[i*3+2];
+        items[i].min = min(min(a, b), c);
+        items[i].max = max(max(a, b), c);
+        items[i].center = (items[i].min + items[i].max) * 0.5f;
+        order[i] = i;
+      }
+
+      nodes.reserve(num_triangles * 2);
+      nodes.resize(1);
+      build_node(0, items.data(), order.data(), order.data(), order.data() + num_triangles, 0);
+
+      // store the triangles in leaf order so that each leaf is a run.
+      triangles.resize(num_triangles);
+      for (unsigned i = 0; i != num_triangles; ++i) {
+        unsigned src = order[i];
+        vec3 a = corners[src*3+0], b = corners[src*3+1], c = corners[src*3+2];
+        vec3 e1 = b - a, e2 = c - a;
+        triangle_t &tri = triangles[i];
+        for (unsigned j = 0; j != 3; ++j) {
+          tri.v0[j] = a[j];
+          tri.e1[j] = e1[j];
+          tri.e2[j] = e2[j];
+        }
+        tri.index = src;
+      }
+    }
+
+    /// Number of nodes, for statistics.
+    unsigned get_num_nodes() const {
+      return nodes.size();
+    }
+
+    /// Number of triangles in the tree.
+    unsigned get_num_triangles() const {
+      return triangles.size();
+    }
+
+    /// Longest path from the root to a leaf.
+    unsigned get_depth() const {
+      return depth;
+    }
+
+    /// Find the nearest triangle hit by the ray start + distance * t for 0 <= t < max_t.
+    /// Returns false if there is none.
+    bool ray_cast(vec3_in start, vec3_in distance, float max_t, hit &result) const {
+      result.t = max_t;
+      result.u = result.v = 0;
+      result.triangle = ~0u;
+      if (nodes.empty()) return false;
+
+      vec3 inv_dir = safe_inverse(distance);
+      unsigned stack[max_stack];
+      unsigned sp = 0;
+      unsigned index = 0;
+      if (intersect_box(nodes[0], start, inv_dir, max_t) < 0) return false;
+      for (;;) {
+        const node_t &n = nodes[index];
+        if (n.count) {
+          const triangle_t *tri = triangles.data() + n.first;
+          for (unsigned i = 0; i != n.count; ++i) {
+            intersect_triangle(tri[i], start, distance, result);
+          }
+        } else {
+          // visit the near child first, so that the far one can often be skipped.
+          unsigned near_child = n.first + (distance[n.axis] < 0);
+          unsigned far_child = n.first + (distance[n.axis] >= 0);
+          float near_t = intersect_box(nodes[near_child], start, inv_dir, result.t);
+          float far_t = intersect_box(nodes[far_child], start, inv_dir, result.t);
+          if (near_t >= 0) {
+            if (far_t >= 0) stack[sp++] = far_child;
+            index = near_child;
+            continue;
+          } else if (far_t >= 0) {
+            index = far_child;
+            continue;
+          }
+        }
+        // pop nodes that are still closer than the nearest hit.
+        for (;;) {
+          if (sp == 0) return result.triangle != ~0u;
+          index = stack[--sp];
+          if (intersect_box(nodes[index], start, inv_dir, result.t) >= 0) break;
+        }
+      }
+    }
+
+    /// Cast four rays together. The rays should start close together and point in similar directions.
+    void ray_cast4(const vec3 *start, const vec3 *distance, float max_t, hit *results) const {
+      #if OCTET_SSE2
+        for (unsigned r = 0; r != 4; ++r) {
+          results[r].t = max_t;
+          results[r].u = results[r].v = 0;
+          results[r].triangle = ~0u;
+        }
+        if (nodes.empty()) return;
+
+        // rays as structures of arrays.
+        __m128 ox = _mm_setr_ps(start[0][0], start[1][0], start[2][0], start[3][0]);
+        __m128 oy = _mm_setr_ps(start[0][1], start[1][1], start[2][1], start[3][1]);
+        __m128 oz = _mm_setr_ps(start[0][2], start[1][2], start[2][2], start[3][2]);
+        __m128 dx = _mm_setr_ps(distance[0][0], distance[1][0], distance[2][0], distance[3][0]);
+        __m128 dy = _mm_setr_ps(distance[0][1], distance[1][1], distance[2][1], distance[3][1]);
+        __m128 dz = _mm_setr_ps(distance[0][2], distance[1][2], distance[2][2], distance[3][2]);
+        vec3 inv[4] = { safe_inverse(distance[0]), safe_inverse(distance[1]), safe_inverse(distance[2]), safe_inverse(distance[3]) };
+        __m128 ix = _mm_setr_ps(inv[0][0], inv[1][0], inv[2][0], inv[3][0]);
+        __m128 iy = _mm_setr_ps(inv[0][1], inv[1][1], inv[2][1], inv[3][1]);
+        __m128 iz = _mm_setr_ps(inv[0][2], inv[1][2], inv[2][2], inv[3][2]);
+        __m128 best_t = _mm_set1_ps(max_t), best_u = _mm_setzero_ps(), best_v = _mm_setzero_ps();
+        __m128i best_tri = _mm_set1_epi32(-1);
+        __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f);
+
+        // the directions of the first ray choose which child to visit first.
+        unsigned dir_neg[3] = { distance[0][0] < 0, distance[0][1] < 0, distance[0][2] < 0 };
+
+        unsigned stack[max_stack];
+        unsigned sp = 0;
+        stack[sp++] = 0;
+        while (sp) {
+          const node_t &n = nodes[stack[--sp]];
+
+          // slab test of all four rays against the node.
+          __m128 tx0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(n.min[0]), ox), ix);
+          __m128 tx1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(n.max[0]), ox), ix);
+          __m128 ty0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(n.min[1]), oy), iy);
+          __m128 ty1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(n.max[1]), oy), iy);
+          __m128 tz0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(n.min[2]), oz), iz);
+          __m128 tz1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(n.max[2]), oz), iz);
+          __m128 t0 = _mm_max_ps(_mm_max_ps(_mm_min_ps(tx0, tx1), _mm_min_ps(ty0, ty1)), _mm_max_ps(_mm_min_ps(tz0, tz1), zero));
+          __m128 t1 = _mm_min_ps(_mm_min_ps(_mm_max_ps(tx0, tx1), _mm_max_ps(ty0, ty1)), _mm_min_ps(_mm_max_ps(tz0, tz1), best_t));
+          if (!_mm_movemask_ps(_mm_cmple_ps(t0, t1))) continue;
+
+          if (!n.count) {
+            unsigned neg = dir_neg[n.axis];
+            stack[sp++] = n.first + 1 - neg;
+            stack[sp++] = n.first + neg;
+            continue;
+          }
+
+          // test each triangle of the leaf against all four rays.
+          const triangle_t *tri = triangles.data() + n.first;
+          for (unsigned i = 0; i != n.count; ++i, ++tri) {
+            __m128 e1x = _mm_set1_ps(tri->e1[0]), e1y = _mm_set1_ps(tri->e1[1]), e1z = _mm_set1_ps(tri->e1[2]);
+            __m128 e2x = _mm_set1_ps(tri->e2[0]), e2y = _mm_set1_ps(tri->e2[1]), e2z = _mm_set1_ps(tri->e2[2]);
+
+            // p = cross(dir, e2), det = dot(e1, p)
+            __m128 px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+            __m128 py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+            __m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+            __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+            __m128 inv_det = _mm_div_ps(one, det);
+
+            // s = org - v0, u = dot(s, p) / det
+            __m128 sx = _mm_sub_ps(ox, _mm_set1_ps(tri->v0[0]));
+            __m128 sy = _mm_sub_ps(oy, _mm_set1_ps(tri->v0[1]));
+            __m128 sz = _mm_sub_ps(oz, _mm_set1_ps(tri->v0[2]));
+            __m128 u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(sx, px), _mm_mul_ps(sy, py)), _mm_mul_ps(sz, pz)), inv_det);
+
+            // q = cross(s, e1), v = dot(dir, q) / det, t = dot(e2, q) / det
+            __m128 qx = _mm_sub_ps(_mm_mul_ps(sy, e1z), _mm_mul_ps(sz, e1y));
+            __m128 qy = _mm_sub_ps(_mm_mul_ps(sz, e1x), _mm_mul_ps(sx, e1z));
+            __m128 qz = _mm_sub_ps(_mm_mul_ps(sx, e1y), _mm_mul_ps(sy, e1x));
+            __m128 v = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz)), inv_det);
+            __m128 t = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)), inv_det);
+
+            // comparisons with NaN (det == 0) are false, so those lanes miss.
+            __m128 mask = _mm_and_ps(
+              _mm_and_ps(_mm_cmpge_ps(u, zero), _mm_cmpge_ps(v, zero)),
+              _mm_and_ps(_mm_cmple_ps(_mm_add_ps(u, v), one), _mm_and_ps(_mm_cmpge_ps(t, zero), _mm_cmplt_ps(t, best_t)))
+            );
+            if (!_mm_movemask_ps(mask)) continue;
+            best_t = _mm_or_ps(_mm_and_ps(mask, t), _mm_andnot_ps(mask, best_t));
+            best_u = _mm_or_ps(_mm_and_ps(mask, u), _mm_andnot_ps(mask, best_u));
+            best_v = _mm_or_ps(_mm_and_ps(mask, v), _mm_andnot_ps(mask, best_v));
+            __m128i imask = _mm_castps_si128(mask);
+            best_tri = _mm_or_si128(_mm_and_si128(imask, _mm_set1_epi32((int)tri->index)), _mm_andnot_si128(imask, best_tri));
+          }
+        }
+
+        float ts[4], us[4], vs[4];
+        uint32_t tris[4];
+        _mm_storeu_ps(ts, best_t);
+        _mm_storeu_ps(us, best_u);
+        _mm_storeu_ps(vs, best_v);
+        _mm_storeu_si128((__m128i*)tris, best_tri);
+        for (unsigned r = 0; r != 4; ++r) {
+          results[r].t = ts[r];
+          results[r].u = us[r];
+          results[r].v = vs[r];
+          results[r].triangle = tris[r];
+        }
+      #else
+        for (unsigned r = 0; r != 4; ++r) {
+          ray_cast(start[r], distance[r], max_t, results[r]);
+        }
+      #endif
+    }
+
+    /// Cast many rays, four at a time. Rays next to each other in the array should be close together.
+    void ray_cast(const vec3 *start, const vec3 *distance, unsigned num_rays, float max_t, hit *results) const {
+      unsigned i = 0;
+      for (; i + 4 <= num_rays; i += 4) {
+        ray_cast4(start + i, distance + i, max_t, results + i);
+      }
+      for (; i != num_rays; ++i) {
+        ray_cast(start[i], distance[i], max_t, results[i]);
+      }
+    }
+  };
+}}
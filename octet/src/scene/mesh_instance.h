@@ -11,7 +11,9 @@ namespace octet { namespace scene {
   /// Instance of a mesh in a game world; node, mesh, material and skin.
   class mesh_instance : public resource {
   public:
-    enum { flag_selected = 1 << 0, flag_enabled = 1 << 1, flag_lod = 1 << 2 };
+    /// flag_no_cull: always draw this instance, even if its mesh's box is off screen.
+    /// flag_translucent: when the scene sorts by state, draw this instance after the opaque ones, furthest first.
+    enum { flag_selected = 1 << 0, flag_enabled = 1 << 1, flag_lod = 1 << 2, flag_no_cull = 1 << 3, flag_translucent = 1 << 4 };
 
   private:
     // which scene_node (model to world matrix) to use in the scene
@@ -26,6 +28,9 @@ namespace octet { namespace scene {
     // for characters, which skeleton to use
     ref<skeleton> skel;
 
+    // for characters with too many bones for the shader, the mesh skinned on the CPU
+    ref<cpu_skin> cpu_skinned;
+
     // assorted mesh instance booleans (see flag_*)
     unsigned flags;
 
@@ -35,6 +40,9 @@ namespace octet { namespace scene {
     // if the object is further than this from the camera, do not draw.
     float max_draw_distance;
 
+    // where this instance is in its visual_scene, so that it can be deleted in O(1).
+    slot_handle scene_handle;
+
   public:
     RESOURCE_META(mesh_instance)
 
@@ -47,6 +55,7 @@ namespace octet { namespace scene {
       flags = flag_enabled;
       min_draw_distance = -8.507059e37f;
       max_draw_distance = 8.507059e37f;
+      scene_handle = 0;
     }
 
     /// metadata visitor. Used for serialisation and script interface.
@@ -58,6 +67,16 @@ namespace octet { namespace scene {
       v.visit(flags, atom_flags);
     }
 
+    /// Handle of this instance in the visual_scene it was last added to, or 0.
+    slot_handle get_scene_handle() const {
+      return scene_handle;
+    }
+
+    /// Called by visual_scene to remember where it put this instance.
+    void set_scene_handle(slot_handle value) {
+      scene_handle = value;
+    }
+
     //////////////////////////////
     //
     // animation_target interface
@@ -142,6 +161,12 @@ namespace octet { namespace scene {
     /// Set the skeleton for this instance.
     void set_skeleton(skeleton *value) { skel = value; }
 
+    /// Get the CPU skinned copy of the mesh, if any.
+    cpu_skin *get_cpu_skin() const { return cpu_skinned; }
+
+    /// Set the CPU skinned copy of the mesh.
+    void set_cpu_skin(cpu_skin *value) { cpu_skinned = value; }
+
     /// Set the flags for this instance.
     void set_flags(unsigned value) { flags = value; }
 
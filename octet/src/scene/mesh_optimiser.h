@@ -0,0 +1,409 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// Triangle and vertex ordering for the GPU
+//
+// example:
+//
+//   mesh_optimiser::cache_stats before, after;
+//   msh->reindex();                                    // share vertices first
+//   mesh_optimiser::optimise(msh, &before, &after);
+//   printf("ACMR %f -> %f\n", before.acmr, after.acmr);
+//
+
+namespace octet { namespace scene {
+  /// Reorders the triangles and vertices of a mesh so that the GPU draws it faster.
+  ///
+  /// Three passes run in turn:
+  ///
+  /// - Vertex cache: triangles are reordered with Tom Forsyth's linear speed algorithm, which
+  ///   greedily picks the next triangle by a score made from the cache position of its vertices
+  ///   and the number of triangles left to draw that use them.
+  /// - Overdraw: the new order is cut into clusters where the cache would start afresh, and
+  ///   clusters that face out from the middle of the mesh are drawn first, as they tend to hide
+  ///   the others. The cuts keep the cache miss ratio within a threshold of the cache pass.
+  /// - Vertex fetch: vertices are renumbered in the order the triangles first use them, so the
+  ///   vertex buffer is read from start to end.
+  ///
+  /// The quality of the result is measured as the average cache miss ratio (ACMR): vertex
+  /// shader runs per triangle, from 0.5 for a large regular grid up to 3. The average
+  /// transform to vertex ratio (ATVR) is vertex shader runs per vertex, with 1 the best.
+  class mesh_optimiser {
+  public:
+    /// Cache behaviour of an index buffer.
+    struct cache_stats {
+      float acmr;               // vertex shader runs per triangle
+      float atvr;               // vertex shader runs per vertex
+      unsigned num_triangles;
+      unsigned num_vertices;    // vertices used by the triangles
+    };
+
+    enum {
+      forsyth_cache_size = 32,  // the cache the triangle order is made for
+      stats_cache_size = 16,    // a FIFO cache like that of common GPUs, for the statistics
+    };
+
+  private:
+    // the two parts of a vertex score.
+    struct score_tables {
+      float cache[forsyth_cache_size];    // from its place in the cache
+      float valence[64];                  // from the number of triangles still to draw
+
+      score_tables() {
+        for (int i = 0; i != forsyth_cache_size; ++i) {
+          // the three most recent vertices score a fixed amount, so that strips are not favoured over fans.
+          cache[i] = i < 3 ? 0.75f : powf(1.0f - (float)(i - 3) / (forsyth_cache_size - 3), 1.5f);
+        }
+        // vertices with few triangles left are boosted to get rid of lone triangles.
+        valence[0] = 0;
+        for (unsigned i = 1; i != 64; ++i) {
+          valence[i] = 2.0f / sqrtf((float)i);
+        }
+      }
+    };
+
+    static float get_vertex_score(const score_tables &tables, int cache_pos, unsigned remaining) {
+      if (!remaining) return -1.0f;
+      float score = cache_pos < 0 ? 0.0f : tables.cache[cache_pos];
+      return score + (remaining < 64 ? tables.valence[remaining] : 2.0f / sqrtf((float)remaining));
+    }
+
+    // a FIFO cache simulation: a vertex is in the cache if fewer than cache_size misses have happened since it was loaded.
+    class fifo_cache {
+      dynarray<unsigned> loaded;
+      unsigned time;
+      unsigned size;
+    public:
+      fifo_cache(unsigned num_vertices, unsigned size_) : loaded(num_vertices), size(size_) {
+        memset(loaded.data(), 0, num_vertices * sizeof(unsigned));
+        time = size + 1;
+      }
+
+      // returns 1 for a miss.
+      unsigned use(unsigned vertex) {
+        if (time - loaded[vertex] > size) {
+          loaded[vertex] = time++;
+          return 1;
+        }
+        return 0;
+      }
+
+      // forget everything, as if a new draw call started.
+      void flush() {
+        time += size + 1;
+      }
+    };
+
+    // triangles of each vertex
+    struct adjacency {
+      dynarray<unsigned> offsets;
+      dynarray<unsigned> triangles;
+      dynarray<unsigned> counts;
+
+      adjacency(const uint32_t *indices, unsigned num_indices, unsigned num_vertices) : offsets(num_vertices + 1), triangles(num_indices), counts(num_vertices) {
+        memset(counts.data(), 0, num_vertices * sizeof(unsigned));
+        for (unsigned i = 0; i != num_indices; ++i) {
+          counts[indices[i]]++;
+        }
+        unsigned total = 0;
+        for (unsigned v = 0; v != num_vertices; ++v) {
+          offsets[v] = total;
+          total += counts[v];
+        }
+        offsets[num_vertices] = total;
+        memset(counts.data(), 0, num_vertices * sizeof(unsigned));
+        for (unsigned i = 0; i != num_indices; ++i) {
+          unsigned v = indices[i];
+          triangles[offsets[v] + counts[v]++] = i / 3;
+        }
+      }
+    };
+
+    static void get_triangle(vec3 &centre, vec3 &normal, const vec3p *positions, const uint32_t *tri) {
+      vec3 p0 = positions[tri[0]], p1 = positions[tri[1]], p2 = positions[tri[2]];
+      centre = (p0 + p1 + p2) * (1.0f / 3);
+      normal = cross(p1 - p0, p2 - p0);
+    }
+
+  public:
+    /// Measure the vertex cache behaviour of some triangles.
+    static cache_stats analyse(const uint32_t *indices, unsigned num_indices, unsigned num_vertices, unsigned cache_size = stats_cache_size) {
+      cache_stats result = { 0, 0, num_indices / 3, 0 };
+      fifo_cache cache(num_vertices, cache_size);
+      dynarray<uint8_t> used(num_vertices);
+      memset(used.data(), 0, num_vertices);
+      unsigned misses = 0;
+      for (unsigned i = 0; i != num_indices; ++i) {
+        misses += cache.use(indices[i]);
+        result.num_vertices += used[indices[i]] ? 0 : 1;
+        used[indices[i]] = 1;
+      }
+      result.acmr = result.num_triangles ? (float)misses / result.num_triangles : 0;
+      result.atvr = result.num_vertices ? (float)misses / result.num_vertices : 0;
+      return result;
+    }
+
+    /// Reorder triangles for the vertex cache with Forsyth's algorithm. dest and indices must not overlap.
+    static void optimise_vertex_cache(uint32_t *dest, const uint32_t *indices, unsigned num_indices, unsigned num_vertices) {
+      static const score_tables tables;
+      unsigned num_triangles = num_indices / 3;
+      adjacency adj(indices, num_triangles * 3, num_vertices);
+
+      // adj.counts is the number of triangles still to draw; the live ones are at the start of each list.
+      dynarray<float> score(num_vertices);
+      for (unsigned v = 0; v != num_vertices; ++v) {
+        score[v] = get_vertex_score(tables, -1, adj.counts[v]);
+      }
+      dynarray<uint8_t> emitted(num_triangles);
+      memset(emitted.data(), 0, num_triangles);
+
+      unsigned cache[forsyth_cache_size + 3];
+      unsigned cache_count = 0;
+      unsigned best = num_triangles ? 0 : ~0u;
+      unsigned cursor = 0;
+
+      for (unsigned n = 0; n != num_triangles; ++n) {
+        if (best == ~0u) {
+          // dead end: take the next triangle of the original order.
+          while (emitted[cursor]) ++cursor;
+          best = cursor;
+        }
+
+        const uint32_t *tri = indices + best * 3;
+        memcpy(dest + n * 3, tri, 3 * sizeof(uint32_t));
+        emitted[best] = 1;
+
+        // take the triangle off the live lists of its vertices.
+        for (unsigned j = 0; j != 3; ++j) {
+          unsigned v = tri[j];
+          unsigned *list = adj.triangles.data() + adj.offsets[v];
+          unsigned count = adj.counts[v];
+          for (unsigned k = 0; k != count; ++k) {
+            if (list[k] == best) {
+              list[k] = list[count - 1];
+              list[count - 1] = best;
+              adj.counts[v] = count - 1;
+              break;
+            }
+          }
+        }
+
+        // the triangle's vertices go to the front of the LRU cache.
+        unsigned new_cache[forsyth_cache_size + 3];
+        unsigned new_count = 0;
+        for (unsigned j = 0; j != 3; ++j) {
+          unsigned v = tri[j];
+          if (new_count == 0 || (v != new_cache[0] && (new_count == 1 || v != new_cache[1]))) {
+            new_cache[new_count++] = v;
+          }
+        }
+        for (unsigned i = 0; i != cache_count; ++i) {
+          unsigned v = cache[i];
+          if (v != tri[0] && v != tri[1] && v != tri[2]) new_cache[new_count++] = v;
+        }
+
+        // rescore the vertices in the cache and those that just fell out of it.
+        for (unsigned i = 0; i != new_count; ++i) {
+          unsigned v = new_cache[i];
+          score[v] = get_vertex_score(tables, i < forsyth_cache_size ? (int)i : -1, adj.counts[v]);
+        }
+        cache_count = std::min(new_count, (unsigned)forsyth_cache_size);
+        memcpy(cache, new_cache, cache_count * sizeof(unsigned));
+
+        // the next triangle is the best one that uses a vertex in the cache.
+        best = ~0u;
+        float best_score = -1.0f;
+        for (unsigned i = 0; i != cache_count; ++i) {
+          unsigned v = cache[i];
+          const unsigned *list = adj.triangles.data() + adj.offsets[v];
+          for (unsigned k = 0, count = adj.counts[v]; k != count; ++k) {
+            const uint32_t *t = indices + list[k] * 3;
+            float s = score[t[0]] + score[t[1]] + score[t[2]];
+            if (s > best_score) {
+              best_score = s;
+              best = list[k];
+            }
+          }
+        }
+      }
+    }
+
+    /// Reorder clusters of triangles so that those facing out from the middle of the mesh are drawn first.
+    /// The triangles should already be in vertex cache order. The clusters are chosen so that the cache
+    /// miss ratio grows by at most the threshold (eg. 1.05 for 5%). dest and indices must not overlap.
+    static void optimise_overdraw(uint32_t *dest, const uint32_t *indices, unsigned num_indices, const vec3p *positions, unsigned num_vertices, float threshold = 1.05f) {
+      unsigned num_triangles = num_indices / 3;
+      if (num_triangles == 0) return;
+
+      // hard boundaries: places where the cache order jumps to a new part of the mesh (three misses).
+      dynarray<unsigned> hard;
+      {
+        fifo_cache cache(num_vertices, stats_cache_size);
+        for (unsigned t = 0; t != num_triangles; ++t) {
+          const uint32_t *tri = indices + t * 3;
+          unsigned misses = cache.use(tri[0]) + cache.use(tri[1]) + cache.use(tri[2]);
+          if (t == 0 || misses == 3) hard.push_back(t);
+        }
+        hard.push_back(num_triangles);
+      }
+
+      // soft boundaries: cut each hard cluster as soon as a piece, drawn from an empty cache,
+      // is within the threshold of the cluster's own miss ratio.
+      dynarray<unsigned> clusters;
+      {
+        fifo_cache cache(num_vertices, stats_cache_size);
+        for (unsigned h = 0; h + 1 < hard.size(); ++h) {
+          unsigned start = hard[h], end = hard[h + 1];
+          cache.flush();
+          unsigned misses = 0;
+          for (unsigned t = start; t != end; ++t) {
+            const uint32_t *tri = indices + t * 3;
+            misses += cache.use(tri[0]) + cache.use(tri[1]) + cache.use(tri[2]);
+          }
+          float target = threshold * misses / (end - start);
+
+          cache.flush();
+          unsigned piece = start;
+          misses = 0;
+          clusters.push_back(start);
+          for (unsigned t = start; t != end; ++t) {
+            const uint32_t *tri = indices + t * 3;
+            misses += cache.use(tri[0]) + cache.use(tri[1]) + cache.use(tri[2]);
+            if (t + 1 != end && misses <= target * (t + 1 - piece)) {
+              clusters.push_back(t + 1);
+              cache.flush();
+              piece = t + 1;
+              misses = 0;
+            }
+          }
+        }
+        clusters.push_back(num_triangles);
+      }
+
+      // the middle of the mesh, by area.
+      vec3 mesh_centre(0, 0, 0);
+      float mesh_area = 0;
+      for (unsigned t = 0; t != num_triangles; ++t) {
+        vec3 centre, normal;
+        get_triangle(centre, normal, positions, indices + t * 3);
+        float area = length(normal);
+        mesh_centre += centre * area;
+        mesh_area += area;
+      }
+      mesh_centre = mesh_area > 0 ? mesh_centre / mesh_area : mesh_centre;
+
+      // sort the clusters by how far they face out from the middle.
+      unsigned num_clusters = clusters.size() - 1;
+      dynarray<float> sort_key(num_clusters);
+      dynarray<unsigned> order(num_clusters);
+      for (unsigned c = 0; c != num_clusters; ++c) {
+        vec3 cluster_centre(0, 0, 0), cluster_normal(0, 0, 0);
+        float cluster_area = 0;
+        for (unsigned t = clusters[c]; t != clusters[c + 1]; ++t) {
+          vec3 centre, normal;
+          get_triangle(centre, normal, positions, indices + t * 3);
+          float area = length(normal);
+          cluster_centre += centre * area;
+          cluster_normal += normal;
+          cluster_area += area;
+        }
+        cluster_centre = cluster_area > 0 ? cluster_centre / cluster_area : cluster_centre;
+        float normal_length = length(cluster_normal);
+        cluster_normal = normal_length > 0 ? cluster_normal / normal_length : cluster_normal;
+        sort_key[c] = dot(cluster_centre - mesh_centre, cluster_normal);
+        order[c] = c;
+      }
+      std::stable_sort(order.data(), order.data() + num_clusters, [&](unsigned a, unsigned b) {
+        return sort_key[a] > sort_key[b];
+      });
+
+      uint32_t *dp = dest;
+      for (unsigned c = 0; c != num_clusters; ++c) {
+        unsigned start = clusters[order[c]], end = clusters[order[c] + 1];
+        memcpy(dp, indices + start * 3, (end - start) * 3 * sizeof(uint32_t));
+        dp += (end - start) * 3;
+      }
+    }
+
+    /// Number the vertices in the order the triangles first use them. remap[old vertex] is the new vertex,
+    /// or ~0 for vertices no triangle uses. The indices are rewritten. Returns the number of vertices used.
+    static unsigned optimise_vertex_fetch(uint32_t *remap, uint32_t *indices, unsigned num_indices, unsigned num_vertices) {
+      memset(remap, 0xff, num_vertices * sizeof(uint32_t));
+      unsigned next = 0;
+      for (unsigned i = 0; i != num_indices; ++i) {
+        uint32_t &r = remap[indices[i]];
+        if (r == ~0u) r = next++;
+        indices[i] = r;
+      }
+      return next;
+    }
+
+    /// Run the three passes on a triangle mesh, replacing its index and vertex buffers.
+    /// Vertices that no triangle uses are dropped. Share vertices first with mesh::reindex().
+    /// Returns false if the mesh is not made of indexed triangles.
+    static bool optimise(mesh *msh, cache_stats *before = 0, cache_stats *after = 0, float overdraw_threshold = 1.05f) {
+      unsigned index_type = msh->get_index_type();
+      unsigned pos_slot = msh->get_slot(attribute_pos);
+      if (msh->get_mode() != GL_TRIANGLES || pos_slot == ~0u) return false;
+      if (index_type != GL_UNSIGNED_SHORT && index_type != GL_UNSIGNED_INT) return false;
+
+      unsigned num_indices = msh->get_num_indices() / 3 * 3;
+      unsigned num_vertices = msh->get_num_vertices();
+      unsigned stride = msh->get_stride();
+      dynarray<uint32_t> indices(num_indices);
+      dynarray<vec3p> positions(num_vertices);
+      dynarray<uint8_t> vertex_bytes(num_vertices * stride);
+      {
+        gl_resource::rolock idx_lock(msh->get_indices());
+        gl_resource::rolock vtx_lock(msh->get_vertices());
+        for (unsigned i = 0; i != num_indices; ++i) {
+          indices[i] = msh->get_index(idx_lock.u8(), i);
+          if (indices[i] >= num_vertices) return false;
+        }
+        for (unsigned v = 0; v != num_vertices; ++v) {
+          positions[v] = msh->get_value(vtx_lock.u8(), pos_slot, v).xyz();
+        }
+        memcpy(vertex_bytes.data(), vtx_lock.u8(), num_vertices * stride);
+      }
+
+      if (before) *before = analyse(indices.data(), num_indices, num_vertices);
+
+      dynarray<uint32_t> ordered(num_indices);
+      optimise_vertex_cache(ordered.data(), indices.data(), num_indices, num_vertices);
+      optimise_overdraw(indices.data(), ordered.data(), num_indices, positions.data(), num_vertices, overdraw_threshold);
+
+      dynarray<uint32_t> remap(num_vertices);
+      unsigned num_used = optimise_vertex_fetch(remap.data(), indices.data(), num_indices, num_vertices);
+
+      if (after) *after = analyse(indices.data(), num_indices, num_used);
+
+      // new buffers, in case the old ones are shared with other meshes.
+      dynarray<uint8_t> new_vertices(num_used * stride);
+      for (unsigned v = 0; v != num_vertices; ++v) {
+        if (remap[v] != ~0u) memcpy(new_vertices.data() + remap[v] * stride, vertex_bytes.data() + v * stride, stride);
+      }
+      unsigned index_size = index_type == GL_UNSIGNED_SHORT ? 2 : 4;
+      gl_resource *idx = new gl_resource(GL_ELEMENT_ARRAY_BUFFER, num_indices * index_size);
+      gl_resource *vtx = new gl_resource(GL_ARRAY_BUFFER, new_vertices.size());
+      if (index_type == GL_UNSIGNED_SHORT) {
+        gl_resource::wolock idx_lock(idx);
+        for (unsigned i = 0; i != num_indices; ++i) {
+          idx_lock.u16()[i] = (uint16_t)indices[i];
+        }
+      } else {
+        idx->assign(indices.data(), 0, num_indices * index_size);
+      }
+      vtx->assign(new_vertices.data(), 0, new_vertices.size());
+
+      msh->set_indices(idx);
+      msh->set_vertices(vtx);
+      msh->set_first_index(0);
+      msh->set_num_indices(num_indices);
+      msh->set_num_vertices(num_used);
+      return true;
+    }
+  };
+}}
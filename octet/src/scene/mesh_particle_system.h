@@ -76,15 +76,15 @@ namespace octet { namespace scene {
 
     // POD (plain-old-data) structure dynarray of camera-facing particles
     dynarray<billboard_particle> billboard_particles;
-    int free_billboard_particle;
+    dynamic_bitset<> billboard_live;
 
     // POD structure dynarray of trail particles.
     dynarray<trail_particle> trail_particles;
-    int free_trail_particle;
+    dynamic_bitset<> trail_live;
 
     // POD structure dynarray of animators for particles.
     dynarray<particle_animator> particle_animators;
-    int free_particle_animator;
+    dynamic_bitset<> animator_live;
 
     // camera matrix
     mat4t cameraToWorld;
@@ -95,32 +95,31 @@ namespace octet { namespace scene {
       billboard_particles.reserve(bbcap);
       trail_particles.reserve(tpcap);
       particle_animators.reserve(pacap);
-      free_billboard_particle = -1;
-      free_trail_particle = -1;
-      free_particle_animator = -1;
+      billboard_live.resize(bbcap);
+      trail_live.resize(tpcap);
+      animator_live.resize(pacap);
 
       unsigned vsize = (bbcap * 4 + tpcap * 2) * sizeof(vertex);
       unsigned isize = (bbcap * 6 + tpcap * 6) * sizeof(uint32_t);
       mesh::allocate(vsize, isize);
     }
 
-    // pool allocation of particles.
+    // pool allocation of particles: the live mask has one bit per slot.
     // note: we won't allocate beyond the capacity
-    template <class Type> int allocate(dynarray<Type> &array, int &free) {
-      int result = free;
-      if (free != -1) {
-        free = array[free].link;
-      } else if (array.size() < array.capacity()) {
-        result = (int)array.size();
-        array.resize(result+1);
+    template <class Type> int allocate(dynarray<Type> &array, dynamic_bitset<> &live) {
+      int result = live.find_next_clear();
+      if (result != -1) {
+        if ((unsigned)result >= array.size()) {
+          array.resize(result+1);
+        }
+        live.setbit(result);
       }
       return result;
     }
 
     // return to pool
-    template <class Type> void free(dynarray<Type> &array, int &free, int element) {
-      array[free].link = free;
-      free = element;
+    void free(dynamic_bitset<> &live, int element) {
+      live.clearbit(element);
     }
 
   public:
@@ -133,15 +132,18 @@ namespace octet { namespace scene {
 
     /// Update the vertices for newtonian physics.
     void animate(float time_step) {
-      for (unsigned i = 0; i != particle_animators.size(); ++i) {
+      for (int i = animator_live.find_first(); i != -1; i = animator_live.find_next(i+1)) {
         particle_animator &g = particle_animators[i];
-        if (g.link >= 0) {
+        if (g.link < 0) {
+          // the particle could not be allocated.
+          free(animator_live, i);
+        } else {
           billboard_particle &p = billboard_particles[g.link];
           if (g.age >= g.lifetime) {
             p.enabled = false;
-            free(billboard_particles, free_billboard_particle, g.link);
+            free(billboard_live, g.link);
             g.link = -1;
-            free(particle_animators, free_particle_animator, i);
+            free(animator_live, i);
           } else {
             p.pos = (vec3)p.pos + (vec3)g.vel * time_step;
             g.vel = (vec3)g.vel + (vec3)g.acceleration * time_step;
@@ -174,7 +176,7 @@ namespace octet { namespace scene {
       vec3 cy = cameraToWorld.y().xyz();
       vec3p n = cameraToWorld.z().xyz();
 
-      for (unsigned i = 0; i != billboard_particles.size(); ++i) {
+      for (int i = billboard_live.find_first(); i != -1; i = billboard_live.find_next(i+1)) {
         billboard_particle &p = billboard_particles[i];
         if (p.enabled) {
           vec2 size = p.size;
@@ -203,7 +205,7 @@ namespace octet { namespace scene {
 
     /// Add a billboard particle. Returns -1 if capacity reached.
     int add_billboard_particle(const billboard_particle &p) {
-      int i = allocate(billboard_particles, free_billboard_particle);
+      int i = allocate(billboard_particles, billboard_live);
       if (i != -1) {
         billboard_particles[i] = p;
       }
@@ -212,7 +214,7 @@ namespace octet { namespace scene {
 
     /// Add a particle animator. Returns -1 if capacity reached.
     int add_particle_animator(const particle_animator &p) {
-      int i = allocate(particle_animators, free_particle_animator);
+      int i = allocate(particle_animators, animator_live);
       if (i != -1) {
         particle_animators[i] = p;
       }
@@ -221,7 +223,7 @@ namespace octet { namespace scene {
 
     /// Add a trail particle. Returns -1 if capacity reached.
     int add_trail_particle(const trail_particle &p) {
-      int i = allocate(trail_particles, free_trail_particle);
+      int i = allocate(trail_particles, trail_live);
       if (i != -1) {
         trail_particles[i] = p;
       }
@@ -237,11 +239,11 @@ namespace octet { namespace scene {
       mesh::visit(v);
       /*
       v.visit(billboard_particles);
-      v.visit(free_billboard_particle);
+      v.visit(billboard_live);
       v.visit(trail_particles);
-      v.visit(free_trail_particle);
+      v.visit(trail_live);
       v.visit(particle_animators);
-      v.visit(free_particle_animator);
+      v.visit(animator_live);
       v.visit(cameraToWorld);
       */
     }
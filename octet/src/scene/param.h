@@ -34,7 +34,8 @@ namespace octet { namespace scene {
     virtual void bind(param_bind_info &pbi) {
     }
 
-    virtual void render(const uint8_t *buffer) {
+    /// Set the GL state for this parameter in a version of the program (see shader::get_program_version()).
+    virtual void render(const uint8_t *buffer, unsigned mode = shader::instancing_none) {
     }
 
     const char *get_atom_name() const {
@@ -45,7 +46,7 @@ namespace octet { namespace scene {
       return name;
     }
 
-    uint16_t get_gl_type() {
+    uint16_t get_gl_type() const {
       return type;
     }
 
@@ -86,6 +87,12 @@ namespace octet { namespace scene {
 
   struct param_bind_info {
     GLint program;
+    unsigned mode;  // version of the program (see shader::get_program_version())
+
+    param_bind_info() {
+      program = 0;
+      mode = shader::instancing_none;
+    }
   };
 
   struct param_buffer_info {
@@ -105,7 +112,7 @@ namespace octet { namespace scene {
   /// For OpenGL ES3 we keep uniforms in a uniform buffer and use the buffer.
   /// The parameter uniform records the location, name and type of the uniform as well as the repeat count for arrays.
   class param_uniform : public param {
-    GLint uniform;           // uniform index
+    GLint uniform[shader::num_program_versions];  // uniform index in each version of the program
     uint16_t offset;         // offset in uniform buffer
     uint16_t repeat;         // how many in array?
     uint8_t uniform_buffer;  // Which uniform buffer? 0 = dynamic, 1 = static.
@@ -113,6 +120,14 @@ namespace octet { namespace scene {
     RESOURCE_META(param_uniform)
 
     param_uniform() {
+      init_uniforms();
+    }
+
+    /// no locations until bind() is called.
+    void init_uniforms() {
+      for (unsigned i = 0; i != shader::num_program_versions; ++i) {
+        uniform[i] = -1;
+      }
     }
 
     /// create a new uniform parameter with a prototype in "buffer"
@@ -120,6 +135,7 @@ namespace octet { namespace scene {
     param_uniform(param_buffer_info &pbi, const void *data, atom_t name, uint16_t _type, uint16_t _repeat, stage_type _stage=stage_fragment) :
       param(name, _type, _stage)
     {
+      init_uniforms();
       repeat = _repeat;
 
       // in uniform buffers, everything is in units of 16 bytes
@@ -169,19 +185,35 @@ namespace octet { namespace scene {
 
     /// connect the parameter to the shader
     void bind(param_bind_info &pbi) {
-      uniform = glGetUniformLocation(pbi.program, get_atom_name());
-      //log("bind %d %s\n", uniform, get_atom_name());
+      uniform[pbi.mode] = glGetUniformLocation(pbi.program, get_atom_name());
+      //log("bind %d %s\n", uniform[pbi.mode], get_atom_name());
     }
 
     /// get the uniform location
-    GLint get_uniform() const {
-      return uniform;
+    GLint get_uniform(unsigned mode = shader::instancing_none) const {
+      return uniform[mode];
     }
 
     unsigned get_offset() const {
       return offset;
     }
 
+    /// number of elements in an array uniform, or one.
+    unsigned get_repeat() const {
+      return repeat;
+    }
+
+    /// bytes used in the buffer; each element takes 16 bytes per column as in a std140 uniform block.
+    unsigned get_size() const {
+      unsigned size = repeat * 16;
+      switch (get_gl_type()) {
+        case GL_FLOAT_MAT2: size *= 2; break;
+        case GL_FLOAT_MAT3: size *= 3; break;
+        case GL_FLOAT_MAT4: size *= 4; break;
+      }
+      return size;
+    }
+
     /// if buffer is a pointer to a uniform buffer, set the value in the correct place.
     void set_value(uint8_t *buffer, const void *value, unsigned size) {
       memcpy(buffer + offset, value, size);
@@ -199,16 +231,21 @@ namespace octet { namespace scene {
 
     /// for OpenGL ES2, call glUniform* to copy the uniform to the GPU command buffer.
     /// for OpenGL ES3, we can use the uniform buffer directly and so don't need this.
-    void render(const uint8_t *buffer) {
-      GLint uni = get_uniform();
+    void render(const uint8_t *buffer, unsigned mode = shader::instancing_none) {
+      GLint uni = get_uniform(mode);
 
       if (uni == -1) return;
 
-      switch (get_gl_type()) {
-        case GL_FLOAT: glUniform1fv(uni, repeat, (float*)(buffer + offset)); break;
-        case GL_FLOAT_VEC2: glUniform2fv(uni, repeat, (float*)(buffer + offset)); break;
-        case GL_FLOAT_VEC3: glUniform3fv(uni, repeat, (float*)(buffer + offset)); break;
-        case GL_FLOAT_VEC4: glUniform4fv(uni, repeat, (float*)(buffer + offset)); break;
+      upload(uni, get_gl_type(), repeat, buffer + offset);
+    }
+
+    /// call the glUniform* function for a GL type.
+    static void upload(GLint uni, unsigned type, unsigned repeat, const uint8_t *data) {
+      switch (type) {
+        case GL_FLOAT: glUniform1fv(uni, repeat, (float*)data); break;
+        case GL_FLOAT_VEC2: glUniform2fv(uni, repeat, (float*)data); break;
+        case GL_FLOAT_VEC3: glUniform3fv(uni, repeat, (float*)data); break;
+        case GL_FLOAT_VEC4: glUniform4fv(uni, repeat, (float*)data); break;
 
         case GL_SAMPLER_2D:
         case GL_SAMPLER_CUBE:
@@ -216,14 +253,14 @@ namespace octet { namespace scene {
         case GL_SAMPLER_2D_SHADOW:
         case GL_INT:
         case GL_BOOL: 
-        case GL_UNSIGNED_INT: glUniform1iv(uni, repeat, (GLint*)(buffer + offset)); break;
-        case GL_BOOL_VEC2: case GL_INT_VEC2: glUniform2iv(uni, repeat, (GLint*)(buffer + offset)); break;
-        case GL_BOOL_VEC3: case GL_INT_VEC3: glUniform3iv(uni, repeat, (GLint*)(buffer + offset)); break;
-        case GL_BOOL_VEC4: case GL_INT_VEC4: glUniform4iv(uni, repeat, (GLint*)(buffer + offset)); break;
+        case GL_UNSIGNED_INT: glUniform1iv(uni, repeat, (GLint*)data); break;
+        case GL_BOOL_VEC2: case GL_INT_VEC2: glUniform2iv(uni, repeat, (GLint*)data); break;
+        case GL_BOOL_VEC3: case GL_INT_VEC3: glUniform3iv(uni, repeat, (GLint*)data); break;
+        case GL_BOOL_VEC4: case GL_INT_VEC4: glUniform4iv(uni, repeat, (GLint*)data); break;
 
-        case GL_FLOAT_MAT2: glUniformMatrix2fv(uni, repeat, GL_FALSE, (float*)(buffer + offset)); break;
-        case GL_FLOAT_MAT3: glUniformMatrix3fv(uni, repeat, GL_FALSE, (float*)(buffer + offset)); break;
-        case GL_FLOAT_MAT4: glUniformMatrix4fv(uni, repeat, GL_FALSE, (float*)(buffer + offset)); break;
+        case GL_FLOAT_MAT2: glUniformMatrix2fv(uni, repeat, GL_FALSE, (float*)data); break;
+        case GL_FLOAT_MAT3: glUniformMatrix3fv(uni, repeat, GL_FALSE, (float*)data); break;
+        case GL_FLOAT_MAT4: glUniformMatrix4fv(uni, repeat, GL_FALSE, (float*)data); break;
 
         default: abort();
       }
@@ -288,8 +325,13 @@ namespace octet { namespace scene {
     }
 
     /// Set the OpenGL state for this sampler.
-    void render(const uint8_t *buffer) {
-      param_uniform::render(buffer);
+    void render(const uint8_t *buffer, unsigned mode = shader::instancing_none) {
+      param_uniform::render(buffer, mode);
+      bind_texture();
+    }
+
+    /// Bind the texture to the sampler's texture slot. Unlike uniforms, this is not kept in the program.
+    void bind_texture() {
       glActiveTexture(GL_TEXTURE0 + texture_slot);
       glBindTexture(sampler_->get_gl_target(), sampler_->get_gl_texture(image_));
 
@@ -302,13 +344,33 @@ namespace octet { namespace scene {
     std::string vertex_shader;
     std::string fragment_shader;
 
+    // instanced and packed versions of the program, made when first needed.
+    // see shader::get_program_version().
+    GLuint instanced_programs[num_program_versions];
+    GLint cameraToProjection_uniforms[num_program_versions];
+    GLint instance_matrix_uniforms[num_program_versions];
+
+    // the material uniforms last set in each version of the program (see set_uniforms_version).
+    unsigned uniforms_version[num_program_versions];
+
+    void init_instancing() {
+      for (unsigned i = 0; i != num_program_versions; ++i) {
+        instanced_programs[i] = 0;
+        cameraToProjection_uniforms[i] = -1;
+        instance_matrix_uniforms[i] = -1;
+        uniforms_version[i] = 0;
+      }
+    }
+
   public:
     RESOURCE_META(param_shader)
 
     param_shader() {
+      init_instancing();
     }
 
     param_shader(const char *vs_url, const char *fs_url) {
+      init_instancing();
       dynarray<uint8_t> vs;
       dynarray<uint8_t> fs;
       app_utils::get_url(vs, vs_url);
@@ -320,6 +382,7 @@ namespace octet { namespace scene {
 
     void init(dynarray<ref<param> > &params) {
       shader::init(vertex_shader.data(), fragment_shader.data());
+      uniforms_version[instancing_none] = 0;
 
       param_bind_info pbi;
       pbi.program = get_program();
@@ -328,6 +391,65 @@ namespace octet { namespace scene {
         params[i]->bind(pbi);
       }
     }
+
+    /// Make the instanced or packed version of the program for a mode and vertex format
+    /// if we have not already and find a material's parameters in it.
+    void init_instanced(dynarray<ref<param> > &params, instancing_mode mode, vertex_format format = vertex_float) {
+      unsigned pv = get_program_version(mode, format);
+      assert(pv != 0 && pv < num_program_versions);
+      GLuint &program = instanced_programs[pv];
+      if (!program) {
+        std::string vs = format == vertex_packed ? make_packed_vertex_shader(vertex_shader.c_str()) : vertex_shader;
+        if (mode != instancing_none) vs = make_instanced_vertex_shader(vs.c_str(), mode);
+        program = build(vs.c_str(), fragment_shader.c_str());
+        cameraToProjection_uniforms[pv] = glGetUniformLocation(program, "cameraToProjection");
+        if (mode == instancing_uniform_array) {
+          instance_matrix_uniforms[pv] = glGetUniformLocation(program, "instance_modelToCamera");
+        }
+      }
+
+      param_bind_info pbi;
+      pbi.program = program;
+      pbi.mode = pv;
+
+      for (unsigned i = 0; i != params.size(); ++i) {
+        params[i]->bind(pbi);
+      }
+    }
+
+    /// The program for an instancing mode and vertex format; zero if it has not been made yet.
+    GLuint get_instanced_program(instancing_mode mode, vertex_format format = vertex_float) const {
+      unsigned pv = get_program_version(mode, format);
+      return pv == 0 ? get_program() : instanced_programs[pv];
+    }
+
+    /// Uniforms stay in a program until they are set again, so a material can skip
+    /// its constant uniforms if it was the last to set them.
+    /// Versions are unique across all materials; zero means nothing has been set.
+    unsigned get_uniforms_version(instancing_mode mode, vertex_format format = vertex_float) const {
+      return uniforms_version[get_program_version(mode, format)];
+    }
+
+    /// Record the version of the material uniforms now in the program for a mode and vertex format.
+    void set_uniforms_version(instancing_mode mode, unsigned version, vertex_format format = vertex_float) {
+      uniforms_version[get_program_version(mode, format)] = version;
+    }
+
+    /// Use the instanced version of the program and set its camera to projection matrix.
+    void render_instanced(instancing_mode mode, const mat4t &cameraToProjection, bool use_program = true, vertex_format format = vertex_float) {
+      unsigned pv = get_program_version(mode, format);
+      if (use_program) {
+        glUseProgram(instanced_programs[pv]);
+      }
+      glUniformMatrix4fv(cameraToProjection_uniforms[pv], 1, GL_FALSE, cameraToProjection.get());
+    }
+
+    /// For instancing_uniform_array, set the model to camera matrices of up to max_array_instances instances.
+    void set_instance_matrices(const mat4t *modelToCamera, unsigned num_instances, vertex_format format = vertex_float) {
+      assert(num_instances <= max_array_instances);
+      GLint uniform = instance_matrix_uniforms[get_program_version(instancing_uniform_array, format)];
+      glUniformMatrix4fv(uniform, num_instances, GL_FALSE, modelToCamera[0].get());
+    }
   };
 }}
 
@@ -0,0 +1,153 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// Draw list sorted by GL state
+//
+// example:
+//
+//   queue.reset();
+//   for (unsigned i = 0; i != num_draws; ++i) {
+//     queue.add(queue.make_key(shader[i], mat[i], msh[i], distance[i], false), i);
+//   }
+//   queue.sort();
+//   for (unsigned i = 0; i != queue.size(); ++i) draw(queue[i].index);
+//
+
+namespace octet { namespace scene {
+  /// A list of draws sorted so that draws that share a shader, material and mesh are together.
+  ///
+  /// Each draw has a 64 bit key. For opaque draws the key is, from the top bit:
+  ///
+  ///     0 | shader (12 bits) | material (16 bits) | mesh (16 bits) | depth (19 bits)
+  ///
+  /// so the renderer changes shader least often and draws near objects first within a group.
+  /// Translucent draws come after all the opaque ones and are sorted back to front:
+  ///
+  ///     1 | inverted depth (31 bits) | shader (12 bits) | material (16 bits) | mesh (4 bits)
+  ///
+  /// The ids of shaders, materials and meshes are small numbers given out as they are first seen.
+  class render_queue {
+  public:
+    /// One draw. "index" is the caller's number for the draw.
+    struct item {
+      uint64_t key;
+      unsigned index;
+    };
+
+  private:
+    enum {
+      shader_bits = 12,
+      material_bits = 16,
+      mesh_bits = 16,
+      depth_bits = 19,
+    };
+
+    dynarray<item> items;
+    dynarray<item> temp;
+
+    // ids + 1, so that zero is a new object.
+    hash_map<void *, unsigned> ids[3];
+
+    // give each object a small id that stays the same from frame to frame.
+    unsigned get_id(unsigned kind, void *ptr, unsigned bits) {
+      if (ids[kind].get_num_entries() >= (1u << bits) - 1) {
+        // too many objects: start again. The order changes, but not the result.
+        ids[kind].clear();
+      }
+      unsigned &id = ids[kind][ptr];
+      if (id == 0) id = ids[kind].get_num_entries();
+      return id - 1;
+    }
+
+    // a float >= 0 as an integer that sorts in the same order.
+    static uint32_t depth_to_int(float depth) {
+      union { float f; uint32_t i; } u;
+      u.f = depth > 0 ? depth : 0;
+      return u.i;
+    }
+
+  public:
+    /// Make an empty queue.
+    render_queue() {
+    }
+
+    /// Make the key for a draw.
+    uint64_t make_key(void *shader, void *material, void *mesh, float depth, bool translucent) {
+      uint64_t shader_id = get_id(0, shader, shader_bits);
+      uint64_t material_id = get_id(1, material, material_bits);
+      uint64_t mesh_id = get_id(2, mesh, mesh_bits);
+      uint64_t state = (shader_id << (material_bits + mesh_bits)) | (material_id << mesh_bits) | mesh_id;
+      if (!translucent) {
+        return (state << depth_bits) | (depth_to_int(depth) >> (32 - depth_bits));
+      } else {
+        uint64_t inv_depth = ~depth_to_int(depth) & 0x7fffffff;
+        return (1ull << 63) | (inv_depth << 32) | (uint32_t)(state >> (mesh_bits - 4));
+      }
+    }
+
+    /// Remove all the draws.
+    void reset() {
+      items.resize(0);
+    }
+
+    /// Add a draw.
+    void add(uint64_t key, unsigned index) {
+      item new_item = { key, index };
+      items.push_back(new_item);
+    }
+
+    /// Sort the draws by key. Draws with the same key stay in the order they were added.
+    void sort() {
+      unsigned num_items = items.size();
+      if (num_items <= 1) return;
+
+      // count all eight digits in one pass.
+      dynarray<unsigned, frame_allocator> counts(8 * 256);
+      memset(counts.data(), 0, 8 * 256 * sizeof(unsigned));
+      for (unsigned i = 0; i != num_items; ++i) {
+        uint64_t key = items[i].key;
+        for (unsigned digit = 0; digit != 8; ++digit) {
+          counts[digit * 256 + (unsigned)((key >> (digit * 8)) & 0xff)]++;
+        }
+      }
+
+      // stable radix sort, lowest digit first, skipping digits that are the same in every key.
+      temp.resize(num_items);
+      item *src = items.data(), *dest = temp.data();
+      for (unsigned digit = 0; digit != 8; ++digit) {
+        unsigned *count = &counts[digit * 256];
+        unsigned shift = digit * 8;
+        if (count[(unsigned)((src[0].key >> shift) & 0xff)] == num_items) continue;
+
+        unsigned offset = 0;
+        for (unsigned j = 0; j != 256; ++j) {
+          unsigned c = count[j];
+          count[j] = offset;
+          offset += c;
+        }
+
+        for (unsigned i = 0; i != num_items; ++i) {
+          dest[count[(unsigned)((src[i].key >> shift) & 0xff)]++] = src[i];
+        }
+        item *t = src; src = dest; dest = t;
+      }
+
+      if (src != items.data()) {
+        memcpy(items.data(), src, num_items * sizeof(item));
+      }
+    }
+
+    /// Number of draws.
+    unsigned size() const {
+      return items.size();
+    }
+
+    /// Get a draw. After sort() the draws are in key order.
+    const item &operator[](unsigned index) const {
+      return items[index];
+    }
+  };
+} }
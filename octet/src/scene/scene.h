@@ -11,10 +11,20 @@
 #define OCTET_SCENE_INCLUDED
 
 #include "../scene/scene_node.h"
+#include "../scene/transform_hierarchy.h"
+#include "../scene/transform_benchmark.h"
 #include "../scene/skin.h"
 #include "../scene/skeleton.h"
+#include "../scene/animation_clip.h"
 #include "../scene/animation.h"
+#include "../scene/mesh_bvh.h"
+#include "../scene/mesh_adjacency.h"
+#include "../scene/vertex_welder.h"
+#include "../scene/vertex_packing.h"
 #include "../scene/mesh.h"
+#include "../scene/mesh_optimiser.h"
+#include "../scene/cpu_skin.h"
+#include "../scene/skin_benchmark.h"
 #include "../scene/image.h"
 #include "../scene/sampler.h"
 #include "../scene/param.h"
@@ -24,6 +34,9 @@
 #include "../scene/light_instance.h"
 #include "../scene/mesh_instance.h"
 #include "../scene/animation_instance.h"
+#include "../scene/aabb_tree.h"
+#include "../scene/aabb_tree_benchmark.h"
+#include "../scene/render_queue.h"
 #include "../scene/visual_scene.h"
 #include "../scene/displacement_map.h"
 #include "../scene/indexer.h"
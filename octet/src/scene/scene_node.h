@@ -10,6 +10,13 @@
 namespace octet { namespace scene {
   /// Scene node. Part of a scene heirachy.
   /// Each node has a transform matrix, an identifying atom (sid), a parent and children.
+  ///
+  /// The node to world matrix and the enabled state of the node and its parents are cached.
+  /// Changing a node marks it and its children dirty and the caches are brought up to date
+  /// by update_world_transforms() once a frame, or when you ask for them.
+  ///
+  /// Note: access_nodeToParent() marks the node dirty, so call it again
+  /// if you change the matrix later instead of keeping the reference.
   class scene_node : public resource {
     // every scene_node has a parent scene_node except the roots (NULL)
     // todo: support DAGs with multiple node parents
@@ -27,6 +34,75 @@ namespace octet { namespace scene {
     // is this node and all its children renderable?
     bool enabled;
 
+    // cached nodeToParent * parent->modelToWorld
+    mat4t modelToWorld;
+
+    // cached enabled state of this node and its parents
+    bool world_enabled;
+
+    // modelToWorld and world_enabled are out of date. if a node is dirty, so are its children.
+    bool world_dirty;
+
+    // some node below this one is dirty.
+    bool child_dirty;
+
+    // changes every time modelToWorld is calculated.
+    unsigned world_version;
+
+    void init_world() {
+      modelToWorld.loadIdentity();
+      world_enabled = true;
+      world_dirty = true;
+      child_dirty = false;
+      world_version = 0;
+    }
+
+    // bring this node's cache up to date from its parent.
+    void update_world() {
+      if (parent) {
+        const mat4t &parentToWorld = parent->get_modelToWorld();
+        modelToWorld = nodeToParent * parentToWorld;
+        world_enabled = enabled && parent->world_enabled;
+      } else {
+        modelToWorld = nodeToParent;
+        world_enabled = enabled;
+      }
+      world_dirty = false;
+      world_version++;
+      // our children are still dirty, so make sure the next update pass finds them.
+      if (!children.empty()) child_dirty = true;
+    }
+
+    // make this node and all its children dirty.
+    void mark_subtree_dirty() {
+      if (world_dirty) return;
+      world_dirty = true;
+      // the update pass must visit our children too.
+      if (!children.empty()) child_dirty = true;
+      for (unsigned i = 0; i != children.size(); ++i) {
+        children[i]->mark_subtree_dirty();
+      }
+    }
+
+    // update every dirty node in this subtree, parents first.
+    void update_subtree(const mat4t &parentToWorld, bool parent_enabled) {
+      if (world_dirty) {
+        modelToWorld = nodeToParent * parentToWorld;
+        world_enabled = enabled && parent_enabled;
+        world_dirty = false;
+        world_version++;
+      }
+      if (child_dirty) {
+        for (unsigned i = 0; i != children.size(); ++i) {
+          scene_node *child = children[i];
+          if (child->world_dirty || child->child_dirty) {
+            child->update_subtree(modelToWorld, world_enabled);
+          }
+        }
+        child_dirty = false;
+      }
+    }
+
   public:
     RESOURCE_META(scene_node)
 
@@ -35,6 +111,7 @@ namespace octet { namespace scene {
       nodeToParent.loadIdentity();
       sid = atom_;
       enabled = true;
+      init_world();
       if (parent) {
         parent->add_child(this);
       }
@@ -45,6 +122,7 @@ namespace octet { namespace scene {
       this->nodeToParent = nodeToParent;
       this->sid = sid;
       enabled = true;
+      init_world();
     }
 
     /// the virtual add_ref on animation_target gets passed to here and we pass iton (delegate it) to the resource
@@ -61,6 +139,7 @@ namespace octet { namespace scene {
     void set_value(atom_t sid, atom_t sub_target, atom_t component, float *value) {
       if (sub_target == atom_transform) {
         nodeToParent.init_transpose(value);
+        mark_dirty();
       }
     }
 
@@ -73,6 +152,9 @@ namespace octet { namespace scene {
       //log("visit scene_node nodeToParent\n");
       v.visit(nodeToParent, atom_nodeToParent);
       v.visit(sid, atom_sid);
+      if (v.is_reader()) {
+        mark_dirty();
+      }
     }
 
 
@@ -80,6 +162,7 @@ namespace octet { namespace scene {
     void add_child(scene_node *new_node) {
       new_node->parent = this;
       children.push_back(new_node);
+      new_node->mark_dirty();
     }
 
     /// Get the parent node of this node.
@@ -97,21 +180,119 @@ namespace octet { namespace scene {
       return children[index];
     }
 
+    /// Mark this node's transform or enabled state as changed.
+    /// Its children become dirty too and the next update pass will find them.
+    void mark_dirty() {
+      mark_subtree_dirty();
+      for (scene_node *p = parent; p != NULL && !p->child_dirty; p = p->parent) {
+        p->child_dirty = true;
+      }
+    }
+
+    /// Update the cached world matrices and enabled states of all the dirty nodes
+    /// in this subtree in a single pass. visual_scene::update() does this every frame.
+    void update_world_transforms() {
+      if (world_dirty) {
+        update_world();
+      }
+      if (child_dirty) {
+        for (unsigned i = 0; i != children.size(); ++i) {
+          scene_node *child = children[i];
+          if (child->world_dirty || child->child_dirty) {
+            child->update_subtree(modelToWorld, world_enabled);
+          }
+        }
+        child_dirty = false;
+      }
+    }
+
+    /// Prepare to update the world matrices of this subtree on several threads.
+    /// This updates the dirty nodes near the top of the tree, level by level, until there are
+    /// at least "min_subtrees" dirty subtrees below them (or "max_depth" levels have been done).
+    /// The roots of those subtrees go in "subtrees": call update_world_subtree() on each of them,
+    /// on any thread, to finish the update. Call this on the main thread, as its work array
+    /// comes from frame_allocator.
+    void split_world_update(dynarray<scene_node *> &subtrees, unsigned min_subtrees, unsigned max_depth = 8) {
+      subtrees.resize(0);
+      if (world_dirty) update_world();
+      if (!child_dirty) return;
+
+      dynarray<scene_node *, frame_allocator> level;
+      level.push_back(this);
+      for (unsigned depth = 0; ; ++depth) {
+        // the dirty children of this level.
+        subtrees.resize(0);
+        for (unsigned i = 0; i != level.size(); ++i) {
+          scene_node *node = level[i];
+          for (unsigned j = 0; j != node->children.size(); ++j) {
+            scene_node *child = node->children[j];
+            if (child->world_dirty || child->child_dirty) {
+              subtrees.push_back(child);
+            }
+          }
+          node->child_dirty = false;
+        }
+
+        if (subtrees.size() >= min_subtrees || depth == max_depth || subtrees.empty()) {
+          return;
+        }
+
+        // update this level and go down to the next.
+        level.resize(0);
+        for (unsigned i = 0; i != subtrees.size(); ++i) {
+          scene_node *node = subtrees[i];
+          if (node->world_dirty) node->update_world();
+          if (node->child_dirty) level.push_back(node);
+        }
+        if (level.empty()) {
+          subtrees.resize(0);
+          return;
+        }
+      }
+    }
+
+    /// Update one of the subtrees from split_world_update().
+    void update_world_subtree() {
+      if (parent) {
+        update_subtree(parent->modelToWorld, parent->world_enabled);
+      } else {
+        update_world_transforms();
+      }
+    }
+
+    /// Get the cached scene_node to world matrix, updating it if the node is dirty.
+    const mat4t &get_modelToWorld() {
+      if (world_dirty) update_world();
+      return modelToWorld;
+    }
+
+    /// Return true if the cached world matrix and enabled state are out of date.
+    /// Reading them from several threads is only safe when this is false.
+    bool is_world_dirty() const {
+      return world_dirty;
+    }
+
+    /// Return true if this node or any node below it has changed since the last update.
+    bool is_subtree_dirty() const {
+      return world_dirty || child_dirty;
+    }
+
+    /// A number that changes whenever the node to world matrix or enabled state is recalculated.
+    /// Use this to find nodes that have moved since you last looked.
+    unsigned get_world_version() {
+      if (world_dirty) update_world();
+      return world_version;
+    }
+
     // compute the scene_node to world matrix for an individual scene_node;
     mat4t calcModelToWorld() {
-      mat4t result = nodeToParent;
-      for (scene_node *p = parent; p != NULL; p = p->parent) {
-        result = result * p->nodeToParent;
-      }
-      return result;
+      return get_modelToWorld();
     }
 
     // calculate whether this node is enabled (recursively)
     bool calcEnabled() {
-      for (scene_node *p = this; p != NULL; p = p->parent) {
-        if (!p->enabled) return false;
-      }
-      return true;
+      if (world_dirty) update_world();
+      return world_enabled;
     }
 
     /// transform a point from model space to world space
@@ -134,7 +315,9 @@ namespace octet { namespace scene {
     }
 
     /// access the node to parent transform matrix for writing.
+    /// This marks the node dirty.
     mat4t &access_nodeToParent() {
+      mark_dirty();
       return nodeToParent;
     }
 
@@ -165,27 +348,34 @@ namespace octet { namespace scene {
 
     /// set enabled state
     void set_enabled(bool value) {
-      enabled = value;
+      if (enabled != value) {
+        enabled = value;
+        mark_dirty();
+      }
     }
 
     /// reset the matrix
     void loadIdentity() {
       nodeToParent.loadIdentity();
+      mark_dirty();
     }
 
     /// Translate the matrix
     void translate(vec3_in xyz) {
       nodeToParent.translate(xyz[0], xyz[1], xyz[2]);
+      mark_dirty();
     }
 
     /// Rotate the matrix
     void rotate(float angle, vec3_in axis) {
       nodeToParent.rotate(angle, axis[0], axis[1], axis[2]);
+      mark_dirty();
     }
 
     /// Scale the matrix
     void scale(vec3_in xyz) {
       nodeToParent.scale(xyz[0], xyz[1], xyz[2]);
+      mark_dirty();
     }
 
     /// Get the identifying sid
@@ -194,9 +384,12 @@ namespace octet { namespace scene {
     }
 
     /// recursively fetch all child nodes
-    void get_all_child_nodes(dynarray<scene_node*> &nodes, dynarray<int> &parents) {
-      dynarray<scene_node*> stack;
-      dynarray<int> parent_stack;
+    /// parents come before children in the result.
+    /// The work arrays use the same allocator as the result, so use frame_allocator
+    /// only in per-frame code that resets it; loaders use the default allocator.
+    template <class allocator_t> void get_all_child_nodes(dynarray<scene_node*, allocator_t> &nodes, dynarray<int, allocator_t> &parents) {
+      dynarray<scene_node*, allocator_t> stack;
+      dynarray<int, allocator_t> parent_stack;
       stack.push_back(this);
       parent_stack.push_back(-1);
       while (!stack.empty()) {
@@ -207,7 +400,7 @@ namespace octet { namespace scene {
         parent_stack.pop_back();
         nodes.push_back(node);
         parents.push_back(parent);
-        for (int i = 0; i != node->children.size(); ++i) {
+        for (unsigned i = 0; i != node->children.size(); ++i) {
           stack.push_back(node->children[i]);
           parent_stack.push_back(new_parent);
         }
@@ -10,6 +10,17 @@
 
 namespace octet { namespace scene {
   class skeleton : public resource {
+  public:
+    /// The skin matrices of one skin on this skeleton, cached for a pose.
+    /// Each matrix maps skin model space to the space of the skeleton's parent (the mesh instance).
+    struct skin_pose {
+      ref<skin> skn;
+      dynarray<int> indices;    // skeleton bone of each skin joint, or -1
+      dynarray<mat4t> matrices;
+      unsigned key;             // pose key the matrices were made for
+    };
+
+  private:
     // skeleton components
     dynarray<mat4t> nodeToParents;
     dynarray<atom_t> joints;
@@ -20,10 +31,21 @@ namespace octet { namespace scene {
     // cached skin components
     dynarray<mat4t> result;  /// uniforms to shader
     dynarray<int> indices;   /// map skeleton to skin indices
+
+    // the pose: bone to skeleton parent space, and the key it was made for.
+    unsigned pose_key;
+    dynarray<skin_pose *> skin_poses;
   public:
     RESOURCE_META(skeleton)
 
     skeleton() {
+      pose_key = 0;
+    }
+
+    ~skeleton() {
+      for (unsigned i = 0; i != skin_poses.size(); ++i) {
+        delete skin_poses[i];
+      }
     }
 
     void visit(visitor &v) {
@@ -56,51 +78,85 @@ namespace octet { namespace scene {
       return -1;
     }
 
-    mat4t *calc_transforms(const mat4t &worldToCamera, skin *skn) {
-      //static bool first_frame = true;
+    /// Mark the pose as made for "key" and return true if it was made for another key.
+    /// Use a new key each frame so that the pose is only worked out once however many
+    /// mesh instances share the skeleton.
+    bool begin_pose(unsigned key) {
+      if (pose_key == key) return false;
+      pose_key = key;
+      return true;
+    }
+
+    /// Find (or add) the cache for a skin on this skeleton.
+    skin_pose *get_skin_pose(skin *skn) {
+      for (unsigned i = 0; i != skin_poses.size(); ++i) {
+        if (skin_poses[i]->skn == skn) return skin_poses[i];
+      }
+      skin_pose *sp = new skin_pose();
+      sp->skn = skn;
+      sp->key = 0;
+      unsigned num_joints = skn->get_num_joints();
+      sp->indices.resize(num_joints);
+      sp->matrices.resize(num_joints);
+      for (unsigned i = 0; i != num_joints; ++i) {
+        sp->indices[i] = find_joint(skn->get_joint(i));
+      }
+      skin_poses.push_back(sp);
+      return sp;
+    }
+
+    /// Work out the bone to skeleton parent matrices from the nodes.
+    /// Skeletons can do this on different threads.
+    void calc_pose() {
       if (boneToNode.size() < nodeToParents.size()) {
         boneToNode.resize(nodeToParents.size());
       }
 
       // todo: optionally drive animation directly to the skeleton.
       for (int i = 0; i != nodes.size(); ++i) {
-        nodeToParents[i] = nodes[i]->access_nodeToParent();
+        nodeToParents[i] = nodes[i]->get_nodeToParent();
       }
 
-      // compute matrix heirachy
+      // compute matrix heirachy: parents come before their children.
       for (int i = 0; i != nodeToParents.size(); ++i) {
         int parent = parents[i];
-        // skeleton -> parent -> parent -> world -> camera
         if (parent == -1) {
-          boneToNode[i] = nodeToParents[i] * worldToCamera;
+          boneToNode[i] = nodeToParents[i];
         } else {
           boneToNode[i] = nodeToParents[i] * boneToNode[parent];
         }
-        //log("%d %s p=%d\n", i, result[i].toString(), parent);
-      }
-
-      unsigned num_joints = skn->get_num_joints();
-      if (result.size() < num_joints) {
-        result.resize(num_joints);
-        indices.resize(num_joints);
-        for (int i = 0; i != num_joints; ++i) {
-          // skin -> bind space -> skeleton -> parent -> parent -> world -> camera
-          indices[i] = find_joint(skn->get_joint(i));
-        }
       }
+    }
 
-      // premultiply by skin matrices
-      for (int i = 0; i != num_joints; ++i) {
-        // skin -> bind space -> skeleton -> parent -> parent -> world -> camera
-        int index = indices[i];
+    /// Premultiply the pose by the skin matrices after calc_pose().
+    void calc_skin_matrices(skin_pose *sp) const {
+      const skin *skn = sp->skn;
+      const mat4t &modelToBind = skn->get_modelToBind();
+      for (unsigned i = 0; i != sp->matrices.size(); ++i) {
+        // skin -> bind space -> skeleton -> parent -> parent -> skeleton parent
+        int index = sp->indices[i];
         if (index != -1) {
-          result[i] = skn->get_modelToBind() * skn->get_bindToModel(i) * boneToNode[index];
+          sp->matrices[i] = modelToBind * skn->get_bindToModel(i) * boneToNode[index];
         } else {
-          result[i] = worldToCamera;
+          sp->matrices[i].loadIdentity();
         }
-        //if (first_frame) log("%d %d [%s]\n", i, index, result[i].toString());
       }
+    }
 
+    /// Work out the pose and the skin matrices times worldToCamera (the mesh instance's model to camera).
+    mat4t *calc_transforms(const mat4t &worldToCamera, skin *skn) {
+      calc_pose();
+      skin_pose *sp = get_skin_pose(skn);
+      calc_skin_matrices(sp);
+
+      unsigned num_joints = sp->matrices.size();
+      if (result.size() < num_joints) {
+        result.resize(num_joints);
+      }
+      for (unsigned i = 0; i != num_joints; ++i) {
+        // skin -> bind space -> skeleton -> parent -> parent -> world -> camera
+        result[i] = sp->matrices[i] * worldToCamera;
+      }
       return &result[0];
     }
 
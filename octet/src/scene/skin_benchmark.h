@@ -0,0 +1,242 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// Benchmarks for skeleton poses and CPU skinning
+//
+// example:
+//
+//   skin_benchmark::run(stdout);       // on the GL thread, 4 threads
+//   skin_benchmark::run(stdout, 8);    // 8 threads
+//
+
+namespace octet { namespace scene {
+  /// Cost of posing and skinning a crowd of 500 characters.
+  ///
+  /// Each character has a chain of 60 bones. We print the best of five frames, in ms, of:
+  ///
+  ///   per draw: calc_transforms() for every character, as render_impl() used to;
+  ///   cached:   the pose once per skeleton with begin_pose(), then the skin matrices times
+  ///             each character's model to camera, as prepare_render() does;
+  ///   threaded: the same, with the poses and matrices in parallel_for()s;
+  ///
+  /// with every character on its own skeleton and with ten skeletons shared between them.
+  ///
+  /// Then we skin a Laurana sized mesh (250 bones, 25000 vertices) with cpu_skin
+  /// and print the cost per vertex and for 500 characters.
+  ///
+  /// cpu_skin reads the vertices of the mesh, so call this on the GL thread.
+  class skin_benchmark {
+    typedef std::chrono::high_resolution_clock clock;
+
+    static double elapsed_ms(clock::time_point start) {
+      return std::chrono::duration<double, std::milli>(clock::now() - start).count();
+    }
+
+    // a skinned vertex in the layout of the collada loader.
+    struct skinned_vertex {
+      float pos[3];
+      float normal[3];
+      float uv[2];
+      float weight[3];
+      float index[4];
+    };
+
+    // a chain of bones going up the y axis, each one unit long.
+    static skeleton *make_skeleton(unsigned num_bones, dynarray<scene_node *> &bones) {
+      skeleton *skel = new skeleton();
+      for (unsigned b = 0; b != num_bones; ++b) {
+        char name[32];
+        sprintf(name, "bone%u", b);
+        mat4t nodeToParent;
+        nodeToParent.loadIdentity();
+        nodeToParent.translate(0, b ? 1.0f : 0.0f, 0);
+        scene_node *node = new scene_node(nodeToParent, app_utils::get_atom(name));
+        bones.push_back(node);
+        skel->add_bone(node, (int)b - 1);
+      }
+      return skel;
+    }
+
+    static skin *make_skin(unsigned num_bones) {
+      mat4t modelToBind;
+      modelToBind.loadIdentity();
+      skin *skn = new skin(modelToBind);
+      for (unsigned b = 0; b != num_bones; ++b) {
+        char name[32];
+        sprintf(name, "bone%u", b);
+        mat4t bindToModel;
+        bindToModel.loadIdentity();
+        bindToModel.translate(0, -(float)b, 0);
+        skn->add_joint(bindToModel, app_utils::get_atom(name));
+      }
+      return skn;
+    }
+
+    // a tube of rings around the bones, each vertex weighted to four bones.
+    static mesh *make_mesh(skin *skn, unsigned verts_per_bone) {
+      unsigned num_bones = skn->get_num_joints();
+      dynarray<skinned_vertex> vertices;
+      dynarray<uint32_t> indices;
+      for (unsigned b = 0; b != num_bones; ++b) {
+        for (unsigned v = 0; v != verts_per_bone; ++v) {
+          float angle = v * (6.2831853f / verts_per_bone);
+          skinned_vertex sv = {
+            { cosf(angle), (float)b + 0.5f, sinf(angle) },
+            { cosf(angle), 0, sinf(angle) },
+            { angle, (float)b },
+            { 0.2f, 0.1f, 0.05f },
+            { (float)b, (float)(b ? b - 1 : 0), (float)((b + 1) % num_bones), (float)((b * 7) % num_bones) }
+          };
+          vertices.push_back(sv);
+        }
+      }
+      for (unsigned i = 0; i + 2 < vertices.size(); i += 3) {
+        indices.push_back(i);
+        indices.push_back(i + 1);
+        indices.push_back(i + 2);
+      }
+      mesh *msh = new mesh(skn);
+      msh->add_attribute(attribute_pos, 3, GL_FLOAT, 0);
+      msh->add_attribute(attribute_normal, 3, GL_FLOAT, 12);
+      msh->add_attribute(attribute_uv, 2, GL_FLOAT, 24);
+      msh->add_attribute(attribute_blendweight, 3, GL_FLOAT, 32);
+      msh->add_attribute(attribute_blendindices, 4, GL_FLOAT, 44);
+      msh->set_vertices(vertices);
+      msh->set_indices(indices);
+      msh->set_mode(GL_TRIANGLES);
+      msh->set_aabb(aabb(vec3(0, num_bones * 0.5f, 0), vec3(1, num_bones * 0.5f + 1, 1)));
+      return msh;
+    }
+
+  public:
+    struct result {
+      double per_draw_ms;
+      double cached_ms;
+      double threaded_ms;
+    };
+
+    /// Pose "num_chars" characters sharing "num_skeletons" skeletons of "num_bones" bones.
+    static result measure_poses(job_system &jobs, unsigned num_chars, unsigned num_skeletons, unsigned num_bones) {
+      ref<skin> skn = make_skin(num_bones);
+      dynarray<ref<skeleton> > skeletons;
+      dynarray<scene_node *> bones;
+      for (unsigned s = 0; s != num_skeletons; ++s) {
+        skeletons.push_back(make_skeleton(num_bones, bones));
+      }
+
+      dynarray<mat4t> modelToCamera(num_chars);
+      for (unsigned i = 0; i != num_chars; ++i) {
+        modelToCamera[i].loadIdentity();
+        modelToCamera[i].translate((float)(i % 25) * 4 - 48, -20, -80 - (float)(i / 25) * 4);
+      }
+
+      dynarray<mat4t> matrices(num_chars * num_bones);
+      dynarray<skeleton *> posed;
+      result res = { 1e9, 1e9, 1e9 };
+      unsigned key = 0;
+      float sum = 0;
+
+      for (unsigned rep = 0; rep != 5; ++rep) {
+        for (unsigned b = 0; b != bones.size(); ++b) {
+          bones[b]->rotate(0.1f, vec3(0, 0, 1));
+        }
+
+        clock::time_point start = clock::now();
+        for (unsigned i = 0; i != num_chars; ++i) {
+          const mat4t *m = skeletons[i % num_skeletons]->calc_transforms(modelToCamera[i], skn);
+          sum += m[num_bones - 1].w().x();
+        }
+        res.per_draw_ms = std::min(res.per_draw_ms, elapsed_ms(start));
+
+        for (unsigned threaded = 0; threaded != 2; ++threaded) {
+          start = clock::now();
+
+          // find the skeletons to pose this frame.
+          posed.resize(0);
+          ++key;
+          for (unsigned i = 0; i != num_chars; ++i) {
+            skeleton *skel = skeletons[i % num_skeletons];
+            if (skel->begin_pose(key)) posed.push_back(skel);
+          }
+
+          auto pose = [&](unsigned begin, unsigned end) {
+            for (unsigned i = begin; i != end; ++i) {
+              posed[i]->calc_pose();
+              posed[i]->calc_skin_matrices(posed[i]->get_skin_pose(skn));
+            }
+          };
+
+          auto premultiply = [&](unsigned begin, unsigned end) {
+            for (unsigned i = begin; i != end; ++i) {
+              const skeleton::skin_pose *sp = skeletons[i % num_skeletons]->get_skin_pose(skn);
+              mat4t *dest = &matrices[i * num_bones];
+              for (unsigned j = 0; j != num_bones; ++j) {
+                dest[j] = sp->matrices[j] * modelToCamera[i];
+              }
+            }
+          };
+
+          if (threaded) {
+            jobs.parallel_for(0, posed.size(), 1, pose);
+            jobs.parallel_for(0, num_chars, 1, premultiply);
+          } else {
+            pose(0, posed.size());
+            premultiply(0, num_chars);
+          }
+
+          double ms = elapsed_ms(start);
+          double &best = threaded ? res.threaded_ms : res.cached_ms;
+          best = std::min(best, ms);
+          sum += matrices[num_bones - 1].w().x();
+        }
+      }
+
+      // stop the compiler from throwing the loops away.
+      *(volatile float*)&sum = sum;
+      return res;
+    }
+
+    /// Skin a mesh of "num_bones" bones and "verts_per_bone" vertices per bone. Returns ns per vertex.
+    static double measure_cpu_skin(unsigned num_bones, unsigned verts_per_bone) {
+      ref<skin> skn = make_skin(num_bones);
+      ref<mesh> msh = make_mesh(skn, verts_per_bone);
+      ref<cpu_skin> skinner = new cpu_skin(msh);
+
+      dynarray<scene_node *> bones;
+      ref<skeleton> skel = make_skeleton(num_bones, bones);
+      for (unsigned b = 0; b != num_bones; ++b) {
+        bones[b]->rotate(0.5f, vec3(0, 0, 1));
+      }
+      mat4t modelToCamera;
+      modelToCamera.loadIdentity();
+      const mat4t *matrices = skel->calc_transforms(modelToCamera, skn);
+
+      double best = 1e9;
+      for (unsigned rep = 0; rep != 5; ++rep) {
+        clock::time_point start = clock::now();
+        skinner->skin(matrices, num_bones);
+        best = std::min(best, elapsed_ms(start));
+      }
+      return best * 1e6 / (num_bones * verts_per_bone);
+    }
+
+    /// Print a table using a job system of "num_threads" threads.
+    static void run(FILE *file, unsigned num_threads = 4) {
+      job_system jobs(num_threads - 1);
+      fprintf(file, "skin_benchmark: 500 characters of 60 bones, %u threads, ms per frame\n", num_threads);
+      fprintf(file, "skeletons      per draw    cached  threaded\n");
+      static const unsigned num_skeletons[] = { 500, 10 };
+      for (unsigned i = 0; i != 2; ++i) {
+        result res = measure_poses(jobs, 500, num_skeletons[i], 60);
+        fprintf(file, "%9u %13.3f %9.3f %9.3f\n", num_skeletons[i], res.per_draw_ms, res.cached_ms, res.threaded_ms);
+      }
+      double ns = measure_cpu_skin(250, 100);
+      fprintf(file, "cpu_skin, 250 bones, 25000 vertices: %.2f ns per vertex, %.1f ms for 500 characters on one thread\n",
+        ns, ns * 25000 * 500 * 1e-6
+      );
+    }
+  };
+}}
@@ -0,0 +1,154 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// Benchmarks for world transforms
+//
+// example:
+//
+//   transform_benchmark::run(stdout);            // 1000 to 100000 nodes
+//   transform_benchmark::run(stdout, 1000000);   // 1000 to 1000000 nodes
+//
+
+namespace octet { namespace scene {
+  /// Cost of updating the world transforms of a tree of nodes.
+  ///
+  /// The tree has about four children per node. For each size we print the best of
+  /// five runs, in ms per frame, of:
+  ///
+  ///   walk:      multiplying up the parents of every node, like calcModelToWorld() used to;
+  ///   scene_node update_world_transforms() when the root moved, 1% moved and nothing moved;
+  ///   transform_hierarchy update() when the root moved and 1% moved;
+  ///   transform_hierarchy split() into eight ranges, then update_node() and update_range().
+  ///
+  /// The last column is the largest difference between the walk and the other results.
+  class transform_benchmark {
+    typedef std::chrono::high_resolution_clock clock;
+
+    static double elapsed_ms(clock::time_point start) {
+      return std::chrono::duration<double, std::milli>(clock::now() - start).count();
+    }
+
+    static float max_error(const mat4t &a, const mat4t &b) {
+      float err = 0;
+      for (unsigned i = 0; i != 16; ++i) {
+        err = std::max(err, fabsf(a.get()[i] - b.get()[i]));
+      }
+      return err;
+    }
+
+  public:
+    struct result {
+      double walk_ms;
+      double root_moved_ms;
+      double some_moved_ms;
+      double static_ms;
+      double flat_root_moved_ms;
+      double flat_some_moved_ms;
+      double flat_split_ms;
+      float error;
+    };
+
+    /// Measure a tree of "num_nodes" nodes.
+    static result measure(unsigned num_nodes) {
+      // nodes are in depth first order, the same as the transform_hierarchy ids.
+      ref<scene_node> root = new scene_node();
+      dynarray<scene_node *> parents;
+      parents.push_back(root);
+      for (unsigned i = 1; i != num_nodes; ++i) {
+        scene_node *node = new scene_node();
+        node->translate(vec3(1, 0.5f, 0));
+        node->rotate(3, vec3(0, 0, 1));
+        parents[(i - 1) / 4]->add_child(node);
+        parents.push_back(node);
+      }
+
+      dynarray<scene_node *> nodes;
+      dynarray<int> node_parents;
+      root->get_all_child_nodes(nodes, node_parents);
+
+      ref<transform_hierarchy> flat = new transform_hierarchy();
+      dynarray<int> ids;
+      flat->add_scene_nodes(root, -1, &ids);
+
+      result res = { 1e9, 1e9, 1e9, 1e9, 1e9, 1e9, 1e9, 0 };
+      dynarray<mat4t> walked(num_nodes);
+      dynarray<unsigned> serial;
+      dynarray<transform_hierarchy::range> ranges;
+
+      for (unsigned rep = 0; rep != 5; ++rep) {
+        clock::time_point start = clock::now();
+        for (unsigned i = 0; i != num_nodes; ++i) {
+          mat4t nodeToWorld = nodes[i]->get_nodeToParent();
+          for (scene_node *p = nodes[i]->get_parent(); p; p = p->get_parent()) {
+            nodeToWorld = nodeToWorld * p->get_nodeToParent();
+          }
+          walked[i] = nodeToWorld;
+        }
+        res.walk_ms = std::min(res.walk_ms, elapsed_ms(start));
+
+        root->access_nodeToParent();
+        start = clock::now();
+        root->update_world_transforms();
+        res.root_moved_ms = std::min(res.root_moved_ms, elapsed_ms(start));
+
+        flat->access_nodeToParent(ids[0]);
+        start = clock::now();
+        flat->update();
+        res.flat_root_moved_ms = std::min(res.flat_root_moved_ms, elapsed_ms(start));
+
+        // move one node in a hundred.
+        for (unsigned i = 1; i < num_nodes; i += 100) {
+          nodes[i]->access_nodeToParent();
+          flat->access_nodeToParent(ids[i]);
+        }
+
+        start = clock::now();
+        root->update_world_transforms();
+        res.some_moved_ms = std::min(res.some_moved_ms, elapsed_ms(start));
+
+        start = clock::now();
+        flat->update();
+        res.flat_some_moved_ms = std::min(res.flat_some_moved_ms, elapsed_ms(start));
+
+        start = clock::now();
+        root->update_world_transforms();
+        res.static_ms = std::min(res.static_ms, elapsed_ms(start));
+
+        // the ranges would go to separate threads.
+        flat->access_nodeToParent(ids[0]);
+        start = clock::now();
+        flat->split(serial, ranges, num_nodes / 8 + 1);
+        for (unsigned i = 0; i != serial.size(); ++i) {
+          flat->update_node(serial[i]);
+        }
+        for (unsigned i = 0; i != ranges.size(); ++i) {
+          flat->update_range(ranges[i].begin, ranges[i].end);
+        }
+        res.flat_split_ms = std::min(res.flat_split_ms, elapsed_ms(start));
+      }
+
+      for (unsigned i = 0; i != num_nodes; ++i) {
+        res.error = std::max(res.error, max_error(walked[i], nodes[i]->get_modelToWorld()));
+        res.error = std::max(res.error, max_error(walked[i], flat->get_nodeToWorld(ids[i])));
+      }
+      return res;
+    }
+
+    /// Print a table for 1000 nodes up to "max_nodes" nodes.
+    static void run(FILE *file, unsigned max_nodes = 100000) {
+      fprintf(file, "transform_benchmark: ms per frame\n");
+      fprintf(file, "                    scene_node                      transform_hierarchy\n");
+      fprintf(file, "   nodes     walk   root moved  1%% moved  static   root moved  1%% moved   split    error\n");
+      for (unsigned num_nodes = 1000; num_nodes <= max_nodes; num_nodes *= 10) {
+        result res = measure(num_nodes);
+        fprintf(file, "%8u %8.3f %10.3f %9.3f %8.3f %10.3f %9.3f %8.3f %8.1e\n",
+          num_nodes, res.walk_ms, res.root_moved_ms, res.some_moved_ms, res.static_ms,
+          res.flat_root_moved_ms, res.flat_some_moved_ms, res.flat_split_ms, res.error
+        );
+      }
+    }
+  };
+}}
@@ -0,0 +1,583 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// Flat transform hierarchy
+//
+// example:
+//
+//   ref<transform_hierarchy> transforms = new transform_hierarchy();
+//   int body = transforms->add_node(-1, body_matrix);
+//   int arm = transforms->add_node(body, arm_matrix);
+//   transform_node(transforms, arm).rotate(10, vec3(0, 0, 1));
+//   transforms->update();
+//   const mat4t &armToWorld = transforms->get_nodeToWorld(arm);
+//
+//   // or let a visual_scene update it and draw a mesh at a node
+//   transform_hierarchy *transforms = app_scene->get_transform_hierarchy();
+//   int arm = transforms->add_node(-1, arm_matrix);
+//   scene_node *node = app_scene->add_scene_node();
+//   app_scene->add_mesh_instance(new mesh_instance(node, arm_mesh, arm_material));
+//   app_scene->bind_transform(arm, node);
+//
+
+namespace octet { namespace scene {
+  /// A transform hierarchy stored as arrays instead of a tree of scene_nodes.
+  ///
+  /// The matrices, parents and flags of every node are kept in separate contiguous arrays
+  /// in depth first order: parents come before their children and every subtree is a
+  /// contiguous range of nodes. This means that update() is a single linear pass over
+  /// the arrays with no pointer chasing, and that separate subtrees can be updated
+  /// on separate threads (see split()).
+  ///
+  /// Nodes are named by ids which do not change when the arrays are sorted.
+  /// An id is a slot and a generation number, like a slot_handle, so the id of a
+  /// removed node stays invalid when its slot is given to a new node.
+  /// transform_node is a small handle with the same interface as scene_node.
+  class transform_hierarchy : public resource {
+  public:
+    /// A range of node positions [begin, end) that can be updated on its own.
+    struct range {
+      unsigned begin;
+      unsigned end;
+    };
+
+  private:
+    enum {
+      slot_bits = 23,
+      slot_mask = (1 << slot_bits) - 1,
+      generation_mask = 0xff,
+    };
+
+    enum {
+      flag_enabled = 1,       // this node is enabled
+      flag_world_enabled = 2, // this node and all its parents are enabled
+      flag_dirty = 4,         // nodeToParent or enabled has changed
+      flag_changed = 8,       // nodeToWorld changed in the last update
+    };
+
+    // one entry per node, in depth first order.
+    dynarray<mat4t> nodeToParent;
+    dynarray<mat4t> nodeToWorld;
+    dynarray<int> parents;
+    dynarray<unsigned> subtree_ends;
+    dynarray<uint8_t> flags;
+    dynarray<atom_t> sids;
+    dynarray<int> index_to_id;
+
+    // position in the arrays of the node in each id slot, or -1 for unused slots.
+    dynarray<int> id_to_index;
+    dynarray<uint8_t> generations;
+    dynarray<int> free_slots;
+
+    // a node has been added out of depth first order, so subtree_ends is not valid.
+    bool order_dirty;
+
+    // nodeToWorld = nodeToParent * parentToWorld, the same as mat4t::operator*
+    static void multiply(mat4t &dest, const mat4t &lhs, const mat4t &rhs) {
+      #if OCTET_SSE2
+        const float *l = (const float*)&lhs;
+        const float *r = (const float*)&rhs;
+        float *d = (float*)&dest;
+        __m128 r0 = _mm_loadu_ps(r + 0);
+        __m128 r1 = _mm_loadu_ps(r + 4);
+        __m128 r2 = _mm_loadu_ps(r + 8);
+        __m128 r3 = _mm_loadu_ps(r + 12);
+        for (unsigned i = 0; i != 16; i += 4) {
+          __m128 sum = _mm_mul_ps(r0, _mm_set1_ps(l[i+0]));
+          sum = _mm_add_ps(sum, _mm_mul_ps(r1, _mm_set1_ps(l[i+1])));
+          sum = _mm_add_ps(sum, _mm_mul_ps(r2, _mm_set1_ps(l[i+2])));
+          sum = _mm_add_ps(sum, _mm_mul_ps(r3, _mm_set1_ps(l[i+3])));
+          _mm_storeu_ps(d + i, sum);
+        }
+      #else
+        dest = lhs * rhs;
+      #endif
+    }
+
+    static unsigned get_slot(int id) {
+      return (unsigned)id & slot_mask;
+    }
+
+    int alloc_id(int index) {
+      unsigned slot;
+      if (free_slots.empty()) {
+        slot = id_to_index.size();
+        assert(slot <= (unsigned)slot_mask && "transform_hierarchy: too many nodes");
+        id_to_index.push_back(index);
+        generations.push_back(1);
+      } else {
+        slot = free_slots.back();
+        free_slots.pop_back();
+        id_to_index[slot] = index;
+      }
+      return (int)((generations[slot] << slot_bits) | slot);
+    }
+
+    // make the slot of a removed node free and its old ids invalid.
+    void free_id(int id) {
+      unsigned slot = get_slot(id);
+      id_to_index[slot] = -1;
+      unsigned generation = (generations[slot] + 1) & generation_mask;
+      generations[slot] = (uint8_t)(generation ? generation : 1);
+      free_slots.push_back(slot);
+    }
+
+    // re-order the nodes depth first, keeping siblings in the order they were added.
+    void sort() {
+      unsigned num_nodes = parents.size();
+
+      // list the children of each node with a counting sort on the parent.
+      dynarray<unsigned> child_start(num_nodes + 2);
+      dynarray<unsigned> child_list(num_nodes);
+      memset(child_start.data(), 0, child_start.size() * sizeof(unsigned));
+      for (unsigned i = 0; i != num_nodes; ++i) {
+        child_start[parents[i] + 1]++;
+      }
+      for (unsigned i = 0, total = 0; i != num_nodes + 2; ++i) {
+        unsigned count = child_start[i];
+        child_start[i] = total;
+        total += count;
+      }
+      // the roots start at child_start[0], the children of node i at child_start[i+1]
+      dynarray<unsigned> fill(child_start);
+      for (unsigned i = 0; i != num_nodes; ++i) {
+        child_list[fill[parents[i] + 1]++] = i;
+      }
+
+      // depth first walk with an explicit stack.
+      dynarray<unsigned> order;
+      dynarray<unsigned> stack;
+      order.reserve(num_nodes);
+      for (unsigned r = child_start[1]; r != child_start[0]; ) {
+        stack.push_back(child_list[--r]);
+      }
+      while (!stack.empty()) {
+        unsigned node = stack.back();
+        stack.pop_back();
+        order.push_back(node);
+        for (unsigned c = child_start[node + 2]; c != child_start[node + 1]; ) {
+          stack.push_back(child_list[--c]);
+        }
+      }
+
+      dynarray<int> new_index(num_nodes);
+      for (unsigned i = 0; i != num_nodes; ++i) {
+        new_index[order[i]] = (int)i;
+      }
+
+      permute(nodeToParent, order);
+      permute(nodeToWorld, order);
+      permute(flags, order);
+      permute(sids, order);
+      permute(index_to_id, order);
+      dynarray<int> old_parents(std::move(parents));
+      parents.resize(num_nodes);
+      for (unsigned i = 0; i != num_nodes; ++i) {
+        int parent = old_parents[order[i]];
+        parents[i] = parent < 0 ? -1 : new_index[parent];
+        id_to_index[get_slot(index_to_id[i])] = (int)i;
+      }
+
+      // a subtree ends where its last child's subtree ends.
+      for (unsigned i = 0; i != num_nodes; ++i) {
+        subtree_ends[i] = i + 1;
+      }
+      for (unsigned i = num_nodes; i-- != 0; ) {
+        int parent = parents[i];
+        if (parent >= 0 && subtree_ends[parent] < subtree_ends[i]) {
+          subtree_ends[parent] = subtree_ends[i];
+        }
+      }
+      order_dirty = false;
+    }
+
+    template <class item_t> static void permute(dynarray<item_t> &items, const dynarray<unsigned> &order) {
+      dynarray<item_t> old_items(std::move(items));
+      items.resize(order.size());
+      for (unsigned i = 0; i != order.size(); ++i) {
+        items[i] = old_items[order[i]];
+      }
+    }
+
+    unsigned get_checked_index(int id) const {
+      assert(is_valid(id) && "transform_hierarchy: bad node id");
+      return (unsigned)id_to_index[get_slot(id)];
+    }
+
+  public:
+    RESOURCE_META(transform_hierarchy)
+
+    /// Make an empty hierarchy.
+    transform_hierarchy() {
+      order_dirty = false;
+    }
+
+    /// Add a node as the last child of "parent_id" (or as a root if parent_id is -1).
+    /// Returns the id of the new node.
+    int add_node(int parent_id = -1, const mat4t &matrix = mat4t(), atom_t sid = atom_) {
+      unsigned index = parents.size();
+      int parent = parent_id < 0 ? -1 : (int)get_checked_index(parent_id);
+
+      nodeToParent.push_back(matrix);
+      nodeToWorld.push_back(matrix);
+      parents.push_back(parent);
+      subtree_ends.push_back(index + 1);
+      flags.push_back(flag_enabled | flag_world_enabled | flag_dirty);
+      sids.push_back(sid);
+      int id = alloc_id(index);
+      index_to_id.push_back(id);
+
+      // adding to the last subtree keeps depth first order (as does adding a root).
+      if (parent >= 0 && !order_dirty) {
+        if (subtree_ends[parent] == index) {
+          for (int p = parent; p >= 0; p = parents[p]) {
+            subtree_ends[p] = index + 1;
+          }
+        } else {
+          order_dirty = true;
+        }
+      }
+      return id;
+    }
+
+    /// Add a copy of a scene_node tree below "parent_id" and return the id of the copy of "root".
+    /// If "ids" is not null, it receives the id for each node in the order of root->get_all_child_nodes().
+    int add_scene_nodes(scene_node *root, int parent_id = -1, dynarray<int> *ids = 0) {
+      dynarray<scene_node*> nodes;
+      dynarray<int> node_parents;
+      root->get_all_child_nodes(nodes, node_parents);
+
+      // get_all_child_nodes is depth first, so this keeps the arrays in order.
+      dynarray<int> new_ids(nodes.size());
+      for (unsigned i = 0; i != nodes.size(); ++i) {
+        int parent = node_parents[i] < 0 ? parent_id : new_ids[node_parents[i]];
+        new_ids[i] = add_node(parent, nodes[i]->get_nodeToParent(), nodes[i]->get_sid());
+        set_enabled(new_ids[i], nodes[i]->get_enabled());
+      }
+      if (ids) *ids = new_ids;
+      return new_ids.empty() ? -1 : new_ids[0];
+    }
+
+    /// Remove a node and all its children.
+    void remove_node(int id) {
+      if (order_dirty) sort();
+      unsigned begin = get_checked_index(id);
+      unsigned end = subtree_ends[begin];
+      unsigned num_removed = end - begin;
+      unsigned num_nodes = parents.size();
+
+      for (unsigned i = begin; i != end; ++i) {
+        free_id(index_to_id[i]);
+      }
+
+      // the ancestors of the subtree get shorter.
+      for (int p = parents[begin]; p >= 0; p = parents[p]) {
+        subtree_ends[p] -= num_removed;
+      }
+
+      // close the gap.
+      for (unsigned i = end; i != num_nodes; ++i) {
+        unsigned dest = i - num_removed;
+        nodeToParent[dest] = nodeToParent[i];
+        nodeToWorld[dest] = nodeToWorld[i];
+        int parent = parents[i];
+        parents[dest] = parent >= (int)end ? parent - (int)num_removed : parent;
+        subtree_ends[dest] = subtree_ends[i] - num_removed;
+        flags[dest] = flags[i];
+        sids[dest] = sids[i];
+        index_to_id[dest] = index_to_id[i];
+        id_to_index[get_slot(index_to_id[dest])] = (int)dest;
+      }
+
+      unsigned new_size = num_nodes - num_removed;
+      nodeToParent.resize(new_size);
+      nodeToWorld.resize(new_size);
+      parents.resize(new_size);
+      subtree_ends.resize(new_size);
+      flags.resize(new_size);
+      sids.resize(new_size);
+      index_to_id.resize(new_size);
+    }
+
+    /// Remove all the nodes. Their ids stay invalid.
+    void reset() {
+      for (unsigned i = 0; i != index_to_id.size(); ++i) {
+        free_id(index_to_id[i]);
+      }
+      nodeToParent.reset();
+      nodeToWorld.reset();
+      parents.reset();
+      subtree_ends.reset();
+      flags.reset();
+      sids.reset();
+      index_to_id.reset();
+      order_dirty = false;
+    }
+
+    /// Calculate nodeToWorld for every dirty node and its children in one pass.
+    void update() {
+      if (order_dirty) sort();
+      update_range(0, parents.size());
+    }
+
+    /// Update the nodes at positions [begin, end).
+    /// The parents of these nodes must be up to date, so update split() ranges
+    /// after the serial nodes, or a subtree after its parents.
+    void update_range(unsigned begin, unsigned end) {
+      assert(!order_dirty && end <= parents.size());
+      const mat4t *local = nodeToParent.data();
+      mat4t *world = nodeToWorld.data();
+      const int *parent_ptr = parents.data();
+      uint8_t *flag_ptr = flags.data();
+
+      for (unsigned i = begin; i != end; ++i) {
+        int parent = parent_ptr[i];
+        unsigned f = flag_ptr[i];
+        unsigned parent_flags = parent >= 0 ? flag_ptr[parent] : flag_changed|flag_world_enabled;
+        if ((f & flag_dirty) || (parent >= 0 && (parent_flags & flag_changed))) {
+          if (parent >= 0) {
+            multiply(world[i], local[i], world[parent]);
+          } else {
+            world[i] = local[i];
+          }
+          unsigned world_enabled = (f & flag_enabled) && (parent_flags & flag_world_enabled) ? flag_world_enabled : 0;
+          flag_ptr[i] = (uint8_t)((f & flag_enabled) | world_enabled | flag_changed);
+        } else {
+          flag_ptr[i] = (uint8_t)(f & ~flag_changed);
+        }
+      }
+    }
+
+    /// Divide the hierarchy into work for several threads.
+    ///
+    /// Subtrees with no more than "grain_size" nodes go into "ranges" (small neighbouring
+    /// subtrees are combined). The nodes above them go into "serial_nodes".
+    /// Call update_node() on the serial nodes in order, then update_range() on each range
+    /// in any order or on any thread.
+    void split(dynarray<unsigned> &serial_nodes, dynarray<range> &ranges, unsigned grain_size) {
+      if (order_dirty) sort();
+      serial_nodes.resize(0);
+      ranges.resize(0);
+      if (grain_size == 0) grain_size = 1;
+      unsigned num_nodes = parents.size();
+      for (unsigned i = 0; i != num_nodes; ) {
+        unsigned end = subtree_ends[i];
+        if (end - i <= grain_size) {
+          if (!ranges.empty() && ranges.back().end == i && end - ranges.back().begin <= grain_size) {
+            ranges.back().end = end;
+          } else {
+            range r = { i, end };
+            ranges.push_back(r);
+          }
+          i = end;
+        } else {
+          serial_nodes.push_back(i);
+          ++i;
+        }
+      }
+    }
+
+    /// Update a single node at a position. Its parent must be up to date.
+    void update_node(unsigned index) {
+      update_range(index, index + 1);
+    }
+
+    /// Number of nodes.
+    unsigned get_num_nodes() const {
+      return parents.size();
+    }
+
+    /// Position of a node in the arrays. This changes when nodes are added or removed.
+    unsigned get_index(int id) {
+      if (order_dirty) sort();
+      return get_checked_index(id);
+    }
+
+    /// Id of the node at a position in the arrays.
+    int get_id(unsigned index) const {
+      return index_to_id[index];
+    }
+
+    /// One past the last node position of the subtree starting at "index".
+    unsigned get_subtree_end(unsigned index) {
+      if (order_dirty) sort();
+      return subtree_ends[index];
+    }
+
+    /// Return true if the id refers to a node.
+    bool is_valid(int id) const {
+      unsigned slot = get_slot(id);
+      return id >= 0 && slot < id_to_index.size() && id_to_index[slot] >= 0 && (unsigned)generations[slot] == (unsigned)id >> slot_bits;
+    }
+
+    /// Id of the parent of a node or -1 for a root.
+    int get_parent(int id) const {
+      int parent = parents[get_checked_index(id)];
+      return parent < 0 ? -1 : index_to_id[parent];
+    }
+
+    /// Get the sid of a node.
+    atom_t get_sid(int id) const {
+      return sids[get_checked_index(id)];
+    }
+
+    /// Find the first node with a sid or -1.
+    int find_node(atom_t sid) const {
+      for (unsigned i = 0; i != sids.size(); ++i) {
+        if (sids[i] == sid) return index_to_id[i];
+      }
+      return -1;
+    }
+
+    /// Read the node to parent matrix.
+    const mat4t &get_nodeToParent(int id) const {
+      return nodeToParent[get_checked_index(id)];
+    }
+
+    /// Access the node to parent matrix for writing. This marks the node dirty.
+    mat4t &access_nodeToParent(int id) {
+      unsigned index = get_checked_index(id);
+      flags[index] |= flag_dirty;
+      return nodeToParent[index];
+    }
+
+    /// The node to world matrix from the last update().
+    const mat4t &get_nodeToWorld(int id) const {
+      return nodeToWorld[get_checked_index(id)];
+    }
+
+    /// Get the enabled state of this node alone.
+    bool get_enabled(int id) const {
+      return (flags[get_checked_index(id)] & flag_enabled) != 0;
+    }
+
+    /// Set the enabled state of a node. This marks the node dirty.
+    void set_enabled(int id, bool value) {
+      unsigned index = get_checked_index(id);
+      flags[index] = (uint8_t)((flags[index] & ~flag_enabled) | (value ? flag_enabled : 0) | flag_dirty);
+    }
+
+    /// Return true if this node and its parents were enabled at the last update().
+    bool get_world_enabled(int id) const {
+      return (flags[get_checked_index(id)] & flag_world_enabled) != 0;
+    }
+
+    /// Return true if the node to world matrix changed in the last update().
+    bool has_changed(int id) const {
+      return (flags[get_checked_index(id)] & flag_changed) != 0;
+    }
+
+    /// The node to world matrices in node position order, for bulk processing.
+    const mat4t *get_nodeToWorld_array() const {
+      return nodeToWorld.data();
+    }
+
+    /// The parent positions in node position order (-1 for roots).
+    const int *get_parent_array() const {
+      return parents.data();
+    }
+  };
+
+  /// A handle to a node in a transform_hierarchy with a similar interface to scene_node.
+  ///
+  /// This is just a pointer and an id, so pass it by value.
+  /// Like a raw pointer, it must not outlive the hierarchy.
+  class transform_node {
+    transform_hierarchy *hierarchy;
+    int id;
+  public:
+    /// Make a handle to a node.
+    transform_node(transform_hierarchy *hierarchy = 0, int id = -1) {
+      this->hierarchy = hierarchy;
+      this->id = id;
+    }
+
+    /// Return true if the handle refers to a node.
+    bool is_valid() const {
+      return hierarchy && hierarchy->is_valid(id);
+    }
+
+    /// The hierarchy that owns the node.
+    transform_hierarchy *get_hierarchy() const {
+      return hierarchy;
+    }
+
+    /// The node's id in the hierarchy.
+    int get_id() const {
+      return id;
+    }
+
+    /// Add a new child node with an identity matrix.
+    transform_node add_child(const mat4t &matrix = mat4t(), atom_t sid = atom_) {
+      return transform_node(hierarchy, hierarchy->add_node(id, matrix, sid));
+    }
+
+    /// Get the parent node (not valid for a root).
+    transform_node get_parent() const {
+      return transform_node(hierarchy, hierarchy->get_parent(id));
+    }
+
+    /// Get the sid of the node.
+    atom_t get_sid() const {
+      return hierarchy->get_sid(id);
+    }
+
+    /// Read the node to parent transform matrix.
+    const mat4t &get_nodeToParent() const {
+      return hierarchy->get_nodeToParent(id);
+    }
+
+    /// Access the node to parent transform matrix for writing. This marks the node dirty.
+    mat4t &access_nodeToParent() {
+      return hierarchy->access_nodeToParent(id);
+    }
+
+    /// The node to world matrix from the last update().
+    const mat4t &get_modelToWorld() const {
+      return hierarchy->get_nodeToWorld(id);
+    }
+
+    /// Return true if this node and its parents were enabled at the last update().
+    bool calcEnabled() const {
+      return hierarchy->get_world_enabled(id);
+    }
+
+    /// get enabled state
+    bool get_enabled() const {
+      return hierarchy->get_enabled(id);
+    }
+
+    /// set enabled state
+    void set_enabled(bool value) {
+      hierarchy->set_enabled(id, value);
+    }
+
+    /// reset the matrix
+    void loadIdentity() {
+      access_nodeToParent().loadIdentity();
+    }
+
+    /// Translate the matrix
+    void translate(vec3_in xyz) {
+      access_nodeToParent().translate(xyz[0], xyz[1], xyz[2]);
+    }
+
+    /// Rotate the matrix
+    void rotate(float angle, vec3_in axis) {
+      access_nodeToParent().rotate(angle, axis[0], axis[1], axis[2]);
+    }
+
+    /// Scale the matrix
+    void scale(vec3_in xyz) {
+      access_nodeToParent().scale(xyz[0], xyz[1], xyz[2]);
+    }
+
+    /// get the position of the node in world space
+    vec3 get_position() const {
+      return get_modelToWorld().w().xyz();
+    }
+  };
+} }
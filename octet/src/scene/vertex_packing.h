@@ -0,0 +1,145 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// Encoding of compact vertex attributes
+//
+// example:
+//
+//   msh->pack_vertices();      // 16 bit positions, 2x16 bit normals, half float uvs
+//   msh->pack_vertices(8);     // 2x8 bit normals
+//
+
+namespace octet { namespace scene {
+  /// Encoders and decoders for the compact vertex layouts made by mesh::pack_vertices().
+  ///
+  /// Positions are three 16 bit unsigned normalised lanes, scaled and offset by the range of
+  /// the mesh in the vertex shader (see shader::make_packed_vertex_shader()).
+  /// Normals, tangents and bitangents are unit vectors projected onto an octahedron and unfolded
+  /// into a square, stored as two signed normalised lanes of 16 or 8 bits.
+  /// UVs are half floats, which the GPU converts for us.
+  ///
+  /// Signed lanes use the OpenGL ES3 rule c / (2^(bits-1) - 1). OpenGL ES2 uses (2c + 1) / (2^bits - 1),
+  /// which moves an 8 bit normal by less than half a degree.
+  class vertex_packing {
+  public:
+    /// Convert a float to a half float, rounding to the nearest even.
+    /// Values too big for a half become infinity and NaNs stay NaNs.
+    static uint16_t float_to_half(float value) {
+      uint32_t f;
+      memcpy(&f, &value, sizeof(f));
+      uint32_t sign = f & 0x80000000;
+      f ^= sign;
+
+      uint16_t result;
+      if (f >= (127 + 16) << 23) {
+        // too big, infinity or NaN
+        result = f > 0x7f800000 ? 0x7e00 : 0x7c00;
+      } else if (f < (127 - 14) << 23) {
+        // a half denormal: let the float adder do the rounding.
+        float magic_value, fvalue;
+        uint32_t magic = (127 - 15 + 23 - 10 + 1) << 23;
+        memcpy(&magic_value, &magic, sizeof(magic));
+        memcpy(&fvalue, &f, sizeof(f));
+        fvalue += magic_value;
+        memcpy(&f, &fvalue, sizeof(f));
+        result = (uint16_t)(f - magic);
+      } else {
+        // rebias the exponent and round the mantissa to nearest even.
+        uint32_t odd = (f >> 13) & 1;
+        f -= (127 - 15) << 23;
+        f += 0xfff + odd;
+        result = (uint16_t)(f >> 13);
+      }
+      return result | (uint16_t)(sign >> 16);
+    }
+
+    /// Convert a half float to a float.
+    static float half_to_float(uint16_t value) {
+      const uint32_t exponent_mask = 0x7c00 << 13;
+      uint32_t f = (value & 0x7fff) << 13;
+      uint32_t exponent = f & exponent_mask;
+      f += (127 - 15) << 23;
+
+      float result;
+      if (exponent == exponent_mask) {
+        // infinity or NaN
+        f += (128 - 16) << 23;
+        memcpy(&result, &f, sizeof(f));
+      } else if (exponent == 0) {
+        // zero or a denormal: renormalise with the float adder.
+        float magic_value;
+        uint32_t magic = 113 << 23;
+        memcpy(&magic_value, &magic, sizeof(magic));
+        f += 1 << 23;
+        memcpy(&result, &f, sizeof(f));
+        result -= magic_value;
+      } else {
+        memcpy(&result, &f, sizeof(f));
+      }
+      return (value & 0x8000) ? -result : result;
+    }
+
+    /// Encode a position as 16 bit unsigned normalised lanes: value = lane / 65535 * scale + offset.
+    static void encode_position(uint16_t *dest, const vec3 &pos, const vec3 &scale, const vec3 &offset) {
+      for (unsigned i = 0; i != 3; ++i) {
+        float t = scale[i] > 0 ? (pos[i] - offset[i]) / scale[i] : 0;
+        t = std::max(0.0f, std::min(1.0f, t));
+        dest[i] = (uint16_t)(t * 65535.0f + 0.5f);
+      }
+    }
+
+    /// Decode a position made by encode_position() from lanes that are already divided by 65535.
+    static vec3 decode_position(const vec3 &lanes, const vec3 &scale, const vec3 &offset) {
+      return lanes * scale + offset;
+    }
+
+    /// Decode two octahedral lanes in the range [-1, 1] to a unit vector.
+    /// This is the same as octet_decode_octahedral() in a packed vertex shader.
+    static vec3 decode_octahedral(float x, float y) {
+      float z = 1.0f - fabsf(x) - fabsf(y);
+      float t = std::max(-z, 0.0f);
+      x += x >= 0 ? -t : t;
+      y += y >= 0 ? -t : t;
+      return normalize(vec3(x, y, z));
+    }
+
+    /// Encode a unit vector as two octahedral lanes of type int8_t or int16_t.
+    /// Of the four nearest codes, we choose the one that decodes closest to the vector.
+    template <class lane_t> static void encode_octahedral(lane_t *dest, const vec3 &value) {
+      const float max_lane = (float)((1 << (sizeof(lane_t) * 8 - 1)) - 1);
+      float sum = fabsf(value.x()) + fabsf(value.y()) + fabsf(value.z());
+      if (sum == 0) {
+        dest[0] = dest[1] = 0;
+        return;
+      }
+
+      float x = value.x() / sum;
+      float y = value.y() / sum;
+      if (value.z() < 0) {
+        // fold the lower half of the octahedron over the upper half.
+        float fx = (1.0f - fabsf(y)) * (x >= 0 ? 1.0f : -1.0f);
+        float fy = (1.0f - fabsf(x)) * (y >= 0 ? 1.0f : -1.0f);
+        x = fx;
+        y = fy;
+      }
+
+      vec3 unit = normalize(value);
+      float base_x = floorf(x * max_lane);
+      float base_y = floorf(y * max_lane);
+      float best_dot = -2;
+      for (unsigned i = 0; i != 4; ++i) {
+        float cx = std::max(-max_lane, std::min(max_lane, base_x + (i & 1)));
+        float cy = std::max(-max_lane, std::min(max_lane, base_y + (i >> 1)));
+        float d = dot(decode_octahedral(cx / max_lane, cy / max_lane), unit);
+        if (d > best_dot) {
+          best_dot = d;
+          dest[0] = (lane_t)cx;
+          dest[1] = (lane_t)cy;
+        }
+      }
+    }
+  };
+}}
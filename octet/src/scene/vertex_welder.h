@@ -0,0 +1,308 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// Welding of duplicate vertices
+//
+// example:
+//
+//   vertex_welder welder;
+//   welder.weld(vertex_bytes, stride, num_vertices, indices, num_indices);
+//   // welder.get_vertices() has get_num_vertices() vertices, in the order they are first used
+//   // welder.get_indices() has num_indices indices into them
+//
+
+namespace octet { namespace scene {
+  /// Finds the vertices of an indexed mesh that have the same bytes and makes one vertex of each.
+  ///
+  /// New vertices are numbered in the order the indices first use them, so the result does not
+  /// depend on the number of threads. Vertices are hashed with SSE2, sorted into buckets by the
+  /// top bits of the hash and each bucket is de-duplicated on its own thread.
+  ///
+  /// With an epsilon, positions are snapped to a grid of that size before they are compared,
+  /// so vertices with positions in the same grid cell and the same other attributes are welded.
+  /// The welded vertex keeps the bytes of the first one used.
+  class vertex_welder {
+    enum {
+      max_bucket_bits = 6,
+      min_bucket_size = 4096,   // fewer vertices per bucket than this are not worth a thread
+      chunk_size = 16384,       // vertices per piece of the bucket sort
+    };
+
+    const uint8_t *keys;      // the bytes that are compared: the vertices, or a copy with snapped positions
+    unsigned stride;
+    unsigned num_source;
+    unsigned bucket_bits;
+
+    dynarray<uint8_t> snapped;
+    dynarray<uint64_t> hashes;
+    dynarray<uint64_t> order;        // low hash bits and source vertex, by bucket, in increasing order in each bucket
+    dynarray<unsigned> bucket_start;
+    dynarray<unsigned> first_same;   // the lowest numbered source vertex with the same bytes
+    dynarray<unsigned> new_index;
+    dynarray<unsigned> source_of;    // the source vertex each new vertex is copied from
+
+    dynarray<uint8_t> dest_vertices;
+    dynarray<uint32_t> dest_indices;
+
+    // a different key for each sixteen bytes of a vertex, so that moving bytes changes the hash.
+    static const uint64_t *get_keys() {
+      static const uint64_t keys[16] = {
+        0xbe4ba423396cfeb8ULL, 0x1cad21f72c81017cULL, 0xdb979083e96dd4deULL, 0x1f67b3b7a4a44072ULL,
+        0x78e5c0cc4ee679cbULL, 0x2172ffcc7dd05a82ULL, 0x8e2443f7744608b8ULL, 0x4c263a81e69035e0ULL,
+        0xcb00c391bb52283cULL, 0xa32e531b8b65d088ULL, 0x4ef90da297486471ULL, 0xd8acdea946ef1938ULL,
+        0x3f349ce33f76faa8ULL, 0x1d4f0bc7c7bbdcf9ULL, 0x3159b4cd4be0518aULL, 0x647378d9c97e9fc8ULL,
+      };
+      return keys;
+    }
+
+    // add sixteen bytes to the two 64 bit accumulators.
+    // each half is mixed with a key, its two 32 bit words multiplied and the other half added.
+    #if OCTET_SSE2
+      static __m128i accumulate(__m128i acc, const uint8_t *bytes, const uint64_t *key) {
+        __m128i data = _mm_loadu_si128((const __m128i*)bytes);
+        __m128i mixed = _mm_xor_si128(data, _mm_loadu_si128((const __m128i*)key));
+        __m128i product = _mm_mul_epu32(mixed, _mm_shuffle_epi32(mixed, _MM_SHUFFLE(0, 3, 0, 1)));
+        __m128i swapped = _mm_shuffle_epi32(data, _MM_SHUFFLE(1, 0, 3, 2));
+        return _mm_add_epi64(acc, _mm_add_epi64(product, swapped));
+      }
+    #else
+      static void accumulate(uint64_t acc[2], const uint8_t *bytes, const uint64_t *key) {
+        uint64_t data[2];
+        memcpy(data, bytes, 16);
+        uint64_t mixed0 = data[0] ^ key[0];
+        uint64_t mixed1 = data[1] ^ key[1];
+        acc[0] += (mixed0 & 0xffffffff) * (mixed0 >> 32) + data[1];
+        acc[1] += (mixed1 & 0xffffffff) * (mixed1 >> 32) + data[0];
+      }
+    #endif
+
+    template <class fn_t> static void parallel_for(job_system *jobs, unsigned num_items, unsigned grain, fn_t fn) {
+      if (jobs) {
+        jobs->parallel_for(0, num_items, grain, fn);
+      } else if (num_items) {
+        fn(0, num_items);
+      }
+    }
+
+    unsigned get_bucket(uint64_t hash) const {
+      return bucket_bits ? (unsigned)(hash >> (64 - bucket_bits)) : 0;
+    }
+
+    void snap_positions(const uint8_t *vertices, unsigned pos_offset, float epsilon, job_system *jobs) {
+      snapped.resize(num_source * stride);
+      float scale = 1.0f / epsilon;
+      parallel_for(jobs, num_source, 1024, [=](unsigned begin, unsigned end) {
+        for (unsigned i = begin; i != end; ++i) {
+          uint8_t *dest = snapped.data() + i * stride;
+          memcpy(dest, vertices + i * stride, stride);
+          for (unsigned j = 0; j != 3; ++j) {
+            float pos;
+            memcpy(&pos, dest + pos_offset + j * 4, 4);
+            int32_t cell = (int32_t)floorf(pos * scale + 0.5f);
+            memcpy(dest + pos_offset + j * 4, &cell, 4);
+          }
+        }
+      });
+      keys = snapped.data();
+    }
+
+    // put the source vertices into buckets by the top bits of their hash with a counting sort.
+    void sort_into_buckets(job_system *jobs) {
+      unsigned num_buckets = 1 << bucket_bits;
+      unsigned num_chunks = (num_source + chunk_size - 1) / chunk_size;
+      dynarray<unsigned> counts(num_chunks * num_buckets);
+      memset(counts.data(), 0, counts.size() * sizeof(unsigned));
+
+      parallel_for(jobs, num_chunks, 1, [&](unsigned begin, unsigned end) {
+        for (unsigned c = begin; c != end; ++c) {
+          unsigned *count = counts.data() + c * num_buckets;
+          unsigned last = std::min(num_source, (c + 1) * chunk_size);
+          for (unsigned i = c * chunk_size; i != last; ++i) {
+            count[get_bucket(hashes[i])]++;
+          }
+        }
+      });
+
+      // turn the counts into the place each chunk starts in each bucket.
+      bucket_start.resize(num_buckets + 1);
+      unsigned total = 0;
+      for (unsigned b = 0; b != num_buckets; ++b) {
+        bucket_start[b] = total;
+        for (unsigned c = 0; c != num_chunks; ++c) {
+          unsigned count = counts[c * num_buckets + b];
+          counts[c * num_buckets + b] = total;
+          total += count;
+        }
+      }
+      bucket_start[num_buckets] = total;
+
+      order.resize(num_source);
+      parallel_for(jobs, num_chunks, 1, [&](unsigned begin, unsigned end) {
+        for (unsigned c = begin; c != end; ++c) {
+          unsigned *pos = counts.data() + c * num_buckets;
+          unsigned last = std::min(num_source, (c + 1) * chunk_size);
+          for (unsigned i = c * chunk_size; i != last; ++i) {
+            uint64_t hash = hashes[i];
+            order[pos[get_bucket(hash)]++] = (hash << 32) | i;
+          }
+        }
+      });
+    }
+
+    // find the first vertex with the same bytes as each vertex in a bucket.
+    void weld_bucket(unsigned bucket) {
+      unsigned begin = bucket_start[bucket];
+      unsigned end = bucket_start[bucket + 1];
+      unsigned table_size = 16;
+      while (table_size < (end - begin) * 2) table_size *= 2;
+      unsigned mask = table_size - 1;
+
+      // slots hold the low bits of the hash and the vertex, as in order, so most misses do not touch the vertex.
+      dynarray<uint64_t> table(table_size);
+      memset(table.data(), 0xff, table_size * sizeof(uint64_t));
+
+      for (unsigned k = begin; k != end; ++k) {
+        uint64_t item = order[k];
+        unsigned v = (unsigned)item;
+        const uint8_t *bytes = keys + v * stride;
+        #if OCTET_SSE2
+          // the vertices of a bucket are scattered over the mesh: fetch ahead in case we compare them.
+          if (k + 8 < end) _mm_prefetch((const char*)(keys + (unsigned)order[k + 8] * stride), _MM_HINT_T0);
+        #endif
+        for (unsigned slot = (unsigned)(item >> 32) & mask; ; slot = (slot + 1) & mask) {
+          uint64_t entry = table[slot];
+          unsigned t = (unsigned)entry;
+          if (t == ~0u) {
+            table[slot] = item;
+            first_same[v] = v;
+            break;
+          } else if ((entry >> 32) == (item >> 32) && memcmp(keys + t * stride, bytes, stride) == 0) {
+            first_same[v] = t;
+            break;
+          }
+        }
+      }
+    }
+
+  public:
+    /// Make an empty welder. The buffers are kept between calls to weld().
+    vertex_welder() {
+      keys = 0;
+      stride = 0;
+      num_source = 0;
+      bucket_bits = 0;
+    }
+
+    /// Hash the bytes of a vertex. The SSE2 and plain versions give the same result.
+    static uint64_t get_hash(const uint8_t *bytes, unsigned size) {
+      const uint64_t *keys = get_keys();
+      uint64_t acc[2] = { 0x9e3779b97f4a7c15ULL, size };
+      uint8_t tail[16] = { 0 };
+      unsigned num_chunks = size / 16;
+      memcpy(tail, bytes + num_chunks * 16, size - num_chunks * 16);
+      #if OCTET_SSE2
+        __m128i sum = _mm_loadu_si128((const __m128i*)acc);
+        for (unsigned chunk = 0; chunk != num_chunks; ++chunk) {
+          sum = accumulate(sum, bytes + chunk * 16, keys + (chunk * 2 & 15));
+        }
+        if (size & 15) sum = accumulate(sum, tail, keys + (num_chunks * 2 & 15));
+        _mm_storeu_si128((__m128i*)acc, sum);
+      #else
+        for (unsigned chunk = 0; chunk != num_chunks; ++chunk) {
+          accumulate(acc, bytes + chunk * 16, keys + (chunk * 2 & 15));
+        }
+        if (size & 15) accumulate(acc, tail, keys + (num_chunks * 2 & 15));
+      #endif
+      return hash_map_cmp::mix_hash(acc[0] ^ (acc[1] * 0xc2b2ae3d27d4eb4fULL));
+    }
+
+    /// Weld a mesh's vertices. Indices must be less than num_vertices.
+    /// For epsilon welding, pos_offset is the byte offset of three float coordinates in each vertex.
+    /// Returns the number of welded vertices.
+    unsigned weld(
+      const uint8_t *vertices, unsigned stride_, unsigned num_vertices, const uint32_t *indices, unsigned num_indices,
+      float epsilon = 0, unsigned pos_offset = ~0u, job_system *jobs = &job_system::get()
+    ) {
+      stride = stride_;
+      num_source = num_vertices;
+      keys = vertices;
+      if (epsilon > 0 && pos_offset != ~0u) {
+        assert(pos_offset + 12 <= stride);
+        snap_positions(vertices, pos_offset, epsilon, jobs);
+      }
+
+      hashes.resize(num_source);
+      parallel_for(jobs, num_source, 1024, [this](unsigned begin, unsigned end) {
+        for (unsigned i = begin; i != end; ++i) {
+          hashes[i] = get_hash(keys + i * stride, stride);
+        }
+      });
+
+      bucket_bits = 0;
+      while (bucket_bits != max_bucket_bits && (num_source >> bucket_bits) >= min_bucket_size * 2) {
+        bucket_bits++;
+      }
+      sort_into_buckets(jobs);
+
+      first_same.resize(num_source);
+      parallel_for(jobs, 1 << bucket_bits, 1, [this](unsigned begin, unsigned end) {
+        for (unsigned b = begin; b != end; ++b) {
+          weld_bucket(b);
+        }
+      });
+
+      // number the vertices in the order they are first used. This is one pass of array lookups.
+      new_index.resize(num_source);
+      memset(new_index.data(), 0xff, num_source * sizeof(unsigned));
+      source_of.resize(0);
+      source_of.reserve(num_source);
+      dest_indices.resize(num_indices);
+      for (unsigned i = 0; i != num_indices; ++i) {
+        assert(indices[i] < num_source);
+        unsigned &e = new_index[first_same[indices[i]]];
+        if (e == ~0u) {
+          e = source_of.size();
+          source_of.push_back(indices[i]);
+        }
+        dest_indices[i] = e;
+      }
+
+      unsigned num_welded = source_of.size();
+      dest_vertices.resize(num_welded * stride);
+      parallel_for(jobs, num_welded, 4096, [=](unsigned begin, unsigned end) {
+        for (unsigned i = begin; i != end; ++i) {
+          memcpy(dest_vertices.data() + i * stride, vertices + source_of[i] * stride, stride);
+        }
+      });
+      return num_welded;
+    }
+
+    /// Number of vertices after weld().
+    unsigned get_num_vertices() const {
+      return source_of.size();
+    }
+
+    /// The welded vertices, get_num_vertices() * stride bytes.
+    const uint8_t *get_vertices() const {
+      return dest_vertices.data();
+    }
+
+    /// The new indices, one for each index given to weld().
+    const uint32_t *get_indices() const {
+      return dest_indices.data();
+    }
+
+    /// Size of the welded vertices in bytes.
+    unsigned get_vertices_size() const {
+      return dest_vertices.size();
+    }
+
+    /// Size of the new indices in bytes.
+    unsigned get_indices_size() const {
+      return dest_indices.size() * sizeof(uint32_t);
+    }
+  };
+}}
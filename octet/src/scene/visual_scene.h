@@ -10,22 +10,145 @@
 namespace octet { namespace scene {
   /// Visual scene; contains instances of meshes, cameras and lights required to draw a scene.
   class visual_scene : public scene_node {
+  public:
+    /// Frustum culling counters for the last frame.
+    struct cull_stats {
+      unsigned num_instances;       // mesh instances in the scene
+      unsigned num_tested;          // instances in the culling tree
+      unsigned num_culled;          // instances skipped because they were off screen
+      unsigned num_drawn;           // instances drawn
+      unsigned num_nodes_visited;   // tree nodes visited
+      unsigned num_boxes_tested;    // boxes tested against the frustum
+      bool tree_built;              // the tree was built from scratch
+    };
+
+    /// State change counters for the last frame.
+    struct render_stats {
+      unsigned num_draws;             // draw calls
+      unsigned num_instanced;         // mesh instances drawn as part of an instanced draw
+      unsigned num_shader_changes;    // glUseProgram calls
+      unsigned num_material_changes;  // materials whose uniforms were set
+      unsigned num_mesh_changes;      // meshes whose attributes were set
+    };
+
+  private:
     ///////////////////////////////////////////
     //
     // rendering information
     //
 
     /// each of these is a set of (scene_node, mesh, material)
-    dynarray<ref<mesh_instance> > mesh_instances;
+    /// slot maps keep the instances packed for rendering and let us delete them in O(1).
+    slot_map<ref<mesh_instance> > mesh_instances;
 
     /// animations playing at the moment
-    dynarray<ref<animation_instance> > animation_instances;
+    slot_map<ref<animation_instance> > animation_instances;
 
     /// cameras available
-    dynarray<ref<camera_instance> > camera_instances;
+    slot_map<ref<camera_instance> > camera_instances;
 
     /// lights available
-    dynarray<ref<light_instance> > light_instances;
+    slot_map<ref<light_instance> > light_instances;
+
+    /// what we knew about each mesh instance when we last put it in the culling tree.
+    struct mesh_instance_bounds {
+      mesh_instance *mi;
+      scene_node *node;
+      mesh *msh;
+      unsigned world_version;
+      aabb mesh_aabb;
+      int item;  // item in mesh_instance_tree, not_cullable or not_in_tree
+    };
+    enum { not_cullable = -1, not_in_tree = -2 };
+
+    /// frustum culling of mesh instances
+    bool frustum_culling;
+    aabb_tree mesh_instance_tree;
+    dynarray<mesh_instance_bounds> mesh_bounds;
+    dynarray<unsigned> tree_mesh_instances;   // mesh instance index of each tree item
+    dynarray<unsigned> unculled_mesh_instances;
+    unsigned num_mesh_instances_not_in_tree;
+    dynamic_bitset<> visible_mesh_instances;
+    cull_stats stats;
+
+    /// what the parallel pass found out about each mesh instance in the culling tree.
+    enum { bounds_same, bounds_moved, bounds_check };
+    dynarray<uint8_t> bounds_status;
+    dynarray<aabb> moved_boxes;
+
+    /// the culling tree is up to date for cast_ray() until the next update().
+    bool ray_casts_ready;
+
+    /// one visible mesh instance to draw this frame.
+    struct draw_t {
+      mesh_instance *mi;
+      mat4t modelToProjection;
+      mat4t modelToCamera;
+      skeleton::skin_pose *pose;  // skin matrices of a skinned mesh, or NULL
+      unsigned skin_base;         // first matrix in skin_matrices for skinning on the GPU
+    };
+
+    /// threads for the update and for working out what to draw; NULL to do it all on the caller's thread.
+    job_system *jobs;
+    dynarray<scene_node *> world_subtrees;
+
+    /// flat transforms for large numbers of simple nodes, and the scene nodes that follow them.
+    struct transform_binding {
+      int id;
+      ref<scene_node> node;
+    };
+    ref<transform_hierarchy> transforms;
+    dynarray<transform_binding> transform_bindings;
+    dynarray<unsigned> transform_serial_nodes;
+    dynarray<transform_hierarchy::range> transform_ranges;
+    dynarray<unsigned> visible_list;
+    dynarray<uint8_t> draw_status;
+    enum { draw_skip, draw_ready, draw_later };
+
+    /// draws sorted to reduce state changes
+    bool sort_by_state;
+    dynarray<draw_t> draws;
+    render_queue queue;
+    render_stats rstats;
+
+    /// skinning: the skeletons and skins to pose this frame, the skinned draws
+    /// and their model to camera matrices for the skinned shader.
+    enum { max_gpu_bones = 192 };  // size of the skinned shader's matrix array
+    struct skin_job {
+      skeleton *skel;
+      skeleton::skin_pose *pose;
+    };
+    dynarray<skeleton *> pose_skeletons;
+    dynarray<skin_job> skin_jobs;
+    dynarray<unsigned> skinned_draws;
+    dynarray<mat4t> skin_matrices;
+
+    /// a group of draws in the queue with the same mesh and material, drawn together.
+    struct instance_run {
+      unsigned begin;
+      unsigned end;
+      unsigned base;  // first matrix in instance_matrices
+    };
+
+    /// a mesh with shader::max_array_instances copies for instancing_uniform_array.
+    /// the source is not a ref, so that deleted meshes are not kept alive; vertex buffer
+    /// versions are never reused, so a new mesh at the same address is not mistaken for it.
+    struct mesh_copies {
+      mesh *source;
+      ref<mesh> copies;
+      unsigned vertex_version;
+      unsigned num_vertices;
+      unsigned num_indices;
+      int last_frame;
+    };
+
+    /// drawing many mesh instances with one call
+    shader::instancing_mode instancing;
+    unsigned min_instances;
+    dynarray<instance_run> instance_runs;
+    dynarray<mat4t> instance_matrices;
+    ref<gl_resource> instance_buffer;
+    hash_map<mesh *, mesh_copies> copies;
 
     /// set this to draw bounding boxes
     bool render_aabbs;
@@ -119,6 +242,237 @@ namespace octet { namespace scene {
       }
     }
 
+    // call fn(begin, end) for pieces of [0, num_items) on the job threads.
+    template <class fn_t> void parallel_for(unsigned num_items, unsigned grain, fn_t fn) {
+      if (jobs) {
+        jobs->parallel_for(0, num_items, grain, fn);
+      } else if (num_items) {
+        fn(0, num_items);
+      }
+    }
+
+    // bring the world matrices up to date, with subtrees of the scene on different threads.
+    void update_world_transforms_parallel() {
+      if (!jobs || jobs->get_num_threads() == 1) {
+        update_world_transforms();
+        return;
+      }
+      split_world_update(world_subtrees, jobs->get_num_threads() * 4);
+      parallel_for(world_subtrees.size(), 1, [this](unsigned begin, unsigned end) {
+        for (unsigned i = begin; i != end; ++i) {
+          world_subtrees[i]->update_world_subtree();
+        }
+      });
+    }
+
+    // update the flat hierarchy, subtrees on different threads, then copy the
+    // world matrices of the bound nodes to their scene nodes.
+    void update_transform_hierarchy() {
+      if (!transforms) return;
+      if (!jobs || jobs->get_num_threads() == 1) {
+        transforms->update();
+      } else {
+        unsigned grain = transforms->get_num_nodes() / (jobs->get_num_threads() * 4) + 1;
+        transforms->split(transform_serial_nodes, transform_ranges, grain < 256 ? 256 : grain);
+        for (unsigned i = 0; i != transform_serial_nodes.size(); ++i) {
+          transforms->update_node(transform_serial_nodes[i]);
+        }
+        parallel_for(transform_ranges.size(), 1, [this](unsigned begin, unsigned end) {
+          for (unsigned i = begin; i != end; ++i) {
+            transforms->update_range(transform_ranges[i].begin, transform_ranges[i].end);
+          }
+        });
+      }
+
+      unsigned num_bindings = 0;
+      for (unsigned i = 0; i != transform_bindings.size(); ++i) {
+        transform_binding &b = transform_bindings[i];
+        if (!transforms->is_valid(b.id)) continue;
+        if (transforms->has_changed(b.id)) {
+          b.node->access_nodeToParent() = transforms->get_nodeToWorld(b.id);
+          b.node->set_enabled(transforms->get_world_enabled(b.id));
+        }
+        transform_bindings[num_bindings++] = b;
+      }
+      transform_bindings.resize(num_bindings);
+    }
+
+    // can we skip this instance when its box is off screen?
+    static bool is_cullable(mesh_instance *mi, const aabb &mesh_aabb) {
+      if (mi->get_flags() & mesh_instance::flag_no_cull) return false;
+
+      // skinned meshes move away from their bind pose box.
+      if (mi->get_skeleton() && mi->get_mesh()->get_skin()) return false;
+
+      // meshes without a box, such as text.
+      vec3 half = mesh_aabb.get_half_extent();
+      return half.x() != 0 || half.y() != 0 || half.z() != 0;
+    }
+
+    static bool same_box(const aabb &a, const aabb &b) {
+      vec3 ac = a.get_center(), ah = a.get_half_extent();
+      vec3 bc = b.get_center(), bh = b.get_half_extent();
+      return
+        ac.x() == bc.x() && ac.y() == bc.y() && ac.z() == bc.z() &&
+        ah.x() == bh.x() && ah.y() == bh.y() && ah.z() == bh.z()
+      ;
+    }
+
+    static void init_bounds(mesh_instance_bounds &b, mesh_instance *mi) {
+      b.mi = mi;
+      b.node = mi->get_node();
+      b.msh = mi->get_mesh();
+      b.world_version = b.node->get_world_version();
+      b.mesh_aabb = b.msh->get_aabb();
+    }
+
+    // put every mesh instance in the culling tree and build it.
+    void build_culling_tree() {
+      unsigned num_instances = mesh_instances.size();
+      mesh_bounds.resize(num_instances);
+      tree_mesh_instances.resize(0);
+      unculled_mesh_instances.resize(0);
+      for (unsigned i = 0; i != num_instances; ++i) {
+        mesh_instance *mi = mesh_instances[i];
+        mesh_instance_bounds &b = mesh_bounds[i];
+        init_bounds(b, mi);
+        if (is_cullable(mi, b.mesh_aabb)) {
+          b.item = (int)tree_mesh_instances.size();
+          tree_mesh_instances.push_back(i);
+        } else {
+          b.item = not_cullable;
+          unculled_mesh_instances.push_back(i);
+        }
+      }
+      num_mesh_instances_not_in_tree = 0;
+
+      // the nodes are up to date after init_bounds() and each item has its own box, so this can be parallel.
+      mesh_instance_tree.resize(tree_mesh_instances.size());
+      parallel_for(num_instances, 256, [this](unsigned begin, unsigned end) {
+        for (unsigned i = begin; i != end; ++i) {
+          const mesh_instance_bounds &b = mesh_bounds[i];
+          if (b.item >= 0) {
+            mesh_instance_tree.set_item(b.item, b.mesh_aabb.get_transform(b.node->get_modelToWorld()));
+          }
+        }
+      });
+      mesh_instance_tree.build();
+    }
+
+    // find the mesh instances that have moved and refit the tree.
+    // removing mesh instances builds the tree again. New mesh instances are drawn
+    // without culling until there are enough of them to make a build worthwhile.
+    bool update_culling_tree() {
+      unsigned num_instances = mesh_instances.size();
+      unsigned num_known = mesh_bounds.size();
+      if (num_instances < num_known) {
+        build_culling_tree();
+        return true;
+      }
+
+      // compare the instances with what we knew and transform the boxes of the ones that moved, in parallel.
+      // nodes outside the scene may still be dirty and are left for the serial pass below.
+      bounds_status.resize(num_known);
+      moved_boxes.resize(num_known);
+      parallel_for(num_known, 256, [this](unsigned begin, unsigned end) {
+        for (unsigned i = begin; i != end; ++i) {
+          mesh_instance *mi = mesh_instances[i];
+          const mesh_instance_bounds &b = mesh_bounds[i];
+          scene_node *node = mi->get_node();
+          uint8_t status = bounds_check;
+          if (b.mi == mi && !node->is_world_dirty()) {
+            mesh *msh = mi->get_mesh();
+            aabb mesh_aabb = msh->get_aabb();
+            if (node == b.node && msh == b.msh && node->get_world_version() == b.world_version && same_box(mesh_aabb, b.mesh_aabb)) {
+              status = bounds_same;
+            } else if (b.item >= 0 && is_cullable(mi, mesh_aabb)) {
+              moved_boxes[i] = mesh_aabb.get_transform(node->get_modelToWorld());
+              status = bounds_moved;
+            }
+          }
+          bounds_status[i] = status;
+        }
+      });
+
+      for (unsigned i = 0; i != num_known; ++i) {
+        if (bounds_status[i] == bounds_same) continue;
+
+        mesh_instance *mi = mesh_instances[i];
+        mesh_instance_bounds &b = mesh_bounds[i];
+        if (b.mi != mi) {
+          build_culling_tree();
+          return true;
+        }
+
+        scene_node *node = mi->get_node();
+        mesh *msh = mi->get_mesh();
+        unsigned world_version = node->get_world_version();
+        aabb mesh_aabb = msh->get_aabb();
+        if (node == b.node && msh == b.msh && world_version == b.world_version && same_box(mesh_aabb, b.mesh_aabb)) {
+          continue;
+        }
+
+        if (b.item != not_in_tree && is_cullable(mi, mesh_aabb) != (b.item >= 0)) {
+          build_culling_tree();
+          return true;
+        }
+
+        b.node = node;
+        b.msh = msh;
+        b.world_version = world_version;
+        b.mesh_aabb = mesh_aabb;
+        if (b.item >= 0) {
+          mesh_instance_tree.set_item(b.item, bounds_status[i] == bounds_moved ? moved_boxes[i] : mesh_aabb.get_transform(node->get_modelToWorld()));
+        }
+      }
+
+      if (num_instances != num_known) {
+        num_mesh_instances_not_in_tree += num_instances - num_known;
+        if (num_mesh_instances_not_in_tree > 64 + mesh_instance_tree.get_num_items() / 8) {
+          build_culling_tree();
+          return true;
+        }
+        mesh_bounds.resize(num_instances);
+        for (unsigned i = num_known; i != num_instances; ++i) {
+          init_bounds(mesh_bounds[i], mesh_instances[i]);
+          mesh_bounds[i].item = not_in_tree;
+          unculled_mesh_instances.push_back(i);
+        }
+      }
+      return mesh_instance_tree.update();
+    }
+
+    // set a bit in visible_mesh_instances for each mesh instance that might be on screen.
+    void find_visible_mesh_instances(camera_instance &cam) {
+      unsigned num_instances = mesh_instances.size();
+      visible_mesh_instances.resize(num_instances);
+      memset(&stats, 0, sizeof(stats));
+      stats.num_instances = num_instances;
+
+      if (!frustum_culling) {
+        visible_mesh_instances.set_all();
+        return;
+      }
+
+      stats.tree_built = update_culling_tree();
+      visible_mesh_instances.clear();
+      for (unsigned i = 0; i != unculled_mesh_instances.size(); ++i) {
+        visible_mesh_instances.setbit(unculled_mesh_instances[i]);
+      }
+
+      aabb_tree::query_stats qs;
+      const unsigned *tree_instances = tree_mesh_instances.data();
+      dynamic_bitset<> &visible = visible_mesh_instances;
+      mesh_instance_tree.query(cam.get_frustum(), [tree_instances, &visible](unsigned item) {
+        visible.setbit(tree_instances[item]);
+      }, &qs);
+
+      stats.num_tested = mesh_instance_tree.get_num_items();
+      stats.num_culled = stats.num_tested - qs.num_items_found;
+      stats.num_nodes_visited = qs.num_nodes_visited;
+      stats.num_boxes_tested = qs.num_boxes_tested;
+    }
+
     void render_debug_line_buffer() {
       glBindBuffer(GL_ARRAY_BUFFER, 0);
       glVertexAttribPointer(attribute_pos, 3, GL_FLOAT, GL_FALSE, 12, (void*)debug_line_buffer.data() );
@@ -132,7 +486,7 @@ namespace octet { namespace scene {
       for (unsigned mesh_index = 0; mesh_index != mesh_instances.size(); ++mesh_index) {
         mesh_instance *mi = mesh_instances[mesh_index];
         mesh *msh = mi->get_mesh();
-        mat4t modelToWorld = mi->get_node()->calcModelToWorld();
+        const mat4t &modelToWorld = mi->get_node()->get_modelToWorld();
         mat4t modelToCamera;
         mat4t modelToProjection;
         cam.get_matrices(modelToProjection, modelToCamera, modelToWorld);
@@ -181,86 +535,400 @@ namespace octet { namespace scene {
       }
     }
 
-    void render_impl(bump_shader &object_shader, bump_shader &skin_shader, camera_instance &cam, float aspect_ratio) {
-      mat4t cameraToWorld = cam.get_node()->calcModelToWorld();
+    // can this draw be drawn with others of the same mesh and material?
+    static bool can_instance(const draw_t &d) {
+      mesh_instance *mi = d.mi;
+      if (mi->get_flags() & mesh_instance::flag_selected) return false;
+      if (mi->get_skeleton() && mi->get_mesh()->get_skin()) return false;
+      return mi->get_material()->get_shader() != 0;
+    }
 
-      mat4t worldToCamera;
-      cameraToWorld.invertQuick(worldToCamera);
+    // can we draw with glDrawElementsInstanced and glVertexAttribDivisor?
+    // on Windows they are fetched from the driver at run time and may be missing.
+    static bool has_instanced_arrays() {
+      #if defined(OCTET_GLES2)
+        return false;
+      #elif defined(WIN32)
+        return glDrawArraysInstanced != 0 && glDrawElementsInstanced != 0 && glVertexAttribDivisor != 0;
+      #else
+        return true;
+      #endif
+    }
 
-      calc_lighting(worldToCamera);
+    // copies of a mesh for instancing_uniform_array, made again if the mesh or its vertices have changed.
+    mesh *get_mesh_copies(mesh *msh) {
+      mesh_copies &mc = copies[msh];
+      unsigned vertex_version = msh->get_vertices()->get_version();
+      if (!mc.copies || mc.source != msh || mc.vertex_version != vertex_version || mc.num_vertices != msh->get_num_vertices() || mc.num_indices != msh->get_num_indices()) {
+        mc.source = msh;
+        mc.vertex_version = vertex_version;
+        mc.num_vertices = msh->get_num_vertices();
+        mc.num_indices = msh->get_num_indices();
+        mc.copies = msh->make_copies(shader::max_array_instances);
+      }
+      mc.last_frame = frame_number;
+      return mc.copies;
+    }
 
-      cam.set_cameraToWorld(cameraToWorld, aspect_ratio);
-      mat4t cameraToProjection = cam.get_cameraToProjection();
+    // every 64 frames, let go of the copies of meshes that have not been drawn with them lately,
+    // eg. because their mesh instances were deleted.
+    void prune_mesh_copies() {
+      if (copies.empty() || (frame_number & 63) != 0) return;
+      for (hash_map<mesh *, mesh_copies>::iterator it = copies.begin(); it != copies.end(); ) {
+        if (frame_number - it->value.last_frame > 64) {
+          it = copies.erase(it);
+        } else {
+          ++it;
+        }
+      }
+    }
 
-      draw_debug_data(cam);
+    // find the groups of at least min_instances sorted draws that share a mesh and material
+    // and gather their model to camera matrices.
+    void find_instance_runs() {
+      prune_mesh_copies();
+      instance_runs.resize(0);
+      instance_matrices.resize(0);
+      if (instancing == shader::instancing_none || !sort_by_state) return;
+
+      unsigned num_items = queue.size();
+      for (unsigned i = 0; i != num_items; ) {
+        const draw_t &d = draws[queue[i].index];
+        unsigned end = i + 1;
+        if (can_instance(d)) {
+          while (end != num_items) {
+            const draw_t &e = draws[queue[end].index];
+            if (e.mi->get_mesh() != d.mi->get_mesh() || e.mi->get_material() != d.mi->get_material() || !can_instance(e)) break;
+            end++;
+          }
+        }
+        if (end - i >= min_instances && (instancing != shader::instancing_uniform_array || get_mesh_copies(d.mi->get_mesh()))) {
+          instance_run run = { i, end, instance_matrices.size() };
+          instance_runs.push_back(run);
+          for (unsigned j = i; j != end; ++j) {
+            instance_matrices.push_back(draws[queue[j].index].modelToCamera);
+          }
+        }
+        i = end;
+      }
 
-      for (unsigned mesh_index = 0; mesh_index != mesh_instances.size(); ++mesh_index) {
-        mesh_instance *mi = mesh_instances[mesh_index];
+      #ifndef OCTET_GLES2
+        // one upload for all the instances this frame.
+        if (instancing == shader::instancing_attributes && !instance_matrices.empty()) {
+          if (!instance_buffer) instance_buffer = new gl_resource();
+          instance_buffer->stream(GL_ARRAY_BUFFER, instance_matrices.data(), instance_matrices.size() * sizeof(mat4t));
+        }
+      #endif
+    }
 
-        scene_node *node = mi->get_node();
-        unsigned flags = mi->get_flags();
+    // draw a group of instances with the instanced version of their material's shader.
+    void draw_instances(const instance_run &run, const mat4t &cameraToProjection, param_shader *&cur_shader, material *&cur_material, mesh *&cur_mesh, unsigned &cur_version) {
+      mesh_instance *mi = draws[queue[run.begin].index].mi;
+      material *mat = mi->get_material();
+      mesh *msh = mi->get_mesh();
+      param_shader *shader = mat->get_shader();
+      unsigned num_instances = run.end - run.begin;
+
+      shader::vertex_format format = msh->get_vertex_format();
+      unsigned version = shader::get_program_version(instancing, format);
+      bool new_program = shader != cur_shader || cur_version != version;
+      mat->begin_render_instanced(instancing, cameraToProjection, light_uniforms, num_light_uniforms, num_lights, new_program, format);
+      if (format != shader::vertex_float) {
+        mat->render_vertex_decode(msh->get_pos_scale(), msh->get_pos_offset());
+      }
+      rstats.num_material_changes++;
+      if (new_program) rstats.num_shader_changes++;
+      cur_shader = shader;
+      cur_material = 0;
+      cur_version = version;
+
+      if (instancing == shader::instancing_uniform_array) {
+        mesh *copy = get_mesh_copies(msh);
+        if (copy != cur_mesh) {
+          if (cur_mesh) cur_mesh->disable_attributes();
+          copy->enable_attributes();
+          rstats.num_mesh_changes++;
+        }
+        unsigned count = msh->get_index_type() ? msh->get_num_indices() : msh->get_num_vertices();
+        for (unsigned i = 0; i < num_instances; i += shader::max_array_instances) {
+          unsigned n = std::min(num_instances - i, (unsigned)shader::max_array_instances);
+          shader->set_instance_matrices(&instance_matrices[run.base + i], n, format);
+          copy->draw(i == 0 && copy != cur_mesh, n * count);
+          rstats.num_draws++;
+        }
+        cur_mesh = copy;
+      } else {
+        #ifndef OCTET_GLES2
+          if (msh != cur_mesh) {
+            if (cur_mesh) cur_mesh->disable_attributes();
+            msh->enable_attributes();
+            rstats.num_mesh_changes++;
+          }
+
+          // the model to camera matrix is four vec4 attributes that step once per instance.
+          instance_buffer->bind();
+          for (unsigned k = 0; k != 4; ++k) {
+            GLuint attr = attribute_instance_matrix + k;
+            glVertexAttribPointer(attr, 4, GL_FLOAT, GL_FALSE, sizeof(mat4t), (void*)(run.base * sizeof(mat4t) + k * sizeof(vec4)));
+            glVertexAttribDivisor(attr, 1);
+            glEnableVertexAttribArray(attr);
+          }
+          msh->draw_instanced(num_instances, msh != cur_mesh);
+          for (unsigned k = 0; k != 4; ++k) {
+            GLuint attr = attribute_instance_matrix + k;
+            glVertexAttribDivisor(attr, 0);
+            glDisableVertexAttribArray(attr);
+          }
+          cur_mesh = msh;
+          rstats.num_draws++;
+        #endif
+      }
+      rstats.num_instanced += num_instances;
+      stats.num_drawn += num_instances;
+    }
+
+    // a different key for every prepare_render() of every scene, for the skeletons' pose caches.
+    static unsigned new_pose_key() {
+      static std::atomic<unsigned> next_key(0);
+      unsigned key = ++next_key;
+      return key ? key : ++next_key;
+    }
 
+    // work out the poses of the skeletons of the skinned draws, each skeleton and skin once,
+    // then the matrices for the skinned shader or the vertices of meshes skinned on the CPU.
+    void prepare_skinning() {
+      unsigned key = new_pose_key();
+      pose_skeletons.resize(0);
+      skin_jobs.resize(0);
+      skinned_draws.resize(0);
+      unsigned num_matrices = 0;
+      for (unsigned i = 0; i != draws.size(); ++i) {
+        draw_t &d = draws[i];
+        skeleton *skel = d.mi->get_skeleton();
+        skin *skn = d.mi->get_mesh()->get_skin();
+        d.pose = 0;
+        d.skin_base = 0;
+        if (!skel || !skn) continue;
+
+        if (skel->begin_pose(key)) {
+          pose_skeletons.push_back(skel);
+        }
+        skeleton::skin_pose *sp = skel->get_skin_pose(skn);
+        if (sp->key != key) {
+          sp->key = key;
+          skin_job sj = { skel, sp };
+          skin_jobs.push_back(sj);
+        }
+        d.pose = sp;
+        if (sp->matrices.size() <= max_gpu_bones) {
+          d.skin_base = num_matrices;
+          num_matrices += sp->matrices.size();
+        }
+        skinned_draws.push_back(i);
+      }
+      if (skinned_draws.empty()) return;
+
+      skin_matrices.resize(num_matrices);
+      parallel_for(pose_skeletons.size(), 1, [this](unsigned begin, unsigned end) {
+        for (unsigned i = begin; i != end; ++i) {
+          pose_skeletons[i]->calc_pose();
+        }
+      });
+      parallel_for(skin_jobs.size(), 1, [this](unsigned begin, unsigned end) {
+        for (unsigned i = begin; i != end; ++i) {
+          skin_jobs[i].skel->calc_skin_matrices(skin_jobs[i].pose);
+        }
+      });
+      parallel_for(skinned_draws.size(), 1, [this](unsigned begin, unsigned end) {
+        for (unsigned i = begin; i != end; ++i) {
+          const draw_t &d = draws[skinned_draws[i]];
+          const mat4t *src = d.pose->matrices.data();
+          unsigned num_joints = d.pose->matrices.size();
+          if (num_joints <= max_gpu_bones) {
+            mat4t *dest = skin_matrices.data() + d.skin_base;
+            for (unsigned j = 0; j != num_joints; ++j) {
+              dest[j] = src[j] * d.modelToCamera;
+            }
+          } else {
+            // the first frame, the copy is made on the GL thread by get_cpu_skinned_mesh().
+            cpu_skin *cs = d.mi->get_cpu_skin();
+            if (cs && cs->get_source() == d.mi->get_mesh()) {
+              cs->skin(src, num_joints);
+            }
+          }
+        }
+      });
+    }
+
+    // the mesh skinned on the CPU for a draw with too many bones for the shader.
+    mesh *get_cpu_skinned_mesh(const draw_t &d) {
+      mesh_instance *mi = d.mi;
+      cpu_skin *cs = mi->get_cpu_skin();
+      if (!cs || cs->get_source() != mi->get_mesh()) {
+        cs = new cpu_skin(mi->get_mesh());
+        mi->set_cpu_skin(cs);
+        cs->skin(d.pose->matrices.data(), d.pose->matrices.size());
+      }
+      return cs->upload();
+    }
+
+    // work out the matrices of a visible mesh instance. Returns false if it is not drawn.
+    static bool make_draw(draw_t &d, mesh_instance *mi, const camera_instance &cam) {
+      scene_node *node = mi->get_node();
+      unsigned flags = mi->get_flags();
+
+      if (
+        !(flags & mesh_instance::flag_enabled) ||
+        !node->calcEnabled()
+      ) return false;
+
+      const mat4t &modelToWorld = node->get_modelToWorld();
+      d.mi = mi;
+      mat4t &modelToCamera = d.modelToCamera;
+      cam.get_matrices(d.modelToProjection, modelToCamera, modelToWorld);
+      //printf("%f\n", modelToWorld.w().y());
+
+      // selecting LOD meshes by distance
+      if (flags & mesh_instance::flag_lod) {
+        float distance = -modelToCamera.w().z();
+        //printf("%f %f %f\n", distance, mi->get_min_draw_distance(), mi->get_max_draw_distance());
         if (
-          !(flags & mesh_instance::flag_enabled) ||
-          !node->calcEnabled()
-        ) continue;
+          distance < mi->get_min_draw_distance() ||
+          distance >= mi->get_max_draw_distance()
+        ) {
+          return false;
+        }
+      }
+      return true;
+    }
 
+    void render_impl(bump_shader &object_shader, bump_shader &skin_shader, camera_instance &cam, float aspect_ratio) {
+      prepare_render(cam, aspect_ratio);
+      submit_render(cam);
+      frame_number++;
+    }
+
+    // make the GL calls for the draws from prepare_render().
+    void submit_render(camera_instance &cam) {
+      mat4t cameraToProjection = cam.get_cameraToProjection();
+
+      draw_debug_data(cam);
+
+      find_instance_runs();
+
+      // draw them, only changing state when the shader, material or mesh changes.
+      memset(&rstats, 0, sizeof(rstats));
+      param_shader *cur_shader = 0;
+      material *cur_material = 0;
+      mesh *cur_mesh = 0;
+      unsigned cur_version = shader::instancing_none;
+      unsigned next_run = 0;
+      for (unsigned i = 0; i != queue.size(); ++i) {
+        if (next_run != instance_runs.size() && instance_runs[next_run].begin == i) {
+          const instance_run &run = instance_runs[next_run++];
+          draw_instances(run, cameraToProjection, cur_shader, cur_material, cur_mesh, cur_version);
+          i = run.end - 1;
+          continue;
+        }
+
+        const draw_t &d = draws[queue[i].index];
+        mesh_instance *mi = d.mi;
         mesh *msh = mi->get_mesh();
-        skin *skn = msh->get_skin();
-        skeleton *skel = mi->get_skeleton();
         material *mat = mi->get_material();
+        const mat4t &modelToProjection = d.modelToProjection;
+        const mat4t &modelToCamera = d.modelToCamera;
 
-        mat4t modelToWorld = node->calcModelToWorld();
-        mat4t modelToCamera;
-        mat4t modelToProjection;
-        cam.get_matrices(modelToProjection, modelToCamera, modelToWorld);
-        //printf("%d %f\n", mesh_index, modelToWorld.w().y());
-
-        // selecting LOD meshes by distance
-        if (flags & mesh_instance::flag_lod) {
-          float distance = -modelToCamera.w().z();
-          //printf("%f %f %f\n", distance, mi->get_min_draw_distance(), mi->get_max_draw_distance());
-          if (
-            distance < mi->get_min_draw_distance() ||
-            distance >= mi->get_max_draw_distance()
-          ) {
-            continue;
-          }
+        bool gpu_skinned = d.pose && d.pose->matrices.size() <= max_gpu_bones;
+        if (d.pose && !gpu_skinned) {
+          // too many bones for the skinned shader: draw a copy skinned on the CPU.
+          msh = get_cpu_skinned_mesh(d);
         }
 
-        if (!skel || !skn) {
+        if (!gpu_skinned) {
           /// normal rendering for single matrix objects
           /// build a projection matrix: model -> world -> camera_instance -> projection
           /// the projection space is the cube -1 <= x/w, y/w, z/w <= 1
-          mat->render(modelToProjection, modelToCamera, light_uniforms, num_light_uniforms, num_lights);
-        } else {
-          /// multi-matrix rendering
-          mat4t *transforms = skel->calc_transforms(modelToCamera, skn);
-          int num_bones = skel->get_num_bones();
-          if(num_bones > 192) {
-            GLint mvuv = 0;
-            //glGetIntegerv(GL_MAX_VERTEX_UNIFORM_VECTORS, &mvuv);
-            printf("warning: too many bones (%d/%d)\n", num_bones, mvuv/4);
-          } else {
-            mat->render_skinned(cameraToProjection, transforms, num_bones, light_uniforms, num_light_uniforms, num_lights);
+          // meshes with packed vertices use another version of the material's program.
+          shader::vertex_format format = msh->get_vertex_format();
+          unsigned version = shader::get_program_version(shader::instancing_none, format);
+          if (mat != cur_material || cur_version != version) {
+            param_shader *shader = mat->get_shader();
+            bool new_program = shader != cur_shader || cur_version != version;
+            mat->begin_render(light_uniforms, num_light_uniforms, num_lights, new_program, format);
+            rstats.num_material_changes++;
+            if (new_program) rstats.num_shader_changes++;
+            cur_material = mat;
+            cur_shader = shader;
+            cur_version = version;
           }
+          mat->render_matrices(modelToProjection, modelToCamera);
+          if (format != shader::vertex_float) {
+            mat->render_vertex_decode(msh->get_pos_scale(), msh->get_pos_offset());
+          }
+        } else {
+          /// multi-matrix rendering with the matrices from prepare_skinning()
+          mat->render_skinned(cameraToProjection, skin_matrices.data() + d.skin_base, d.pose->matrices.size(), light_uniforms, num_light_uniforms, num_lights);
         }
 
         /*if (true) {
           static bool dumped;
           if (!dumped) { msh->dump_transformed(modelToProjection); dumped = true; }
         }*/
-        msh->enable_attributes();
-        msh->draw();
-        msh->disable_attributes();
+        if (msh != cur_mesh) {
+          if (cur_mesh) cur_mesh->disable_attributes();
+          msh->enable_attributes();
+          rstats.num_mesh_changes++;
+        }
+        msh->draw(msh != cur_mesh);
+        cur_mesh = msh;
+        stats.num_drawn++;
+        rstats.num_draws++;
 
         if (mi->get_flags() & mesh_instance::flag_selected) {
+          // the debug material and mesh change all the state.
+          cur_mesh->disable_attributes();
+          cur_mesh = 0;
+          cur_material = 0;
+          cur_shader = 0;
           aabb bb = mi->get_mesh()->get_aabb();
           bb = bb.get_transform(mi->get_node()->calcModelToWorld());
           draw_aabb(bb);
         }
       }
-      frame_number++;
+      if (cur_mesh) cur_mesh->disable_attributes();
+    }
+
+    // add an instance and remember its handle in it, so that deleting it by pointer is O(1).
+    template <class type> static slot_handle insert_instance(slot_map<ref<type> > &instances, type *inst) {
+      slot_handle handle = instances.insert(inst);
+      if (inst) inst->set_scene_handle(handle);
+      return handle;
+    }
+
+    // give every instance its handle again after the slot map has been rebuilt.
+    template <class type> static void update_handles(slot_map<ref<type> > &instances) {
+      for (unsigned i = 0; i != instances.size(); ++i) {
+        if (instances[i]) instances[i]->set_scene_handle(instances.get_handle(i));
+      }
+    }
+
+    // remove an instance by pointer in O(1) using the handle it holds.
+    template <class type> static void erase_by_value(slot_map<ref<type> > &instances, type *inst) {
+      if (!inst) return;
+      slot_handle handle = inst->get_scene_handle();
+      ref<type> *item = instances.get(handle);
+      if (item && *item == inst) {
+        instances.erase(handle);
+        return;
+      }
+
+      // the instance holds the handle of another scene: search for it.
+      for (unsigned i = 0; i != instances.size(); ++i) {
+        if (instances[i] == inst) {
+          instances.erase_index(i);
+          return;
+        }
+      }
     }
   public:
     RESOURCE_META(visual_scene)
@@ -273,6 +941,15 @@ namespace octet { namespace scene {
       render_aabbs = false;
       dump_vertices = false;
       render_debug_lines = false;
+      frustum_culling = true;
+      num_mesh_instances_not_in_tree = 0;
+      ray_casts_ready = false;
+      memset(&stats, 0, sizeof(stats));
+      sort_by_state = false;
+      memset(&rstats, 0, sizeof(rstats));
+      instancing = has_instanced_arrays() ? shader::instancing_attributes : shader::instancing_uniform_array;
+      min_instances = 4;
+      jobs = &job_system::get();
       debug_material = new material(vec4(1, 0, 0, 1));
       debug_line_buffer.resize(256);
       assert(is_power_of_two(debug_line_buffer.size()));
@@ -337,14 +1014,27 @@ namespace octet { namespace scene {
     /// Serialization
     void visit(visitor &v) {
       scene_node::visit(v);
-      v.visit(mesh_instances, atom_mesh_instances);
-      v.visit(animation_instances, atom_animation_instances);
-      v.visit(camera_instances, atom_camera_instances);
-      v.visit(light_instances, atom_light_instances);
+      v.visit(mesh_instances.access_items(), atom_mesh_instances);
+      v.visit(animation_instances.access_items(), atom_animation_instances);
+      v.visit(camera_instances.access_items(), atom_camera_instances);
+      v.visit(light_instances.access_items(), atom_light_instances);
+      if (v.is_reader()) {
+        mesh_instances.rebuild();
+        animation_instances.rebuild();
+        camera_instances.rebuild();
+        light_instances.rebuild();
+        update_handles(mesh_instances);
+        update_handles(animation_instances);
+        update_handles(camera_instances);
+        update_handles(light_instances);
+      }
     }
 
     /// reset the scene.
     void reset() {
+      copies.clear();
+      transforms = 0;
+      transform_bindings.reset();
       mesh_instances.reset();
       animation_instances.reset();
       camera_instances.reset();
@@ -395,7 +1085,7 @@ namespace octet { namespace scene {
         float f = distance * 2, n = f * 0.001f;
         cam->set_node(node);
         cam->set_perspective(0, 45, 1, n, f);
-        camera_instances.push_back(cam);
+        insert_instance(camera_instances, cam);
       }
 
       /// default light instance
@@ -410,7 +1100,7 @@ namespace octet { namespace scene {
         _light->set_kind(atom_directional);
         li->set_node(node);
         li->set_light(_light);
-        light_instances.push_back(li);
+        insert_instance(light_instances, li);
       }
 
       if (!object_shader) {
@@ -442,39 +1132,106 @@ namespace octet { namespace scene {
     }
 
     mesh_instance *add_mesh_instance(mesh_instance *inst=0) {
-      mesh_instances.push_back(inst);
+      insert_instance(mesh_instances, inst);
       return inst;
     }
 
     animation_instance *add_animation_instance(animation_instance *inst) {
-      animation_instances.push_back(inst);
+      insert_instance(animation_instances, inst);
       return inst;
     }
 
     camera_instance *add_camera_instance(camera_instance *inst) {
-      camera_instances.push_back(inst);
+      insert_instance(camera_instances, inst);
       return inst;
     }
 
     light_instance *add_light_instance(light_instance *inst) {
-      light_instances.push_back(inst);
+      insert_instance(light_instances, inst);
       return inst;
     }
 
+    /// Add a mesh instance and return a handle for fast deletion.
+    /// Use this for objects that come and go often, such as bullets and debris.
+    slot_handle insert_mesh_instance(mesh_instance *inst) {
+      return insert_instance(mesh_instances, inst);
+    }
+
+    /// Add an animation instance and return a handle for fast deletion.
+    slot_handle insert_animation_instance(animation_instance *inst) {
+      return insert_instance(animation_instances, inst);
+    }
+
+    /// Add a camera instance and return a handle for fast deletion.
+    slot_handle insert_camera_instance(camera_instance *inst) {
+      return insert_instance(camera_instances, inst);
+    }
+
+    /// Add a light instance and return a handle for fast deletion.
+    slot_handle insert_light_instance(light_instance *inst) {
+      return insert_instance(light_instances, inst);
+    }
+
+    /// Get a mesh instance from its handle or null if it has been deleted.
+    mesh_instance *find_mesh_instance(slot_handle handle) {
+      ref<mesh_instance> *inst = mesh_instances.get(handle);
+      return inst ? (mesh_instance*)*inst : (mesh_instance*)NULL;
+    }
+
+    /// Get an animation instance from its handle or null if it has been deleted.
+    animation_instance *find_animation_instance(slot_handle handle) {
+      ref<animation_instance> *inst = animation_instances.get(handle);
+      return inst ? (animation_instance*)*inst : (animation_instance*)NULL;
+    }
+
+    /// Get a camera instance from its handle or null if it has been deleted.
+    camera_instance *find_camera_instance(slot_handle handle) {
+      ref<camera_instance> *inst = camera_instances.get(handle);
+      return inst ? (camera_instance*)*inst : (camera_instance*)NULL;
+    }
+
+    /// Get a light instance from its handle or null if it has been deleted.
+    light_instance *find_light_instance(slot_handle handle) {
+      ref<light_instance> *inst = light_instances.get(handle);
+      return inst ? (light_instance*)*inst : (light_instance*)NULL;
+    }
+
+    /// Delete a mesh instance in O(1). Returns false if it was already deleted.
+    /// Note that the last mesh instance takes the place of the deleted one.
+    bool delete_mesh_instance(slot_handle handle) {
+      return mesh_instances.erase(handle);
+    }
+
+    /// Delete an animation instance in O(1). Returns false if it was already deleted.
+    bool delete_animation_instance(slot_handle handle) {
+      return animation_instances.erase(handle);
+    }
+
+    /// Delete a camera instance in O(1). Returns false if it was already deleted.
+    bool delete_camera_instance(slot_handle handle) {
+      return camera_instances.erase(handle);
+    }
+
+    /// Delete a light instance in O(1). Returns false if it was already deleted.
+    bool delete_light_instance(slot_handle handle) {
+      return light_instances.erase(handle);
+    }
+
+    /// Delete a mesh instance by pointer in O(1), using the handle it was given when it was added.
     void delete_mesh_instance(mesh_instance *inst) {
-      //mesh_instances.erase_by_value(inst);
+      erase_by_value(mesh_instances, inst);
     }
 
     void delete_animation_instance(animation_instance *inst) {
-      //animation_instances.erase_by_value(inst);
+      erase_by_value(animation_instances, inst);
     }
 
     void delete_camera_instance(camera_instance *inst) {
-      //camera_instances.erase_by_value(inst);
+      erase_by_value(camera_instances, inst);
     }
 
     void delete_light_instance(light_instance *inst) {
-      //light_instances.erase_by_value(inst);
+      erase_by_value(light_instances, inst);
     }
 
     /// how many mesh instances do we have?
@@ -511,6 +1268,160 @@ namespace octet { namespace scene {
       dump_vertices = value;
     }
 
+    /// Skip mesh instances whose boxes are outside the camera's view (on by default).
+    void set_frustum_culling(bool value) {
+      frustum_culling = value;
+    }
+
+    /// Is frustum culling on?
+    bool get_frustum_culling() const {
+      return frustum_culling;
+    }
+
+    /// Frustum culling counters for the last render.
+    const cull_stats &get_cull_stats() const {
+      return stats;
+    }
+
+    /// Draw mesh instances grouped by shader, material and mesh (off by default).
+    /// If this is off, they are drawn in the order they were added.
+    ///
+    /// Sorting changes the order of blended draws, so mark instances with blended
+    /// materials with mesh_instance::flag_translucent before turning this on: those are
+    /// drawn after the opaque ones, furthest first. Note that begin_render() turns on
+    /// GL_BLEND when multisampling is off, so unmarked instances are blended in sorted order.
+    void set_sort_by_state(bool value) {
+      sort_by_state = value;
+    }
+
+    /// Are draws sorted by state?
+    bool get_sort_by_state() const {
+      return sort_by_state;
+    }
+
+    /// State change counters for the last render.
+    const render_stats &get_render_stats() const {
+      return rstats;
+    }
+
+    /// How to draw many instances of the same mesh and material in one call.
+    /// The default is instancing_attributes, or instancing_uniform_array on OpenGL ES2
+    /// and on drivers without instanced draws and vertex attribute divisors.
+    /// Instancing needs set_sort_by_state(true) to bring the instances together.
+    void set_instancing(shader::instancing_mode value) {
+      if (value == shader::instancing_attributes && !has_instanced_arrays()) value = shader::instancing_uniform_array;
+      instancing = value;
+    }
+
+    /// How are instances drawn?
+    shader::instancing_mode get_instancing() const {
+      return instancing;
+    }
+
+    /// Draw instances one at a time unless there are at least this many with the same mesh and material.
+    void set_min_instances(unsigned value) {
+      min_instances = value < 1 ? 1 : value;
+    }
+
+    /// Threads to use for update() and prepare_render(). The default is job_system::get().
+    /// NULL does everything on the calling thread.
+    void set_job_system(job_system *value) {
+      jobs = value;
+    }
+
+    /// Threads used for update() and prepare_render().
+    job_system *get_job_system() const {
+      return jobs;
+    }
+
+    /// The scene's flat transform hierarchy, made on first use.
+    /// update() updates it before the scene nodes, so use it for large numbers of nodes
+    /// that move every frame and bind the ones you want to draw with bind_transform().
+    transform_hierarchy *get_transform_hierarchy() {
+      if (!transforms) transforms = new transform_hierarchy();
+      return transforms;
+    }
+
+    /// Make a scene node follow a node of get_transform_hierarchy().
+    /// Each update() copies the node to world matrix and enabled state of "id" to the
+    /// scene node's node to parent matrix, so the scene node should be a child of the scene.
+    /// The binding is dropped by the next update() after the transform node is removed,
+    /// even if a new node has been added in the meantime.
+    void bind_transform(int id, scene_node *node) {
+      assert(transforms && transforms->is_valid(id));
+      transform_binding b = { id, node };
+      transform_bindings.push_back(b);
+      // make the next update() copy the matrix even if the node does not move.
+      transforms->access_nodeToParent(id);
+    }
+
+    /// Work out what to draw from a camera without calling OpenGL: the world matrices,
+    /// culling, the matrices of each visible mesh instance and the order of the draws.
+    /// This is the part of render() that runs on the job threads.
+    /// Call it on its own, after update(), to measure a scene without a GL context.
+    void prepare_render(camera_instance &cam, float aspect_ratio) {
+      mat4t cameraToWorld = cam.get_node()->calcModelToWorld();
+
+      mat4t worldToCamera;
+      cameraToWorld.invertQuick(worldToCamera);
+
+      calc_lighting(worldToCamera);
+
+      cam.set_cameraToWorld(cameraToWorld, aspect_ratio);
+
+      // nodes may have moved since update().
+      update_world_transforms_parallel();
+
+      // skip the mesh instances that are off screen.
+      find_visible_mesh_instances(cam);
+
+      // work out the matrices of the visible mesh instances in parallel.
+      visible_list.resize(0);
+      for (int mesh_index = visible_mesh_instances.find_first(); mesh_index != -1; mesh_index = visible_mesh_instances.find_next(mesh_index + 1)) {
+        visible_list.push_back(mesh_index);
+      }
+      unsigned num_visible = visible_list.size();
+      draws.resize(num_visible);
+      draw_status.resize(num_visible);
+      const camera_instance *view = &cam;
+      parallel_for(num_visible, 128, [this, view](unsigned begin, unsigned end) {
+        for (unsigned i = begin; i != end; ++i) {
+          mesh_instance *mi = mesh_instances[visible_list[i]];
+          // nodes outside the scene may still be dirty and are done on this thread below.
+          if (mi->get_node()->is_world_dirty()) {
+            draw_status[i] = draw_later;
+          } else {
+            draw_status[i] = make_draw(draws[i], mi, *view) ? draw_ready : draw_skip;
+          }
+        }
+      });
+
+      // gather the draws and sort them by shader, material and mesh.
+      queue.reset();
+      unsigned num_draws = 0;
+      for (unsigned i = 0; i != num_visible; ++i) {
+        unsigned status = draw_status[i];
+        if (status == draw_later) {
+          status = make_draw(draws[i], mesh_instances[visible_list[i]], cam) ? draw_ready : draw_skip;
+        }
+        if (status == draw_skip) continue;
+
+        if (num_draws != i) draws[num_draws] = draws[i];
+        const draw_t &d = draws[num_draws];
+        uint64_t key = 0;
+        if (sort_by_state) {
+          mesh_instance *mi = d.mi;
+          material *mat = mi->get_material();
+          key = queue.make_key(mat->get_shader(), mat, mi->get_mesh(), -d.modelToCamera.w().z(), (mi->get_flags() & mesh_instance::flag_translucent) != 0);
+        }
+        queue.add(key, num_draws++);
+      }
+      draws.resize(num_draws);
+      queue.sort();
+
+      prepare_skinning();
+    }
+
     /// access camera_instance information
     camera_instance *get_camera_instance(int index) {
       return camera_instances[index];
@@ -543,15 +1454,33 @@ namespace octet { namespace scene {
         }
       #endif
 
+      ray_casts_ready = false;
+
+      // jobs that need the GL context, eg. uploads from loader jobs.
+      if (jobs && jobs->is_main_thread()) {
+        jobs->run_main_thread_jobs();
+      }
+
+      // sample the animations in parallel, then set the values on this thread
+      // as several animations may drive the same node.
+      parallel_for(animation_instances.size(), 4, [this](unsigned begin, unsigned end) {
+        for (unsigned idx = begin; idx != end; ++idx) {
+          animation_instances[idx]->evaluate();
+        }
+      });
       for (int idx = 0; idx != animation_instances.size(); ++idx) {
         animation_instance *inst = animation_instances[idx];
-        inst->update(delta_time);
+        inst->apply(delta_time);
       }
 
       for (int idx = 0; idx != mesh_instances.size(); ++idx) {
         mesh_instance *inst = mesh_instances[idx];
         inst->update(delta_time);
       }
+
+      // one pass over the scene to bring the cached world matrices up to date.
+      update_transform_hierarchy();
+      update_world_transforms_parallel();
     }
 
     /// render using specific shaders.
@@ -571,13 +1500,13 @@ namespace octet { namespace scene {
     /// play an animation on another target (not the same one as in the collada file)
     void play(animation *anim, resource *target, bool is_looping) {
       animation_instance *inst = new animation_instance(anim, target, is_looping);
-      animation_instances.push_back(inst);
+      insert_instance(animation_instances, inst);
     }
 
     /// play an animation with built-in targets (as in the collada file)
     void play(animation *anim, bool is_looping) {
       animation_instance *inst = new animation_instance(anim, NULL, is_looping);
-      animation_instances.push_back(inst);
+      insert_instance(animation_instances, inst);
     }
 
     /// find a mesh instance for a node
@@ -612,43 +1541,93 @@ namespace octet { namespace scene {
       return world_aabb;
     }
 
+    /// The nearest mesh instance hit by a ray.
     struct cast_result {
-      mesh_instance *mi;
-      rational depth;
+      mesh_instance *mi;    // NULL if nothing was hit
+      rational depth;       // how far along the ray: start + distance * depth
+      mesh_bvh::hit hit;    // the triangle of the mesh and where on it
     };
 
-    /// brute force & ignorance ray cast.
-    /// return the mesh instance and location of hits.
-    /// todo: build a kd tree for mesh instance bbs & mesh triangles
-    void cast_ray(cast_result &result, const ray &the_ray) {
+  private:
+    // ray cast against one mesh instance; shrinks max_t on a hit.
+    void cast_ray_instance(cast_result &result, const ray &the_ray, unsigned index, float &max_t) {
+      mesh_instance *mi = mesh_instances[index];
+      scene_node *node = mi ? mi->get_node() : NULL;
+      mesh *msh = mi ? mi->get_mesh() : NULL;
+      if (!node || !msh) return;
+
+      // distances along the ray are the same in model space.
+      mat4t worldToNode = node->get_modelToWorld().inverse3x4();
+      ray model_ray = the_ray.get_transform(worldToNode);
+      mesh_bvh::hit h;
+      if (msh->ray_cast(model_ray, h, max_t)) {
+        max_t = h.t;
+        result.mi = mi;
+        result.depth = rational(h.t);
+        result.hit = h;
+      }
+    }
+
+    // ray cast against every mesh instance, using the culling tree to skip most of them.
+    void cast_ray_tree(cast_result &result, const ray &the_ray, float max_t) {
       result.mi = 0;
       result.depth = rational(0, 0);
+      result.hit.t = max_t;
+      result.hit.u = result.hit.v = 0;
+      result.hit.triangle = ~0u;
 
-      for (int i = 0; i != mesh_instances.size(); ++i) {
-        mesh_instance *mi = mesh_instances[i];
-        if (mi && mi->get_node()) {
-          mat4t nodeToWorld = mi->get_node()->calcModelToWorld();
-          mesh *mesh = mi->get_mesh();
-          aabb bb = mesh->get_aabb();
-          bb = bb.get_transform(nodeToWorld);
-          if (the_ray.intersects(bb)) {
-            mat4t worldToNode = nodeToWorld.inverse3x4();
-            //ray model_ray = ray(vec3(0, 0, -1), vec3(0, 0, 2)); //the_ray.get_transform(worldToNode);
-            ray model_ray = the_ray.get_transform(worldToNode);
-            int indices[3] = {0};
-            vec4 bary_numer(0, 0, 0, 0);
-            float bary_denom;
-            bool hit = mesh->ray_cast(model_ray, indices, bary_numer, bary_denom);
-            if (hit) {
-              rational depth(bary_numer.w() / bary_denom);
-              result.depth = min(depth, result.depth);
-            }
-            //printf("hit=%d %s %f\n", hit, (bary_numer/bary_denom).toString(tmp, sizeof(tmp)), (float)result.depth);
-          }
+      for (unsigned i = 0; i != unculled_mesh_instances.size(); ++i) {
+        cast_ray_instance(result, the_ray, unculled_mesh_instances[i], max_t);
+      }
+      const unsigned *tree_instances = tree_mesh_instances.data();
+      mesh_instance_tree.query_ray(the_ray.get_start(), the_ray.get_distance(), max_t, [&](unsigned item, float &tree_max_t) {
+        cast_ray_instance(result, the_ray, tree_instances[item], max_t);
+        tree_max_t = max_t;
+      });
+    }
+
+  public:
+    /// Bring the culling tree and, with "all_meshes", the triangle trees of the meshes
+    /// up to date for casting rays.
+    /// cast_ray() does this itself after update(), when nodes in the scene have moved or when
+    /// mesh instances have been added or deleted. Call it after changing nodes outside the scene
+    /// or the boxes of meshes between casts in the same frame.
+    void prepare_ray_casts(bool all_meshes = false) {
+      update_world_transforms_parallel();
+      update_culling_tree();
+      ray_casts_ready = true;
+      if (all_meshes) {
+        for (int i = 0; i != mesh_instances.size(); ++i) {
+          mesh_instance *mi = mesh_instances[i];
+          if (!mi) continue;
+          if (mi->get_node()) mi->get_node()->get_modelToWorld();
+          if (mi->get_mesh()) mi->get_mesh()->get_bvh();
         }
       }
     }
 
+    /// Find the nearest mesh instance hit by the ray start + distance * t for 0 <= t < max_t.
+    /// Use max_t = 1 to stop at the end of the ray.
+    /// Mesh instances are found with the culling tree and triangles with a tree in each mesh.
+    /// The tree is prepared by the first cast after a change, so later casts only cost
+    /// a search of the tree.
+    void cast_ray(cast_result &result, const ray &the_ray, float max_t = 1e37f) {
+      if (!ray_casts_ready || is_subtree_dirty() || mesh_instances.size() != mesh_bounds.size()) {
+        prepare_ray_casts(false);
+      }
+      cast_ray_tree(result, the_ray, max_t);
+    }
+
+    /// Cast many rays, eg. for line of sight tests, on the worker threads.
+    void cast_rays(cast_result *results, const ray *rays, unsigned num_rays, float max_t = 1e37f) {
+      prepare_ray_casts(true);
+      parallel_for(num_rays, 16, [this, results, rays, max_t](unsigned begin, unsigned end) {
+        for (unsigned i = begin; i != end; ++i) {
+          cast_ray_tree(results[i], rays[i], max_t);
+        }
+      });
+    }
+
     /// Debug rendering: add a new line in world space (old ones will be lost)
     void add_debug_line(const vec3 &start, const vec3 &end) {
       if (debug_line_buffer.size()) {
@@ -16,6 +16,7 @@ namespace octet { namespace shaders {
     GLuint light_uniforms_index;    // lighting parameters for fragment shader
     GLuint num_lights_index;        // how many lights?
     GLuint samplers_index;          // index for texture samplers
+    GLuint instance_matrices_index; // model to camera matrices for instancing_uniform_array
 
     void init_uniforms(const char *vertex_shader, const char *fragment_shader) {
       // use the common shader code to compile and link the shaders
@@ -29,10 +30,13 @@ namespace octet { namespace shaders {
       light_uniforms_index = glGetUniformLocation(program(), "light_uniforms");
       num_lights_index = glGetUniformLocation(program(), "num_lights");
       samplers_index = glGetUniformLocation(program(), "samplers");
+      instance_matrices_index = glGetUniformLocation(program(), "instance_modelToCamera");
     }
 
   public:
-    void init(bool is_skinned=false) {
+    /// Make the shader. An instanced shader gets its model to camera matrices from the instances;
+    /// use render_instanced() with it.
+    void init(bool is_skinned=false, instancing_mode instancing=instancing_none) {
       // this is the vertex shader for regular geometry
       // it is called for each corner of each triangle
       // it inputs pos and uv from each corner
@@ -159,7 +163,14 @@ namespace octet { namespace shaders {
     
       // use the common shader code to compile and link the shaders
       // the result is a shader program
-      init_uniforms(is_skinned ? skinned_vertex_shader : vertex_shader, fragment_shader);
+      if (is_skinned) {
+        init_uniforms(skinned_vertex_shader, fragment_shader);
+      } else if (instancing != instancing_none) {
+        std::string instanced_vertex_shader = make_instanced_vertex_shader(vertex_shader, instancing);
+        init_uniforms(instanced_vertex_shader.c_str(), fragment_shader);
+      } else {
+        init_uniforms(vertex_shader, fragment_shader);
+      }
     }
 
     void render(const mat4t &modelToProjection, const mat4t &modelToCamera, const vec4 *light_uniforms, int num_light_uniforms, int num_lights) {
@@ -178,6 +189,28 @@ namespace octet { namespace shaders {
       glUniform1iv(samplers_index, 6, samplers);
     }
 
+    /// Render with a shader made with instancing. For instancing_uniform_array,
+    /// set the model to camera matrices with set_instance_matrices() before each draw.
+    void render_instanced(const mat4t &cameraToProjection, const vec4 *light_uniforms, int num_light_uniforms, int num_lights) {
+      // tell openGL to use the program
+      shader::render();
+
+      // customize the program with uniforms
+      glUniformMatrix4fv(cameraToProjection_index, 1, GL_FALSE, cameraToProjection.get());
+
+      glUniform4fv(light_uniforms_index, num_light_uniforms, (float*)light_uniforms);
+      glUniform1i(num_lights_index, num_lights);
+
+      // we use textures 0-3 for material properties.
+      static const GLint samplers[] = { 0, 1, 2, 3, 4, 5 };
+      glUniform1iv(samplers_index, 6, samplers);
+    }
+
+    /// Set up to max_array_instances model to camera matrices for instancing_uniform_array.
+    void set_instance_matrices(const mat4t *modelToCamera, unsigned num_instances) {
+      glUniformMatrix4fv(instance_matrices_index, num_instances, GL_FALSE, modelToCamera[0].get());
+    }
+
     void render_skinned(const mat4t &cameraToProjection, const mat4t *modelToCamera, int num_matrices, const vec4 *light_uniforms, int num_light_uniforms, int num_lights) {
       // tell openGL to use the program
       shader::render();
@@ -12,9 +12,88 @@
 
 namespace octet { namespace shaders {
   class shader : public resource {
+  public:
+    /// How an instanced shader finds the model to camera matrix of each instance.
+    /// See make_instanced_vertex_shader().
+    enum instancing_mode {
+      instancing_none,            // modelToCamera and modelToProjection uniforms
+      instancing_attributes,      // four vec4 attributes with a divisor of one
+      instancing_uniform_array,   // a uniform array indexed by an "instance" attribute (OpenGL ES2)
+      num_instancing_modes,
+
+      // number of matrices in the uniform array
+      max_array_instances = 16,
+    };
+
+    /// The vertex attributes a program reads. See make_packed_vertex_shader().
+    enum vertex_format {
+      vertex_float,               // float attributes
+      vertex_packed,              // 16 bit positions and octahedral normals from mesh::pack_vertices()
+      num_vertex_formats,
+
+      // a version of a program for each instancing mode and vertex format
+      num_program_versions = num_instancing_modes * num_vertex_formats,
+    };
+
+    /// Number a version of a program. Float versions have the same number as their instancing mode.
+    static unsigned get_program_version(instancing_mode mode, vertex_format format) {
+      return mode + format * num_instancing_modes;
+    }
+
+  private:
     GLuint program_;
 
-    void link(GLuint vertex_shader, GLuint fragment_shader) {
+    // remove "qualifier type name;" from a shader, allowing any amount of white space.
+    // an empty type matches any type and is set to the type found.
+    static bool remove_declaration(std::string &source, const char *qualifier, std::string &type, const char *name) {
+      for (size_t pos = source.find(qualifier); pos != std::string::npos; pos = source.find(qualifier, pos + 1)) {
+        size_t end = pos + strlen(qualifier);
+        size_t type_start = 0, type_end = 0;
+        const char *tokens[] = { type.c_str(), name, ";" };
+        unsigned t = 0;
+        for (; t != 3; ++t) {
+          size_t start = end;
+          while (end < source.size() && isspace((unsigned char)source[end])) ++end;
+          if (end == start && t != 2) break;
+          if (t == 0) type_start = end;
+          if (t == 0 && type.empty()) {
+            while (end < source.size() && (isalnum((unsigned char)source[end]) || source[end] == '_')) ++end;
+            if (end == type_start) break;
+          } else {
+            size_t len = strlen(tokens[t]);
+            if (source.compare(end, len, tokens[t]) != 0) break;
+            end += len;
+          }
+          if (t == 0) type_end = end;
+          if (t != 2 && end < source.size() && (isalnum((unsigned char)source[end]) || source[end] == '_')) break;
+        }
+        if (t == 3) {
+          type.assign(source, type_start, type_end - type_start);
+          source.erase(pos, end - pos);
+          return true;
+        }
+      }
+      return false;
+    }
+
+    // remove "uniform mat4 name;" from a shader, allowing any amount of white space.
+    static void remove_uniform(std::string &source, const char *name) {
+      std::string type("mat4");
+      remove_declaration(source, "uniform", type, name);
+    }
+
+    // insert a header after the #version line of a shader, which must stay at the start.
+    static void insert_header(std::string &source, const char *header) {
+      size_t insert_pos = 0;
+      size_t version = source.find("#version");
+      if (version != std::string::npos && source.find_first_not_of(" \t\r\n") == version) {
+        insert_pos = source.find('\n', version);
+        insert_pos = insert_pos == std::string::npos ? source.size() : insert_pos + 1;
+      }
+      source.insert(insert_pos, header);
+    }
+
+    GLuint link(GLuint vertex_shader, GLuint fragment_shader) {
           // assemble the program for use by glUseProgram
       GLuint program = glCreateProgram();
       glAttachShader(program, vertex_shader);
@@ -29,9 +108,17 @@ namespace octet { namespace shaders {
       glBindAttribLocation(program, attribute_blendindices, "blendindices");
       glBindAttribLocation(program, attribute_color, "color");
       glBindAttribLocation(program, attribute_uv, "uv");
+      glBindAttribLocation(program, attribute_instance_matrix + 0, "instance_modelToCamera0");
+      glBindAttribLocation(program, attribute_instance_matrix + 1, "instance_modelToCamera1");
+      glBindAttribLocation(program, attribute_instance_matrix + 2, "instance_modelToCamera2");
+      glBindAttribLocation(program, attribute_instance_matrix + 3, "instance_modelToCamera3");
+      glBindAttribLocation(program, attribute_instance, "instance");
+      glBindAttribLocation(program, attribute_pos, "packed_pos");
+      glBindAttribLocation(program, attribute_normal, "packed_normal");
+      glBindAttribLocation(program, attribute_tangent, "packed_tangent");
+      glBindAttribLocation(program, attribute_bitangent, "packed_bitangent");
       glLinkProgram(program);
 
-      program_ = program;
       GLsizei length;
       char buf[0x10000];
       glGetProgramInfoLog(program, sizeof(buf), &length, buf);
@@ -41,16 +128,12 @@ namespace octet { namespace shaders {
       } else {
         printf("linked ok\n");
       }
+      return program;
     }
-  public:
-    shader() {
-    }
-
-    GLuint program() { return program_; }
-  
-    void init(const char *vs, const char *fs) {
-      //printf("creating shader program\n");
 
+  protected:
+    /// compile and link a program without making it this shader's program.
+    GLuint build(const char *vs, const char *fs) {
       GLsizei length;
       char buf[0x10000];
       // create our vertex shader and compile it
@@ -71,7 +154,99 @@ namespace octet { namespace shaders {
         log("Fragment shader error:\n%s\n%s\n\n\n\n", buf, fs);
       }
 
-      link(vertex_shader, fragment_shader);
+      return link(vertex_shader, fragment_shader);
+    }
+
+  public:
+    shader() {
+    }
+
+    GLuint program() { return program_; }
+  
+    void init(const char *vs, const char *fs) {
+      //printf("creating shader program\n");
+      program_ = build(vs, fs);
+    }
+
+    /// Make an instanced version of a vertex shader that uses the uniforms
+    /// "modelToProjection" and "modelToCamera".
+    ///
+    /// The uniforms are removed and replaced by macros that get modelToCamera for
+    /// the current instance and multiply by a new "cameraToProjection" uniform.
+    /// With instancing_attributes, the matrix comes from the attributes "instance_modelToCamera0-3".
+    /// With instancing_uniform_array, it comes from "instance_modelToCamera[max_array_instances]"
+    /// indexed by the "instance" attribute of a mesh that has been copied max_array_instances times.
+    static std::string make_instanced_vertex_shader(const char *vs, instancing_mode mode) {
+      std::string source(vs);
+      remove_uniform(source, "modelToProjection");
+      remove_uniform(source, "modelToCamera");
+
+      char header[1024];
+      if (mode == instancing_attributes) {
+        sprintf(header,
+          "\nuniform mat4 cameraToProjection;\n"
+          "attribute vec4 instance_modelToCamera0;\n"
+          "attribute vec4 instance_modelToCamera1;\n"
+          "attribute vec4 instance_modelToCamera2;\n"
+          "attribute vec4 instance_modelToCamera3;\n"
+          "#define modelToCamera mat4(instance_modelToCamera0, instance_modelToCamera1, instance_modelToCamera2, instance_modelToCamera3)\n"
+          "#define modelToProjection (cameraToProjection * modelToCamera)\n"
+        );
+      } else {
+        sprintf(header,
+          "\nuniform mat4 cameraToProjection;\n"
+          "uniform mat4 instance_modelToCamera[%d];\n"
+          "attribute float instance;\n"
+          "#define modelToCamera instance_modelToCamera[int(instance)]\n"
+          "#define modelToProjection (cameraToProjection * modelToCamera)\n",
+          (int)max_array_instances
+        );
+      }
+
+      insert_header(source, header);
+      return source;
+    }
+
+    /// Make a version of a vertex shader that reads the compact attributes of mesh::pack_vertices().
+    ///
+    /// The declarations of the "pos", "normal", "tangent" and "bitangent" attributes are removed
+    /// and replaced by macros that decode "packed_pos" with the "packed_pos_scale" and "packed_pos_offset"
+    /// uniforms and "packed_normal" etc. from octahedral coordinates. Half float uvs need no decoding.
+    /// This can be combined with make_instanced_vertex_shader().
+    static std::string make_packed_vertex_shader(const char *vs) {
+      std::string source(vs);
+      std::string header =
+        "\nuniform vec4 packed_pos_scale;\n"
+        "uniform vec4 packed_pos_offset;\n"
+        "vec3 octet_decode_octahedral(vec2 e) {\n"
+        "  vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));\n"
+        "  float t = max(-n.z, 0.0);\n"
+        "  n.x += n.x >= 0.0 ? -t : t;\n"
+        "  n.y += n.y >= 0.0 ? -t : t;\n"
+        "  return normalize(n);\n"
+        "}\n"
+      ;
+
+      std::string type;
+      if (remove_declaration(source, "attribute", type, "pos")) {
+        header += "attribute vec3 packed_pos;\n";
+        const char *decoded = "packed_pos * packed_pos_scale.xyz + packed_pos_offset.xyz";
+        header += type == "vec4" ? std::string("#define pos vec4(") + decoded + ", 1.0)\n" : std::string("#define pos (") + decoded + ")\n";
+      }
+
+      const char *directions[] = { "normal", "tangent", "bitangent" };
+      for (unsigned i = 0; i != 3; ++i) {
+        type.clear();
+        if (remove_declaration(source, "attribute", type, directions[i])) {
+          std::string packed = std::string("packed_") + directions[i];
+          std::string decoded = "octet_decode_octahedral(" + packed + ")";
+          header += "attribute vec2 " + packed + ";\n";
+          header += std::string("#define ") + directions[i] + " " + (type == "vec4" ? "vec4(" + decoded + ", 0.0)" : decoded) + "\n";
+        }
+      }
+
+      insert_header(source, header.c_str());
+      return source;
     }
 
     /// create a program from pre-compiled binary code. (ie. PS Vita)  
@@ -85,7 +260,7 @@ namespace octet { namespace shaders {
         GLuint fragment_shader = glCreateShader(GL_FRAGMENT_SHADER);
         glShaderBinary(1, &fragment_shader, 0, fs, 0);
 
-        link(vertex_shader, fragment_shader);
+        program_ = link(vertex_shader, fragment_shader);
       #endif
     }
 